@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+#
+# Build the benchmark suite in every configuration and report each
+# build's speedup over the debug (sanitizer) build.
+#
+# Usage: scripts/bench-builds.sh [SECONDS]
+# SECONDS is how long each benchmark runs (default 1). Extra make
+# arguments (e.g. PKG_DEPS=libcrypt) can be passed in MAKEFLAGS.
+
+set -euo pipefail
+
+SECS="${1:-1}"
+cd "$(dirname "$0")/.."
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+
+make -s bench >/dev/null
+make -s BUILD=release bench >/dev/null
+make -s BUILD=release-lto bench >/dev/null
+make -s pgo >/dev/null
+
+bin/bench -T "$SECS" >"$DIR/debug"
+for build in release release-lto pgo; do
+  "bin/$build/bench" -T "$SECS" >"$DIR/$build"
+done
+
+printf '%-20s %14s %18s %18s %18s\n' benchmark "debug ops/s" release release-lto pgo
+join "$DIR/debug" "$DIR/release" | join - "$DIR/release-lto" | join - "$DIR/pgo" |
+  awk '{ printf "%-20s %14.0f %11.0f %5.1fx %11.0f %5.1fx %11.0f %5.1fx\n",
+         $1, $2, $3, $3 / $2, $4, $4 / $2, $5, $5 / $2 }'
@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+#
+# Start a small login cluster on unix sockets, drive it with loadgen,
+# then add and remove a node while checking that logins still succeed.
+#
+# Usage: scripts/run-cluster.sh [NODES] [QPS] [SECONDS]
+# Build first with `make cluster loadgen`.
+
+set -euo pipefail
+
+NODES="${1:-3}"
+QPS="${2:-20}"
+SECONDS_="${3:-5}"
+BIN="$(dirname "$0")/../bin"
+DIR="$(mktemp -d)"
+PIDS=()
+
+cleanup() {
+  for pid in "${PIDS[@]}"; do kill "$pid" 2>/dev/null || true; done
+  rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+wait_for() {
+  for _ in $(seq 50); do [ -S "$1" ] && return 0; sleep 0.1; done
+  echo "timed out waiting for $1" >&2
+  return 1
+}
+
+start_node() {
+  "$BIN/login-node" -l "unix:$DIR/node$1.sock" 2>>"$DIR/node$1.log" &
+  PIDS+=($!)
+  wait_for "$DIR/node$1.sock"
+}
+
+NODE_ARGS=()
+for i in $(seq "$NODES"); do
+  start_node "$i"
+  NODE_ARGS+=(-n "unix:$DIR/node$i.sock")
+done
+
+"$BIN/login-router" -l "unix:$DIR/router.sock" "${NODE_ARGS[@]}" 2>>"$DIR/router.log" &
+PIDS+=($!)
+wait_for "$DIR/router.sock"
+
+echo "== $NODES nodes"
+"$BIN/loadgen" -S "unix:$DIR/router.sock" -q "$QPS" -d "$SECONDS_" -u 200
+
+EXTRA=$((NODES + 1))
+start_node "$EXTRA"
+"$BIN/login-router" -c "unix:$DIR/router.sock" join "unix:$DIR/node$EXTRA.sock"
+echo "== after join of node$EXTRA"
+"$BIN/loadgen" -S "unix:$DIR/router.sock" -q "$QPS" -d "$SECONDS_" -u 200 -s 2
+
+"$BIN/login-router" -c "unix:$DIR/router.sock" leave "unix:$DIR/node1.sock"
+echo "== after leave of node1"
+"$BIN/loadgen" -S "unix:$DIR/router.sock" -q "$QPS" -d "$SECONDS_" -u 200 -s 3
@@ -1,5 +1,8 @@
 #include "account.h"
+#include "entropy.h"
+#include "hash_memory.h"
 #include "logging.h"
+#include "slab.h"
 #include <crypt.h>
 #include <string.h>
 #include <assert.h>
@@ -41,12 +44,12 @@ account_t *account_create(const char *userid, const char *plaintext_password,
         return NULL;
     }
     
-    account_t *acc = malloc(sizeof(account_t));
+    // slab_alloc() hands out zeroed memory
+    account_t *acc = slab_alloc(sizeof(account_t));
     if (!acc) {
         log_message(LOG_ERROR, "account_create: Failed to allocate memory for account.");
         return NULL;
     }
-    memset(acc, 0, sizeof(account_t));
     
     // Copy user ID and email with null termination
     strncpy(acc->userid, userid, sizeof(acc->userid) - 1);
@@ -66,7 +69,7 @@ account_t *account_create(const char *userid, const char *plaintext_password,
   
     if (!account_update_password(acc, plaintext_password)) {
         log_message(LOG_ERROR, "account_create: Failed to hash password.");
-        free(acc);
+        slab_free(acc, sizeof(account_t));
         return NULL;
     }
     
@@ -75,11 +78,8 @@ account_t *account_create(const char *userid, const char *plaintext_password,
 
 
 void account_free(account_t *acc) {
-  // remove the contents of this function and replace it with your own code.
-    if (!acc) return;
-
-    memset(acc, 0, sizeof(account_t));
-    free(acc);
+    // slab_free() wipes the record before it can be reused
+    slab_free(acc, sizeof(account_t));
 }
 
 
@@ -95,12 +95,17 @@ bool account_validate_password(const account_t *acc, const char *plaintext_passw
   memcpy(data.setting, acc->password_hash, sizeof acc->password_hash);
   strncpy(data.input, plaintext_password, sizeof data.input);
 
+  hash_memory_ticket_t ticket;
+  hash_memory_acquire(data.setting, &ticket);
   char *out_hash = crypt_r(data.input, data.setting, &data);
+  hash_memory_release(&ticket);
   if (out_hash == NULL) return false;
 
   return strncmp(out_hash, acc->password_hash, sizeof acc->password_hash) == 0;
 }
 
+#define SALT_RANDOM_BYTES 16
+
 /**
  * Used by account_update_password() to generate a hash.
  * Should not be used elsewhere! Call account_update_password() directly instead.
@@ -121,12 +126,23 @@ bool _get_hash(struct crypt_data *data, size_t max_hash_length) {
 
   char *out;
   char *hash;
+  hash_memory_ticket_t ticket;
+
+  // salt bytes come from the per-thread pool rather than a syscall per
+  // hash; 16 is what libcrypt would fetch itself, and what $y$, $7$ and
+  // $2b$ need. If the pool can't be seeded, libcrypt fetches its own.
+  unsigned char rbytes[SALT_RANDOM_BYTES];
+  bool have_rbytes = entropy_fill(rbytes, sizeof rbytes);
+  const char *salt_bytes = have_rbytes ? (const char *)rbytes : NULL;
+  int salt_len = have_rbytes ? SALT_RANDOM_BYTES : 0;
 
   // locally scoped macro to reduce code repetition
 #define TRY_HASH(prefix, count) do { \
-  out = crypt_gensalt_rn(prefix, count, NULL, 0, data->setting, sizeof data->setting); \
+  out = crypt_gensalt_rn(prefix, count, salt_bytes, salt_len, data->setting, sizeof data->setting); \
   if (out != NULL && out[0] != '*') { \
+    hash_memory_acquire(data->setting, &ticket); \
     hash = crypt_r(data->input, data->setting, data); \
+    hash_memory_release(&ticket); \
     if (hash != NULL && data->output[0] != '*' && strlen(data->output) < max_hash_length) { \
       return true; \
     } \
@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_admin.h"
+#include "account.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static bool apply_email(account_t *acc, void *arg) {
+  const char *email = arg;
+  account_set_email(acc, email);
+  // account_set_email() leaves the record alone if it rejects the address
+  return strncmp(acc->email, email, EMAIL_LENGTH - 1) == 0;
+}
+
+static bool apply_unban_time(account_t *acc, void *arg) {
+  account_set_unban_time(acc, *(const time_t *)arg);
+  return true;
+}
+
+static bool apply_expiration_time(account_t *acc, void *arg) {
+  account_set_expiration_time(acc, *(const time_t *)arg);
+  return true;
+}
+
+static bool apply_password_hash(account_t *acc, void *arg) {
+  memcpy(acc->password_hash, arg, sizeof acc->password_hash);
+  return true;
+}
+
+bool account_admin_set_email(account_store_t *store, const char *userid, const char *new_email) {
+  if (!new_email) {
+    log_message(LOG_ERROR, "account_admin_set_email: NULL argument.");
+    return false;
+  }
+  return account_store_update(store, userid, apply_email, (void *)new_email);
+}
+
+bool account_admin_set_unban_time(account_store_t *store, const char *userid, time_t t) {
+  return account_store_update(store, userid, apply_unban_time, &t);
+}
+
+bool account_admin_set_expiration_time(account_store_t *store, const char *userid, time_t t) {
+  return account_store_update(store, userid, apply_expiration_time, &t);
+}
+
+bool account_admin_update_password(account_store_t *store, const char *userid,
+                                   const char *new_plaintext_password) {
+  if (!store || !userid || !new_plaintext_password) {
+    log_message(LOG_ERROR, "account_admin_update_password: NULL argument.");
+    return false;
+  }
+  account_t acc;
+  bool ok = account_store_get(store, userid, &acc) &&
+            account_update_password(&acc, new_plaintext_password) &&
+            account_store_update(store, userid, apply_password_hash, acc.password_hash);
+  memset(&acc, 0, sizeof acc);
+  return ok;
+}
+
+////
+// Bulk changes
+
+const char *account_bulk_op_name(account_bulk_op_t op) {
+  switch (op) {
+    case ACCOUNT_BULK_BAN: return "ban";
+    case ACCOUNT_BULK_EXPIRE: return "expire";
+    case ACCOUNT_BULK_SET_EMAIL: return "set_email";
+  }
+  return "unknown";
+}
+
+static bool apply_bulk(account_t *acc, void *arg) {
+  const account_bulk_t *bulk = arg;
+  switch (bulk->op) {
+    case ACCOUNT_BULK_BAN:
+      account_set_unban_time(acc, bulk->time);
+      return true;
+    case ACCOUNT_BULK_EXPIRE:
+      account_set_expiration_time(acc, bulk->time);
+      return true;
+    case ACCOUNT_BULK_SET_EMAIL:
+      return apply_email(acc, (void *)bulk->email);
+  }
+  return false;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// write the transaction's log entry; called before the change is visible
+static bool write_wal(const account_t *const *changed, size_t count, void *arg) {
+  const account_bulk_t *bulk = arg;
+  if (bulk->wal_fd < 0) return true;
+
+  size_t cap = 64 + EMAIL_LENGTH + count * USER_ID_LENGTH;
+  char *buf = malloc(cap);
+  if (!buf) {
+    log_message(LOG_ERROR, "account_admin_bulk: failed to allocate log entry.");
+    return false;
+  }
+  int len;
+  if (bulk->op == ACCOUNT_BULK_SET_EMAIL) {
+    len = snprintf(buf, cap, "BULK %s %s %zu\n", account_bulk_op_name(bulk->op), bulk->email, count);
+  } else {
+    len = snprintf(buf, cap, "BULK %s %lld %zu\n", account_bulk_op_name(bulk->op),
+                   (long long)bulk->time, count);
+  }
+  size_t used = (size_t)len;
+  for (size_t i = 0; i < count; i++) {
+    // userids are shorter than USER_ID_LENGTH, leaving room for the newline
+    size_t n = strnlen(changed[i]->userid, USER_ID_LENGTH - 1);
+    memcpy(buf + used, changed[i]->userid, n);
+    buf[used + n] = '\n';
+    used += n + 1;
+  }
+  memcpy(buf + used, "END\n", 4);
+  used += 4;
+
+  bool ok = write_all(bulk->wal_fd, buf, used) && fsync(bulk->wal_fd) == 0;
+  if (!ok) log_message(LOG_ERROR, "account_admin_bulk: can't write log entry: %s.", strerror(errno));
+  free(buf);
+  return ok;
+}
+
+static bool bulk_run(account_store_t *store, const account_bulk_t *bulk, account_store_batch_t *batch,
+                     size_t *changed) {
+  if (!store || !bulk) {
+    log_message(LOG_ERROR, "account_admin_bulk: NULL argument.");
+    return false;
+  }
+  if (bulk->op == ACCOUNT_BULK_SET_EMAIL) {
+    // reject a bad address once, up front, rather than once per account
+    account_t scratch = {0};
+    if (!bulk->email || !apply_email(&scratch, (void *)bulk->email)) return false;
+  }
+
+  batch->update = apply_bulk;
+  batch->update_arg = (void *)bulk;
+  batch->commit = write_wal;
+  batch->commit_arg = (void *)bulk;
+  batch->threads = bulk->threads;
+
+  size_t n = 0;
+  if (!account_store_update_batch(store, batch, &n)) return false;
+  log_message(LOG_INFO, "Bulk %s applied to %zu accounts", account_bulk_op_name(bulk->op), n);
+  if (changed) *changed = n;
+  return true;
+}
+
+bool account_admin_bulk(account_store_t *store, const account_bulk_t *bulk,
+                        const char *const *userids, size_t count, size_t *changed) {
+  if (!userids && count > 0) {
+    log_message(LOG_ERROR, "account_admin_bulk: NULL argument.");
+    return false;
+  }
+  account_store_batch_t batch = { .userids = userids, .userid_count = count };
+  // an empty list means no accounts, not every account
+  if (count == 0) {
+    if (changed) *changed = 0;
+    return store && bulk;
+  }
+  return bulk_run(store, bulk, &batch, changed);
+}
+
+bool account_admin_bulk_where(account_store_t *store, const account_bulk_t *bulk,
+                              account_store_visit_fn select, void *arg, size_t *changed) {
+  if (!select) {
+    log_message(LOG_ERROR, "account_admin_bulk_where: NULL argument.");
+    return false;
+  }
+  account_store_batch_t batch = { .select = select, .select_arg = arg };
+  return bulk_run(store, bulk, &batch, changed);
+}
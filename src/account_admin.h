@@ -0,0 +1,79 @@
+#ifndef ACCOUNT_ADMIN_H
+#define ACCOUNT_ADMIN_H
+
+#include "account_store.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * @file account_admin.h
+ * @brief Admin updates to accounts held in an account store.
+ *
+ * Each function applies the matching account.h mutator to a copy of the
+ * stored record and publishes the copy as the record's new version (see
+ * account_store_update()), so logins running concurrently never see a
+ * half-written record and never wait for the update.
+ *
+ * Each returns false if the account doesn't exist or the mutator
+ * rejected the new value.
+ *
+ * The bulk functions apply one change to many accounts as a single
+ * transaction (see account_store_update_batch()): lookups see either
+ * none of the changes or all of them, and the transaction is recorded
+ * as a single entry in an optional write-ahead log before it becomes
+ * visible. The log entry is text:
+ *
+ *     BULK <op> <value> <count>
+ *     <userid>            (count lines)
+ *     END
+ */
+
+bool account_admin_set_email(account_store_t *store, const char *userid, const char *new_email);
+
+bool account_admin_set_unban_time(account_store_t *store, const char *userid, time_t t);
+
+bool account_admin_set_expiration_time(account_store_t *store, const char *userid, time_t t);
+
+/**
+ * Hash the new password outside the store's lock, then install the hash.
+ * If the password is changed concurrently, the last update wins.
+ */
+bool account_admin_update_password(account_store_t *store, const char *userid,
+                                   const char *new_plaintext_password);
+
+////
+// Bulk changes
+
+typedef enum {
+  ACCOUNT_BULK_BAN,           // set the unban time to `time`
+  ACCOUNT_BULK_EXPIRE,        // set the expiration time to `time`
+  ACCOUNT_BULK_SET_EMAIL      // set the email address to `email`
+} account_bulk_op_t;
+
+typedef struct {
+  account_bulk_op_t op;
+  time_t time;
+  const char *email;
+  int wal_fd;                 // write-ahead log, flushed before the change is visible; -1 for none
+  size_t threads;             // 0 for one per online CPU
+} account_bulk_t;
+
+/**
+ * Apply `bulk` to the listed accounts. Userids that don't exist are
+ * skipped. Returns false, changing nothing, if the change is invalid or
+ * the log can't be written; otherwise sets *changed (if not NULL) to the
+ * number of accounts changed.
+ */
+bool account_admin_bulk(account_store_t *store, const account_bulk_t *bulk,
+                        const char *const *userids, size_t count, size_t *changed);
+
+// as account_admin_bulk(), for every account `select` returns true for
+bool account_admin_bulk_where(account_store_t *store, const account_bulk_t *bulk,
+                              account_store_visit_fn select, void *arg, size_t *changed);
+
+// "ban", "expire" or "set_email"
+const char *account_bulk_op_name(account_bulk_op_t op);
+
+#endif // ACCOUNT_ADMIN_H
@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_backup.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BACKUP_MAGIC "ACCTBAK1"
+#define BACKUP_MAGIC_LEN 8
+
+typedef struct {
+  char magic[BACKUP_MAGIC_LEN];
+  uint32_t record_size;     // sizeof(account_t) of the writer
+  uint32_t reserved;
+  uint64_t count;
+} backup_header_t;
+
+struct account_backup {
+  pthread_t thread;
+  account_snapshot_t *snap;
+  char *path;
+  bool ok;
+};
+
+typedef struct {
+  FILE *f;
+  uint64_t written;
+} write_state_t;
+
+static bool write_record(const account_t *acc, void *arg) {
+  write_state_t *ws = arg;
+  if (fwrite(acc, sizeof *acc, 1, ws->f) != 1) return false;
+  ws->written++;
+  return true;
+}
+
+bool account_backup_write(const account_snapshot_t *snap, const char *path) {
+  if (!snap || !path) {
+    log_message(LOG_ERROR, "account_backup_write: NULL argument.");
+    return false;
+  }
+
+  size_t tmp_len = strlen(path) + sizeof ".tmp";
+  char *tmp = malloc(tmp_len);
+  if (!tmp) {
+    log_message(LOG_ERROR, "account_backup_write: failed to allocate.");
+    return false;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!f) {
+    log_message(LOG_ERROR, "account_backup_write: can't create '%s': %s.", tmp, strerror(errno));
+    if (fd >= 0) close(fd);
+    free(tmp);
+    return false;
+  }
+
+  backup_header_t header = {
+    .record_size = (uint32_t)sizeof(account_t),
+    .count = account_snapshot_count(snap),
+  };
+  memcpy(header.magic, BACKUP_MAGIC, BACKUP_MAGIC_LEN);
+  write_state_t ws = { .f = f };
+  bool ok = fwrite(&header, sizeof header, 1, f) == 1;
+  if (ok) account_snapshot_foreach(snap, write_record, &ws);
+  ok = ok && ws.written == header.count;
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  ok = ok && rename(tmp, path) == 0;
+
+  if (!ok) {
+    log_message(LOG_ERROR, "account_backup_write: failed to write '%s': %s.", path, strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+static void *backup_thread(void *arg) {
+  account_backup_t *backup = arg;
+  backup->ok = account_backup_write(backup->snap, backup->path);
+  return NULL;
+}
+
+account_backup_t *account_backup_start(account_store_t *store, const char *path) {
+  if (!store || !path) {
+    log_message(LOG_ERROR, "account_backup_start: NULL argument.");
+    return NULL;
+  }
+  account_backup_t *backup = calloc(1, sizeof *backup);
+  if (!backup || !(backup->path = strdup(path))) {
+    log_message(LOG_ERROR, "account_backup_start: failed to allocate.");
+    free(backup);
+    return NULL;
+  }
+  backup->snap = account_store_snapshot(store);
+  if (!backup->snap) {
+    free(backup->path);
+    free(backup);
+    return NULL;
+  }
+  if (pthread_create(&backup->thread, NULL, backup_thread, backup) != 0) {
+    log_message(LOG_ERROR, "account_backup_start: can't start backup thread.");
+    account_snapshot_free(backup->snap);
+    free(backup->path);
+    free(backup);
+    return NULL;
+  }
+  return backup;
+}
+
+bool account_backup_wait(account_backup_t *backup) {
+  if (!backup) return false;
+  pthread_join(backup->thread, NULL);
+  bool ok = backup->ok;
+  account_snapshot_free(backup->snap);
+  free(backup->path);
+  free(backup);
+  return ok;
+}
+
+bool account_backup_restore(const char *path, account_store_t *store) {
+  if (!path || !store) {
+    log_message(LOG_ERROR, "account_backup_restore: NULL argument.");
+    return false;
+  }
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    log_message(LOG_ERROR, "account_backup_restore: can't open '%s': %s.", path, strerror(errno));
+    return false;
+  }
+
+  backup_header_t header;
+  if (fread(&header, sizeof header, 1, f) != 1 ||
+      memcmp(header.magic, BACKUP_MAGIC, BACKUP_MAGIC_LEN) != 0 ||
+      header.record_size != sizeof(account_t)) {
+    log_message(LOG_ERROR, "account_backup_restore: '%s' is not a backup from this build.", path);
+    fclose(f);
+    return false;
+  }
+
+  bool ok = true;
+  account_t acc;
+  for (uint64_t i = 0; ok && i < header.count; i++) {
+    if (fread(&acc, sizeof acc, 1, f) != 1) {
+      log_message(LOG_ERROR, "account_backup_restore: '%s' is truncated.", path);
+      ok = false;
+    } else {
+      ok = account_store_put(store, &acc);
+    }
+  }
+  memset(&acc, 0, sizeof acc);
+  fclose(f);
+  return ok;
+}
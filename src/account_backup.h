@@ -0,0 +1,53 @@
+#ifndef ACCOUNT_BACKUP_H
+#define ACCOUNT_BACKUP_H
+
+#include "account_store.h"
+
+#include <stdbool.h>
+
+/**
+ * @file account_backup.h
+ * @brief Point-in-time backups of an account store.
+ *
+ * A backup is a snapshot of the store (see account_store_snapshot())
+ * written to a file. The snapshot is taken up front, so the file holds
+ * the store exactly as it was when the backup started, while logins and
+ * updates carry on unhindered as it is written.
+ *
+ * The file is written to "<path>.tmp" and renamed into place once it is
+ * complete, so `path` always holds either the previous backup or the
+ * new one. It contains password hashes and is created with mode 0600.
+ *
+ * Records are stored in their in-memory layout, so a backup can only be
+ * restored by a build with the same account_t.
+ */
+
+typedef struct account_backup account_backup_t;
+
+/**
+ * Write a snapshot to `path`, synchronously.
+ * Returns false and logs an error message on failure.
+ */
+bool account_backup_write(const account_snapshot_t *snap, const char *path);
+
+/**
+ * Snapshot `store` and start writing it to `path` on a background thread.
+ * Returns NULL and logs an error message on failure.
+ */
+account_backup_t *account_backup_start(account_store_t *store, const char *path);
+
+/**
+ * Wait for a backup started by account_backup_start() to finish, and
+ * free it. Returns true if the backup was written successfully.
+ */
+bool account_backup_wait(account_backup_t *backup);
+
+/**
+ * Load every account in the backup at `path` into `store`, replacing
+ * records with the same userid. Returns false and logs an error message
+ * if the file can't be read or is malformed; accounts loaded before the
+ * error stay in the store.
+ */
+bool account_backup_restore(const char *path, account_store_t *store);
+
+#endif // ACCOUNT_BACKUP_H
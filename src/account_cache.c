@@ -0,0 +1,796 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_cache.h"
+#include "account_store.h"
+#include "logging.h"
+#include "login_throttle.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHARD_BITS 6
+#define SHARDS (1u << SHARD_BITS)
+
+#define HOT_SET_MAGIC "HOTSET01"
+#define MAGIC_LEN 8
+#define HOT_FOUND 0x01            // record flags
+#define HOT_THROTTLED 0x02        // followed by 8 bytes of throttle state
+
+#define WARM_BATCH 256            // userids per multi-get
+
+#define FILL_STAMPS 64            // invalidation counters per shard, for fill tickets
+
+typedef struct cache_entry {
+  struct cache_entry *chain;    // next in the hash bucket
+  struct cache_entry *newer;    // in the shard's LRU list
+  struct cache_entry *older;
+  uint64_t hash;
+  uint64_t expires;             // monotonic ns
+  uint64_t used;                // monotonic ns of the last lookup, 0 if none since warm-up
+  bool found;
+  char userid[USER_ID_LENGTH + 1];
+  account_t acc[];              // only if found
+} cache_entry_t;
+
+#define NEGATIVE_SIZE sizeof(cache_entry_t)
+#define POSITIVE_SIZE (sizeof(cache_entry_t) + sizeof(account_t))
+
+typedef struct {
+  pthread_mutex_t lock;
+  cache_entry_t **buckets;
+  size_t mask;
+  cache_entry_t *newest;
+  cache_entry_t *oldest;
+  size_t bytes;
+  uint64_t stamps[FILL_STAMPS];   // bumped by each invalidation of a userid that maps there
+} shard_t;
+
+typedef struct {
+  char magic[MAGIC_LEN];
+  uint32_t count;
+  uint32_t reserved;
+  int64_t saved_at;
+} hot_set_header_t;
+
+struct account_cache {
+  account_cache_config_t config;
+  char *hot_set_path;
+  size_t shard_max_bytes;
+  atomic_size_t bytes;
+  shard_t shards[SHARDS];
+
+  pthread_mutex_t save_lock;    // one save at a time, as they share a temporary file
+
+  // periodic saving
+  pthread_mutex_t saver_lock;
+  pthread_cond_t saver_wake;
+  bool stopping;
+  bool saving;
+  pthread_t saver;
+};
+
+static account_cache_t *_Atomic default_cache = NULL;
+
+static STATS_DEFINE(stat_hits, "account_cache.hits");
+static STATS_DEFINE(stat_negative_hits, "account_cache.negative_hits");
+static STATS_DEFINE(stat_misses, "account_cache.misses");
+static STATS_DEFINE(stat_evictions, "account_cache.evictions");
+static STATS_DEFINE(stat_bytes, "account_cache.bytes");
+static STATS_DEFINE(stat_warmed, "account_cache.warmed");
+static STATS_DEFINE(stat_stale_fills, "account_cache.stale_fills");
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t hash_userid(const char *userid) {
+  // FNV-1a's high bits choose the shard; mix so they depend on every byte
+  uint64_t h = account_store_hash_userid(userid);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static shard_t *shard_for(account_cache_t *c, uint64_t hash) {
+  return &c->shards[hash >> (64 - SHARD_BITS)];
+}
+
+static uint64_t *stamp_of(shard_t *s, uint64_t hash) {
+  return &s->stamps[(hash >> 32) % FILL_STAMPS];
+}
+
+static size_t entry_size(const cache_entry_t *e) {
+  return e->found ? POSITIVE_SIZE : NEGATIVE_SIZE;
+}
+
+static void entry_free(cache_entry_t *e) {
+  slab_free(e, entry_size(e));
+}
+
+void account_cache_config_defaults(account_cache_config_t *config) {
+  *config = (account_cache_config_t){
+    .max_bytes = (size_t)64 << 20,
+    .ttl_secs = 60,
+    .negative_ttl_secs = 10,
+    .hot_set_path = NULL,
+    .save_interval_secs = 60,
+    .hot_set_max = 100000,
+    .warm_max_secs = 30,
+    .warm_max_bytes = (size_t)32 << 20,
+    .warm_max_in_flight = 4096,
+  };
+}
+
+////
+// Shards. Called with the shard lock held.
+
+static cache_entry_t **bucket_of(shard_t *s, uint64_t hash) {
+  return &s->buckets[hash & s->mask];
+}
+
+static cache_entry_t *shard_find(shard_t *s, uint64_t hash, const char *userid) {
+  for (cache_entry_t *e = *bucket_of(s, hash); e; e = e->chain) {
+    if (e->hash == hash && strncmp(e->userid, userid, USER_ID_LENGTH) == 0) return e;
+  }
+  return NULL;
+}
+
+static void lru_unlink(shard_t *s, cache_entry_t *e) {
+  if (e->newer) e->newer->older = e->older;
+  else s->newest = e->older;
+  if (e->older) e->older->newer = e->newer;
+  else s->oldest = e->newer;
+  e->newer = e->older = NULL;
+}
+
+static void lru_push(shard_t *s, cache_entry_t *e) {
+  e->newer = NULL;
+  e->older = s->newest;
+  if (s->newest) s->newest->newer = e;
+  else s->oldest = e;
+  s->newest = e;
+}
+
+static void lru_append(shard_t *s, cache_entry_t *e) {
+  e->older = NULL;
+  e->newer = s->oldest;
+  if (s->oldest) s->oldest->older = e;
+  else s->newest = e;
+  s->oldest = e;
+}
+
+// take `e` out of the shard; the caller frees it once the lock is dropped
+static void shard_remove(account_cache_t *c, shard_t *s, cache_entry_t *e) {
+  cache_entry_t **p = bucket_of(s, e->hash);
+  while (*p != e) p = &(*p)->chain;
+  *p = e->chain;
+  e->chain = NULL;
+  lru_unlink(s, e);
+  s->bytes -= entry_size(e);
+  atomic_fetch_sub_explicit(&c->bytes, entry_size(e), memory_order_relaxed);
+  stats_sub(&stat_bytes, entry_size(e));
+}
+
+////
+
+static void *saver_thread(void *arg);
+
+account_cache_t *account_cache_create(const account_cache_config_t *config) {
+  if (!config || config->max_bytes < SHARDS * POSITIVE_SIZE || config->warm_max_in_flight == 0) {
+    log_message(LOG_ERROR, "account_cache_create: invalid config.");
+    return NULL;
+  }
+  account_cache_t *c = calloc(1, sizeof *c);
+  if (!c) {
+    log_message(LOG_ERROR, "account_cache_create: failed to allocate.");
+    return NULL;
+  }
+  c->config = *config;
+  c->shard_max_bytes = config->max_bytes / SHARDS;
+  atomic_init(&c->bytes, 0);
+  pthread_mutex_init(&c->save_lock, NULL);
+  pthread_mutex_init(&c->saver_lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&c->saver_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // a bucket per full-sized entry a shard can hold
+  size_t buckets = 8;
+  while (buckets < c->shard_max_bytes / POSITIVE_SIZE) buckets <<= 1;
+  bool ok = true;
+  for (size_t i = 0; i < SHARDS; i++) {
+    pthread_mutex_init(&c->shards[i].lock, NULL);
+    c->shards[i].mask = buckets - 1;
+    c->shards[i].buckets = calloc(buckets, sizeof *c->shards[i].buckets);
+    ok = ok && c->shards[i].buckets;
+  }
+  if (ok && config->hot_set_path) {
+    c->hot_set_path = strdup(config->hot_set_path);
+    ok = c->hot_set_path != NULL;
+  }
+  c->config.hot_set_path = c->hot_set_path;
+  if (!ok) {
+    free(c->hot_set_path);
+    c->hot_set_path = NULL;
+    log_message(LOG_ERROR, "account_cache_create: failed to allocate.");
+    account_cache_free(c);
+    return NULL;
+  }
+
+  if (c->hot_set_path && config->save_interval_secs > 0) {
+    if (pthread_create(&c->saver, NULL, saver_thread, c) != 0) {
+      log_message(LOG_ERROR, "account_cache_create: can't start saver thread.");
+      // don't replace the saved hot set with this empty cache's
+      free(c->hot_set_path);
+      c->hot_set_path = NULL;
+      account_cache_free(c);
+      return NULL;
+    }
+    c->saving = true;
+  }
+  return c;
+}
+
+void account_cache_free(account_cache_t *c) {
+  if (!c) return;
+  account_cache_t *expected = c;
+  atomic_compare_exchange_strong(&default_cache, &expected, NULL);
+
+  if (c->saving) {
+    pthread_mutex_lock(&c->saver_lock);
+    c->stopping = true;
+    pthread_cond_signal(&c->saver_wake);
+    pthread_mutex_unlock(&c->saver_lock);
+    pthread_join(c->saver, NULL);
+  }
+  if (c->hot_set_path) account_cache_save(c, c->hot_set_path);
+
+  for (size_t i = 0; i < SHARDS; i++) {
+    shard_t *s = &c->shards[i];
+    for (cache_entry_t *e = s->newest, *next; e; e = next) {
+      next = e->older;
+      entry_free(e);
+    }
+    stats_sub(&stat_bytes, s->bytes);
+    free(s->buckets);
+    pthread_mutex_destroy(&s->lock);
+  }
+  pthread_mutex_destroy(&c->save_lock);
+  pthread_mutex_destroy(&c->saver_lock);
+  pthread_cond_destroy(&c->saver_wake);
+  free(c->hot_set_path);
+  free(c);
+}
+
+bool account_cache_get(account_cache_t *c, const char *userid, account_t *acc, bool *found) {
+  uint64_t hash = hash_userid(userid);
+  shard_t *s = shard_for(c, hash);
+  uint64_t now = now_ns();
+
+  pthread_mutex_lock(&s->lock);
+  cache_entry_t *e = shard_find(s, hash, userid);
+  if (!e || e->expires <= now) {
+    if (e) shard_remove(c, s, e);
+    pthread_mutex_unlock(&s->lock);
+    if (e) entry_free(e);
+    stats_add(&stat_misses, 1);
+    return false;
+  }
+  lru_unlink(s, e);
+  lru_push(s, e);
+  e->used = now;
+  *found = e->found;
+  if (e->found) *acc = e->acc[0];
+  pthread_mutex_unlock(&s->lock);
+
+  // `e` may be freed as soon as the lock is dropped
+  stats_add(*found ? &stat_hits : &stat_negative_hits, 1);
+  return true;
+}
+
+/**
+ * Add an entry for `userid`, replacing any already there and evicting
+ * the least recently used to make room.
+ *
+ * A `warm` entry, restored from the hot set, is added behind everything
+ * looked up since the start instead, so warm-up is fed hottest first
+ * and never displaces live entries: it is dropped if the shard is full
+ * or already has an entry for `userid`. Returns false if the entry
+ * wasn't added.
+ *
+ * With a `ticket` (from account_cache_ticket()), the entry is also
+ * dropped if `userid` may have been invalidated since the ticket was
+ * taken, as the lookup that produced it may have seen the old record.
+ */
+static bool cache_insert(account_cache_t *c, const char *userid, const account_t *acc, bool warm,
+                         const uint64_t *ticket) {
+  size_t size = acc ? POSITIVE_SIZE : NEGATIVE_SIZE;
+  cache_entry_t *e = slab_alloc(size);
+  if (!e) return false;
+  uint64_t now = now_ns();
+  e->hash = hash_userid(userid);
+  e->found = acc != NULL;
+  e->expires = now + (uint64_t)(acc ? c->config.ttl_secs : c->config.negative_ttl_secs) * 1000000000ULL;
+  e->used = warm ? 0 : now;
+  memcpy(e->userid, userid, strnlen(userid, USER_ID_LENGTH));
+  if (acc) e->acc[0] = *acc;
+
+  shard_t *s = shard_for(c, e->hash);
+  cache_entry_t *removed = NULL;
+  pthread_mutex_lock(&s->lock);
+  cache_entry_t *old = shard_find(s, e->hash, e->userid);
+  bool stale = ticket && *stamp_of(s, e->hash) != *ticket;
+  if (stale || (warm && (old || s->bytes + size > c->shard_max_bytes))) {
+    pthread_mutex_unlock(&s->lock);
+    if (stale) stats_add(&stat_stale_fills, 1);
+    entry_free(e);
+    return false;
+  }
+  if (old) {
+    shard_remove(c, s, old);
+    removed = old;
+  }
+  e->chain = *bucket_of(s, e->hash);
+  *bucket_of(s, e->hash) = e;
+  if (warm) lru_append(s, e);
+  else lru_push(s, e);
+  s->bytes += size;
+  atomic_fetch_add_explicit(&c->bytes, size, memory_order_relaxed);
+  stats_add(&stat_bytes, size);
+  while (s->bytes > c->shard_max_bytes && s->oldest != e) {
+    cache_entry_t *victim = s->oldest;
+    shard_remove(c, s, victim);
+    victim->chain = removed;
+    removed = victim;
+    stats_add(&stat_evictions, 1);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  while (removed) {
+    cache_entry_t *next = removed->chain;
+    entry_free(removed);
+    removed = next;
+  }
+  return true;
+}
+
+void account_cache_put(account_cache_t *c, const char *userid, const account_t *acc) {
+  cache_insert(c, userid, acc, false, NULL);
+}
+
+uint64_t account_cache_ticket(account_cache_t *c, const char *userid) {
+  uint64_t hash = hash_userid(userid);
+  shard_t *s = shard_for(c, hash);
+  pthread_mutex_lock(&s->lock);
+  uint64_t ticket = *stamp_of(s, hash);
+  pthread_mutex_unlock(&s->lock);
+  return ticket;
+}
+
+void account_cache_fill(account_cache_t *c, const char *userid, const account_t *acc, uint64_t ticket) {
+  cache_insert(c, userid, acc, false, &ticket);
+}
+
+void account_cache_invalidate(account_cache_t *c, const char *userid) {
+  account_cache_refresh(c, userid, NULL);
+}
+
+void account_cache_refresh(account_cache_t *c, const char *userid, const account_t *acc) {
+  uint64_t hash = hash_userid(userid);
+  shard_t *s = shard_for(c, hash);
+  uint64_t expires = now_ns() + (uint64_t)c->config.ttl_secs * 1000000000ULL;
+  pthread_mutex_lock(&s->lock);
+  (*stamp_of(s, hash))++;
+  cache_entry_t *e = shard_find(s, hash, userid);
+  if (e && e->found && acc) {
+    // in place, keeping its recency: a login changes the account, and it stays hot
+    e->acc[0] = *acc;
+    e->expires = expires;
+    e = NULL;
+  } else if (e) {
+    shard_remove(c, s, e);
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (e) entry_free(e);
+}
+
+size_t account_cache_memory(const account_cache_t *c) {
+  return atomic_load_explicit(&c->bytes, memory_order_relaxed);
+}
+
+////
+// Saving the hot set
+
+typedef struct {
+  uint64_t used;
+  bool found;
+  char userid[USER_ID_LENGTH + 1];
+} hot_entry_t;
+
+static int by_recency(const void *a, const void *b) {
+  uint64_t ua = ((const hot_entry_t *)a)->used, ub = ((const hot_entry_t *)b)->used;
+  return ua < ub ? 1 : ua > ub ? -1 : 0;
+}
+
+/**
+ * The most recently used entries, newest first. Each shard contributes
+ * up to twice its even share, which is plenty since userids are spread
+ * over the shards by hash.
+ */
+static hot_entry_t *collect_hot(account_cache_t *c, size_t *count) {
+  size_t per_shard = c->config.hot_set_max / SHARDS * 2 + 16;
+  size_t cap = per_shard * SHARDS, n = 0;
+  hot_entry_t *hot = malloc(cap * sizeof *hot);
+  if (!hot) return NULL;
+
+  for (size_t i = 0; i < SHARDS; i++) {
+    shard_t *s = &c->shards[i];
+    pthread_mutex_lock(&s->lock);
+    size_t taken = 0;
+    for (cache_entry_t *e = s->newest; e && taken < per_shard; e = e->older, taken++) {
+      hot_entry_t *h = &hot[n++];
+      h->used = e->used;
+      h->found = e->found;
+      memcpy(h->userid, e->userid, sizeof h->userid);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  qsort(hot, n, sizeof *hot, by_recency);
+  *count = n < c->config.hot_set_max ? n : c->config.hot_set_max;
+  return hot;
+}
+
+bool account_cache_save(account_cache_t *c, const char *path) {
+  if (!c || !path) {
+    log_message(LOG_ERROR, "account_cache_save: NULL argument.");
+    return false;
+  }
+  size_t count;
+  hot_entry_t *hot = collect_hot(c, &count);
+  size_t tmp_len = strlen(path) + sizeof ".tmp";
+  char *tmp = malloc(tmp_len);
+  if (!hot || !tmp) {
+    log_message(LOG_ERROR, "account_cache_save: failed to allocate.");
+    free(hot);
+    free(tmp);
+    return false;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+
+  pthread_mutex_lock(&c->save_lock);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!f) {
+    log_message(LOG_ERROR, "account_cache_save: can't create '%s': %s.", tmp, strerror(errno));
+    pthread_mutex_unlock(&c->save_lock);
+    if (fd >= 0) close(fd);
+    free(hot);
+    free(tmp);
+    return false;
+  }
+
+  hot_set_header_t header = { .count = (uint32_t)count, .saved_at = (int64_t)time(NULL) };
+  memcpy(header.magic, HOT_SET_MAGIC, MAGIC_LEN);
+  bool ok = fwrite(&header, sizeof header, 1, f) == 1;
+  login_throttle_t *throttle = login_throttle_get_default();
+  for (size_t i = 0; ok && i < count; i++) {
+    uint64_t state = throttle ? login_throttle_export(throttle, hot[i].userid) : 0;
+    unsigned char head[2] = {
+      (unsigned char)((hot[i].found ? HOT_FOUND : 0) | (state ? HOT_THROTTLED : 0)),
+      (unsigned char)strlen(hot[i].userid),
+    };
+    ok = fwrite(head, sizeof head, 1, f) == 1 && fwrite(hot[i].userid, head[1], 1, f) == 1 &&
+         (!state || fwrite(&state, sizeof state, 1, f) == 1);
+  }
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  ok = ok && rename(tmp, path) == 0;
+
+  if (!ok) {
+    log_message(LOG_ERROR, "account_cache_save: failed to write '%s': %s.", path, strerror(errno));
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&c->save_lock);
+  free(hot);
+  free(tmp);
+  return ok;
+}
+
+static void *saver_thread(void *arg) {
+  account_cache_t *c = arg;
+  pthread_mutex_lock(&c->saver_lock);
+  while (!c->stopping) {
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    wake.tv_sec += c->config.save_interval_secs;
+    while (!c->stopping && pthread_cond_timedwait(&c->saver_wake, &c->saver_lock, &wake) != ETIMEDOUT) {}
+    if (c->stopping) break;
+    pthread_mutex_unlock(&c->saver_lock);
+    account_cache_save(c, c->hot_set_path);
+    pthread_mutex_lock(&c->saver_lock);
+  }
+  pthread_mutex_unlock(&c->saver_lock);
+  return NULL;
+}
+
+////
+// Warming
+
+// shared by a warm-up and its outstanding lookups
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t progress;      // a lookup completed
+  account_cache_t *cache;
+  db_async_t *db;               // where accounts are fetched from; NULL to use `lookup`
+  account_cache_lookup_fn lookup;   // run on a thread per batch
+  void *lookup_arg;
+  size_t in_flight;
+  bool abandoned;               // warm-up gave up waiting; the last lookup frees this
+  size_t bytes;                 // taken by warmed entries, counting those in flight
+  size_t fetched;
+  size_t negative;
+} warm_t;
+
+typedef struct warm_batch warm_batch_t;
+
+typedef struct {
+  warm_batch_t *batch;
+  uint64_t ticket;
+  char userid[USER_ID_LENGTH + 1];
+} warm_lookup_t;
+
+struct warm_batch {
+  warm_t *w;
+  size_t remaining;
+  warm_lookup_t lookups[WARM_BATCH];
+};
+
+static void warm_free(warm_t *w) {
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->progress);
+  free(w);
+}
+
+// db_async completion; runs on the connection's receiver thread, or a local batch's thread
+static void warm_arrived(void *arg, db_lookup_status_t status, const account_t *acc) {
+  warm_lookup_t *lookup = arg;
+  warm_batch_t *batch = lookup->batch;
+  warm_t *w = batch->w;
+
+  pthread_mutex_lock(&w->lock);
+  if (!w->abandoned) {
+    // the slot reserved for the account is given back unless it's cached
+    w->bytes -= POSITIVE_SIZE;
+    const uint64_t *ticket = &lookup->ticket;
+    if (status == DB_LOOKUP_FOUND && cache_insert(w->cache, lookup->userid, acc, true, ticket)) {
+      w->bytes += POSITIVE_SIZE;
+      w->fetched++;
+    } else if (status == DB_LOOKUP_NOT_FOUND && cache_insert(w->cache, lookup->userid, NULL, true, ticket)) {
+      w->bytes += NEGATIVE_SIZE;
+      w->negative++;
+    }
+  }
+  if (--batch->remaining == 0) free(batch);
+  bool last = --w->in_flight == 0 && w->abandoned;
+  pthread_cond_broadcast(&w->progress);
+  pthread_mutex_unlock(&w->lock);
+  if (last) warm_free(w);
+}
+
+static bool past(const struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline->tv_sec ||
+         (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// run a batch's lookups locally, one after another
+static void *warm_lookup_batch(void *arg) {
+  warm_batch_t *batch = arg;
+  warm_t *w = batch->w;
+  // the last completion frees the batch, and then perhaps `w`
+  size_t n = batch->remaining;
+  for (size_t i = 0; i < n; i++) {
+    pthread_mutex_lock(&w->lock);
+    bool abandoned = w->abandoned;
+    pthread_mutex_unlock(&w->lock);
+
+    account_t acc = {0};
+    db_lookup_status_t status = DB_LOOKUP_ERROR;
+    if (!abandoned) {
+      status = w->lookup(w->lookup_arg, batch->lookups[i].userid, &acc) ? DB_LOOKUP_FOUND
+                                                                         : DB_LOOKUP_NOT_FOUND;
+    }
+    warm_arrived(&batch->lookups[i], status, &acc);
+    memset(&acc, 0, sizeof acc);
+  }
+  return NULL;
+}
+
+/**
+ * Send the batch's lookups once there is room for them in flight.
+ * Returns false, having freed the batch, if the deadline passes first.
+ */
+static bool warm_send(warm_t *w, warm_batch_t *batch, size_t max_in_flight,
+                      const struct timespec *deadline) {
+  size_t n = batch->remaining;
+  pthread_mutex_lock(&w->lock);
+  while (w->in_flight > 0 && w->in_flight + n > max_in_flight &&
+         pthread_cond_timedwait(&w->progress, &w->lock, deadline) != ETIMEDOUT) {}
+  if (w->in_flight > 0 && w->in_flight + n > max_in_flight) {
+    w->bytes -= n * POSITIVE_SIZE;
+    pthread_mutex_unlock(&w->lock);
+    free(batch);
+    return false;
+  }
+  w->in_flight += n;
+  pthread_mutex_unlock(&w->lock);
+
+  if (!w->db) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, warm_lookup_batch, batch) == 0) pthread_detach(thread);
+    else warm_lookup_batch(batch);
+    return true;
+  }
+  const char *userids[WARM_BATCH];
+  void *args[WARM_BATCH];
+  for (size_t i = 0; i < n; i++) {
+    userids[i] = batch->lookups[i].userid;
+    args[i] = &batch->lookups[i];
+  }
+  // the batch may be freed by the last completion before this returns
+  db_async_multi_get(w->db, userids, n, warm_arrived, args);
+  return true;
+}
+
+// warm from `db`, or with `lookup` if `db` is NULL
+static bool warm_run(account_cache_t *c, const char *path, db_async_t *db,
+                     account_cache_lookup_fn lookup, void *lookup_arg,
+                     account_cache_warm_stats_t *stats) {
+  account_cache_warm_stats_t local;
+  if (!stats) stats = &local;
+  *stats = (account_cache_warm_stats_t){ .complete = true };
+  if (!c || !path || (!db && !lookup)) {
+    log_message(LOG_ERROR, "account_cache_warm: NULL argument.");
+    return false;
+  }
+  FILE *f = fopen(path, "rb");
+  if (!f && errno == ENOENT) return true;
+  if (!f) {
+    log_message(LOG_ERROR, "account_cache_warm: can't open '%s': %s.", path, strerror(errno));
+    return false;
+  }
+  hot_set_header_t header;
+  if (fread(&header, sizeof header, 1, f) != 1 || memcmp(header.magic, HOT_SET_MAGIC, MAGIC_LEN) != 0) {
+    log_message(LOG_ERROR, "account_cache_warm: '%s' is not a hot-set file.", path);
+    fclose(f);
+    return false;
+  }
+  stats->records = header.count;
+
+  warm_t *w = calloc(1, sizeof *w);
+  if (!w) {
+    log_message(LOG_ERROR, "account_cache_warm: failed to allocate.");
+    fclose(f);
+    return false;
+  }
+  w->cache = c;
+  w->db = db;
+  w->lookup = lookup;
+  w->lookup_arg = lookup_arg;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w->progress, &attr);
+  pthread_condattr_destroy(&attr);
+
+  const account_cache_config_t *config = &c->config;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += config->warm_max_secs;
+  size_t max_in_flight = config->warm_max_in_flight;
+  login_throttle_t *throttle = login_throttle_get_default();
+
+  bool ok = true, stopped = false;
+  warm_batch_t *batch = NULL;
+  for (uint32_t i = 0; ok && !stopped && i < header.count; i++) {
+    unsigned char head[2];
+    char userid[USER_ID_LENGTH + 1] = {0};
+    uint64_t state = 0;
+    if (fread(head, sizeof head, 1, f) != 1 || head[1] > USER_ID_LENGTH ||
+        (head[1] > 0 && fread(userid, head[1], 1, f) != 1) ||
+        ((head[0] & HOT_THROTTLED) && fread(&state, sizeof state, 1, f) != 1)) {
+      log_message(LOG_ERROR, "account_cache_warm: '%s' is truncated.", path);
+      ok = false;
+      break;
+    }
+
+    // the throttle state is tiny, so it is restored even past the limits
+    if (state && throttle) {
+      login_throttle_import(throttle, userid, state);
+      stats->throttled++;
+    }
+    size_t size = head[0] & HOT_FOUND ? POSITIVE_SIZE : NEGATIVE_SIZE;
+    pthread_mutex_lock(&w->lock);
+    stopped = past(&deadline) || w->bytes + size > config->warm_max_bytes;
+    if (!stopped) w->bytes += size;
+    pthread_mutex_unlock(&w->lock);
+    if (stopped) break;
+
+    if (!(head[0] & HOT_FOUND)) {
+      // nothing to fetch
+      pthread_mutex_lock(&w->lock);
+      if (cache_insert(c, userid, NULL, true, NULL)) w->negative++;
+      else w->bytes -= size;
+      pthread_mutex_unlock(&w->lock);
+      continue;
+    }
+    if (!batch && !(batch = calloc(1, sizeof *batch))) {
+      log_message(LOG_ERROR, "account_cache_warm: failed to allocate.");
+      ok = false;
+      break;
+    }
+    batch->w = w;
+    warm_lookup_t *lookup = &batch->lookups[batch->remaining++];
+    lookup->batch = batch;
+    lookup->ticket = account_cache_ticket(c, userid);
+    memcpy(lookup->userid, userid, sizeof userid);
+    if (batch->remaining == WARM_BATCH) {
+      stopped = !warm_send(w, batch, max_in_flight, &deadline);
+      batch = NULL;
+    }
+  }
+  fclose(f);
+  // what has been read so far is within the limits, whatever stopped the loop
+  if (batch && ok) {
+    if (!warm_send(w, batch, max_in_flight, &deadline)) stopped = true;
+  } else {
+    free(batch);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->in_flight > 0 && pthread_cond_timedwait(&w->progress, &w->lock, &deadline) != ETIMEDOUT) {}
+  stats->fetched = w->fetched;
+  stats->negative = w->negative;
+  stats->complete = ok && !stopped && w->in_flight == 0;
+  bool outstanding = w->in_flight > 0;
+  w->abandoned = outstanding;
+  pthread_mutex_unlock(&w->lock);
+  if (!outstanding) warm_free(w);
+
+  stats_add(&stat_warmed, stats->fetched + stats->negative);
+  return ok;
+}
+
+bool account_cache_warm(account_cache_t *c, const char *path, db_async_t *db,
+                        account_cache_warm_stats_t *stats) {
+  return warm_run(c, path, db, NULL, NULL, stats);
+}
+
+bool account_cache_warm_local(account_cache_t *c, const char *path, account_cache_lookup_fn lookup,
+                              void *arg, account_cache_warm_stats_t *stats) {
+  return warm_run(c, path, NULL, lookup, arg, stats);
+}
+
+void account_cache_set_default(account_cache_t *c) {
+  atomic_store(&default_cache, c);
+}
+
+account_cache_t *account_cache_get_default(void) {
+  return atomic_load(&default_cache);
+}
@@ -0,0 +1,177 @@
+#ifndef ACCOUNT_CACHE_H
+#define ACCOUNT_CACHE_H
+
+#include "account.h"
+#include "db_async.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file account_cache.h
+ * @brief Cache of account lookups in front of the database, with warm
+ * starts from a saved hot set.
+ *
+ * Holds the answers to recent lookups: the account for userids that
+ * exist, and a smaller "not found" entry for those that don't, each for
+ * a limited time. The least recently used entries are evicted once the
+ * cache reaches its memory limit. While a cache is installed with
+ * account_cache_set_default(), login_async_t and
+ * account_lookup_by_userid() answer lookups from it when they can, and
+ * cache what the database or store returns.
+ *
+ * Entries must not outlive changes to the accounts they hold: a store
+ * with a cache attached (account_store_set_cache(),
+ * compact_store_set_cache()) refreshes the cached copy of each account
+ * it changes, or invalidates the entry. A lookup made to fill the cache
+ * can race with such a change and return the old record afterwards, so
+ * fills go through account_cache_ticket() and account_cache_fill(),
+ * which drop a result if its userid changed while it was being looked
+ * up.
+ *
+ * A freshly started process has an empty cache, so every login goes to
+ * the database at once. To avoid that, the cache can record its hot set
+ * in a file every `save_interval_secs` and when it is freed: the most
+ * recently used userids, whether each exists, and the failure state
+ * the default login throttle (login_throttle.h) holds for it. The file
+ * holds no account data, just over a dozen bytes per userid.
+ * account_cache_warm() reads it back on startup: it restores the
+ * "not found" entries and throttle state directly, and fetches the
+ * accounts from the database in large pipelined multi-gets, hottest
+ * first, until it runs out of records, time or memory.
+ *
+ * Restored "not found" entries are trusted for a full
+ * `negative_ttl_secs` from the warm-up, so an account created while the
+ * process was down may be reported missing for that long.
+ *
+ * The hot-set file is written in native byte order.
+ */
+
+typedef struct account_cache account_cache_t;
+
+typedef struct {
+  size_t max_bytes;             // memory for entries
+  uint32_t ttl_secs;            // how long an account is served from the cache
+  uint32_t negative_ttl_secs;   // how long "not found" is
+
+  const char *hot_set_path;     // where the hot set is saved, or NULL not to save it
+  uint32_t save_interval_secs;  // 0 to save only when the cache is freed
+  size_t hot_set_max;           // userids saved
+
+  // limits for account_cache_warm()
+  uint32_t warm_max_secs;       // give up after this long
+  size_t warm_max_bytes;        // stop once warmed entries take this much memory
+  size_t warm_max_in_flight;    // lookups outstanding at once
+} account_cache_config_t;
+
+// what account_cache_warm() did
+typedef struct {
+  size_t records;               // userids in the hot-set file
+  size_t fetched;               // accounts fetched into the cache
+  size_t negative;              // "not found" entries restored or fetched
+  size_t throttled;             // throttle states restored
+  bool complete;                // every record was dealt with, within the limits
+} account_cache_warm_stats_t;
+
+/**
+ * Fill in a config with defaults: 64 MiB of entries kept for 60 seconds
+ * (10 if not found), a hot set of up to 100,000 userids saved every
+ * minute (with no path set), and warm-ups of up to 30 seconds and
+ * 32 MiB with 4096 lookups in flight.
+ */
+void account_cache_config_defaults(account_cache_config_t *config);
+
+/**
+ * Create a cache. If `config->hot_set_path` is set and
+ * `save_interval_secs` isn't 0, a background thread saves the hot set
+ * there periodically.
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+account_cache_t *account_cache_create(const account_cache_config_t *config);
+
+// save the hot set (if there is a path), then wipe and free the cache
+void account_cache_free(account_cache_t *cache);
+
+/**
+ * Look up `userid`. Returns false on a miss. On a hit, *found says
+ * whether the account exists, and if it does, it is copied to *acc.
+ */
+bool account_cache_get(account_cache_t *cache, const char *userid, account_t *acc, bool *found);
+
+// cache the result of a lookup of `userid`: the account, or NULL if it wasn't found
+void account_cache_put(account_cache_t *cache, const char *userid, const account_t *acc);
+
+// forget `userid`, e.g. after the account has changed
+void account_cache_invalidate(account_cache_t *cache, const char *userid);
+
+/**
+ * `userid` has changed to `acc` (NULL if removed). A cached copy of the
+ * account is replaced in place, keeping its place in the hot set;
+ * otherwise this is account_cache_invalidate().
+ */
+void account_cache_refresh(account_cache_t *cache, const char *userid, const account_t *acc);
+
+/**
+ * Take a ticket before looking `userid` up to fill the cache. It is
+ * only compared for equality by account_cache_fill(); unrelated userids
+ * occasionally share a counter, which just drops a few more fills.
+ */
+uint64_t account_cache_ticket(account_cache_t *cache, const char *userid);
+
+// as account_cache_put(), unless `userid` has changed since `ticket` was taken
+void account_cache_fill(account_cache_t *cache, const char *userid, const account_t *acc,
+                        uint64_t ticket);
+
+// bytes taken by entries
+size_t account_cache_memory(const account_cache_t *cache);
+
+/**
+ * Write the hot set to `path` now, replacing the file atomically.
+ * Returns false and logs an error message on failure.
+ */
+bool account_cache_save(account_cache_t *cache, const char *path);
+
+/**
+ * Warm the cache from the hot set saved at `path`, fetching accounts
+ * through `db`, within the config's warm_* limits. Lookups are
+ * pipelined, so the time this takes is roughly the number of records
+ * over `warm_max_in_flight` round trips. Call it before accepting
+ * traffic, or on another thread to warm while serving.
+ *
+ * Lookups still outstanding when the time limit passes complete
+ * without touching the cache; `db` must be closed before the cache is
+ * freed. `stats` may be NULL.
+ *
+ * Returns false and logs an error message if the file can't be read or
+ * is malformed. A missing file is not an error: there is nothing to warm.
+ */
+bool account_cache_warm(account_cache_t *cache, const char *path, db_async_t *db,
+                        account_cache_warm_stats_t *stats);
+
+// Look `userid` up for account_cache_warm_local(); returns false if it doesn't exist.
+typedef bool (*account_cache_lookup_fn)(void *arg, const char *userid, account_t *acc);
+
+/**
+ * As account_cache_warm(), but fetches accounts with `lookup`, for a
+ * process whose accounts are local (a login node's store). Lookups run
+ * in batches on threads of their own, with up to `warm_max_in_flight`
+ * outstanding. A lookup already under way when a warm-up times out
+ * runs to completion after it returns (without touching the cache),
+ * so what `lookup` reads must stay valid past that.
+ */
+bool account_cache_warm_local(account_cache_t *cache, const char *path, account_cache_lookup_fn lookup,
+                              void *arg, account_cache_warm_stats_t *stats);
+
+////
+// Process-wide default cache
+
+// Set the cache login_async_t and account_lookup_by_userid() consult. NULL
+// clears it. The caller keeps ownership.
+void account_cache_set_default(account_cache_t *cache);
+
+// the cache set by account_cache_set_default(), or NULL
+account_cache_t *account_cache_get_default(void);
+
+#endif // ACCOUNT_CACHE_H
@@ -0,0 +1,602 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_cdc.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RING_MAGIC UINT64_C(0x3130434443544341)   // "ACTCDC01" in native byte order
+#define RING_MIN_BYTES ((size_t)64 << 10)
+#define RECORD_PAD UINT32_MAX                     // header length of the filler before a wrap
+#define SERVE_WAIT_NS 100000000L                  // how often a server checks its subscriber is still there
+
+/*
+ * The ring: a header, then `capacity` bytes of records as 64-bit words.
+ * Positions count bytes ever written, so a record's offset in `data` is
+ * its position modulo the capacity, and a reader that sees the writer
+ * more than a capacity ahead knows it has been lapped.
+ *
+ * A record is a header word holding the payload length in its upper
+ * half, then the payload (an encoded change) packed into words. Records
+ * never wrap: one that doesn't fit before the end is preceded by a
+ * RECORD_PAD header, and starts again at offset 0.
+ *
+ * There is one writer. Before it writes anything, it advances `reserved`
+ * to the end of the new record; once it has written it, it advances
+ * `head` to match. Readers copy a record out and then check `reserved`:
+ * if the writer had by then reserved more than a capacity past the
+ * record's start, the copy may be torn, and the record is lost.
+ */
+typedef struct {
+  _Atomic uint64_t magic;
+  uint64_t capacity;              // bytes of records, a power of two
+  _Atomic uint64_t head;          // end of the last complete record
+  _Atomic uint64_t reserved;      // end of the record being written (or `head`)
+  _Atomic uint64_t tail;          // start of the oldest record not overwritten
+  _Atomic uint64_t data[];
+} ring_t;
+
+struct account_cdc {
+  account_cdc_config_t config;
+  char *shm_name;                 // owned copy of config.shm_name
+  ring_t *ring;
+  size_t ring_bytes;              // including the header
+
+  pthread_mutex_t lock;           // serialises writers
+  _Atomic uint64_t next_seq;
+
+  // account_cdc_serve() calls waiting for a change
+  pthread_mutex_t wait_lock;
+  pthread_cond_t wait_cond;
+  atomic_uint waiters;
+};
+
+struct account_cdc_reader {
+  ring_t *ring;
+  void *map;                      // our own mapping of a shared ring, or NULL
+  size_t map_bytes;
+  uint64_t pos;
+  uint8_t buf[WIRE_MAX_FRAME];    // the payload of the record last read
+};
+
+static STATS_DEFINE(stat_changes, "account_cdc.changes");
+static STATS_DEFINE(stat_bytes, "account_cdc.bytes");
+static STATS_DEFINE(stat_lost, "account_cdc.lost");
+
+////
+// Fields
+
+static uint32_t changed_fields(const account_t *a, const account_t *b) {
+  uint32_t f = 0;
+  if (a->account_id != b->account_id) f |= ACCOUNT_FIELD_ACCOUNT_ID;
+  if (strncmp(a->password_hash, b->password_hash, HASH_LENGTH) != 0) f |= ACCOUNT_FIELD_PASSWORD_HASH;
+  if (strncmp(a->email, b->email, EMAIL_LENGTH) != 0) f |= ACCOUNT_FIELD_EMAIL;
+  if (a->unban_time != b->unban_time) f |= ACCOUNT_FIELD_UNBAN_TIME;
+  if (a->expiration_time != b->expiration_time) f |= ACCOUNT_FIELD_EXPIRATION_TIME;
+  if (a->login_count != b->login_count) f |= ACCOUNT_FIELD_LOGIN_COUNT;
+  if (a->login_fail_count != b->login_fail_count) f |= ACCOUNT_FIELD_LOGIN_FAIL_COUNT;
+  if (a->last_login_time != b->last_login_time) f |= ACCOUNT_FIELD_LAST_LOGIN_TIME;
+  if (a->last_ip != b->last_ip) f |= ACCOUNT_FIELD_LAST_IP;
+  if (memcmp(a->birthdate, b->birthdate, BIRTHDATE_LENGTH) != 0) f |= ACCOUNT_FIELD_BIRTHDATE;
+  return f;
+}
+
+static void copy_fields(account_t *to, const account_t *from, uint32_t f) {
+  if (f & ACCOUNT_FIELD_ACCOUNT_ID) to->account_id = from->account_id;
+  if (f & ACCOUNT_FIELD_PASSWORD_HASH) memcpy(to->password_hash, from->password_hash, HASH_LENGTH);
+  if (f & ACCOUNT_FIELD_EMAIL) memcpy(to->email, from->email, EMAIL_LENGTH);
+  if (f & ACCOUNT_FIELD_UNBAN_TIME) to->unban_time = from->unban_time;
+  if (f & ACCOUNT_FIELD_EXPIRATION_TIME) to->expiration_time = from->expiration_time;
+  if (f & ACCOUNT_FIELD_LOGIN_COUNT) to->login_count = from->login_count;
+  if (f & ACCOUNT_FIELD_LOGIN_FAIL_COUNT) to->login_fail_count = from->login_fail_count;
+  if (f & ACCOUNT_FIELD_LAST_LOGIN_TIME) to->last_login_time = from->last_login_time;
+  if (f & ACCOUNT_FIELD_LAST_IP) to->last_ip = from->last_ip;
+  if (f & ACCOUNT_FIELD_BIRTHDATE) memcpy(to->birthdate, from->birthdate, BIRTHDATE_LENGTH);
+}
+
+////
+// Encoding and applying changes
+
+// encode a change to `a`, leaving out the password hash unless `hash` is set
+static void encode(wire_writer_t *w, uint64_t seq, time_t time, account_change_op_t op, uint32_t f,
+                   const account_t *a, bool hash) {
+  wire_put_u64(w, seq);
+  wire_put_i64(w, (int64_t)time);
+  wire_put_u8(w, (uint8_t)op);
+  wire_put_u32(w, f);
+  wire_put_str(w, a->userid, USER_ID_LENGTH);
+  if (f & ACCOUNT_FIELD_ACCOUNT_ID) wire_put_i64(w, a->account_id);
+  if (f & ACCOUNT_FIELD_PASSWORD_HASH) wire_put_str(w, hash ? a->password_hash : "", HASH_LENGTH);
+  if (f & ACCOUNT_FIELD_EMAIL) wire_put_str(w, a->email, EMAIL_LENGTH);
+  if (f & ACCOUNT_FIELD_UNBAN_TIME) wire_put_i64(w, (int64_t)a->unban_time);
+  if (f & ACCOUNT_FIELD_EXPIRATION_TIME) wire_put_i64(w, (int64_t)a->expiration_time);
+  if (f & ACCOUNT_FIELD_LOGIN_COUNT) wire_put_u32(w, a->login_count);
+  if (f & ACCOUNT_FIELD_LOGIN_FAIL_COUNT) wire_put_u32(w, a->login_fail_count);
+  if (f & ACCOUNT_FIELD_LAST_LOGIN_TIME) wire_put_i64(w, (int64_t)a->last_login_time);
+  if (f & ACCOUNT_FIELD_LAST_IP) wire_put_u32(w, a->last_ip);
+  if (f & ACCOUNT_FIELD_BIRTHDATE) wire_put_bytes(w, a->birthdate, BIRTHDATE_LENGTH);
+}
+
+void account_change_encode(wire_writer_t *w, const account_change_t *c) {
+  encode(w, c->seq, c->time, c->op, c->fields, &c->acc, true);
+}
+
+bool account_change_decode(wire_reader_t *r, account_change_t *c) {
+  memset(c, 0, sizeof *c);
+  account_t *a = &c->acc;
+  c->seq = wire_get_u64(r);
+  c->time = (time_t)wire_get_i64(r);
+  uint8_t op = wire_get_u8(r);
+  uint32_t f = c->fields = wire_get_u32(r);
+  if (op < ACCOUNT_CHANGE_PUT || op > ACCOUNT_CHANGE_REMOVE || (f & ~(uint32_t)ACCOUNT_FIELD_ALL)) {
+    return false;
+  }
+  c->op = (account_change_op_t)op;
+  wire_get_str(r, a->userid, sizeof a->userid);
+  if (f & ACCOUNT_FIELD_ACCOUNT_ID) a->account_id = wire_get_i64(r);
+  if (f & ACCOUNT_FIELD_PASSWORD_HASH) wire_get_str(r, a->password_hash, sizeof a->password_hash);
+  if (f & ACCOUNT_FIELD_EMAIL) wire_get_str(r, a->email, sizeof a->email);
+  if (f & ACCOUNT_FIELD_UNBAN_TIME) a->unban_time = (time_t)wire_get_i64(r);
+  if (f & ACCOUNT_FIELD_EXPIRATION_TIME) a->expiration_time = (time_t)wire_get_i64(r);
+  if (f & ACCOUNT_FIELD_LOGIN_COUNT) a->login_count = wire_get_u32(r);
+  if (f & ACCOUNT_FIELD_LOGIN_FAIL_COUNT) a->login_fail_count = wire_get_u32(r);
+  if (f & ACCOUNT_FIELD_LAST_LOGIN_TIME) a->last_login_time = (time_t)wire_get_i64(r);
+  if (f & ACCOUNT_FIELD_LAST_IP) a->last_ip = wire_get_u32(r);
+  if (f & ACCOUNT_FIELD_BIRTHDATE) wire_get_bytes(r, a->birthdate, BIRTHDATE_LENGTH);
+  return !r->error;
+}
+
+bool account_change_apply(const account_change_t *c, account_t *acc) {
+  switch (c->op) {
+    case ACCOUNT_CHANGE_PUT:
+      *acc = c->acc;
+      return true;
+    case ACCOUNT_CHANGE_UPDATE: {
+      uint32_t f = c->fields;
+      // a stream without hashes reports the change but not the hash
+      if (c->acc.password_hash[0] == '\0') f &= ~(uint32_t)ACCOUNT_FIELD_PASSWORD_HASH;
+      copy_fields(acc, &c->acc, f);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+static bool apply_update(account_t *acc, void *arg) {
+  return account_change_apply(arg, acc);
+}
+
+bool account_cdc_apply(account_store_t *replica, const account_change_t *c) {
+  switch (c->op) {
+    case ACCOUNT_CHANGE_PUT:
+      return account_store_put(replica, &c->acc);
+    case ACCOUNT_CHANGE_UPDATE:
+      return account_store_update(replica, c->acc.userid, apply_update, (void *)c);
+    case ACCOUNT_CHANGE_REMOVE:
+      // already gone is as good as removed
+      account_store_remove(replica, c->acc.userid);
+      return true;
+  }
+  return false;
+}
+
+////
+// Ring
+
+static size_t record_words(size_t len) {
+  return 1 + (len + 7) / 8;
+}
+
+static _Atomic uint64_t *ring_word(ring_t *ring, uint64_t pos) {
+  return &ring->data[(pos & (ring->capacity - 1)) / 8];
+}
+
+// bytes from `pos` to the next record; only the writer may call this
+static uint64_t ring_span(ring_t *ring, uint64_t pos) {
+  uint64_t len = atomic_load_explicit(ring_word(ring, pos), memory_order_relaxed) >> 32;
+  if (len == RECORD_PAD) return ring->capacity - (pos & (ring->capacity - 1));
+  return 8 * record_words(len);
+}
+
+static void ring_write(ring_t *ring, const uint8_t *payload, size_t len) {
+  uint64_t cap = ring->capacity;
+  uint64_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t bytes = 8 * record_words(len);
+  uint64_t room = cap - (pos & (cap - 1));
+  uint64_t pad = room < bytes ? room : 0;
+  uint64_t end = pos + pad + bytes;
+
+  // forget the records about to be overwritten, while their headers are intact
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (end - tail > cap) tail += ring_span(ring, tail);
+  atomic_store_explicit(&ring->tail, tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->reserved, end, memory_order_relaxed);
+
+  // release stores (plain stores on x86), so a reader that sees any of
+  // these words also sees the reservation
+  if (pad) {
+    atomic_store_explicit(ring_word(ring, pos), (uint64_t)RECORD_PAD << 32, memory_order_release);
+    pos += pad;
+  }
+  atomic_store_explicit(ring_word(ring, pos), (uint64_t)len << 32, memory_order_release);
+  for (size_t i = 0; i * 8 < len; i++) {
+    uint64_t w = 0;
+    memcpy(&w, payload + i * 8, len - i * 8 < 8 ? len - i * 8 : 8);
+    atomic_store_explicit(ring_word(ring, pos + 8 + i * 8), w, memory_order_release);
+  }
+  // sequentially consistent, so that a server about to wait either sees
+  // the record or is seen waiting (see wait_for_change())
+  atomic_store(&ring->head, end);
+}
+
+////
+// Stream
+
+void account_cdc_config_defaults(account_cdc_config_t *config) {
+  config->shm_name = NULL;
+  config->ring_bytes = (size_t)16 << 20;
+  config->include_hashes = false;
+}
+
+static ring_t *ring_map_shared(const char *name, size_t bytes) {
+  // replace, rather than reuse, whatever has the name, in case it isn't ours
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) return NULL;
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, (off_t)bytes) == 0) p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(name);
+    return NULL;
+  }
+  return p;
+}
+
+account_cdc_t *account_cdc_create(const account_cdc_config_t *config) {
+  if (!config || (config->shm_name && config->shm_name[0] != '/')) {
+    log_message(LOG_ERROR, "account_cdc_create: invalid config.");
+    return NULL;
+  }
+  account_cdc_t *cdc = calloc(1, sizeof *cdc);
+  if (!cdc) {
+    log_message(LOG_ERROR, "account_cdc_create: failed to allocate.");
+    return NULL;
+  }
+  size_t capacity = RING_MIN_BYTES;
+  while (capacity < config->ring_bytes) capacity <<= 1;
+  cdc->ring_bytes = sizeof(ring_t) + capacity;
+
+  if (config->shm_name) {
+    cdc->shm_name = strdup(config->shm_name);
+    cdc->ring = cdc->shm_name ? ring_map_shared(cdc->shm_name, cdc->ring_bytes) : NULL;
+  } else {
+    // never read before it is written, so only the header needs clearing
+    cdc->ring = malloc(cdc->ring_bytes);
+  }
+  if (!cdc->ring) {
+    log_message(LOG_ERROR, "account_cdc_create: failed to allocate the ring.");
+    free(cdc->shm_name);
+    free(cdc);
+    return NULL;
+  }
+  pthread_mutex_init(&cdc->lock, NULL);
+  pthread_mutex_init(&cdc->wait_lock, NULL);
+  pthread_cond_init(&cdc->wait_cond, NULL);
+  atomic_init(&cdc->next_seq, 1);
+  atomic_init(&cdc->waiters, 0);
+
+  ring_t *ring = cdc->ring;
+  ring->capacity = capacity;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->reserved, 0);
+  atomic_init(&ring->tail, 0);
+  // readers check the magic before anything else
+  atomic_store_explicit(&ring->magic, RING_MAGIC, memory_order_release);
+
+  cdc->config = *config;
+  cdc->config.shm_name = cdc->shm_name;
+  cdc->config.ring_bytes = capacity;
+  return cdc;
+}
+
+void account_cdc_free(account_cdc_t *cdc) {
+  if (!cdc) return;
+  if (cdc->shm_name) {
+    munmap(cdc->ring, cdc->ring_bytes);
+    shm_unlink(cdc->shm_name);
+    free(cdc->shm_name);
+  } else {
+    // changes may hold password hashes
+    memset(cdc->ring, 0, cdc->ring_bytes);
+    free(cdc->ring);
+  }
+  pthread_cond_destroy(&cdc->wait_cond);
+  pthread_mutex_destroy(&cdc->wait_lock);
+  pthread_mutex_destroy(&cdc->lock);
+  free(cdc);
+}
+
+uint64_t account_cdc_next_seq(account_cdc_t *cdc) {
+  return atomic_load(&cdc->next_seq);
+}
+
+void account_cdc_record(account_cdc_t *cdc, const account_t *old, const account_t *new) {
+  account_change_op_t op = ACCOUNT_CHANGE_UPDATE;
+  uint32_t fields = ACCOUNT_FIELD_ALL;
+  if (!new) {
+    op = ACCOUNT_CHANGE_REMOVE;
+    fields = 0;
+  } else if (!old) {
+    op = ACCOUNT_CHANGE_PUT;
+  } else {
+    fields = changed_fields(old, new);
+    if (fields == 0) return;
+  }
+
+  // encode with a placeholder sequence number, filled in under the lock
+  wire_writer_t w;
+  wire_writer_init(&w);
+  encode(&w, 0, time(NULL), op, fields, new ? new : old, cdc->config.include_hashes);
+
+  pthread_mutex_lock(&cdc->lock);
+  uint64_t seq = atomic_load_explicit(&cdc->next_seq, memory_order_relaxed);
+  for (size_t i = 0; i < 8; i++) w.buf[i] = (uint8_t)(seq >> (56 - 8 * i));
+  ring_write(cdc->ring, w.buf, w.len);
+  atomic_store(&cdc->next_seq, seq + 1);
+  pthread_mutex_unlock(&cdc->lock);
+
+  memset(w.buf, 0, w.len);
+  stats_add(&stat_changes, 1);
+  stats_add(&stat_bytes, w.len);
+  if (atomic_load(&cdc->waiters) > 0) {
+    pthread_mutex_lock(&cdc->wait_lock);
+    pthread_cond_broadcast(&cdc->wait_cond);
+    pthread_mutex_unlock(&cdc->wait_lock);
+  }
+}
+
+////
+// Readers
+
+account_cdc_reader_t *account_cdc_reader_open(const char *shm_name) {
+  int fd = shm_name ? shm_open(shm_name, O_RDONLY, 0) : -1;
+  if (fd < 0) {
+    log_message(LOG_ERROR, "account_cdc_reader_open: can't open '%s'.", shm_name ? shm_name : "(null)");
+    return NULL;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  size_t bytes = 0;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(ring_t)) {
+    bytes = (size_t)st.st_size;
+    map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  ring_t *ring = map;
+  if (map == MAP_FAILED || atomic_load_explicit(&ring->magic, memory_order_acquire) != RING_MAGIC ||
+      ring->capacity < RING_MIN_BYTES || (ring->capacity & (ring->capacity - 1)) != 0 ||
+      ring->capacity > bytes - sizeof(ring_t)) {
+    log_message(LOG_ERROR, "account_cdc_reader_open: '%s' isn't a change ring.", shm_name);
+    if (map != MAP_FAILED) munmap(map, bytes);
+    return NULL;
+  }
+  account_cdc_reader_t *r = malloc(sizeof *r);
+  if (!r) {
+    log_message(LOG_ERROR, "account_cdc_reader_open: failed to allocate.");
+    munmap(map, bytes);
+    return NULL;
+  }
+  r->ring = ring;
+  r->map = map;
+  r->map_bytes = bytes;
+  r->pos = atomic_load_explicit(&ring->head, memory_order_acquire);
+  return r;
+}
+
+account_cdc_reader_t *account_cdc_reader_create(account_cdc_t *cdc) {
+  account_cdc_reader_t *r = malloc(sizeof *r);
+  if (!r) {
+    log_message(LOG_ERROR, "account_cdc_reader_create: failed to allocate.");
+    return NULL;
+  }
+  r->ring = cdc->ring;
+  r->map = NULL;
+  r->map_bytes = 0;
+  r->pos = atomic_load_explicit(&cdc->ring->head, memory_order_acquire);
+  return r;
+}
+
+void account_cdc_reader_free(account_cdc_reader_t *r) {
+  if (!r) return;
+  if (r->map) munmap(r->map, r->map_bytes);
+  memset(r->buf, 0, sizeof r->buf);
+  free(r);
+}
+
+/**
+ * Copy the payload of the record at r->pos into r->buf, without moving
+ * on, skipping any filler first. On ACCOUNT_CDC_CHANGE, sets *len and
+ * *span (the record's size in the ring).
+ */
+static account_cdc_status_t reader_peek(account_cdc_reader_t *r, size_t *len, uint64_t *span) {
+  ring_t *ring = r->ring;
+  uint64_t cap = ring->capacity;
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (r->pos == head) return ACCOUNT_CDC_EMPTY;
+    if (head - r->pos > cap) return ACCOUNT_CDC_LOST;
+
+    uint64_t n = atomic_load_explicit(ring_word(ring, r->pos), memory_order_acquire) >> 32;
+    bool fits = n != RECORD_PAD && n <= sizeof r->buf;
+    for (size_t i = 0; fits && i * 8 < n; i++) {
+      uint64_t w = atomic_load_explicit(ring_word(ring, r->pos + 8 + i * 8), memory_order_acquire);
+      memcpy(r->buf + i * 8, &w, sizeof w);
+    }
+    // if the writer got as far as the record, the copy can't be trusted
+    if (atomic_load_explicit(&ring->reserved, memory_order_relaxed) - r->pos > cap) {
+      return ACCOUNT_CDC_LOST;
+    }
+    if (n == RECORD_PAD) {
+      r->pos += cap - (r->pos & (cap - 1));
+      continue;
+    }
+    if (!fits) return ACCOUNT_CDC_LOST;
+    *len = (size_t)n;
+    *span = 8 * record_words(*len);
+    return ACCOUNT_CDC_CHANGE;
+  }
+}
+
+static void reader_lost(account_cdc_reader_t *r) {
+  r->pos = atomic_load_explicit(&r->ring->tail, memory_order_acquire);
+}
+
+bool account_cdc_reader_seek(account_cdc_reader_t *r, uint64_t seq) {
+  reader_lost(r);
+  for (;;) {
+    size_t len;
+    uint64_t span;
+    switch (reader_peek(r, &len, &span)) {
+      case ACCOUNT_CDC_EMPTY:
+        return true;
+      case ACCOUNT_CDC_LOST:
+        // lapped while scanning; start again from the new oldest change
+        reader_lost(r);
+        break;
+      case ACCOUNT_CDC_CHANGE: {
+        wire_reader_t wr;
+        wire_reader_init(&wr, r->buf, len);
+        uint64_t found = wire_get_u64(&wr);
+        if (found >= seq) return found == seq;
+        r->pos += span;
+        break;
+      }
+    }
+  }
+}
+
+account_cdc_status_t account_cdc_read(account_cdc_reader_t *r, account_change_t *c) {
+  size_t len;
+  uint64_t span;
+  account_cdc_status_t status = reader_peek(r, &len, &span);
+  if (status == ACCOUNT_CDC_CHANGE) {
+    wire_reader_t wr;
+    wire_reader_init(&wr, r->buf, len);
+    r->pos += span;
+    if (account_change_decode(&wr, c)) return ACCOUNT_CDC_CHANGE;
+    // only a writer of a different version could get here; skip the record
+    stats_add(&stat_lost, 1);
+    return ACCOUNT_CDC_LOST;
+  }
+  if (status == ACCOUNT_CDC_LOST) {
+    stats_add(&stat_lost, 1);
+    reader_lost(r);
+  }
+  return status;
+}
+
+////
+// Socket
+
+// wait a while for a change after ring position `pos`
+static void wait_for_change(account_cdc_t *cdc, uint64_t pos) {
+  pthread_mutex_lock(&cdc->wait_lock);
+  atomic_fetch_add(&cdc->waiters, 1);
+  if (atomic_load(&cdc->ring->head) == pos) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SERVE_WAIT_NS;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&cdc->wait_cond, &cdc->wait_lock, &deadline);
+  }
+  atomic_fetch_sub(&cdc->waiters, 1);
+  pthread_mutex_unlock(&cdc->wait_lock);
+}
+
+// subscribers send nothing after subscribing, so anything readable means it has gone
+static bool subscriber_gone(int fd) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  return poll(&pfd, 1, 0) != 0;
+}
+
+void account_cdc_serve(account_cdc_t *cdc, int fd) {
+  uint8_t type;
+  uint8_t buf[16];
+  size_t len;
+  if (!wire_recv(fd, &type, buf, sizeof buf, &len) || type != ACCOUNT_CDC_MSG_SUBSCRIBE) return;
+  wire_reader_t req;
+  wire_reader_init(&req, buf, len);
+  uint64_t from_seq = wire_get_u64(&req);
+  if (!wire_reader_done(&req)) return;
+
+  account_cdc_reader_t *r = account_cdc_reader_create(cdc);
+  if (!r) return;
+  bool ok = true;
+  if (from_seq != 0 && !account_cdc_reader_seek(r, from_seq)) {
+    stats_add(&stat_lost, 1);
+    ok = wire_send(fd, ACCOUNT_CDC_MSG_LOST, NULL);
+  }
+  wire_writer_t w;
+  while (ok) {
+    size_t n;
+    uint64_t span;
+    switch (reader_peek(r, &n, &span)) {
+      case ACCOUNT_CDC_CHANGE:
+        // forward the encoded change as it is
+        wire_writer_init(&w);
+        wire_put_bytes(&w, r->buf, n);
+        r->pos += span;
+        ok = wire_send(fd, ACCOUNT_CDC_MSG_CHANGE, &w);
+        break;
+      case ACCOUNT_CDC_LOST:
+        stats_add(&stat_lost, 1);
+        reader_lost(r);
+        ok = wire_send(fd, ACCOUNT_CDC_MSG_LOST, NULL);
+        break;
+      case ACCOUNT_CDC_EMPTY:
+        wait_for_change(cdc, r->pos);
+        ok = !subscriber_gone(fd);
+        break;
+    }
+  }
+  memset(w.buf, 0, sizeof w.buf);
+  account_cdc_reader_free(r);
+}
+
+bool account_cdc_subscribe(int fd, uint64_t from_seq) {
+  wire_writer_t w;
+  wire_writer_init(&w);
+  wire_put_u64(&w, from_seq);
+  return wire_send(fd, ACCOUNT_CDC_MSG_SUBSCRIBE, &w);
+}
+
+bool account_cdc_recv(int fd, account_cdc_status_t *status, account_change_t *c) {
+  uint8_t type;
+  uint8_t buf[WIRE_MAX_FRAME];
+  size_t len;
+  if (!wire_recv(fd, &type, buf, sizeof buf, &len)) return false;
+  if (type == ACCOUNT_CDC_MSG_LOST && len == 0) {
+    *status = ACCOUNT_CDC_LOST;
+    return true;
+  }
+  wire_reader_t r;
+  wire_reader_init(&r, buf, len);
+  bool ok = type == ACCOUNT_CDC_MSG_CHANGE && account_change_decode(&r, c) && wire_reader_done(&r);
+  memset(buf, 0, len);
+  if (ok) *status = ACCOUNT_CDC_CHANGE;
+  return ok;
+}
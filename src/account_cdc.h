@@ -0,0 +1,201 @@
+#ifndef ACCOUNT_CDC_H
+#define ACCOUNT_CDC_H
+
+#include "account.h"
+#include "account_store.h"
+#include "wire.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file account_cdc.h
+ * @brief Change-data capture: an ordered stream of the changes made to
+ * an account store, for replicas to apply incrementally.
+ *
+ * While a stream is attached with account_store_set_cdc(), every record
+ * the store publishes (through account_store_put(), _update(),
+ * _update_batch() or _remove(), and so through the account_admin.h
+ * functions and the login path alike) is recorded as a change with the
+ * next sequence number. An update carries only the fields that changed:
+ * a successful login, for instance, is its userid, fail count, last
+ * login time and IP, around 60 bytes rather than a whole account_t.
+ * Changes are recorded under the store's writer lock, so they are in
+ * exactly the order the store applied them.
+ *
+ * Changes go into a ring buffer of fixed size, overwriting the oldest.
+ * If the stream has a `shm_name`, the ring is a POSIX shared-memory
+ * object, and other processes on the host can follow it with
+ * account_cdc_reader_open() without involving the writer at all. Remote
+ * replicas connect over a socket: account_cdc_serve() streams changes
+ * to a subscriber, and account_cdc_subscribe() / account_cdc_recv() are
+ * the other end.
+ *
+ * A reader that falls more than a ring behind has missed changes, and
+ * is told so (ACCOUNT_CDC_LOST); it must reload a full copy of the
+ * accounts. Each change carries new values, never differences, so a
+ * replica can start following the stream, then load a full copy (e.g.
+ * with cluster_list_accounts()), then apply every change received since
+ * subscribing: replaying changes the copy already reflects does no harm,
+ * as long as updates to accounts the copy doesn't have are ignored.
+ *
+ * Unless the stream is created with `include_hashes`, a change to a
+ * password hash is recorded without the hash. Shared-memory rings are
+ * created readable only by the owner's user.
+ *
+ * Ring records and socket frames share one encoding, in wire.h format:
+ *
+ *     seq u64, time i64, op u8, fields u32, userid str,
+ *     then each field in `fields`, in bit order, encoded as by
+ *     cluster_encode_account()
+ */
+
+typedef enum {
+  ACCOUNT_CHANGE_PUT = 1,     // created or replaced; every field is present
+  ACCOUNT_CHANGE_UPDATE,      // the fields in `fields` changed
+  ACCOUNT_CHANGE_REMOVE       // removed; only the userid is present
+} account_change_op_t;
+
+// bits of account_change_t.fields
+enum {
+  ACCOUNT_FIELD_ACCOUNT_ID = 1 << 0,
+  ACCOUNT_FIELD_PASSWORD_HASH = 1 << 1,     // empty if the stream leaves hashes out
+  ACCOUNT_FIELD_EMAIL = 1 << 2,
+  ACCOUNT_FIELD_UNBAN_TIME = 1 << 3,
+  ACCOUNT_FIELD_EXPIRATION_TIME = 1 << 4,
+  ACCOUNT_FIELD_LOGIN_COUNT = 1 << 5,
+  ACCOUNT_FIELD_LOGIN_FAIL_COUNT = 1 << 6,
+  ACCOUNT_FIELD_LAST_LOGIN_TIME = 1 << 7,
+  ACCOUNT_FIELD_LAST_IP = 1 << 8,
+  ACCOUNT_FIELD_BIRTHDATE = 1 << 9,
+  ACCOUNT_FIELD_ALL = (1 << 10) - 1
+};
+
+typedef struct {
+  uint64_t seq;               // starts at 1 and increases by 1 with each change
+  time_t time;                // when the change was recorded
+  account_change_op_t op;
+  uint32_t fields;            // ACCOUNT_FIELD_* bits
+  account_t acc;              // the userid and the fields in `fields`; the rest are zero
+} account_change_t;
+
+typedef enum {
+  ACCOUNT_CDC_CHANGE,         // a change was read
+  ACCOUNT_CDC_EMPTY,          // no new changes yet
+  ACCOUNT_CDC_LOST            // changes were overwritten before they were read; reload
+} account_cdc_status_t;
+
+// socket protocol message types (frames as in wire.h)
+typedef enum {
+  ACCOUNT_CDC_MSG_SUBSCRIBE = 1,    // from_seq u64: the first change wanted, or 0 for new ones only
+  ACCOUNT_CDC_MSG_CHANGE = 64,      // a change
+  ACCOUNT_CDC_MSG_LOST              // changes were lost; the ones that follow skip ahead
+} account_cdc_msg_t;
+
+typedef struct account_cdc_reader account_cdc_reader_t;
+
+typedef struct {
+  const char *shm_name;       // "/name" to share the ring with other processes, or NULL
+  size_t ring_bytes;          // rounded up to a power of two, at least 64 KiB
+  bool include_hashes;        // carry password hashes in changes
+} account_cdc_config_t;
+
+// fill in a config with defaults: a private 16 MiB ring, without hashes
+void account_cdc_config_defaults(account_cdc_config_t *config);
+
+/**
+ * Create a stream. A shared-memory ring replaces any existing object
+ * with the same name.
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+account_cdc_t *account_cdc_create(const account_cdc_config_t *config);
+
+/**
+ * Free a stream, unlinking its shared-memory object. It must already be
+ * detached from its store, and no account_cdc_serve() call or in-process
+ * reader may still be using it.
+ */
+void account_cdc_free(account_cdc_t *cdc);
+
+// the sequence number the next change will get
+uint64_t account_cdc_next_seq(account_cdc_t *cdc);
+
+/**
+ * Record that a store replaced `old` with `new` (either may be NULL, for
+ * an insert or a removal). Called by account_store with its writer lock
+ * held; records nothing if no field changed.
+ */
+void account_cdc_record(account_cdc_t *cdc, const account_t *old, const account_t *new);
+
+////
+// Encoding and applying changes
+
+void account_change_encode(wire_writer_t *w, const account_change_t *c);
+
+// decode a change; returns false on a malformed payload
+bool account_change_decode(wire_reader_t *r, account_change_t *c);
+
+/**
+ * Apply an UPDATE's fields to `acc` (a missing password hash leaves the
+ * hash alone), or replace `acc` with a PUT's account. Returns false for
+ * a REMOVE, which has no record to apply to.
+ */
+bool account_change_apply(const account_change_t *c, account_t *acc);
+
+/**
+ * Apply a change to a replica store. Returns false if it is an update
+ * to an account the replica doesn't have, or the store fails.
+ */
+bool account_cdc_apply(account_store_t *replica, const account_change_t *c);
+
+////
+// Readers
+
+/**
+ * Follow the shared-memory ring `shm_name` from the next change on.
+ * Returns NULL and logs an error message on failure.
+ */
+account_cdc_reader_t *account_cdc_reader_open(const char *shm_name);
+
+// follow a stream in this process, from the next change on
+account_cdc_reader_t *account_cdc_reader_create(account_cdc_t *cdc);
+
+void account_cdc_reader_free(account_cdc_reader_t *r);
+
+/**
+ * Move the reader to change `seq` (or to the next change, if `seq` is
+ * later). Returns false if `seq` has been overwritten, leaving the
+ * reader at the oldest change still in the ring.
+ */
+bool account_cdc_reader_seek(account_cdc_reader_t *r, uint64_t seq);
+
+/**
+ * Read the next change into *c. Never blocks. After ACCOUNT_CDC_LOST,
+ * the reader carries on from the oldest change still in the ring.
+ */
+account_cdc_status_t account_cdc_read(account_cdc_reader_t *r, account_change_t *c);
+
+////
+// Socket
+
+/**
+ * Serve one subscriber on a connected socket: wait for its SUBSCRIBE,
+ * then send changes as they are recorded, until it disconnects or a
+ * write fails.
+ */
+void account_cdc_serve(account_cdc_t *cdc, int fd);
+
+// ask the server on `fd` for changes from `from_seq` on (0 for new changes only)
+bool account_cdc_subscribe(int fd, uint64_t from_seq);
+
+/**
+ * Wait for the next message from the server: a change (*status is
+ * ACCOUNT_CDC_CHANGE and *c is filled in) or news of lost changes
+ * (ACCOUNT_CDC_LOST). Returns false on disconnection or a protocol error.
+ */
+bool account_cdc_recv(int fd, account_cdc_status_t *status, account_change_t *c);
+
+#endif // ACCOUNT_CDC_H
@@ -0,0 +1,889 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_store.h"
+#include "account_cache.h"
+#include "account_cdc.h"
+#include "ebr.h"
+#include "logging.h"
+#include "slab.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Records per page. A power of two no larger than 64, so that a page's
+// occupancy fits in a single uint64_t bitmap.
+#define PAGE_RECORDS 64
+
+#define INDEX_EMPTY 0u
+#define INDEX_TOMBSTONE UINT32_MAX
+#define INDEX_MIN_CAPACITY 64
+#define TABLE_MIN_CAPACITY 16
+
+// batches smaller than this aren't worth spreading over threads
+#define BATCH_RECORDS_PER_THREAD 4096
+
+// One immutable version of an account. Writers never change a published
+// version: they publish a replacement and retire the old one (see ebr.h),
+// so readers can copy it out without locks and without torn reads.
+typedef struct {
+  ebr_entry_t ebr;
+  atomic_uint refs;                   // pages pointing at this version
+  account_t acc;
+} account_version_t;
+
+// Pages are shared between the store and any snapshots taken of it.
+// A page with refs > 1 is immutable: the store copies it before writing
+// (see page_for_write()), so snapshots only cost the pages that change.
+typedef struct {
+  ebr_entry_t ebr;
+  atomic_uint refs;                   // the store's page table and snapshots
+  uint64_t used;                      // bit i set if records[i] holds an account
+  account_version_t *_Atomic records[PAGE_RECORDS];
+} store_page_t;
+
+// Replaced as a whole, never resized in place, so readers can keep
+// using the one they loaded.
+typedef struct {
+  ebr_entry_t ebr;
+  size_t capacity;
+  store_page_t *_Atomic pages[];
+} page_table_t;
+
+// Index entries pack (tag << 32) | slot, where slot is the slot number
+// + 1, or INDEX_EMPTY / INDEX_TOMBSTONE, and tag is the upper half of
+// the userid hash, to skip most string compares. Like the page table,
+// the index is replaced rather than resized in place.
+typedef struct {
+  ebr_entry_t ebr;
+  size_t capacity;                    // always a power of two
+  _Atomic uint64_t entries[];
+} store_index_t;
+
+struct account_store {
+  pthread_mutex_t lock;               // serialises writers; readers take no lock
+
+  page_table_t *_Atomic table;
+  store_index_t *_Atomic index;
+  size_t page_count;
+
+  uint32_t *free_slots;       // stack of slots released by account_store_remove()
+  size_t free_count;
+  size_t free_capacity;
+  size_t next_slot;           // first never-used slot
+
+  size_t index_used;          // live entries plus tombstones
+  atomic_size_t count;        // live entries
+
+  account_cdc_t *cdc;         // records changes; NULL if none
+  account_cache_t *cache;     // refreshed after changes; NULL if none
+};
+
+struct account_snapshot {
+  store_page_t **pages;
+  size_t page_count;
+  size_t count;
+};
+
+static account_store_t *_Atomic default_store = NULL;
+
+static STATS_DEFINE(stat_snapshots, "account_store.snapshots");
+static STATS_DEFINE(stat_pages_copied, "account_store.pages_copied");
+
+uint64_t account_store_hash_userid(const char *userid) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < USER_ID_LENGTH && userid[i] != '\0'; i++) {
+    h ^= (unsigned char)userid[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static size_t round_up_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+static uint64_t entry_make(uint32_t slot, uint32_t tag) {
+  return ((uint64_t)tag << 32) | slot;
+}
+
+static uint32_t entry_slot(uint64_t entry) {
+  return (uint32_t)entry;
+}
+
+static uint32_t entry_tag(uint64_t entry) {
+  return (uint32_t)(entry >> 32);
+}
+
+////
+// Reclamation
+
+static void version_free(ebr_entry_t *entry) {
+  // wipes the record
+  slab_free(entry, sizeof(account_version_t));
+}
+
+static void version_release(account_version_t *v) {
+  if (atomic_fetch_sub(&v->refs, 1) == 1) ebr_retire(&v->ebr, version_free);
+}
+
+static void plain_free(ebr_entry_t *entry) {
+  free(entry);
+}
+
+// drop a reference to a page, retiring it and its versions if it was the last
+static void page_release(store_page_t *page) {
+  if (atomic_fetch_sub(&page->refs, 1) != 1) return;
+  for (size_t i = 0; i < PAGE_RECORDS; i++) {
+    account_version_t *v = atomic_load_explicit(&page->records[i], memory_order_relaxed);
+    if (v) version_release(v);
+  }
+  ebr_retire(&page->ebr, plain_free);
+}
+
+static account_version_t *version_new(const account_t *acc) {
+  account_version_t *v = slab_alloc(sizeof *v);
+  if (!v) {
+    log_message(LOG_ERROR, "account_store: failed to allocate record.");
+    return NULL;
+  }
+  atomic_init(&v->refs, 1);
+  v->acc = *acc;
+  v->acc.userid[USER_ID_LENGTH - 1] = '\0';
+  return v;
+}
+
+////
+// Slots and pages
+
+// Current version in a slot, or NULL. Safe for readers inside ebr_enter().
+static account_version_t *slot_version(const account_store_t *store, size_t slot) {
+  page_table_t *table = atomic_load_explicit(&store->table, memory_order_acquire);
+  store_page_t *page = atomic_load_explicit(&table->pages[slot / PAGE_RECORDS], memory_order_acquire);
+  return atomic_load_explicit(&page->records[slot % PAGE_RECORDS], memory_order_acquire);
+}
+
+/**
+ * Make the page holding `slot` private to the store, copying it if a
+ * snapshot still shares it, and return it. Must be called with the
+ * lock held, before changing anything in the page.
+ */
+static store_page_t *page_for_write(account_store_t *store, size_t slot) {
+  page_table_t *table = atomic_load_explicit(&store->table, memory_order_relaxed);
+  store_page_t *_Atomic *pagep = &table->pages[slot / PAGE_RECORDS];
+  store_page_t *page = atomic_load_explicit(pagep, memory_order_relaxed);
+  if (atomic_load(&page->refs) == 1) return page;
+
+  store_page_t *copy = malloc(sizeof *copy);
+  if (!copy) {
+    log_message(LOG_ERROR, "account_store: failed to copy page for snapshot.");
+    return NULL;
+  }
+  atomic_init(&copy->refs, 1);
+  copy->used = page->used;
+  for (size_t i = 0; i < PAGE_RECORDS; i++) {
+    account_version_t *v = atomic_load_explicit(&page->records[i], memory_order_relaxed);
+    if (v) atomic_fetch_add(&v->refs, 1);
+    atomic_init(&copy->records[i], v);
+  }
+  atomic_store_explicit(pagep, copy, memory_order_release);
+  page_release(page);
+  stats_add(&stat_pages_copied, 1);
+  return copy;
+}
+
+// replace the version in a slot of a private page (NULL to empty it)
+static void slot_publish(store_page_t *page, size_t slot, account_version_t *v) {
+  account_version_t *_Atomic *vp = &page->records[slot % PAGE_RECORDS];
+  account_version_t *old = atomic_load_explicit(vp, memory_order_relaxed);
+  atomic_store_explicit(vp, v, memory_order_release);
+  if (old) version_release(old);
+}
+
+/**
+ * Find the index position for `userid`. Used both by writers, with the
+ * lock held, and by readers inside ebr_enter().
+ *
+ * Returns the position of the matching entry if present, and sets
+ * *version to its record. Otherwise returns the position where it should
+ * be inserted (the first tombstone seen, else the terminating empty
+ * entry), and sets *found to false.
+ */
+static size_t index_find(const account_store_t *store, store_index_t *index, const char *userid,
+                         uint64_t hash, bool *found, account_version_t **version) {
+  size_t mask = index->capacity - 1;
+  size_t pos = (size_t)hash & mask;
+  uint32_t tag = (uint32_t)(hash >> 32);
+  size_t insert_at = SIZE_MAX;
+
+  for (;;) {
+    uint64_t e = atomic_load_explicit(&index->entries[pos], memory_order_acquire);
+    uint32_t slot = entry_slot(e);
+    if (slot == INDEX_EMPTY) {
+      *found = false;
+      return insert_at != SIZE_MAX ? insert_at : pos;
+    }
+    if (slot == INDEX_TOMBSTONE) {
+      if (insert_at == SIZE_MAX) insert_at = pos;
+    } else if (entry_tag(e) == tag) {
+      // a concurrent remove may have emptied or reused the slot
+      account_version_t *v = slot_version(store, slot - 1);
+      if (v && strncmp(v->acc.userid, userid, USER_ID_LENGTH) == 0) {
+        *found = true;
+        if (version) *version = v;
+        return pos;
+      }
+    }
+    pos = (pos + 1) & mask;
+  }
+}
+
+static bool index_resize(account_store_t *store, size_t new_capacity) {
+  store_index_t *old = atomic_load_explicit(&store->index, memory_order_relaxed);
+
+  store_index_t *index = calloc(1, sizeof *index + new_capacity * sizeof index->entries[0]);
+  if (!index) {
+    log_message(LOG_ERROR, "account_store: failed to allocate index.");
+    return false;
+  }
+  index->capacity = new_capacity;
+  size_t used = 0;
+
+  for (size_t i = 0; i < old->capacity; i++) {
+    uint64_t e = atomic_load_explicit(&old->entries[i], memory_order_relaxed);
+    if (entry_slot(e) == INDEX_EMPTY || entry_slot(e) == INDEX_TOMBSTONE) continue;
+    const account_version_t *v = slot_version(store, entry_slot(e) - 1);
+    size_t pos = (size_t)account_store_hash_userid(v->acc.userid) & (new_capacity - 1);
+    while (entry_slot(atomic_load_explicit(&index->entries[pos], memory_order_relaxed)) != INDEX_EMPTY) {
+      pos = (pos + 1) & (new_capacity - 1);
+    }
+    atomic_init(&index->entries[pos], e);
+    used++;
+  }
+
+  atomic_store_explicit(&store->index, index, memory_order_release);
+  store->index_used = used;
+  ebr_retire(&old->ebr, plain_free);
+  return true;
+}
+
+static page_table_t *table_new(size_t capacity) {
+  page_table_t *table = calloc(1, sizeof *table + capacity * sizeof table->pages[0]);
+  if (table) table->capacity = capacity;
+  return table;
+}
+
+static bool slot_alloc(account_store_t *store, size_t *slot) {
+  if (store->free_count > 0) {
+    *slot = store->free_slots[--store->free_count];
+    return true;
+  }
+  if (store->next_slot >= UINT32_MAX - 1) {
+    log_message(LOG_ERROR, "account_store: store is full.");
+    return false;
+  }
+  if (store->next_slot / PAGE_RECORDS >= store->page_count) {
+    page_table_t *table = atomic_load_explicit(&store->table, memory_order_relaxed);
+    if (store->page_count == table->capacity) {
+      page_table_t *grown = table_new(table->capacity * 2);
+      if (!grown) {
+        log_message(LOG_ERROR, "account_store: failed to grow page table.");
+        return false;
+      }
+      for (size_t i = 0; i < store->page_count; i++) {
+        atomic_init(&grown->pages[i], atomic_load_explicit(&table->pages[i], memory_order_relaxed));
+      }
+      atomic_store_explicit(&store->table, grown, memory_order_release);
+      ebr_retire(&table->ebr, plain_free);
+      table = grown;
+    }
+    store_page_t *page = calloc(1, sizeof *page);
+    if (!page) {
+      log_message(LOG_ERROR, "account_store: failed to allocate page.");
+      return false;
+    }
+    atomic_init(&page->refs, 1);
+    atomic_store_explicit(&table->pages[store->page_count++], page, memory_order_release);
+  }
+  *slot = store->next_slot++;
+  return true;
+}
+
+static bool slot_release(account_store_t *store, size_t slot) {
+  if (store->free_count == store->free_capacity) {
+    size_t capacity = store->free_capacity ? store->free_capacity * 2 : 64;
+    uint32_t *free_slots = realloc(store->free_slots, capacity * sizeof *free_slots);
+    if (!free_slots) {
+      log_message(LOG_ERROR, "account_store: failed to grow free list.");
+      return false;
+    }
+    store->free_slots = free_slots;
+    store->free_capacity = capacity;
+  }
+  store->free_slots[store->free_count++] = (uint32_t)slot;
+  return true;
+}
+
+////
+// Store
+
+account_store_t *account_store_create(size_t expected_accounts) {
+  account_store_t *store = calloc(1, sizeof *store);
+  if (!store) {
+    log_message(LOG_ERROR, "account_store_create: failed to allocate store.");
+    return NULL;
+  }
+  if (pthread_mutex_init(&store->lock, NULL) != 0) {
+    log_message(LOG_ERROR, "account_store_create: failed to initialise lock.");
+    free(store);
+    return NULL;
+  }
+
+  size_t capacity = round_up_pow2(expected_accounts * 2);
+  if (capacity < INDEX_MIN_CAPACITY) capacity = INDEX_MIN_CAPACITY;
+  store_index_t *index = calloc(1, sizeof *index + capacity * sizeof index->entries[0]);
+  page_table_t *table = table_new(TABLE_MIN_CAPACITY);
+  if (!index || !table) {
+    log_message(LOG_ERROR, "account_store_create: failed to allocate index.");
+    free(index);
+    free(table);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+    return NULL;
+  }
+  index->capacity = capacity;
+  atomic_init(&store->index, index);
+  atomic_init(&store->table, table);
+  atomic_init(&store->count, 0);
+  return store;
+}
+
+void account_store_free(account_store_t *store) {
+  if (!store) return;
+
+  account_store_t *expected = store;
+  atomic_compare_exchange_strong(&default_store, &expected, NULL);
+
+  page_table_t *table = atomic_load(&store->table);
+  for (size_t i = 0; i < store->page_count; i++) {
+    page_release(atomic_load_explicit(&table->pages[i], memory_order_relaxed));
+  }
+  ebr_retire(&table->ebr, plain_free);
+  ebr_retire(&atomic_load(&store->index)->ebr, plain_free);
+  // wipe the records now rather than whenever reclamation next runs
+  ebr_barrier();
+
+  free(store->free_slots);
+  pthread_mutex_destroy(&store->lock);
+  free(store);
+}
+
+bool account_store_put(account_store_t *store, const account_t *acc) {
+  if (!store || !acc) {
+    log_message(LOG_ERROR, "account_store_put: NULL argument.");
+    return false;
+  }
+  uint64_t hash = account_store_hash_userid(acc->userid);
+  account_version_t *v = version_new(acc);
+  if (!v) return false;
+
+  pthread_mutex_lock(&store->lock);
+
+  // keep the index at most half full (counting tombstones)
+  store_index_t *index = atomic_load_explicit(&store->index, memory_order_relaxed);
+  if ((store->index_used + 1) * 2 > index->capacity) {
+    size_t capacity = index->capacity;
+    if ((atomic_load(&store->count) + 1) * 2 > capacity / 2) capacity *= 2;
+    if (!index_resize(store, capacity)) {
+      pthread_mutex_unlock(&store->lock);
+      version_free(&v->ebr);
+      return false;
+    }
+    index = atomic_load_explicit(&store->index, memory_order_relaxed);
+  }
+
+  bool found;
+  account_version_t *old;
+  size_t pos = index_find(store, index, v->acc.userid, hash, &found, &old);
+  size_t slot;
+  store_page_t *page = NULL;
+  if (found) {
+    slot = entry_slot(atomic_load_explicit(&index->entries[pos], memory_order_relaxed)) - 1;
+    page = page_for_write(store, slot);
+    if (page) {
+      if (store->cdc) account_cdc_record(store->cdc, &old->acc, &v->acc);
+      slot_publish(page, slot, v);
+    }
+  } else if (slot_alloc(store, &slot)) {
+    page = page_for_write(store, slot);
+    if (!page) {
+      slot_release(store, slot);
+    } else {
+      // publish the record before the index entry that leads readers to it
+      slot_publish(page, slot, v);
+      page->used |= UINT64_C(1) << (slot % PAGE_RECORDS);
+      if (entry_slot(atomic_load_explicit(&index->entries[pos], memory_order_relaxed)) == INDEX_EMPTY) {
+        store->index_used++;
+      }
+      atomic_store_explicit(&index->entries[pos], entry_make((uint32_t)(slot + 1), (uint32_t)(hash >> 32)),
+                            memory_order_release);
+      atomic_fetch_add(&store->count, 1);
+      if (store->cdc) account_cdc_record(store->cdc, NULL, &v->acc);
+    }
+  }
+  if (page && store->cache) account_cache_refresh(store->cache, v->acc.userid, &v->acc);
+
+  pthread_mutex_unlock(&store->lock);
+  if (!page) version_free(&v->ebr);
+  return page != NULL;
+}
+
+bool account_store_get(account_store_t *store, const char *userid, account_t *result) {
+  if (!store || !userid || !result) {
+    log_message(LOG_ERROR, "account_store_get: NULL argument.");
+    return false;
+  }
+  uint64_t hash = account_store_hash_userid(userid);
+
+  ebr_enter();
+  bool found;
+  account_version_t *v;
+  store_index_t *index = atomic_load_explicit(&store->index, memory_order_acquire);
+  index_find(store, index, userid, hash, &found, &v);
+  if (found) *result = v->acc;
+  ebr_exit();
+  return found;
+}
+
+bool account_store_remove(account_store_t *store, const char *userid) {
+  if (!store || !userid) {
+    log_message(LOG_ERROR, "account_store_remove: NULL argument.");
+    return false;
+  }
+  uint64_t hash = account_store_hash_userid(userid);
+
+  pthread_mutex_lock(&store->lock);
+  bool found;
+  account_version_t *old;
+  store_index_t *index = atomic_load_explicit(&store->index, memory_order_relaxed);
+  size_t pos = index_find(store, index, userid, hash, &found, &old);
+  if (found) {
+    size_t slot = entry_slot(atomic_load_explicit(&index->entries[pos], memory_order_relaxed)) - 1;
+    store_page_t *page = page_for_write(store, slot);
+    if (!page || !slot_release(store, slot)) {
+      pthread_mutex_unlock(&store->lock);
+      return false;
+    }
+    atomic_store_explicit(&index->entries[pos], entry_make(INDEX_TOMBSTONE, 0), memory_order_release);
+    if (store->cdc) account_cdc_record(store->cdc, &old->acc, NULL);
+    slot_publish(page, slot, NULL);
+    page->used &= ~(UINT64_C(1) << (slot % PAGE_RECORDS));
+    atomic_fetch_sub(&store->count, 1);
+    if (store->cache) account_cache_invalidate(store->cache, userid);
+  }
+  pthread_mutex_unlock(&store->lock);
+  return found;
+}
+
+bool account_store_update(account_store_t *store, const char *userid,
+                          account_store_update_fn fn, void *arg) {
+  if (!store || !userid || !fn) {
+    log_message(LOG_ERROR, "account_store_update: NULL argument.");
+    return false;
+  }
+  uint64_t hash = account_store_hash_userid(userid);
+
+  pthread_mutex_lock(&store->lock);
+  bool found;
+  account_version_t *old;
+  store_index_t *index = atomic_load_explicit(&store->index, memory_order_relaxed);
+  size_t pos = index_find(store, index, userid, hash, &found, &old);
+  account_version_t *v = found ? version_new(&old->acc) : NULL;
+  bool ok = false;
+  if (v && fn(&v->acc, arg)) {
+    // the index is keyed by userid, so it must not change
+    memcpy(v->acc.userid, old->acc.userid, sizeof v->acc.userid);
+    size_t slot = entry_slot(atomic_load_explicit(&index->entries[pos], memory_order_relaxed)) - 1;
+    store_page_t *page = page_for_write(store, slot);
+    if (page) {
+      if (store->cdc) account_cdc_record(store->cdc, &old->acc, &v->acc);
+      slot_publish(page, slot, v);
+      if (store->cache) account_cache_refresh(store->cache, v->acc.userid, &v->acc);
+      ok = true;
+    }
+  }
+  pthread_mutex_unlock(&store->lock);
+  // never published, so nobody else can see it
+  if (v && !ok) version_free(&v->ebr);
+  return ok;
+}
+
+////
+// Batches
+//
+// A batch builds a private copy of every page it changes, pointing at
+// new versions of the changed records and sharing the rest, then
+// publishes a new page table with all of them swapped in at once.
+
+typedef struct {
+  account_store_t *store;
+  const account_store_batch_t *batch;
+  page_table_t *table;
+  size_t page_count;
+  _Atomic uint64_t *masks;    // per page: records selected for the batch
+  store_page_t **copies;      // per page: the changed copy, or NULL
+  size_t threads;
+  atomic_bool failed;
+} batch_job_t;
+
+typedef struct {
+  batch_job_t *job;
+  size_t index;               // this worker's share is index, index + threads, ...
+  pthread_t thread;
+} batch_worker_t;
+
+static bool batch_selects(const account_store_batch_t *batch, const account_version_t *v) {
+  return !batch->select || batch->select(&v->acc, batch->select_arg);
+}
+
+// mark the records this worker is responsible for
+static void batch_select(batch_job_t *job, size_t index) {
+  const account_store_batch_t *batch = job->batch;
+  store_index_t *store_index = atomic_load_explicit(&job->store->index, memory_order_relaxed);
+
+  if (batch->userids) {
+    for (size_t i = index; i < batch->userid_count; i += job->threads) {
+      const char *userid = batch->userids[i];
+      bool found;
+      account_version_t *v;
+      size_t pos = index_find(job->store, store_index, userid, account_store_hash_userid(userid),
+                              &found, &v);
+      if (!found || !batch_selects(batch, v)) continue;
+      size_t slot = entry_slot(atomic_load_explicit(&store_index->entries[pos], memory_order_relaxed)) - 1;
+      atomic_fetch_or_explicit(&job->masks[slot / PAGE_RECORDS], UINT64_C(1) << (slot % PAGE_RECORDS),
+                               memory_order_relaxed);
+    }
+    return;
+  }
+
+  for (size_t p = index; p < job->page_count; p += job->threads) {
+    const store_page_t *page = atomic_load_explicit(&job->table->pages[p], memory_order_relaxed);
+    uint64_t mask = 0;
+    for (size_t i = 0; i < PAGE_RECORDS; i++) {
+      if (!(page->used & (UINT64_C(1) << i))) continue;
+      if (batch_selects(batch, atomic_load_explicit(&page->records[i], memory_order_relaxed))) {
+        mask |= UINT64_C(1) << i;
+      }
+    }
+    atomic_store_explicit(&job->masks[p], mask, memory_order_relaxed);
+  }
+}
+
+// free an unpublished copy made by batch_copy_page()
+static void batch_discard_page(store_page_t *copy, uint64_t mask) {
+  for (size_t i = 0; i < PAGE_RECORDS; i++) {
+    account_version_t *v = atomic_load_explicit(&copy->records[i], memory_order_relaxed);
+    if (!v) continue;
+    if (mask & (UINT64_C(1) << i)) version_free(&v->ebr);
+    else atomic_fetch_sub(&v->refs, 1);   // still held by the original page
+  }
+  free(copy);
+}
+
+// copy page p with its selected records updated; clears records `update` declines
+static store_page_t *batch_copy_page(batch_job_t *job, size_t p) {
+  const account_store_batch_t *batch = job->batch;
+  const store_page_t *page = atomic_load_explicit(&job->table->pages[p], memory_order_relaxed);
+  uint64_t mask = atomic_load_explicit(&job->masks[p], memory_order_relaxed);
+
+  store_page_t *copy = malloc(sizeof *copy);
+  if (!copy) return NULL;
+  atomic_init(&copy->refs, 1);
+  copy->used = page->used;
+  for (size_t i = 0; i < PAGE_RECORDS; i++) {
+    account_version_t *v = atomic_load_explicit(&page->records[i], memory_order_relaxed);
+    account_version_t *nv = NULL;
+    if (mask & (UINT64_C(1) << i)) {
+      nv = version_new(&v->acc);
+      if (!nv) {
+        atomic_init(&copy->records[i], NULL);
+        for (size_t j = i + 1; j < PAGE_RECORDS; j++) atomic_init(&copy->records[j], NULL);
+        batch_discard_page(copy, mask);
+        return NULL;
+      }
+      if (batch->update(&nv->acc, batch->update_arg)) {
+        memcpy(nv->acc.userid, v->acc.userid, sizeof nv->acc.userid);
+      } else {
+        version_free(&nv->ebr);
+        nv = NULL;
+        mask &= ~(UINT64_C(1) << i);
+      }
+    }
+    if (!nv && v) {
+      atomic_fetch_add(&v->refs, 1);
+      nv = v;
+    }
+    atomic_init(&copy->records[i], nv);
+  }
+  atomic_store_explicit(&job->masks[p], mask, memory_order_relaxed);
+  if (mask == 0) {
+    batch_discard_page(copy, 0);
+    return NULL;
+  }
+  return copy;
+}
+
+static void batch_build(batch_job_t *job, size_t index) {
+  for (size_t p = index; p < job->page_count; p += job->threads) {
+    if (atomic_load(&job->failed)) return;
+    if (atomic_load_explicit(&job->masks[p], memory_order_relaxed) == 0) continue;
+    job->copies[p] = batch_copy_page(job, p);
+    if (!job->copies[p] && atomic_load_explicit(&job->masks[p], memory_order_relaxed) != 0) {
+      log_message(LOG_ERROR, "account_store_update_batch: failed to allocate records.");
+      atomic_store(&job->failed, true);
+    }
+  }
+}
+
+static void *batch_select_worker(void *arg) {
+  batch_worker_t *w = arg;
+  batch_select(w->job, w->index);
+  return NULL;
+}
+
+static void *batch_build_worker(void *arg) {
+  batch_worker_t *w = arg;
+  batch_build(w->job, w->index);
+  return NULL;
+}
+
+// run fn for each worker index, on threads where possible
+static void batch_run(batch_job_t *job, batch_worker_t *workers, void *(*fn)(void *)) {
+  size_t started = 1;
+  for (size_t i = 1; i < job->threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0) break;
+    started++;
+  }
+  // this thread does worker 0's share, plus any workers that didn't start
+  fn(&workers[0]);
+  for (size_t i = started; i < job->threads; i++) fn(&workers[i]);
+  for (size_t i = 1; i < started; i++) pthread_join(workers[i].thread, NULL);
+}
+
+static size_t batch_threads(const account_store_batch_t *batch, size_t records) {
+  size_t threads = batch->threads;
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (size_t)cpus : 1;
+  }
+  size_t useful = records / BATCH_RECORDS_PER_THREAD + 1;
+  return threads < useful ? threads : useful;
+}
+
+bool account_store_update_batch(account_store_t *store, const account_store_batch_t *batch,
+                                size_t *changed) {
+  if (!store || !batch || !batch->update || (!batch->userids && batch->userid_count > 0)) {
+    log_message(LOG_ERROR, "account_store_update_batch: invalid argument.");
+    return false;
+  }
+
+  pthread_mutex_lock(&store->lock);
+
+  batch_job_t job = {
+    .store = store,
+    .batch = batch,
+    .table = atomic_load_explicit(&store->table, memory_order_relaxed),
+    .page_count = store->page_count,
+  };
+  job.threads = batch_threads(batch, batch->userids ? batch->userid_count
+                                                    : atomic_load(&store->count));
+  job.masks = calloc(job.page_count + 1, sizeof *job.masks);
+  job.copies = calloc(job.page_count + 1, sizeof *job.copies);
+  batch_worker_t *workers = calloc(job.threads, sizeof *workers);
+  const account_t **records = NULL;
+  page_table_t *table = NULL;
+  size_t count = 0;
+  bool ok = job.masks && job.copies && workers;
+  if (!ok) log_message(LOG_ERROR, "account_store_update_batch: failed to allocate.");
+
+  if (ok) {
+    for (size_t i = 0; i < job.threads; i++) workers[i] = (batch_worker_t){ .job = &job, .index = i };
+    batch_run(&job, workers, batch_select_worker);
+    batch_run(&job, workers, batch_build_worker);
+    ok = !atomic_load(&job.failed);
+  }
+
+  // collect the changed records for the commit callback
+  for (size_t p = 0; ok && p < job.page_count; p++) {
+    count += (size_t)__builtin_popcountll(atomic_load_explicit(&job.masks[p], memory_order_relaxed));
+  }
+  if (ok && count > 0) {
+    records = malloc(count * sizeof *records);
+    table = table_new(job.table->capacity);
+    ok = records && table;
+    if (!ok) log_message(LOG_ERROR, "account_store_update_batch: failed to allocate.");
+  }
+  if (ok && count > 0 && batch->commit) {
+    size_t n = 0;
+    for (size_t p = 0; p < job.page_count; p++) {
+      uint64_t mask = atomic_load_explicit(&job.masks[p], memory_order_relaxed);
+      for (size_t i = 0; mask && i < PAGE_RECORDS; i++) {
+        if (!(mask & (UINT64_C(1) << i))) continue;
+        records[n++] = &atomic_load_explicit(&job.copies[p]->records[i], memory_order_relaxed)->acc;
+      }
+    }
+    ok = batch->commit(records, count, batch->commit_arg);
+  }
+
+  if (ok && count > 0) {
+    for (size_t p = 0; store->cdc && p < job.page_count; p++) {
+      uint64_t mask = atomic_load_explicit(&job.masks[p], memory_order_relaxed);
+      if (mask == 0) continue;
+      store_page_t *page = atomic_load_explicit(&job.table->pages[p], memory_order_relaxed);
+      for (size_t i = 0; i < PAGE_RECORDS; i++) {
+        if (!(mask & (UINT64_C(1) << i))) continue;
+        account_cdc_record(store->cdc,
+                           &atomic_load_explicit(&page->records[i], memory_order_relaxed)->acc,
+                           &atomic_load_explicit(&job.copies[p]->records[i], memory_order_relaxed)->acc);
+      }
+    }
+    // swap every changed page in with a single store
+    for (size_t p = 0; p < job.page_count; p++) {
+      store_page_t *page = atomic_load_explicit(&job.table->pages[p], memory_order_relaxed);
+      atomic_init(&table->pages[p], job.copies[p] ? job.copies[p] : page);
+    }
+    atomic_store_explicit(&store->table, table, memory_order_release);
+    // only now, so that a lookup refilling the cache can't see the old records
+    for (size_t p = 0; store->cache && p < job.page_count; p++) {
+      uint64_t mask = atomic_load_explicit(&job.masks[p], memory_order_relaxed);
+      for (size_t i = 0; mask && i < PAGE_RECORDS; i++) {
+        if (!(mask & (UINT64_C(1) << i))) continue;
+        account_version_t *v = atomic_load_explicit(&job.copies[p]->records[i], memory_order_relaxed);
+        account_cache_refresh(store->cache, v->acc.userid, &v->acc);
+      }
+    }
+    for (size_t p = 0; p < job.page_count; p++) {
+      if (job.copies[p]) page_release(atomic_load_explicit(&job.table->pages[p], memory_order_relaxed));
+    }
+    ebr_retire(&job.table->ebr, plain_free);
+  } else {
+    for (size_t p = 0; job.copies && p < job.page_count; p++) {
+      if (job.copies[p]) {
+        batch_discard_page(job.copies[p], atomic_load_explicit(&job.masks[p], memory_order_relaxed));
+      }
+    }
+    free(table);
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  free(records);
+  free(workers);
+  free(job.copies);
+  free(job.masks);
+  if (ok && changed) *changed = count;
+  return ok;
+}
+
+void account_store_set_cdc(account_store_t *store, account_cdc_t *cdc) {
+  if (!store) return;
+  pthread_mutex_lock(&store->lock);
+  store->cdc = cdc;
+  pthread_mutex_unlock(&store->lock);
+}
+
+void account_store_set_cache(account_store_t *store, account_cache_t *cache) {
+  if (!store) return;
+  pthread_mutex_lock(&store->lock);
+  store->cache = cache;
+  pthread_mutex_unlock(&store->lock);
+}
+
+size_t account_store_count(account_store_t *store) {
+  if (!store) return 0;
+  return atomic_load_explicit(&store->count, memory_order_relaxed);
+}
+
+void account_store_foreach(account_store_t *store, account_store_visit_fn fn, void *arg) {
+  if (!store || !fn) return;
+  account_snapshot_t *snap = account_store_snapshot(store);
+  account_snapshot_foreach(snap, fn, arg);
+  account_snapshot_free(snap);
+}
+
+////
+// Snapshots
+
+account_snapshot_t *account_store_snapshot(account_store_t *store) {
+  if (!store) {
+    log_message(LOG_ERROR, "account_store_snapshot: NULL argument.");
+    return NULL;
+  }
+  account_snapshot_t *snap = calloc(1, sizeof *snap);
+  if (!snap) {
+    log_message(LOG_ERROR, "account_store_snapshot: failed to allocate snapshot.");
+    return NULL;
+  }
+
+  // only the page table is copied, so writers are held up for
+  // O(pages) rather than O(records), and readers not at all
+  pthread_mutex_lock(&store->lock);
+  if (store->page_count > 0) {
+    snap->pages = malloc(store->page_count * sizeof *snap->pages);
+    if (!snap->pages) {
+      pthread_mutex_unlock(&store->lock);
+      log_message(LOG_ERROR, "account_store_snapshot: failed to allocate page table.");
+      free(snap);
+      return NULL;
+    }
+  }
+  page_table_t *table = atomic_load_explicit(&store->table, memory_order_relaxed);
+  for (size_t i = 0; i < store->page_count; i++) {
+    store_page_t *page = atomic_load_explicit(&table->pages[i], memory_order_relaxed);
+    atomic_fetch_add(&page->refs, 1);
+    snap->pages[i] = page;
+  }
+  snap->page_count = store->page_count;
+  snap->count = atomic_load(&store->count);
+  pthread_mutex_unlock(&store->lock);
+
+  stats_add(&stat_snapshots, 1);
+  return snap;
+}
+
+void account_snapshot_free(account_snapshot_t *snap) {
+  if (!snap) return;
+  for (size_t i = 0; i < snap->page_count; i++) {
+    page_release(snap->pages[i]);
+  }
+  free(snap->pages);
+  free(snap);
+}
+
+size_t account_snapshot_count(const account_snapshot_t *snap) {
+  return snap ? snap->count : 0;
+}
+
+void account_snapshot_foreach(const account_snapshot_t *snap, account_store_visit_fn fn, void *arg) {
+  if (!snap || !fn) return;
+  for (size_t p = 0; p < snap->page_count; p++) {
+    const store_page_t *page = snap->pages[p];
+    for (size_t i = 0; i < PAGE_RECORDS; i++) {
+      if (!(page->used & (UINT64_C(1) << i))) continue;
+      const account_version_t *v = atomic_load_explicit(&page->records[i], memory_order_relaxed);
+      if (!fn(&v->acc, arg)) return;
+    }
+  }
+}
+
+void account_store_set_default(account_store_t *store) {
+  atomic_store(&default_store, store);
+}
+
+account_store_t *account_store_get_default(void) {
+  return atomic_load(&default_store);
+}
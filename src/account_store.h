@@ -0,0 +1,194 @@
+#ifndef ACCOUNT_STORE_H
+#define ACCOUNT_STORE_H
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file account_store.h
+ * @brief In-memory account store.
+ *
+ * Holds account_t records keyed by userid. Records live in fixed-size
+ * pages so that growing the store never moves existing records, and an
+ * open-addressing index maps each userid to its slot.
+ *
+ * All functions are thread-safe. Lookups copy the record out, so callers
+ * never hold a pointer into the store.
+ *
+ * Lookups take no locks: records are immutable once published, and a
+ * write publishes a new version of the record and retires the old one,
+ * which is freed once no lookup can still be reading it (see ebr.h).
+ * Writers are serialised by a mutex, which lookups never touch.
+ *
+ * account_store_snapshot() takes a point-in-time view of the store
+ * without copying records: pages are shared copy-on-write, so taking a
+ * snapshot only briefly blocks writers, and each page is copied at
+ * most once, the first time it is written while a snapshot holds it.
+ */
+
+typedef struct account_store account_store_t;
+
+/**
+ * Callback for account_store_foreach(). Return false to stop iterating.
+ */
+typedef bool (*account_store_visit_fn)(const account_t *acc, void *arg);
+
+// Callback for account_store_update(); modifies a private copy of the
+// record, and returns false to discard the change.
+typedef bool (*account_store_update_fn)(account_t *acc, void *arg);
+
+typedef struct account_snapshot account_snapshot_t;
+
+// a change-data capture stream (see account_cdc.h)
+typedef struct account_cdc account_cdc_t;
+
+// a cache of account lookups (see account_cache.h)
+typedef struct account_cache account_cache_t;
+
+/**
+ * Create an empty store sized for roughly `expected_accounts` records
+ * (the store still grows past that if needed).
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+account_store_t *account_store_create(size_t expected_accounts);
+
+// free the store and securely wipe every record it holds
+void account_store_free(account_store_t *store);
+
+/**
+ * Insert a copy of `acc`, replacing any existing record with the same userid.
+ *
+ * Returns true on success, false on failure (invalid arguments or
+ * out of memory).
+ */
+bool account_store_put(account_store_t *store, const account_t *acc);
+
+/**
+ * Look up an account by userid, copying it into `result`.
+ *
+ * Returns true if the account was found, false otherwise.
+ */
+bool account_store_get(account_store_t *store, const char *userid, account_t *result);
+
+/**
+ * Apply `fn` to a copy of the record for `userid` and publish the result
+ * as its new version. Updates are serialised, so concurrent updates to
+ * the same account aren't lost, and lookups see either the old or the
+ * new version, never a mix. `fn` must be quick and must not call back
+ * into the store; any change it makes to the userid is discarded.
+ *
+ * Returns true if the account was found and `fn` returned true.
+ */
+bool account_store_update(account_store_t *store, const char *userid,
+                          account_store_update_fn fn, void *arg);
+
+/**
+ * Called by account_store_update_batch() with every changed record,
+ * after the new versions are built but before any is visible. Return
+ * false to abort the batch.
+ */
+typedef bool (*account_store_commit_fn)(const account_t *const *changed, size_t count, void *arg);
+
+typedef struct {
+  const char *const *userids;     // records to consider; NULL for every record
+  size_t userid_count;
+  account_store_visit_fn select;  // optional filter; skip records it returns false for
+  void *select_arg;
+  account_store_update_fn update; // applied to a copy of each selected record
+  void *update_arg;
+  account_store_commit_fn commit; // optional
+  void *commit_arg;
+  size_t threads;                 // 0 for one per online CPU
+} account_store_batch_t;
+
+/**
+ * Apply `batch->update` to many records as one transaction. The changes
+ * become visible to lookups all at once; if anything fails (or `commit`
+ * returns false) none of them do. Selection and copying are spread over
+ * `batch->threads` threads. Userids that aren't in the store are ignored,
+ * as are records for which `update` returns false.
+ *
+ * The batch holds up other writers, but not lookups, while it runs.
+ * `select` and `update` are called concurrently and must not call back
+ * into the store.
+ *
+ * Returns true on success, setting *changed (if not NULL) to the number
+ * of records changed.
+ */
+bool account_store_update_batch(account_store_t *store, const account_store_batch_t *batch,
+                                size_t *changed);
+
+// remove an account. returns true if it was present.
+bool account_store_remove(account_store_t *store, const char *userid);
+
+// number of accounts currently held
+size_t account_store_count(account_store_t *store);
+
+/**
+ * Record every change made to the store from now on in `cdc` (see
+ * account_cdc.h), or stop recording if it is NULL. A stream can be
+ * attached to only one store at a time. The caller keeps ownership.
+ */
+void account_store_set_cdc(account_store_t *store, account_cdc_t *cdc);
+
+/**
+ * Refresh `cache` (see account_cache.h) with every change made to the
+ * store from now on, including every record a batch changes, or stop if
+ * it is NULL. The caller keeps ownership, and must detach the cache
+ * before freeing it.
+ */
+void account_store_set_cache(account_store_t *store, account_cache_t *cache);
+
+/**
+ * Call `fn` on every account in the store, in slot order, until it
+ * returns false. Iterates over a snapshot (see below), so it sees the
+ * store as it was when called, and `fn` may update the store.
+ */
+void account_store_foreach(account_store_t *store, account_store_visit_fn fn, void *arg);
+
+////
+// Snapshots
+
+/**
+ * Take a point-in-time snapshot of the store. The snapshot stays valid
+ * and unchanged while the store is updated (or even freed), until it is
+ * released with account_snapshot_free().
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+account_snapshot_t *account_store_snapshot(account_store_t *store);
+
+// release a snapshot, freeing (and wiping) pages no longer shared with the store
+void account_snapshot_free(account_snapshot_t *snap);
+
+// number of accounts in the snapshot
+size_t account_snapshot_count(const account_snapshot_t *snap);
+
+/**
+ * Call `fn` on every account in the snapshot, in slot order, until it
+ * returns false. Takes no locks, so it may run for as long as it likes
+ * without holding up the store.
+ */
+void account_snapshot_foreach(const account_snapshot_t *snap, account_store_visit_fn fn, void *arg);
+
+/**
+ * 64-bit FNV-1a hash of a userid (at most USER_ID_LENGTH chars).
+ * Stable across processes and builds.
+ */
+uint64_t account_store_hash_userid(const char *userid);
+
+////
+// Process-wide default store
+
+// Set the store consulted by account_lookup_by_userid(). NULL clears it.
+// The caller keeps ownership of the store.
+void account_store_set_default(account_store_t *store);
+
+// the store set by account_store_set_default(), or NULL
+account_store_t *account_store_get_default(void);
+
+#endif // ACCOUNT_STORE_H
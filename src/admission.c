@@ -0,0 +1,285 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "admission.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NO_DEADLINE UINT64_MAX
+#define EWMA_SHIFT 3   // service time estimate moves 1/8 of the way towards each sample
+
+static STATS_DEFINE(stat_admitted, "admission.admitted");
+static STATS_DEFINE(stat_expired, "admission.expired");
+static STATS_DEFINE(stat_overloaded, "admission.overloaded");
+static STATS_DEFINE(stat_queued, "admission.queued");
+static STATS_DEFINE(stat_running, "admission.running");
+static STATS_DEFINE(stat_service_ns, "admission.service_ns");
+static STATS_DEFINE(stat_wait_ns, "admission.wait_ns_total");
+
+typedef enum { WAITER_WAITING, WAITER_GRANTED, WAITER_DROPPED } waiter_state_t;
+
+typedef struct waiter {
+  struct waiter *prev;
+  struct waiter *next;
+  pthread_cond_t cond;
+  uint64_t deadline_ns;
+  waiter_state_t state;
+  admission_status_t drop_status;   // why it was dropped, if state == WAITER_DROPPED
+} waiter_t;
+
+typedef struct {
+  waiter_t *head;   // oldest
+  waiter_t *tail;   // newest
+  size_t len;
+} waiter_queue_t;
+
+struct admission {
+  pthread_mutex_t lock;
+  admission_config_t config;
+  size_t running;
+  size_t queued;
+  waiter_queue_t queues[ADMISSION_PRIORITY_COUNT];
+  uint64_t service_ns;   // moving average of time from admission to leave
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+  if (ts->tv_sec < 0) return 0;
+  return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+void admission_deadline_in(struct timespec *deadline, uint64_t timeout_ms) {
+  uint64_t t = now_ns() + timeout_ms * 1000000ULL;
+  deadline->tv_sec = (time_t)(t / 1000000000ULL);
+  deadline->tv_nsec = (long)(t % 1000000000ULL);
+}
+
+const char *admission_status_name(admission_status_t status) {
+  switch (status) {
+    case ADMISSION_ADMITTED: return "ADMISSION_ADMITTED";
+    case ADMISSION_EXPIRED: return "ADMISSION_EXPIRED";
+    case ADMISSION_OVERLOADED: return "ADMISSION_OVERLOADED";
+  }
+  return "ADMISSION_UNKNOWN";
+}
+
+void admission_config_defaults(admission_config_t *config) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  config->max_concurrent = cpus > 0 ? (size_t)cpus : 1;
+  config->max_queued = config->max_concurrent * 64;
+  config->initial_service_ns = 0;   // learn it from the first completions
+}
+
+admission_t *admission_create(const admission_config_t *config) {
+  if (!config || config->max_concurrent == 0) {
+    log_message(LOG_ERROR, "admission_create: invalid config.");
+    return NULL;
+  }
+  admission_t *adm = calloc(1, sizeof *adm);
+  if (!adm) {
+    log_message(LOG_ERROR, "admission_create: failed to allocate.");
+    return NULL;
+  }
+  if (pthread_mutex_init(&adm->lock, NULL) != 0) {
+    log_message(LOG_ERROR, "admission_create: failed to initialise lock.");
+    free(adm);
+    return NULL;
+  }
+  adm->config = *config;
+  adm->service_ns = config->initial_service_ns;
+  return adm;
+}
+
+void admission_free(admission_t *adm) {
+  if (!adm) return;
+  pthread_mutex_destroy(&adm->lock);
+  free(adm);
+}
+
+static void queue_push(waiter_queue_t *q, waiter_t *w) {
+  w->next = NULL;
+  w->prev = q->tail;
+  if (q->tail) q->tail->next = w;
+  else q->head = w;
+  q->tail = w;
+  q->len++;
+}
+
+static void queue_unlink(waiter_queue_t *q, waiter_t *w) {
+  if (w->prev) w->prev->next = w->next;
+  else q->head = w->next;
+  if (w->next) w->next->prev = w->prev;
+  else q->tail = w->prev;
+  w->prev = w->next = NULL;
+  q->len--;
+}
+
+// Remove a waiter from its queue and wake it with the given outcome. Lock must be held.
+static void drop_waiter(admission_t *adm, waiter_queue_t *q, waiter_t *w, admission_status_t why) {
+  queue_unlink(q, w);
+  adm->queued--;
+  w->state = WAITER_DROPPED;
+  w->drop_status = why;
+  pthread_cond_signal(&w->cond);
+}
+
+// Hand free slots to waiters, best priority first. Lock must be held.
+static void dispatch(admission_t *adm) {
+  uint64_t now = now_ns();
+
+  for (size_t p = 0; p < ADMISSION_PRIORITY_COUNT && adm->running < adm->config.max_concurrent; ) {
+    waiter_queue_t *q = &adm->queues[p];
+    if (q->len == 0) {
+      p++;
+      continue;
+    }
+    // FIFO while the queue is short; newest-first once it holds more
+    // than a round of work, so fresh requests aren't stuck behind a
+    // backlog that is going to miss its deadlines anyway.
+    waiter_t *w = q->len > adm->config.max_concurrent ? q->tail : q->head;
+
+    if (w->deadline_ns != NO_DEADLINE && now + adm->service_ns > w->deadline_ns) {
+      drop_waiter(adm, q, w, ADMISSION_EXPIRED);
+      continue;
+    }
+    queue_unlink(q, w);
+    adm->queued--;
+    adm->running++;
+    w->state = WAITER_GRANTED;
+    pthread_cond_signal(&w->cond);
+  }
+  stats_set(&stat_queued, adm->queued);
+  stats_set(&stat_running, adm->running);
+}
+
+/**
+ * Make room in a full queue for a request of the given priority by
+ * shedding the oldest waiter of the lowest strictly-worse priority.
+ * Returns false if there is nothing worse to shed. Lock must be held.
+ */
+static bool shed_lower(admission_t *adm, admission_priority_t priority) {
+  for (size_t p = ADMISSION_PRIORITY_COUNT; p-- > (size_t)priority + 1; ) {
+    waiter_queue_t *q = &adm->queues[p];
+    if (q->head) {
+      drop_waiter(adm, q, q->head, ADMISSION_OVERLOADED);
+      stats_add(&stat_overloaded, 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+admission_status_t admission_enter(admission_t *adm, admission_priority_t priority,
+                                   const struct timespec *deadline, admission_ticket_t *ticket) {
+  if (!adm || !ticket || (unsigned)priority >= ADMISSION_PRIORITY_COUNT) {
+    log_message(LOG_ERROR, "admission_enter: invalid arguments.");
+    return ADMISSION_OVERLOADED;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t deadline_ns = deadline ? timespec_ns(deadline) : NO_DEADLINE;
+
+  pthread_mutex_lock(&adm->lock);
+
+  // not enough time left to do the work at all
+  if (deadline_ns != NO_DEADLINE && start + adm->service_ns > deadline_ns) {
+    pthread_mutex_unlock(&adm->lock);
+    stats_add(&stat_expired, 1);
+    return ADMISSION_EXPIRED;
+  }
+
+  if (adm->running < adm->config.max_concurrent) {
+    adm->running++;
+    stats_set(&stat_running, adm->running);
+    pthread_mutex_unlock(&adm->lock);
+    ticket->admitted_ns = start;
+    stats_add(&stat_admitted, 1);
+    return ADMISSION_ADMITTED;
+  }
+
+  // Predict the queueing delay from the work ahead of us (equal or
+  // better priority); refuse now rather than queue for a deadline we
+  // can't meet.
+  size_t ahead = 0;
+  for (size_t p = 0; p <= (size_t)priority; p++) ahead += adm->queues[p].len;
+  uint64_t rounds = ahead / adm->config.max_concurrent + 1;
+  if (deadline_ns != NO_DEADLINE &&
+      start + (rounds + 1) * adm->service_ns > deadline_ns) {
+    pthread_mutex_unlock(&adm->lock);
+    stats_add(&stat_overloaded, 1);
+    return ADMISSION_OVERLOADED;
+  }
+
+  if (adm->queued >= adm->config.max_queued && !shed_lower(adm, priority)) {
+    pthread_mutex_unlock(&adm->lock);
+    stats_add(&stat_overloaded, 1);
+    return ADMISSION_OVERLOADED;
+  }
+
+  waiter_t w = { .deadline_ns = deadline_ns, .state = WAITER_WAITING };
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w.cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  waiter_queue_t *q = &adm->queues[priority];
+  queue_push(q, &w);
+  adm->queued++;
+  stats_set(&stat_queued, adm->queued);
+
+  while (w.state == WAITER_WAITING) {
+    if (deadline_ns == NO_DEADLINE) {
+      pthread_cond_wait(&w.cond, &adm->lock);
+    } else if (pthread_cond_timedwait(&w.cond, &adm->lock, deadline) == ETIMEDOUT &&
+               w.state == WAITER_WAITING) {
+      queue_unlink(q, &w);
+      adm->queued--;
+      stats_set(&stat_queued, adm->queued);
+      w.state = WAITER_DROPPED;
+      w.drop_status = ADMISSION_EXPIRED;
+    }
+  }
+  pthread_mutex_unlock(&adm->lock);
+  pthread_cond_destroy(&w.cond);
+
+  uint64_t admitted = now_ns();
+  stats_add(&stat_wait_ns, admitted - start);
+  if (w.state == WAITER_GRANTED) {
+    ticket->admitted_ns = admitted;
+    stats_add(&stat_admitted, 1);
+    return ADMISSION_ADMITTED;
+  }
+  if (w.drop_status == ADMISSION_EXPIRED) stats_add(&stat_expired, 1);
+  return w.drop_status;
+}
+
+void admission_leave(admission_t *adm, const admission_ticket_t *ticket) {
+  if (!adm || !ticket) {
+    log_message(LOG_ERROR, "admission_leave: invalid arguments.");
+    return;
+  }
+  uint64_t now = now_ns();
+  uint64_t sample = now > ticket->admitted_ns ? now - ticket->admitted_ns : 0;
+
+  pthread_mutex_lock(&adm->lock);
+  if (adm->service_ns == 0) {
+    adm->service_ns = sample;
+  } else {
+    adm->service_ns = adm->service_ns - (adm->service_ns >> EWMA_SHIFT) + (sample >> EWMA_SHIFT);
+  }
+  stats_set(&stat_service_ns, adm->service_ns);
+  if (adm->running > 0) adm->running--;
+  dispatch(adm);
+  pthread_mutex_unlock(&adm->lock);
+}
@@ -0,0 +1,88 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file admission.h
+ * @brief Deadline-aware admission control for password verification.
+ *
+ * Password hashing is the expensive part of a login, so it is gated by
+ * an admission controller that allows at most `max_concurrent` hashes
+ * at once. Callers that can't be admitted straight away wait in one of
+ * several priority queues.
+ *
+ * Every request carries a deadline (the time after which its client
+ * will have given up). Work is never started if it can't finish in
+ * time: requests are refused up front when the predicted queueing delay
+ * already exceeds their deadline, and queued requests are dropped,
+ * rather than admitted, once their remaining time is shorter than the
+ * typical hash time. When a queue is longer than one round of service
+ * it is served newest-first, so that under sustained overload fresh
+ * requests still meet their deadlines while stale ones expire, rather
+ * than every request waiting out the whole backlog.
+ *
+ * Deadlines are absolute CLOCK_MONOTONIC times.
+ */
+
+typedef enum {
+  ADMISSION_PRIORITY_HIGH = 0,  // e.g. a recent successful login from the same IP
+  ADMISSION_PRIORITY_NORMAL,    // known account, unfamiliar IP
+  ADMISSION_PRIORITY_LOW,       // e.g. an account that is already failing logins
+  ADMISSION_PRIORITY_COUNT
+} admission_priority_t;
+
+typedef enum {
+  ADMISSION_ADMITTED = 0,   // go ahead; call admission_leave() when done
+  ADMISSION_EXPIRED,        // the deadline passed (or would pass) before work could start
+  ADMISSION_OVERLOADED      // refused: queues are full or the backlog is too long
+} admission_status_t;
+
+typedef struct {
+  size_t max_concurrent;          // hashes allowed to run at once
+  size_t max_queued;              // waiters allowed across all queues
+  uint64_t initial_service_ns;    // estimate of one hash, until measurements arrive
+} admission_config_t;
+
+typedef struct admission admission_t;
+
+// Proof of admission, passed back to admission_leave().
+typedef struct {
+  uint64_t admitted_ns;
+} admission_ticket_t;
+
+// fill in a config with defaults sized for the number of online CPUs
+void admission_config_defaults(admission_config_t *config);
+
+/**
+ * Create an admission controller.
+ * Returns NULL and logs an error message on failure.
+ */
+admission_t *admission_create(const admission_config_t *config);
+
+// free an admission controller. No thread may be waiting in it.
+void admission_free(admission_t *adm);
+
+/**
+ * Ask to start one unit of work of the given priority.
+ *
+ * Blocks until the work is admitted or refused. `deadline` may be NULL
+ * for no deadline. On ADMISSION_ADMITTED, `ticket` is filled in and the
+ * caller must call admission_leave() once the work is done.
+ */
+admission_status_t admission_enter(admission_t *adm, admission_priority_t priority,
+                                   const struct timespec *deadline, admission_ticket_t *ticket);
+
+// finish work started by admission_enter(), freeing its slot
+void admission_leave(admission_t *adm, const admission_ticket_t *ticket);
+
+// set *deadline to `timeout_ms` milliseconds from now
+void admission_deadline_in(struct timespec *deadline, uint64_t timeout_ms);
+
+// name of a status, e.g. "ADMISSION_OVERLOADED"
+const char *admission_status_name(admission_status_t status);
+
+#endif // ADMISSION_H
@@ -0,0 +1,784 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "audit_log.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEGMENT_MAGIC "AUDSEG01"
+#define INDEX_MAGIC "AUDIDX01"
+#define MAGIC_LEN 8
+
+#define RECORD_HEADER 14          // time:8 ip:4 result:1 userid_len:1, then the userid
+#define RECORD_MAX (RECORD_HEADER + USER_ID_LENGTH)
+#define APPEND_BUFFER (64 * 1024)
+#define READ_CHUNK (1024 * 1024)
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_PROBES 7
+
+typedef struct {
+  char magic[MAGIC_LEN];
+  int64_t partition;            // start of the segment's time partition
+} segment_header_t;
+
+typedef struct {
+  char magic[MAGIC_LEN];
+  uint64_t records;
+  int64_t min_time;
+  int64_t max_time;
+  uint64_t segment_bytes;       // length of the segment the index covers
+  uint32_t block_count;
+  uint32_t filter_log2;         // each block's filter has 2^filter_log2 bits
+} index_header_t;
+
+// followed by block_count index_block_t, then the block filters (see filter_add())
+typedef struct {
+  uint64_t offset;
+  int64_t min_time;
+  int64_t max_time;
+} index_block_t;
+
+// a sealed segment waiting for its index
+typedef struct pending {
+  struct pending *next;
+  char *path;
+} pending_t;
+
+struct audit_log {
+  char *dir;
+  audit_log_config_t config;
+
+  pthread_mutex_t lock;
+  int fd;                       // active segment, or -1 until the next append
+  char *path;
+  int64_t partition;
+  size_t bytes;                 // active segment length, including the buffer
+  uint32_t next_seq;
+  unsigned char buf[APPEND_BUFFER];
+  size_t buf_used;
+  uint64_t buffered_ns;         // when the oldest buffered event was appended
+
+  // background indexing of sealed segments, and flushing of the buffer
+  pthread_t indexer;
+  pthread_cond_t cond;
+  pending_t *pending;
+  bool indexing;                // a segment taken off `pending` is being indexed
+  bool stopping;
+};
+
+static audit_log_t *_Atomic default_log = NULL;
+
+static STATS_DEFINE(stat_events, "audit_log.events");
+static STATS_DEFINE(stat_segments, "audit_log.segments_sealed");
+
+void audit_log_config_defaults(audit_log_config_t *config) {
+  config->segment_secs = 3600;
+  config->segment_max_bytes = (size_t)256 << 20;
+  config->block_records = 256;
+  config->flush_ms = 1000;
+}
+
+////
+// Records
+
+static size_t record_encode(unsigned char *p, int64_t time, ip4_addr_t ip, const char *userid,
+                            login_result_t result) {
+  size_t len = strnlen(userid, USER_ID_LENGTH);
+  uint32_t ip32 = ip;
+  memcpy(p, &time, 8);
+  memcpy(p + 8, &ip32, 4);
+  p[12] = (unsigned char)result;
+  p[13] = (unsigned char)len;
+  memcpy(p + RECORD_HEADER, userid, len);
+  return RECORD_HEADER + len;
+}
+
+// Decode the record at p. Returns its length, or 0 if `avail` bytes
+// don't hold a whole record or it is malformed.
+static size_t record_decode(const unsigned char *p, size_t avail, audit_event_t *ev) {
+  if (avail < RECORD_HEADER) return 0;
+  size_t len = p[13];
+  if (len > USER_ID_LENGTH || p[12] > LOGIN_FAIL_INTERNAL_ERROR || avail < RECORD_HEADER + len) {
+    return 0;
+  }
+  int64_t time;
+  uint32_t ip;
+  memcpy(&time, p, 8);
+  memcpy(&ip, p + 8, 4);
+  ev->time = (time_t)time;
+  ev->client_ip = ip;
+  ev->result = (login_result_t)p[12];
+  memcpy(ev->userid, p + RECORD_HEADER, len);
+  ev->userid[len] = '\0';
+  return RECORD_HEADER + len;
+}
+
+typedef bool (*record_fn)(const audit_event_t *ev, uint64_t offset, void *arg);
+
+/**
+ * Call `fn` on each record in bytes [from, to) of a segment until it
+ * returns false. *end is set to the offset just past the last whole
+ * record read. Returns false on a read error.
+ */
+static bool read_records(int fd, uint64_t from, uint64_t to, record_fn fn, void *arg,
+                         uint64_t *end) {
+  unsigned char *buf = malloc(READ_CHUNK);
+  if (!buf) return false;
+  uint64_t offset = from;        // file offset of buf[0]
+  size_t have = 0;
+  bool ok = true, more = true;
+  audit_event_t ev;
+
+  while (more && offset + have < to) {
+    size_t want = READ_CHUNK - have;
+    if (want > to - offset - have) want = (size_t)(to - offset - have);
+    ssize_t n = pread(fd, buf + have, want, (off_t)(offset + have));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      ok = false;
+      break;
+    }
+    if (n == 0) break;
+    have += (size_t)n;
+
+    size_t pos = 0, len;
+    while (more && (len = record_decode(buf + pos, have - pos, &ev)) > 0) {
+      more = fn(&ev, offset + pos, arg);
+      pos += len;
+    }
+    if (have - pos >= RECORD_MAX) break;     // a record that doesn't decode: malformed
+    memmove(buf, buf + pos, have - pos);
+    have -= pos;
+    offset += pos;
+  }
+  if (end) *end = offset;
+  free(buf);
+  return ok;
+}
+
+////
+// Bloom filters over the userids and IPs in each block
+
+static uint64_t key_hash(char kind, const void *key, size_t len) {
+  uint64_t h = 14695981039346656037ULL ^ (unsigned char)kind;
+  h *= 1099511628211ULL;
+  const unsigned char *p = key;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t userid_hash(const char *userid) {
+  return key_hash('u', userid, strnlen(userid, USER_ID_LENGTH));
+}
+
+static uint64_t ip_hash(ip4_addr_t ip) {
+  uint32_t ip32 = ip;
+  return key_hash('i', &ip32, sizeof ip32);
+}
+
+// bit i of the filter for a key hashed to h
+static uint64_t bloom_bit(uint64_t h, unsigned i, uint32_t log2) {
+  uint64_t h2 = (h >> 32) | 1;
+  return (h + i * h2) & (((uint64_t)1 << log2) - 1);
+}
+
+/*
+ * The filters are stored bit-sliced: row i holds bit i of every block's
+ * filter, one bit per block, `row_words` words long. A lookup reads just
+ * BLOOM_PROBES rows, ANDed together giving the blocks that may hold the
+ * key, rather than every block's filter.
+ */
+static size_t row_words(uint32_t block_count) {
+  return ((size_t)block_count + 63) / 64;
+}
+
+static void filter_add(uint64_t *rows, size_t words, uint32_t log2, size_t block, uint64_t h) {
+  for (unsigned i = 0; i < BLOOM_PROBES; i++) {
+    uint64_t bit = bloom_bit(h, i, log2);
+    rows[bit * words + block / 64] |= (uint64_t)1 << (block % 64);
+  }
+}
+
+// Clear the blocks in `candidates` whose filters rule out the key hashed
+// to h, reading the rows from the filters at `offset` in an index file.
+static bool filter_narrow(int fd, off_t offset, uint32_t log2, size_t words, uint64_t h,
+                          uint64_t *candidates, uint64_t *row) {
+  for (unsigned i = 0; i < BLOOM_PROBES; i++) {
+    uint64_t bit = bloom_bit(h, i, log2);
+    ssize_t len = (ssize_t)(words * sizeof *row);
+    if (pread(fd, row, (size_t)len, offset + (off_t)(bit * words * sizeof *row)) != len) return false;
+    for (size_t w = 0; w < words; w++) candidates[w] &= row[w];
+  }
+  return true;
+}
+
+////
+// Segment files
+
+static char *segment_path(const char *dir, int64_t partition, uint32_t seq, const char *ext) {
+  int len = snprintf(NULL, 0, "%s/audit-%" PRId64 "-%" PRIu32 ".%s", dir, partition, seq, ext);
+  char *path = malloc((size_t)len + 1);
+  if (path) snprintf(path, (size_t)len + 1, "%s/audit-%" PRId64 "-%" PRIu32 ".%s", dir, partition, seq, ext);
+  return path;
+}
+
+// "<segment>.seg" -> "<segment>.idx", in a new string
+static char *index_path(const char *seg_path) {
+  size_t len = strlen(seg_path);
+  char *path = malloc(len + 1);
+  if (path) {
+    memcpy(path, seg_path, len - 3);
+    memcpy(path + len - 3, "idx", 4);
+  }
+  return path;
+}
+
+typedef struct {
+  int64_t partition;
+  uint32_t seq;
+  char *path;
+} segment_name_t;
+
+static int compare_seq(const void *a, const void *b) {
+  uint32_t x = ((const segment_name_t *)a)->seq, y = ((const segment_name_t *)b)->seq;
+  return (x > y) - (x < y);
+}
+
+static void segment_names_free(segment_name_t *names, size_t count) {
+  for (size_t i = 0; i < count; i++) free(names[i].path);
+  free(names);
+}
+
+// The segments in `dir`, in the order they were written. Returns false on error.
+static bool list_segments(const char *dir, segment_name_t **names, size_t *count) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    log_message(LOG_ERROR, "audit_log: can't open directory '%s': %s.", dir, strerror(errno));
+    return false;
+  }
+  segment_name_t *list = NULL;
+  size_t n = 0, capacity = 0;
+  bool ok = true;
+  struct dirent *entry;
+  while (ok && (entry = readdir(d)) != NULL) {
+    int64_t partition;
+    uint32_t seq;
+    int end = 0;
+    if (sscanf(entry->d_name, "audit-%" SCNd64 "-%" SCNu32 ".seg%n", &partition, &seq, &end) != 2 ||
+        end == 0 || entry->d_name[end] != '\0') {
+      continue;
+    }
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      segment_name_t *grown = realloc(list, capacity * sizeof *list);
+      if (!grown) {
+        ok = false;
+        break;
+      }
+      list = grown;
+    }
+    list[n] = (segment_name_t){ .partition = partition, .seq = seq,
+                                .path = segment_path(dir, partition, seq, "seg") };
+    if (!list[n].path) ok = false;
+    else n++;
+  }
+  closedir(d);
+  if (!ok) {
+    log_message(LOG_ERROR, "audit_log: failed to allocate.");
+    segment_names_free(list, n);
+    return false;
+  }
+  if (n > 0) qsort(list, n, sizeof *list, compare_seq);
+  *names = list;
+  *count = n;
+  return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+  const unsigned char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+typedef struct {
+  uint32_t block_records;
+  uint64_t records;
+  int64_t min_time, max_time;
+  index_block_t *blocks;
+  size_t block_count, block_capacity;
+  uint64_t *filters;
+  uint32_t filter_log2;
+  uint64_t keyed;               // records added to the filters so far
+  bool failed;
+} index_build_t;
+
+static bool index_count(const audit_event_t *ev, uint64_t offset, void *arg) {
+  index_build_t *b = arg;
+  int64_t t = (int64_t)ev->time;
+  if (b->records % b->block_records == 0) {
+    if (b->block_count == b->block_capacity) {
+      size_t capacity = b->block_capacity ? b->block_capacity * 2 : 64;
+      index_block_t *grown = realloc(b->blocks, capacity * sizeof *grown);
+      if (!grown) {
+        b->failed = true;
+        return false;
+      }
+      b->blocks = grown;
+      b->block_capacity = capacity;
+    }
+    b->blocks[b->block_count++] = (index_block_t){ .offset = offset, .min_time = t, .max_time = t };
+  }
+  index_block_t *block = &b->blocks[b->block_count - 1];
+  if (t < block->min_time) block->min_time = t;
+  if (t > block->max_time) block->max_time = t;
+  if (b->records == 0 || t < b->min_time) b->min_time = t;
+  if (b->records == 0 || t > b->max_time) b->max_time = t;
+  b->records++;
+  return true;
+}
+
+static bool index_add_keys(const audit_event_t *ev, uint64_t offset, void *arg) {
+  (void)offset;
+  index_build_t *b = arg;
+  size_t words = row_words((uint32_t)b->block_count), block = b->keyed++ / b->block_records;
+  filter_add(b->filters, words, b->filter_log2, block, userid_hash(ev->userid));
+  filter_add(b->filters, words, b->filter_log2, block, ip_hash(ev->client_ip));
+  return true;
+}
+
+/**
+ * Write the index for the segment at `seg_path`. A torn record at the end
+ * of the segment (from a crash mid-write) is cut off first.
+ */
+static bool segment_index(const char *seg_path, uint32_t block_records) {
+  char *idx_path = index_path(seg_path);
+  size_t tmp_len = idx_path ? strlen(idx_path) + sizeof ".tmp" : 0;
+  char *tmp = idx_path ? malloc(tmp_len) : NULL;
+  int fd = open(seg_path, O_RDWR);
+  index_build_t b = { .block_records = block_records };
+  bool ok = false;
+  int out = -1;
+  segment_header_t header;
+
+  if (!tmp || fd < 0) {
+    log_message(LOG_ERROR, "audit_log: can't open segment '%s'.", seg_path);
+    goto done;
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", idx_path);
+  if (pread(fd, &header, sizeof header, 0) != sizeof header ||
+      memcmp(header.magic, SEGMENT_MAGIC, MAGIC_LEN) != 0) {
+    log_message(LOG_ERROR, "audit_log: '%s' is not an audit segment.", seg_path);
+    goto done;
+  }
+
+  uint64_t end;
+  if (!read_records(fd, sizeof header, UINT64_MAX, index_count, &b, &end) || b.failed) {
+    log_message(LOG_ERROR, "audit_log: failed to read '%s'.", seg_path);
+    goto done;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size > (off_t)end && ftruncate(fd, (off_t)end) != 0) goto done;
+
+  // a userid and an IP per record
+  uint64_t bits = (uint64_t)block_records * 2 * BLOOM_BITS_PER_KEY;
+  b.filter_log2 = 6;
+  while (((uint64_t)1 << b.filter_log2) < bits) b.filter_log2++;
+  size_t words = ((size_t)1 << b.filter_log2) * row_words((uint32_t)b.block_count);
+  b.filters = calloc(words ? words : 1, sizeof *b.filters);
+  if (!b.filters || !read_records(fd, sizeof header, end, index_add_keys, &b, NULL)) goto done;
+
+  index_header_t ih = {
+    .records = b.records,
+    .min_time = b.min_time,
+    .max_time = b.max_time,
+    .segment_bytes = end,
+    .block_count = (uint32_t)b.block_count,
+    .filter_log2 = b.filter_log2,
+  };
+  memcpy(ih.magic, INDEX_MAGIC, MAGIC_LEN);
+  out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ok = out >= 0 && write_all(out, &ih, sizeof ih) &&
+       write_all(out, b.blocks, b.block_count * sizeof *b.blocks) &&
+       write_all(out, b.filters, words * sizeof *b.filters) && fsync(out) == 0;
+  ok = (out < 0 || close(out) == 0) && ok;
+  ok = ok && rename(tmp, idx_path) == 0;
+  if (!ok) {
+    log_message(LOG_ERROR, "audit_log: failed to write index '%s': %s.", idx_path, strerror(errno));
+    unlink(tmp);
+  }
+
+done:
+  if (fd >= 0) close(fd);
+  free(b.blocks);
+  free(b.filters);
+  free(tmp);
+  free(idx_path);
+  return ok;
+}
+
+////
+// Writer
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static bool flush_locked(audit_log_t *log);
+
+// Indexes sealed segments, and writes out the buffer once its oldest
+// event has waited flush_ms, so that other processes can query it.
+static void *indexer_thread(void *arg) {
+  audit_log_t *log = arg;
+  uint64_t flush_ns = (uint64_t)log->config.flush_ms * 1000000u;
+  pthread_mutex_lock(&log->lock);
+  for (;;) {
+    if (flush_ns > 0 && log->buf_used > 0 && now_ns() - log->buffered_ns >= flush_ns) {
+      flush_locked(log);
+    }
+    pending_t *p = log->pending;
+    if (!p) {
+      if (log->stopping) break;
+      if (flush_ns > 0 && log->buf_used > 0) {
+        uint64_t due = log->buffered_ns + flush_ns;
+        struct timespec ts = {
+          .tv_sec = (time_t)(due / 1000000000u),
+          .tv_nsec = (long)(due % 1000000000u),
+        };
+        pthread_cond_timedwait(&log->cond, &log->lock, &ts);
+      } else {
+        pthread_cond_wait(&log->cond, &log->lock);
+      }
+      continue;
+    }
+    log->pending = p->next;
+    log->indexing = true;
+    pthread_mutex_unlock(&log->lock);
+
+    segment_index(p->path, log->config.block_records);
+    free(p->path);
+    free(p);
+
+    pthread_mutex_lock(&log->lock);
+    log->indexing = false;
+    pthread_cond_broadcast(&log->cond);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return NULL;
+}
+
+// write out the buffer. called with the lock held.
+static bool flush_locked(audit_log_t *log) {
+  if (log->buf_used == 0) return true;
+  bool ok = write_all(log->fd, log->buf, log->buf_used);
+  if (!ok) log_message(LOG_ERROR, "audit_log: failed to write '%s': %s.", log->path, strerror(errno));
+  log->buf_used = 0;
+  return ok;
+}
+
+// Close the active segment and queue it for indexing. Called with the lock held.
+static bool seal_locked(audit_log_t *log) {
+  if (log->fd < 0) return true;
+  bool ok = flush_locked(log);
+  close(log->fd);
+  log->fd = -1;
+
+  pending_t *p = malloc(sizeof *p), **tail = &log->pending;
+  if (!p) {
+    log_message(LOG_ERROR, "audit_log: failed to allocate; '%s' is indexed on next open.", log->path);
+    free(log->path);
+  } else {
+    *p = (pending_t){ .path = log->path };
+    while (*tail) tail = &(*tail)->next;
+    *tail = p;
+    pthread_cond_broadcast(&log->cond);
+  }
+  log->path = NULL;
+  stats_add(&stat_segments, 1);
+  return ok;
+}
+
+// start a segment for the partition starting at `partition`. called with the lock held.
+static bool start_segment_locked(audit_log_t *log, int64_t partition) {
+  char *path = segment_path(log->dir, partition, log->next_seq, "seg");
+  int fd = path ? open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600) : -1;
+  segment_header_t header = { .partition = partition };
+  memcpy(header.magic, SEGMENT_MAGIC, MAGIC_LEN);
+  if (fd < 0 || !write_all(fd, &header, sizeof header)) {
+    log_message(LOG_ERROR, "audit_log: can't create segment in '%s': %s.", log->dir, strerror(errno));
+    if (fd >= 0) close(fd);
+    free(path);
+    return false;
+  }
+  log->next_seq++;
+  log->fd = fd;
+  log->path = path;
+  log->partition = partition;
+  log->bytes = sizeof header;
+  return true;
+}
+
+audit_log_t *audit_log_open(const char *dir, const audit_log_config_t *config) {
+  audit_log_config_t defaults;
+  audit_log_config_defaults(&defaults);
+  if (!config) config = &defaults;
+  if (!dir || config->segment_secs == 0 || config->block_records == 0 ||
+      config->segment_max_bytes < sizeof(segment_header_t) + RECORD_MAX) {
+    log_message(LOG_ERROR, "audit_log_open: invalid arguments.");
+    return NULL;
+  }
+
+  // seal what a previous run left behind
+  segment_name_t *names;
+  size_t count;
+  if (!list_segments(dir, &names, &count)) return NULL;
+  uint32_t next_seq = count > 0 ? names[count - 1].seq + 1 : 0;
+  for (size_t i = 0; i < count; i++) {
+    char *idx = index_path(names[i].path);
+    if (idx && access(idx, F_OK) != 0) segment_index(names[i].path, config->block_records);
+    free(idx);
+  }
+  segment_names_free(names, count);
+
+  audit_log_t *log = calloc(1, sizeof *log);
+  if (!log || !(log->dir = strdup(dir))) {
+    log_message(LOG_ERROR, "audit_log_open: failed to allocate.");
+    free(log);
+    return NULL;
+  }
+  log->config = *config;
+  log->fd = -1;
+  log->next_seq = next_seq;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&log->indexer, NULL, indexer_thread, log) != 0) {
+    log_message(LOG_ERROR, "audit_log_open: can't start indexing thread.");
+    pthread_cond_destroy(&log->cond);
+    pthread_mutex_destroy(&log->lock);
+    free(log->dir);
+    free(log);
+    return NULL;
+  }
+  return log;
+}
+
+void audit_log_close(audit_log_t *log) {
+  if (!log) return;
+  audit_log_t *expected = log;
+  atomic_compare_exchange_strong(&default_log, &expected, NULL);
+
+  pthread_mutex_lock(&log->lock);
+  seal_locked(log);
+  log->stopping = true;
+  pthread_cond_broadcast(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+  pthread_join(log->indexer, NULL);
+
+  pthread_cond_destroy(&log->cond);
+  pthread_mutex_destroy(&log->lock);
+  free(log->dir);
+  free(log);
+}
+
+bool audit_log_append(audit_log_t *log, time_t time, ip4_addr_t client_ip,
+                      const char *userid, login_result_t result) {
+  if (!log || !userid) return false;
+  int64_t t = (int64_t)time, secs = log->config.segment_secs;
+  int64_t partition = t - ((t % secs) + secs) % secs;
+
+  pthread_mutex_lock(&log->lock);
+  size_t len = RECORD_HEADER + strnlen(userid, USER_ID_LENGTH);
+  // events are filed by arrival; one that is a little late for its
+  // partition goes in the current segment rather than reopening an old one
+  bool ok = true;
+  if (log->fd >= 0 &&
+      (partition > log->partition || log->bytes + len > log->config.segment_max_bytes)) {
+    ok = seal_locked(log);
+  }
+  if (log->fd < 0) ok = start_segment_locked(log, partition) && ok;
+  if (log->fd >= 0) {
+    if (log->buf_used + len > sizeof log->buf) ok = flush_locked(log) && ok;
+    if (log->buf_used == 0 && log->config.flush_ms > 0) {
+      // start the indexer's clock on this event
+      log->buffered_ns = now_ns();
+      pthread_cond_broadcast(&log->cond);
+    }
+    log->buf_used += record_encode(log->buf + log->buf_used, t, client_ip, userid, result);
+    log->bytes += len;
+    stats_add(&stat_events, 1);
+  } else {
+    ok = false;
+  }
+  pthread_mutex_unlock(&log->lock);
+  return ok;
+}
+
+bool audit_log_flush(audit_log_t *log) {
+  if (!log) return false;
+  pthread_mutex_lock(&log->lock);
+  bool ok = log->fd < 0 || flush_locked(log);
+  pthread_mutex_unlock(&log->lock);
+  return ok;
+}
+
+bool audit_log_seal(audit_log_t *log) {
+  if (!log) return false;
+  pthread_mutex_lock(&log->lock);
+  bool ok = seal_locked(log);
+  while (log->pending || log->indexing) pthread_cond_wait(&log->cond, &log->lock);
+  pthread_mutex_unlock(&log->lock);
+  return ok;
+}
+
+////
+// Queries
+
+typedef struct {
+  const audit_query_t *query;
+  audit_visit_fn fn;
+  void *arg;
+  audit_query_stats_t *stats;
+  bool stopped;
+} query_state_t;
+
+static bool query_match(const audit_event_t *ev, uint64_t offset, void *arg) {
+  (void)offset;
+  query_state_t *qs = arg;
+  const audit_query_t *q = qs->query;
+  if (ev->time < q->from || ev->time >= q->until) return true;
+  if (q->match_ip && ev->client_ip != q->client_ip) return true;
+  if (q->userid && strcmp(ev->userid, q->userid) != 0) return true;
+  qs->stats->matches++;
+  if (!qs->fn(ev, qs->arg)) qs->stopped = true;
+  return !qs->stopped;
+}
+
+// Query one segment through its index. Returns false if there is no
+// usable index, with *ok unset.
+static bool query_indexed(const char *seg_path, int seg_fd, query_state_t *qs, bool *ok) {
+  char *idx_path = index_path(seg_path);
+  int fd = idx_path ? open(idx_path, O_RDONLY) : -1;
+  free(idx_path);
+  if (fd < 0) return false;
+
+  const audit_query_t *q = qs->query;
+  index_header_t ih;
+  if (pread(fd, &ih, sizeof ih, 0) != sizeof ih || memcmp(ih.magic, INDEX_MAGIC, MAGIC_LEN) != 0) {
+    close(fd);
+    return false;
+  }
+  *ok = true;
+
+  if (ih.records == 0 || ih.max_time < (int64_t)q->from || ih.min_time >= (int64_t)q->until) {
+    close(fd);
+    return true;
+  }
+
+  // the blocks that may hold the userid and IP
+  size_t words = row_words(ih.block_count);
+  off_t filter_offset = (off_t)(sizeof ih + ih.block_count * sizeof(index_block_t));
+  uint64_t *candidates = malloc(words * sizeof *candidates);
+  uint64_t *row = malloc(words * sizeof *row);
+  index_block_t *blocks = malloc(ih.block_count * sizeof *blocks);
+  if (!candidates || !row || !blocks ||
+      pread(fd, blocks, ih.block_count * sizeof *blocks, sizeof ih) !=
+      (ssize_t)(ih.block_count * sizeof *blocks)) {
+    *ok = false;
+  } else {
+    memset(candidates, 0xff, words * sizeof *candidates);
+    if (q->userid) {
+      *ok = filter_narrow(fd, filter_offset, ih.filter_log2, words, userid_hash(q->userid),
+                          candidates, row);
+    }
+    if (*ok && q->match_ip) {
+      *ok = filter_narrow(fd, filter_offset, ih.filter_log2, words, ip_hash(q->client_ip),
+                          candidates, row);
+    }
+  }
+  if (!*ok) log_message(LOG_ERROR, "audit_query: failed to read index of '%s'.", seg_path);
+
+  bool counted = false;
+  for (uint32_t i = 0; *ok && !qs->stopped && i < ih.block_count; i++) {
+    if (!(candidates[i / 64] & (uint64_t)1 << (i % 64))) continue;
+    if (blocks[i].max_time < (int64_t)q->from || blocks[i].min_time >= (int64_t)q->until) continue;
+    if (!counted) qs->stats->segments_read++;
+    counted = true;
+    uint64_t to = i + 1 < ih.block_count ? blocks[i + 1].offset : ih.segment_bytes;
+    qs->stats->blocks_read++;
+    *ok = read_records(seg_fd, blocks[i].offset, to, query_match, qs, NULL);
+  }
+  free(candidates);
+  free(row);
+  free(blocks);
+  close(fd);
+  return true;
+}
+
+bool audit_query(const char *dir, const audit_query_t *query, audit_visit_fn fn, void *arg,
+                 audit_query_stats_t *stats) {
+  if (!dir || !query || !fn) {
+    log_message(LOG_ERROR, "audit_query: NULL argument.");
+    return false;
+  }
+  audit_query_stats_t local;
+  if (!stats) stats = &local;
+  memset(stats, 0, sizeof *stats);
+
+  segment_name_t *names;
+  size_t count;
+  if (!list_segments(dir, &names, &count)) return false;
+  stats->segments = count;
+
+  query_state_t qs = { .query = query, .fn = fn, .arg = arg, .stats = stats };
+  bool ok = true;
+  for (size_t i = 0; ok && !qs.stopped && i < count; i++) {
+    int fd = open(names[i].path, O_RDONLY);
+    if (fd < 0) continue;     // removed since it was listed
+    if (!query_indexed(names[i].path, fd, &qs, &ok)) {
+      // the active segment, not indexed yet: read all of it
+      stats->segments_read++;
+      stats->blocks_read++;
+      ok = read_records(fd, sizeof(segment_header_t), UINT64_MAX, query_match, &qs, NULL);
+    }
+    if (!ok) log_message(LOG_ERROR, "audit_query: failed to read '%s'.", names[i].path);
+    close(fd);
+  }
+  segment_names_free(names, count);
+  return ok;
+}
+
+void audit_log_set_default(audit_log_t *log) {
+  atomic_store(&default_log, log);
+}
+
+audit_log_t *audit_log_get_default(void) {
+  return atomic_load(&default_log);
+}
@@ -0,0 +1,148 @@
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H
+
+#include "account.h"
+#include "login.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file audit_log.h
+ * @brief Time-partitioned, indexed audit log of login attempts.
+ *
+ * Every login attempt handled while a log is installed with
+ * audit_log_set_default() is appended as one small binary record (time,
+ * client IP, userid and result) to the active segment in a directory.
+ * A new segment is started for each time partition (an hour by default)
+ * or once a segment reaches its size limit.
+ *
+ * When a segment is sealed, a background thread writes an index file
+ * beside it holding:
+ *
+ * - the segment's earliest and latest event times
+ * - a sparse index: the offset and time range of every block of
+ *   records (256 by default)
+ * - a Bloom filter per block over the userids and client IPs in it,
+ *   stored so that a lookup reads a few short rows rather than every
+ *   block's filter
+ *
+ * audit_query() uses these to skip segments whose time range doesn't
+ * overlap the query, and within the rest to read only the blocks whose
+ * time range overlaps it and whose filter doesn't rule out the userid
+ * or IP.
+ *
+ * Appends are buffered and written in batches, at the latest once the
+ * oldest buffered event has waited `flush_ms` (a second by default), so
+ * other processes see the active segment at most that far behind; call
+ * audit_log_flush() before querying it from the same process. Buffered
+ * events are lost if the process dies. Segments from a previous run
+ * that were never sealed are indexed when the directory is next opened.
+ *
+ * Records are written in native byte order, so a log can only be read
+ * on a machine with the same endianness as the writer.
+ */
+
+typedef struct audit_log audit_log_t;
+
+typedef struct {
+  uint32_t segment_secs;        // length of a time partition
+  size_t segment_max_bytes;     // start a new segment past this size
+  uint32_t block_records;       // records per sparse index entry
+  uint32_t flush_ms;            // longest an event stays buffered; 0 for until the buffer fills
+} audit_log_config_t;
+
+// one logged login attempt
+typedef struct {
+  time_t time;
+  ip4_addr_t client_ip;
+  login_result_t result;
+  char userid[USER_ID_LENGTH + 1];
+} audit_event_t;
+
+/**
+ * What to look for. Events match if their time is in [from, until) and
+ * they have the given userid (if `userid` isn't NULL) and client IP (if
+ * `match_ip` is set).
+ */
+typedef struct {
+  time_t from;
+  time_t until;
+  const char *userid;
+  bool match_ip;
+  ip4_addr_t client_ip;
+} audit_query_t;
+
+// how much of the log a query touched
+typedef struct {
+  size_t segments;              // segments in the directory
+  size_t segments_read;         // segments with blocks not ruled out by the index
+  size_t blocks_read;           // blocks of records read
+  size_t matches;
+} audit_query_stats_t;
+
+// return false to stop the query early
+typedef bool (*audit_visit_fn)(const audit_event_t *event, void *arg);
+
+// hourly segments of up to 256 MiB, with an index entry every 256 records,
+// written out within a second
+void audit_log_config_defaults(audit_log_config_t *config);
+
+/**
+ * Open the audit log in directory `dir` (which must exist) for appending,
+ * indexing any segments left unsealed by a previous run. `config` may be
+ * NULL for the defaults.
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+audit_log_t *audit_log_open(const char *dir, const audit_log_config_t *config);
+
+// seal the active segment, wait for pending indexes and free the log
+void audit_log_close(audit_log_t *log);
+
+/**
+ * Append an event. Thread-safe. `userid` longer than USER_ID_LENGTH is
+ * truncated.
+ *
+ * Returns false and logs an error message if the segment can't be written.
+ */
+bool audit_log_append(audit_log_t *log, time_t time, ip4_addr_t client_ip,
+                      const char *userid, login_result_t result);
+
+// write out buffered events. returns false on a write error.
+bool audit_log_flush(audit_log_t *log);
+
+/**
+ * Write out buffered events, seal the active segment and wait until it
+ * is indexed. The log stays open, and the next append starts a new
+ * segment. Unlike audit_log_close(), this is safe while other threads
+ * may still append, e.g. in a process about to exit.
+ *
+ * Returns false and logs an error message if the segment can't be written.
+ */
+bool audit_log_seal(audit_log_t *log);
+
+/**
+ * Call `fn` on every event in the log in `dir` matching `query`, segment
+ * by segment in the order they were written, until it returns false.
+ * `stats` may be NULL.
+ *
+ * Returns false and logs an error message if the directory or a segment
+ * can't be read.
+ */
+bool audit_query(const char *dir, const audit_query_t *query, audit_visit_fn fn, void *arg,
+                 audit_query_stats_t *stats);
+
+////
+// Process-wide default log
+
+// Set the log handle_login() records attempts in. NULL clears it. The
+// caller keeps ownership.
+void audit_log_set_default(audit_log_t *log);
+
+// the log set by audit_log_set_default(), or NULL
+audit_log_t *audit_log_get_default(void);
+
+#endif // AUDIT_LOG_H
@@ -0,0 +1,131 @@
+// Entry point for the audit log query tool (`make audit`).
+//
+// Prints the login attempts in an audit log directory (see audit_log.h)
+// matching a userid, a client IP and/or a time range, e.g. every login
+// for alice in the last week:
+//
+//     bin/audit-query -d /var/log/audit -u alice -f -7d
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "audit_log.h"
+#include "loadgen.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s -d DIR [-u USERID] [-i IP] [-f TIME] [-t TIME] [-n MAX] [-s]\n"
+    "  -d DIR      audit log directory\n"
+    "  -u USERID   only attempts for this userid\n"
+    "  -i IP       only attempts from this client IP (a.b.c.d)\n"
+    "  -f TIME     only attempts at or after TIME (default: all)\n"
+    "  -t TIME     only attempts before TIME (default: all)\n"
+    "  -n MAX      stop after MAX attempts\n"
+    "  -s          print how much of the log was read to stderr\n"
+    "TIME is seconds since the epoch, or now minus an amount such as\n"
+    "-30m, -12h or -7d.\n",
+    prog);
+}
+
+static bool parse_time(const char *s, time_t now, time_t *out) {
+  char *end;
+  if (s[0] == '-') {
+    long long amount = strtoll(s + 1, &end, 10);
+    long long unit;
+    switch (*end) {
+      case 's': unit = 1; break;
+      case 'm': unit = 60; break;
+      case 'h': unit = 3600; break;
+      case 'd': unit = 86400; break;
+      default: return false;
+    }
+    if (end == s + 1 || end[1] != '\0' || amount < 0) return false;
+    *out = now - (time_t)(amount * unit);
+    return true;
+  }
+  long long t = strtoll(s, &end, 10);
+  if (end == s || *end != '\0') return false;
+  *out = (time_t)t;
+  return true;
+}
+
+static bool parse_ip(const char *s, ip4_addr_t *out) {
+  unsigned a, b, c, d;
+  char extra;
+  if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 ||
+      a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  *out = (ip4_addr_t)(a << 24 | b << 16 | c << 8 | d);
+  return true;
+}
+
+typedef struct {
+  uint64_t printed;
+  uint64_t max;
+} print_state_t;
+
+static bool print_event(const audit_event_t *ev, void *arg) {
+  print_state_t *ps = arg;
+  struct tm tm;
+  char when[32] = "?";
+  if (gmtime_r(&ev->time, &tm)) strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%SZ", &tm);
+  printf("%s %u.%u.%u.%u %s %s\n", when,
+         (ev->client_ip >> 24) & 0xFF, (ev->client_ip >> 16) & 0xFF,
+         (ev->client_ip >> 8) & 0xFF, ev->client_ip & 0xFF,
+         ev->userid, loadgen_result_name(ev->result));
+  return ++ps->printed < ps->max;
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = NULL;
+  bool show_stats = false;
+  time_t now = time(NULL);
+  audit_query_t query = { .from = (time_t)INT64_MIN, .until = (time_t)INT64_MAX };
+  print_state_t ps = { .max = UINT64_MAX };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:u:i:f:t:n:sh")) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case 'd': dir = optarg; break;
+      case 'u': query.userid = optarg; break;
+      case 'i': ok = parse_ip(optarg, &query.client_ip); query.match_ip = true; break;
+      case 'f': ok = parse_time(optarg, now, &query.from); break;
+      case 't': ok = parse_time(optarg, now, &query.until); break;
+      case 'n': ps.max = strtoull(optarg, NULL, 10); break;
+      case 's': show_stats = true; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: invalid argument to -%c: %s\n", argv[0], opt, optarg);
+      return 1;
+    }
+  }
+  if (!dir) {
+    fprintf(stderr, "%s: -d DIR is required\n", argv[0]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  audit_query_stats_t stats;
+  bool ok = ps.max == 0 || audit_query(dir, &query, print_event, &ps, &stats);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fflush(stdout);
+
+  if (show_stats && ps.max > 0) {
+    double ms = (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    fprintf(stderr, "%zu matches; read %zu of %zu segments (%zu blocks) in %.2f ms\n",
+            stats.matches, stats.segments_read, stats.segments, stats.blocks_read, ms);
+  }
+  return ok ? 0 : 1;
+}
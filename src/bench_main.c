@@ -0,0 +1,291 @@
+// Entry point for the benchmark suite (`make bench`).
+//
+// Times the hot paths of a login server: handle_login() (accepted and
+// rejected attempts), account store reads and updates (also with a
+// change-data capture stream attached), logging,
+// batched SHA-512-crypt, salt generation, credential-stuffing detection,
+// and allocating and freeing account records with the slab allocator and
+// with plain malloc(). Each benchmark runs for a
+// fixed time and reports operations per second, one per line as
+//
+//     <name> <ops/s>
+//
+// so the output of different builds can be compared (see
+// scripts/bench-builds.sh). The same workload trains PGO builds.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "account.h"
+#include "account_cdc.h"
+#include "account_store.h"
+#include "entropy.h"
+#include "logging.h"
+#include "login.h"
+#include "sha512_crypt.h"
+#include "slab.h"
+#include "stuffing_detector.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ACCOUNTS 100000
+#define BENCH_PASSWORD "bench-password"
+// cheap enough that the rest of the login path still shows
+#define BENCH_SETTING "$6$rounds=1000$benchsalt"
+#define BENCH_CRYPT_BATCH 16
+// records live at once in the allocation benchmarks
+#define BENCH_ALLOC_BATCH 256
+// client IPs the stuffing detector sees
+#define BENCH_CLIENT_IPS 10000
+
+typedef struct {
+  account_store_t *store;
+  stuffing_detector_t *stuffing;
+  account_cdc_t *cdc;
+  int null_fd;
+  char (*userids)[USER_ID_LENGTH];
+  uint64_t rng;
+} bench_ctx_t;
+
+// run `iters` operations of a benchmark
+typedef void (*bench_fn)(bench_ctx_t *ctx, size_t iters);
+
+typedef struct {
+  const char *name;
+  bench_fn fn;
+  size_t batch;       // operations per call; the clock is read between calls
+} bench_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t next_index(bench_ctx_t *ctx, size_t n) {
+  // xorshift64
+  ctx->rng ^= ctx->rng << 13;
+  ctx->rng ^= ctx->rng >> 7;
+  ctx->rng ^= ctx->rng << 17;
+  return (size_t)(ctx->rng % n);
+}
+
+static void bench_login_success(bench_ctx_t *ctx, size_t iters) {
+  login_session_data_t session;
+  for (size_t i = 0; i < iters; i++) {
+    const char *userid = ctx->userids[next_index(ctx, BENCH_ACCOUNTS)];
+    handle_login(userid, BENCH_PASSWORD, 0x0a000001, time(NULL), ctx->null_fd, ctx->null_fd,
+                 &session);
+  }
+}
+
+// unknown, banned and expired accounts: everything but the hash
+static void bench_login_rejected(bench_ctx_t *ctx, size_t iters) {
+  login_session_data_t session;
+  char unknown[USER_ID_LENGTH];
+  for (size_t i = 0; i < iters; i++) {
+    size_t k = next_index(ctx, BENCH_ACCOUNTS / 3);
+    const char *userid = unknown;
+    if (i % 3 == 0) snprintf(unknown, sizeof unknown, "nobody-%zu", k);
+    else userid = ctx->userids[3 * k + i % 3];    // see setup()
+    handle_login(userid, BENCH_PASSWORD, 0x0a000001, time(NULL), ctx->null_fd, ctx->null_fd,
+                 &session);
+  }
+}
+
+static void bench_store_get(bench_ctx_t *ctx, size_t iters) {
+  account_t acc;
+  for (size_t i = 0; i < iters; i++) {
+    account_store_get(ctx->store, ctx->userids[next_index(ctx, BENCH_ACCOUNTS)], &acc);
+  }
+}
+
+static bool bump_login_count(account_t *acc, void *arg) {
+  (void)arg;
+  acc->login_count++;
+  return true;
+}
+
+static void bench_store_update(bench_ctx_t *ctx, size_t iters) {
+  for (size_t i = 0; i < iters; i++) {
+    account_store_update(ctx->store, ctx->userids[next_index(ctx, BENCH_ACCOUNTS)],
+                         bump_login_count, NULL);
+  }
+}
+
+// as store.update, recording each change in a change stream
+static void bench_store_update_cdc(bench_ctx_t *ctx, size_t iters) {
+  account_store_set_cdc(ctx->store, ctx->cdc);
+  bench_store_update(ctx, iters);
+  account_store_set_cdc(ctx->store, NULL);
+}
+
+static void bench_log_message(bench_ctx_t *ctx, size_t iters) {
+  for (size_t i = 0; i < iters; i++) {
+    log_message(LOG_INFO, "Login success for user '%s'", ctx->userids[i % BENCH_ACCOUNTS]);
+  }
+}
+
+static void bench_sha512_crypt(bench_ctx_t *ctx, size_t iters) {
+  (void)ctx;
+  sha512_crypt_job_t jobs[BENCH_CRYPT_BATCH];
+  for (size_t done = 0; done < iters; done += BENCH_CRYPT_BATCH) {
+    for (size_t j = 0; j < BENCH_CRYPT_BATCH; j++) {
+      jobs[j] = (sha512_crypt_job_t){ .key = BENCH_PASSWORD, .setting = BENCH_SETTING };
+    }
+    sha512_crypt_many(jobs, BENCH_CRYPT_BATCH);
+  }
+}
+
+static void bench_entropy_salt(bench_ctx_t *ctx, size_t iters) {
+  (void)ctx;
+  unsigned char salt[16];
+  for (size_t i = 0; i < iters; i++) entropy_fill(salt, sizeof salt);
+}
+
+static void bench_stuffing_observe(bench_ctx_t *ctx, size_t iters) {
+  time_t now = time(NULL);
+  for (size_t i = 0; i < iters; i++) {
+    ip4_addr_t ip = 0x0a000000u | (ip4_addr_t)next_index(ctx, BENCH_CLIENT_IPS);
+    stuffing_detector_observe(ctx->stuffing, ip, ctx->userids[next_index(ctx, BENCH_ACCOUNTS)], now);
+  }
+}
+
+// allocate a batch of account records and free them again, zeroing and
+// wiping them as account_create() and account_free() do
+static void bench_slab_account(bench_ctx_t *ctx, size_t iters) {
+  (void)ctx;
+  account_t *accs[BENCH_ALLOC_BATCH];
+  for (size_t done = 0; done < iters; done += BENCH_ALLOC_BATCH) {
+    for (size_t i = 0; i < BENCH_ALLOC_BATCH; i++) accs[i] = slab_alloc(sizeof(account_t));
+    for (size_t i = 0; i < BENCH_ALLOC_BATCH; i++) slab_free(accs[i], sizeof(account_t));
+  }
+}
+
+static void bench_malloc_account(bench_ctx_t *ctx, size_t iters) {
+  (void)ctx;
+  account_t *accs[BENCH_ALLOC_BATCH];
+  for (size_t done = 0; done < iters; done += BENCH_ALLOC_BATCH) {
+    for (size_t i = 0; i < BENCH_ALLOC_BATCH; i++) {
+      accs[i] = malloc(sizeof(account_t));
+      if (accs[i]) memset(accs[i], 0, sizeof(account_t));
+    }
+    for (size_t i = 0; i < BENCH_ALLOC_BATCH; i++) {
+      if (accs[i]) memset(accs[i], 0, sizeof(account_t));
+      free(accs[i]);
+    }
+  }
+}
+
+static const bench_t benches[] = {
+  { "login.success", bench_login_success, 16 },
+  { "login.rejected", bench_login_rejected, 1024 },
+  { "store.get", bench_store_get, 4096 },
+  { "store.update", bench_store_update, 1024 },
+  { "store.update_cdc", bench_store_update_cdc, 1024 },
+  { "log.message", bench_log_message, 1024 },
+  { "sha512_crypt.batch", bench_sha512_crypt, BENCH_CRYPT_BATCH },
+  { "entropy.salt", bench_entropy_salt, 4096 },
+  { "stuffing.observe", bench_stuffing_observe, 4096 },
+  { "slab.account", bench_slab_account, BENCH_ALLOC_BATCH },
+  { "malloc.account", bench_malloc_account, BENCH_ALLOC_BATCH },
+};
+
+static bool setup(bench_ctx_t *ctx) {
+  ctx->rng = 0x9e3779b97f4a7c15u;
+  ctx->null_fd = open("/dev/null", O_WRONLY);
+  ctx->store = account_store_create(BENCH_ACCOUNTS);
+  ctx->userids = calloc(BENCH_ACCOUNTS, sizeof *ctx->userids);
+  // flag-only and never installed, so the login benchmarks don't see it
+  stuffing_config_t stuffing_config;
+  stuffing_config_defaults(&stuffing_config);
+  stuffing_config.block = false;
+  ctx->stuffing = stuffing_detector_create(&stuffing_config);
+  account_cdc_config_t cdc_config;
+  account_cdc_config_defaults(&cdc_config);
+  ctx->cdc = account_cdc_create(&cdc_config);
+  if (ctx->null_fd < 0 || !ctx->store || !ctx->userids || !ctx->stuffing || !ctx->cdc) return false;
+
+  sha512_crypt_job_t job = { .key = BENCH_PASSWORD, .setting = BENCH_SETTING };
+  sha512_crypt_many(&job, 1);
+  if (!job.ok) return false;
+
+  // every third account is banned and every third expired, for login.rejected
+  time_t now = time(NULL);
+  for (size_t i = 0; i < BENCH_ACCOUNTS; i++) {
+    account_t acc = {0};
+    snprintf(ctx->userids[i], USER_ID_LENGTH, "bench-%zu", i);
+    memcpy(acc.userid, ctx->userids[i], USER_ID_LENGTH);
+    memcpy(acc.password_hash, job.output, strlen(job.output));
+    memcpy(acc.birthdate, "1990-01-01", BIRTHDATE_LENGTH);
+    acc.account_id = (int64_t)i + 1;
+    if (i % 3 == 1) acc.unban_time = now + 24 * 3600;
+    if (i % 3 == 2) acc.expiration_time = now - 24 * 3600;
+    if (!account_store_put(ctx->store, &acc)) return false;
+  }
+  account_store_set_default(ctx->store);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = 1.0;
+  const char *filter = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "T:f:h")) != -1) {
+    switch (opt) {
+      case 'T': seconds = atof(optarg); break;
+      case 'f': filter = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-T SECS] [-f NAME]\n"
+                        "  -T SECS   time to run each benchmark (default 1)\n"
+                        "  -f NAME   only run benchmarks whose name contains NAME\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (seconds <= 0) {
+    fprintf(stderr, "%s: -T must be positive\n", argv[0]);
+    return 1;
+  }
+
+  // handle_login() and log_message() write to stdout and stderr; keep
+  // the real stdout for the results
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  bench_ctx_t ctx;
+  if (!out || !setup(&ctx)) {
+    fprintf(stderr, "%s: setup failed\n", argv[0]);
+    return 1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  dup2(ctx.null_fd, STDOUT_FILENO);
+  dup2(ctx.null_fd, STDERR_FILENO);
+
+  uint64_t budget = (uint64_t)(seconds * 1e9);
+  for (size_t b = 0; b < sizeof benches / sizeof benches[0]; b++) {
+    const bench_t *bench = &benches[b];
+    if (filter && !strstr(bench->name, filter)) continue;
+
+    size_t ops = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+      bench->fn(&ctx, bench->batch);
+      ops += bench->batch;
+      elapsed = now_ns() - start;
+    } while (elapsed < budget);
+    fprintf(out, "%-20s %14.0f\n", bench->name, (double)ops * 1e9 / (double)elapsed);
+    fflush(out);
+  }
+
+  account_store_set_default(NULL);
+  account_store_free(ctx.store);
+  free(ctx.userids);
+  close(ctx.null_fd);
+  fclose(out);
+  return 0;
+}
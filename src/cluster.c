@@ -0,0 +1,680 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "cluster.h"
+#include "hash_ring.h"
+#include "logging.h"
+
+#include <crypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PASSWORD_MAX CRYPT_MAX_PASSPHRASE_SIZE
+#define POOL_MAX_IDLE 32
+
+////
+// Encoding
+
+// The userid comes first so that routers can route PUT_ACCOUNT
+// requests the same way as every other userid-keyed request.
+void cluster_encode_account(wire_writer_t *w, const account_t *acc) {
+  wire_put_str(w, acc->userid, USER_ID_LENGTH);
+  wire_put_i64(w, acc->account_id);
+  wire_put_str(w, acc->password_hash, HASH_LENGTH);
+  wire_put_str(w, acc->email, EMAIL_LENGTH);
+  wire_put_i64(w, (int64_t)acc->unban_time);
+  wire_put_i64(w, (int64_t)acc->expiration_time);
+  wire_put_u32(w, acc->login_count);
+  wire_put_u32(w, acc->login_fail_count);
+  wire_put_i64(w, (int64_t)acc->last_login_time);
+  wire_put_u32(w, acc->last_ip);
+  wire_put_bytes(w, acc->birthdate, BIRTHDATE_LENGTH);
+}
+
+bool cluster_decode_account(wire_reader_t *r, account_t *acc) {
+  memset(acc, 0, sizeof *acc);
+  wire_get_str(r, acc->userid, sizeof acc->userid);
+  acc->account_id = wire_get_i64(r);
+  wire_get_str(r, acc->password_hash, sizeof acc->password_hash);
+  wire_get_str(r, acc->email, sizeof acc->email);
+  acc->unban_time = (time_t)wire_get_i64(r);
+  acc->expiration_time = (time_t)wire_get_i64(r);
+  acc->login_count = wire_get_u32(r);
+  acc->login_fail_count = wire_get_u32(r);
+  acc->last_login_time = (time_t)wire_get_i64(r);
+  acc->last_ip = wire_get_u32(r);
+  wire_get_bytes(r, acc->birthdate, BIRTHDATE_LENGTH);
+  return !r->error;
+}
+
+////
+// Node
+
+typedef struct {
+  int fd;
+  bool ok;
+} list_send_t;
+
+static bool send_listed_account(const account_t *acc, void *arg) {
+  list_send_t *ls = arg;
+  wire_writer_t w;
+  wire_writer_init(&w);
+  cluster_encode_account(&w, acc);
+  ls->ok = wire_send(ls->fd, CLUSTER_MSG_ACCOUNT, &w);
+  memset(&w, 0, sizeof w);
+  return ls->ok;
+}
+
+/**
+ * Handle one request on a node. Returns false if the connection
+ * should be closed.
+ */
+static bool node_handle(int fd, account_store_t *store, int log_fd, uint8_t type, wire_reader_t *r) {
+  wire_writer_t w;
+  wire_writer_init(&w);
+
+  switch (type) {
+    case CLUSTER_MSG_LOGIN: {
+      char userid[USER_ID_LENGTH];
+      char password[PASSWORD_MAX];
+      wire_get_str(r, userid, sizeof userid);
+      wire_get_str(r, password, sizeof password);
+      ip4_addr_t ip = wire_get_u32(r);
+      time_t login_time = (time_t)wire_get_i64(r);
+      if (!wire_reader_done(r)) {
+        memset(password, 0, sizeof password);
+        return wire_send(fd, CLUSTER_MSG_ERROR, NULL);
+      }
+
+      login_session_data_t session = { .account_id = SESSION_INVALID_ACCOUNT_ID };
+      login_result_t res = handle_login(userid, password, ip, login_time, log_fd, log_fd, &session);
+      memset(password, 0, sizeof password);
+
+      wire_put_u8(&w, (uint8_t)res);
+      wire_put_i64(&w, session.account_id);
+      wire_put_i64(&w, (int64_t)session.session_start);
+      wire_put_i64(&w, (int64_t)session.expiration_time);
+      return wire_send(fd, CLUSTER_MSG_LOGIN_RESULT, &w);
+    }
+
+    case CLUSTER_MSG_PUT_ACCOUNT: {
+      account_t acc;
+      bool ok = cluster_decode_account(r, &acc) && wire_reader_done(r) &&
+                account_store_put(store, &acc);
+      memset(&acc, 0, sizeof acc);
+      return wire_send(fd, ok ? CLUSTER_MSG_OK : CLUSTER_MSG_ERROR, NULL);
+    }
+
+    case CLUSTER_MSG_GET_ACCOUNT: {
+      char userid[USER_ID_LENGTH];
+      wire_get_str(r, userid, sizeof userid);
+      if (!wire_reader_done(r)) return wire_send(fd, CLUSTER_MSG_ERROR, NULL);
+
+      account_t acc;
+      if (!account_store_get(store, userid, &acc)) return wire_send(fd, CLUSTER_MSG_NOT_FOUND, NULL);
+      cluster_encode_account(&w, &acc);
+      memset(&acc, 0, sizeof acc);
+      bool ok = wire_send(fd, CLUSTER_MSG_ACCOUNT, &w);
+      memset(&w, 0, sizeof w);
+      return ok;
+    }
+
+    case CLUSTER_MSG_DROP_ACCOUNT: {
+      char userid[USER_ID_LENGTH];
+      wire_get_str(r, userid, sizeof userid);
+      if (!wire_reader_done(r)) return wire_send(fd, CLUSTER_MSG_ERROR, NULL);
+      bool found = account_store_remove(store, userid);
+      return wire_send(fd, found ? CLUSTER_MSG_OK : CLUSTER_MSG_NOT_FOUND, NULL);
+    }
+
+    case CLUSTER_MSG_LIST_ACCOUNTS: {
+      list_send_t ls = { .fd = fd, .ok = true };
+      account_store_foreach(store, send_listed_account, &ls);
+      return ls.ok && wire_send(fd, CLUSTER_MSG_END, NULL);
+    }
+
+    default:
+      log_message(LOG_WARN, "cluster node: unexpected message type %u.", type);
+      return wire_send(fd, CLUSTER_MSG_ERROR, NULL);
+  }
+}
+
+void cluster_node_serve(int fd, account_store_t *store, int log_fd) {
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  while (wire_recv(fd, &type, buf, sizeof buf, &len)) {
+    wire_reader_t r;
+    wire_reader_init(&r, buf, len);
+    bool keep = node_handle(fd, store, log_fd, type, &r);
+    memset(buf, 0, len);   // may have held a password
+    if (!keep) break;
+  }
+}
+
+////
+// Client calls
+
+// send a request and receive its single reply frame
+static bool call(int fd, uint8_t type, const wire_writer_t *req,
+                 uint8_t *reply_type, uint8_t *buf, size_t *len) {
+  return wire_send(fd, type, req) && wire_recv(fd, reply_type, buf, WIRE_MAX_FRAME, len);
+}
+
+static bool call_userid(int fd, uint8_t type, const char *userid, uint8_t *reply_type,
+                        uint8_t *buf, size_t *len) {
+  wire_writer_t w;
+  wire_writer_init(&w);
+  wire_put_str(&w, userid, USER_ID_LENGTH);
+  return call(fd, type, &w, reply_type, buf, len);
+}
+
+bool cluster_login(int fd, const char *userid, const char *password, ip4_addr_t client_ip,
+                   time_t login_time, login_result_t *result, login_session_data_t *session) {
+  if (!userid || !password || !result) return false;
+
+  wire_writer_t w;
+  wire_writer_init(&w);
+  wire_put_str(&w, userid, USER_ID_LENGTH);
+  wire_put_str(&w, password, PASSWORD_MAX);
+  wire_put_u32(&w, client_ip);
+  wire_put_i64(&w, (int64_t)login_time);
+
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  bool ok = call(fd, CLUSTER_MSG_LOGIN, &w, &type, buf, &len);
+  memset(&w, 0, sizeof w);
+  if (!ok || type != CLUSTER_MSG_LOGIN_RESULT) return false;
+
+  wire_reader_t r;
+  wire_reader_init(&r, buf, len);
+  uint8_t res = wire_get_u8(&r);
+  int64_t account_id = wire_get_i64(&r);
+  time_t start = (time_t)wire_get_i64(&r);
+  time_t expiry = (time_t)wire_get_i64(&r);
+  if (!wire_reader_done(&r) || res > LOGIN_FAIL_INTERNAL_ERROR) return false;
+
+  *result = (login_result_t)res;
+  if (session && *result == LOGIN_SUCCESS) {
+    session->account_id = (int)account_id;
+    session->session_start = start;
+    session->expiration_time = expiry;
+  }
+  return true;
+}
+
+bool cluster_put_account(int fd, const account_t *acc) {
+  if (!acc) return false;
+  wire_writer_t w;
+  wire_writer_init(&w);
+  cluster_encode_account(&w, acc);
+
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  bool ok = call(fd, CLUSTER_MSG_PUT_ACCOUNT, &w, &type, buf, &len);
+  memset(&w, 0, sizeof w);
+  return ok && type == CLUSTER_MSG_OK;
+}
+
+bool cluster_get_account(int fd, const char *userid, account_t *acc, bool *found) {
+  if (!userid || !acc || !found) return false;
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  if (!call_userid(fd, CLUSTER_MSG_GET_ACCOUNT, userid, &type, buf, &len)) return false;
+
+  *found = type == CLUSTER_MSG_ACCOUNT;
+  if (type == CLUSTER_MSG_NOT_FOUND) return true;
+  if (type != CLUSTER_MSG_ACCOUNT) return false;
+
+  wire_reader_t r;
+  wire_reader_init(&r, buf, len);
+  bool ok = cluster_decode_account(&r, acc) && wire_reader_done(&r);
+  memset(buf, 0, len);
+  return ok;
+}
+
+bool cluster_drop_account(int fd, const char *userid) {
+  if (!userid) return false;
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  return call_userid(fd, CLUSTER_MSG_DROP_ACCOUNT, userid, &type, buf, &len) &&
+         (type == CLUSTER_MSG_OK || type == CLUSTER_MSG_NOT_FOUND);
+}
+
+bool cluster_list_accounts(int fd, cluster_account_fn fn, void *arg) {
+  if (!fn || !wire_send(fd, CLUSTER_MSG_LIST_ACCOUNTS, NULL)) return false;
+
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  bool keep = true;
+  // keep draining after fn asks to stop, so the connection stays usable
+  while (wire_recv(fd, &type, buf, sizeof buf, &len)) {
+    if (type == CLUSTER_MSG_END) return true;
+    if (type != CLUSTER_MSG_ACCOUNT) return false;
+
+    wire_reader_t r;
+    wire_reader_init(&r, buf, len);
+    account_t acc;
+    if (!cluster_decode_account(&r, &acc) || !wire_reader_done(&r)) return false;
+    if (keep) keep = fn(&acc, arg);
+    memset(&acc, 0, sizeof acc);
+  }
+  return false;
+}
+
+static bool call_membership(int fd, uint8_t type, const char *node_addr) {
+  if (!node_addr) return false;
+  wire_writer_t w;
+  wire_writer_init(&w);
+  wire_put_str(&w, node_addr, HASH_RING_NODE_NAME_MAX);
+
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t reply;
+  size_t len;
+  return call(fd, type, &w, &reply, buf, &len) && reply == CLUSTER_MSG_OK;
+}
+
+bool cluster_node_join(int fd, const char *node_addr) {
+  return call_membership(fd, CLUSTER_MSG_NODE_JOIN, node_addr);
+}
+
+bool cluster_node_leave(int fd, const char *node_addr) {
+  return call_membership(fd, CLUSTER_MSG_NODE_LEAVE, node_addr);
+}
+
+////
+// Router
+
+typedef struct {
+  char addr[HASH_RING_NODE_NAME_MAX];
+  pthread_mutex_t lock;
+  int idle[POOL_MAX_IDLE];    // open connections not currently in use
+  size_t idle_count;
+} node_pool_t;
+
+struct cluster_router {
+  // Held for reading while a request is routed and forwarded, and for
+  // writing throughout a membership change, accounts and all, so no
+  // request is routed using a ring whose accounts are still being moved.
+  // Copying accounts outside it would let logins change them on their
+  // old node after they had been copied, and those changes would be
+  // lost; instead the router stalls for the length of the move.
+  pthread_rwlock_t lock;
+  hash_ring_t *ring;
+  node_pool_t **pools;
+  size_t pool_count;
+};
+
+static node_pool_t *pool_create(const char *addr) {
+  node_pool_t *pool = calloc(1, sizeof *pool);
+  if (!pool) {
+    log_message(LOG_ERROR, "cluster router: failed to allocate node pool.");
+    return NULL;
+  }
+  memcpy(pool->addr, addr, strlen(addr) + 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+static void pool_free(node_pool_t *pool) {
+  if (!pool) return;
+  for (size_t i = 0; i < pool->idle_count; i++) close(pool->idle[i]);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+static node_pool_t *router_pool(const cluster_router_t *router, const char *addr) {
+  for (size_t i = 0; i < router->pool_count; i++) {
+    if (strcmp(router->pools[i]->addr, addr) == 0) return router->pools[i];
+  }
+  return NULL;
+}
+
+static bool router_add_pool(cluster_router_t *router, const char *addr) {
+  node_pool_t *pool = pool_create(addr);
+  if (!pool) return false;
+  node_pool_t **pools = realloc(router->pools, (router->pool_count + 1) * sizeof *pools);
+  if (!pools) {
+    log_message(LOG_ERROR, "cluster router: failed to grow node pools.");
+    pool_free(pool);
+    return false;
+  }
+  router->pools = pools;
+  router->pools[router->pool_count++] = pool;
+  return true;
+}
+
+static void router_remove_pool(cluster_router_t *router, const char *addr) {
+  for (size_t i = 0; i < router->pool_count; i++) {
+    if (strcmp(router->pools[i]->addr, addr) == 0) {
+      pool_free(router->pools[i]);
+      router->pools[i] = router->pools[--router->pool_count];
+      return;
+    }
+  }
+}
+
+static int pool_take(node_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  int fd = pool->idle_count > 0 ? pool->idle[--pool->idle_count] : -1;
+  pthread_mutex_unlock(&pool->lock);
+  return fd >= 0 ? fd : wire_connect(pool->addr);
+}
+
+// return a connection to the pool; broken connections are closed instead
+static void pool_give(node_pool_t *pool, int fd, bool healthy) {
+  if (healthy) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count < POOL_MAX_IDLE) {
+      pool->idle[pool->idle_count++] = fd;
+      fd = -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  if (fd >= 0) close(fd);
+}
+
+cluster_router_t *cluster_router_create(const char *const *node_addrs, size_t node_count,
+                                        size_t vnodes) {
+  cluster_router_t *router = calloc(1, sizeof *router);
+  if (!router) {
+    log_message(LOG_ERROR, "cluster_router_create: failed to allocate.");
+    return NULL;
+  }
+  pthread_rwlock_init(&router->lock, NULL);
+  router->ring = hash_ring_create(vnodes);
+  if (!router->ring) {
+    cluster_router_free(router);
+    return NULL;
+  }
+  for (size_t i = 0; i < node_count; i++) {
+    if (!hash_ring_add(router->ring, node_addrs[i]) || !router_add_pool(router, node_addrs[i])) {
+      log_message(LOG_ERROR, "cluster_router_create: can't add node '%s'.", node_addrs[i]);
+      cluster_router_free(router);
+      return NULL;
+    }
+  }
+  return router;
+}
+
+void cluster_router_free(cluster_router_t *router) {
+  if (!router) return;
+  for (size_t i = 0; i < router->pool_count; i++) pool_free(router->pools[i]);
+  free(router->pools);
+  hash_ring_free(router->ring);
+  pthread_rwlock_destroy(&router->lock);
+  free(router);
+}
+
+/**
+ * Forward one userid-keyed request to its owning node and relay the
+ * reply. Returns false if the client connection should be closed.
+ */
+static bool router_forward(cluster_router_t *router, int client_fd, uint8_t type,
+                           const uint8_t *buf, size_t len) {
+  wire_reader_t r;
+  wire_reader_init(&r, buf, len);
+  char userid[USER_ID_LENGTH];
+  wire_get_str(&r, userid, sizeof userid);
+  if (r.error) return wire_send(client_fd, CLUSTER_MSG_ERROR, NULL);
+
+  wire_writer_t w;
+  wire_writer_init(&w);
+  wire_put_bytes(&w, buf, len);
+
+  uint8_t reply[WIRE_MAX_FRAME];
+  uint8_t reply_type = CLUSTER_MSG_ERROR;
+  size_t reply_len = 0;
+
+  pthread_rwlock_rdlock(&router->lock);
+  const char *owner = hash_ring_owner(router->ring, userid);
+  node_pool_t *pool = owner ? router_pool(router, owner) : NULL;
+  if (pool) {
+    int fd = pool_take(pool);
+    bool ok = fd >= 0 && call(fd, type, &w, &reply_type, reply, &reply_len);
+    if (fd >= 0) pool_give(pool, fd, ok);
+    if (!ok) {
+      log_message(LOG_ERROR, "cluster router: request to node '%s' failed.", owner);
+      reply_type = CLUSTER_MSG_ERROR;
+      reply_len = 0;
+    }
+  }
+  pthread_rwlock_unlock(&router->lock);
+  memset(&w, 0, sizeof w);
+
+  wire_writer_init(&w);
+  wire_put_bytes(&w, reply, reply_len);
+  bool sent = wire_send(client_fd, reply_type, &w);
+  memset(reply, 0, reply_len);
+  return sent;
+}
+
+void cluster_router_serve(cluster_router_t *router, int fd) {
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  while (wire_recv(fd, &type, buf, sizeof buf, &len)) {
+    bool keep;
+    switch (type) {
+      case CLUSTER_MSG_LOGIN:
+      case CLUSTER_MSG_PUT_ACCOUNT:
+      case CLUSTER_MSG_GET_ACCOUNT:
+      case CLUSTER_MSG_DROP_ACCOUNT:
+        keep = router_forward(router, fd, type, buf, len);
+        break;
+
+      case CLUSTER_MSG_NODE_JOIN:
+      case CLUSTER_MSG_NODE_LEAVE: {
+        wire_reader_t r;
+        wire_reader_init(&r, buf, len);
+        char addr[HASH_RING_NODE_NAME_MAX];
+        wire_get_str(&r, addr, sizeof addr);
+        bool ok = wire_reader_done(&r) &&
+                  (type == CLUSTER_MSG_NODE_JOIN ? cluster_router_join(router, addr)
+                                                 : cluster_router_leave(router, addr));
+        keep = wire_send(fd, ok ? CLUSTER_MSG_OK : CLUSTER_MSG_ERROR, NULL);
+        break;
+      }
+
+      default:
+        log_message(LOG_WARN, "cluster router: unexpected message type %u.", type);
+        keep = wire_send(fd, CLUSTER_MSG_ERROR, NULL);
+        break;
+    }
+    memset(buf, 0, len);
+    if (!keep) break;
+  }
+}
+
+////
+// Rebalancing
+
+typedef struct {
+  account_t *accounts;
+  size_t count;
+  size_t capacity;
+  const hash_ring_t *ring;
+  const char *only_owner;   // if set, collect only accounts this node now owns
+  const char *only_from;    // if set, and that this node owned before only_owner
+  bool failed;
+} account_batch_t;
+
+static bool collect_account(const account_t *acc, void *arg) {
+  account_batch_t *b = arg;
+  if (b->only_owner && strcmp(hash_ring_owner(b->ring, acc->userid), b->only_owner) != 0) {
+    return true;
+  }
+  if (b->only_from) {
+    const char *was = hash_ring_owner_without(b->ring, acc->userid, b->only_owner);
+    if (!was || strcmp(was, b->only_from) != 0) return true;
+  }
+  if (b->count == b->capacity) {
+    size_t capacity = b->capacity ? b->capacity * 2 : 256;
+    account_t *accounts = realloc(b->accounts, capacity * sizeof *accounts);
+    if (!accounts) {
+      log_message(LOG_ERROR, "cluster router: failed to allocate while moving accounts.");
+      b->failed = true;
+      return false;
+    }
+    b->accounts = accounts;
+    b->capacity = capacity;
+  }
+  b->accounts[b->count++] = *acc;
+  return true;
+}
+
+static void batch_free(account_batch_t *b) {
+  if (b->accounts) memset(b->accounts, 0, b->capacity * sizeof *b->accounts);
+  free(b->accounts);
+  b->accounts = NULL;
+  b->count = b->capacity = 0;
+}
+
+// list a node's accounts into `b`, subject to b->only_owner and b->only_from
+static bool collect_from(const char *addr, account_batch_t *b) {
+  int fd = wire_connect(addr);
+  if (fd < 0) return false;
+  bool ok = cluster_list_accounts(fd, collect_account, b) && !b->failed;
+  close(fd);
+  return ok;
+}
+
+bool cluster_router_join(cluster_router_t *router, const char *node_addr) {
+  if (!router || !node_addr) return false;
+
+  pthread_rwlock_wrlock(&router->lock);
+  if (hash_ring_contains(router->ring, node_addr)) {
+    pthread_rwlock_unlock(&router->lock);
+    log_message(LOG_WARN, "cluster router: node '%s' is already a member.", node_addr);
+    return false;
+  }
+
+  int dst = wire_connect(node_addr);
+  size_t old_count = hash_ring_node_count(router->ring);
+  char (*old_nodes)[HASH_RING_NODE_NAME_MAX] = malloc((old_count + 1) * sizeof *old_nodes);
+  if (dst < 0 || !old_nodes || !hash_ring_add(router->ring, node_addr)) {
+    if (dst >= 0) close(dst);
+    free(old_nodes);
+    pthread_rwlock_unlock(&router->lock);
+    return false;
+  }
+  for (size_t i = 0; i < old_count; i++) {
+    // the new node was appended, so the first old_count nodes are the old ones
+    memcpy(old_nodes[i], hash_ring_node(router->ring, i), HASH_RING_NODE_NAME_MAX);
+  }
+
+  // Copy first, drop afterwards: if anything fails before the new node
+  // holds its whole shard, take it back off the ring and every account
+  // is still where the old ring says it is. Each account comes from its
+  // owner before the join; a copy anywhere else is stale (drops are best
+  // effort) and would roll back the live record.
+  account_batch_t *moved = calloc(old_count ? old_count : 1, sizeof *moved);
+  bool ok = moved != NULL;
+  size_t total = 0;
+  for (size_t i = 0; ok && i < old_count; i++) {
+    moved[i].ring = router->ring;
+    moved[i].only_owner = node_addr;
+    moved[i].only_from = old_nodes[i];
+    ok = collect_from(old_nodes[i], &moved[i]);
+    for (size_t j = 0; ok && j < moved[i].count; j++) {
+      ok = cluster_put_account(dst, &moved[i].accounts[j]);
+    }
+    total += moved[i].count;
+  }
+  ok = ok && router_add_pool(router, node_addr);
+
+  if (!ok) {
+    hash_ring_remove(router->ring, node_addr);
+    log_message(LOG_ERROR, "cluster router: join of '%s' failed; ring unchanged.", node_addr);
+  } else {
+    for (size_t i = 0; i < old_count; i++) {
+      if (moved[i].count == 0) continue;
+      int src = wire_connect(old_nodes[i]);
+      for (size_t j = 0; src >= 0 && j < moved[i].count; j++) {
+        if (!cluster_drop_account(src, moved[i].accounts[j].userid)) {
+          // harmless: the stale copy is never routed to
+          log_message(LOG_WARN, "cluster router: couldn't drop moved account from '%s'.", old_nodes[i]);
+          break;
+        }
+      }
+      if (src >= 0) close(src);
+    }
+    log_message(LOG_INFO, "cluster router: node '%s' joined; moved %zu accounts.", node_addr, total);
+  }
+
+  for (size_t i = 0; moved && i < old_count; i++) batch_free(&moved[i]);
+  free(moved);
+  free(old_nodes);
+  close(dst);
+  pthread_rwlock_unlock(&router->lock);
+  return ok;
+}
+
+bool cluster_router_leave(cluster_router_t *router, const char *node_addr) {
+  if (!router || !node_addr) return false;
+
+  pthread_rwlock_wrlock(&router->lock);
+  if (!hash_ring_contains(router->ring, node_addr) || hash_ring_node_count(router->ring) < 2) {
+    pthread_rwlock_unlock(&router->lock);
+    log_message(LOG_WARN, "cluster router: can't remove node '%s'.", node_addr);
+    return false;
+  }
+
+  // Only what the node owns moves. Anything else it holds is a stale
+  // copy (a join's drop is best effort), and putting it would roll back
+  // the live record on its owner.
+  account_batch_t all = {0};
+  bool ok = collect_from(node_addr, &all);
+  size_t owned = 0;
+  for (size_t j = 0; ok && j < all.count; j++) {
+    if (strcmp(hash_ring_owner(router->ring, all.accounts[j].userid), node_addr) != 0) continue;
+    account_t acc = all.accounts[owned];
+    all.accounts[owned++] = all.accounts[j];
+    all.accounts[j] = acc;
+    memset(&acc, 0, sizeof acc);
+  }
+  hash_ring_remove(router->ring, node_addr);
+
+  size_t n = hash_ring_node_count(router->ring);
+  int *dst = malloc(n * sizeof *dst);
+  ok = ok && dst != NULL;
+  for (size_t i = 0; ok && i < n; i++) dst[i] = -1;
+
+  for (size_t j = 0; ok && j < owned; j++) {
+    const char *owner = hash_ring_owner(router->ring, all.accounts[j].userid);
+    size_t i = 0;
+    while (strcmp(hash_ring_node(router->ring, i), owner) != 0) i++;
+    if (dst[i] < 0) dst[i] = wire_connect(owner);
+    ok = dst[i] >= 0 && cluster_put_account(dst[i], &all.accounts[j]);
+  }
+  for (size_t i = 0; dst && i < n; i++) {
+    if (dst[i] >= 0) close(dst[i]);
+  }
+
+  if (!ok) {
+    // placement is deterministic, so re-adding restores the old ownership
+    hash_ring_add(router->ring, node_addr);
+    log_message(LOG_ERROR, "cluster router: leave of '%s' failed; ring unchanged.", node_addr);
+  } else {
+    router_remove_pool(router, node_addr);
+    // clear the departed node of everything, moved or stale, so it holds
+    // nothing stale if it rejoins; best effort, since it no longer owns anything
+    int src = wire_connect(node_addr);
+    for (size_t j = 0; src >= 0 && j < all.count; j++) {
+      if (!cluster_drop_account(src, all.accounts[j].userid)) break;
+    }
+    if (src >= 0) close(src);
+    log_message(LOG_INFO, "cluster router: node '%s' left; moved %zu accounts.", node_addr, owned);
+  }
+
+  free(dst);
+  batch_free(&all);
+  pthread_rwlock_unlock(&router->lock);
+  return ok;
+}
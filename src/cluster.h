@@ -0,0 +1,132 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "account.h"
+#include "account_store.h"
+#include "login.h"
+#include "wire.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file cluster.h
+ * @brief Sharded login cluster: node service, router and client calls.
+ *
+ * Accounts are sharded over login nodes by consistent hashing of userid
+ * (see hash_ring.h). Each node keeps its shard in an account store and
+ * answers requests using the framed protocol from wire.h. A router
+ * accepts the same requests from clients and forwards each one to the
+ * node owning its userid, so clients only need the router's address.
+ *
+ * When a node joins or leaves, the router moves the affected accounts
+ * between nodes before routing any further requests. Requests that
+ * arrive during a move wait for it to finish: the router routes nothing
+ * while it copies, which takes time in proportion to the accounts
+ * moved, so membership changes belong in quiet periods.
+ *
+ * Every request gets exactly one reply frame, except LIST_ACCOUNTS,
+ * which is answered by a stream of ACCOUNT frames ended by END.
+ */
+
+typedef enum {
+  // requests
+  CLUSTER_MSG_LOGIN = 1,        // userid, password, client_ip u32, login_time i64
+  CLUSTER_MSG_PUT_ACCOUNT,      // account
+  CLUSTER_MSG_GET_ACCOUNT,      // userid
+  CLUSTER_MSG_DROP_ACCOUNT,     // userid
+  CLUSTER_MSG_LIST_ACCOUNTS,    // (empty); nodes only
+  CLUSTER_MSG_NODE_JOIN,        // node address; routers only
+  CLUSTER_MSG_NODE_LEAVE,       // node address; routers only
+
+  // replies
+  CLUSTER_MSG_LOGIN_RESULT = 64,  // result u8, account_id i64, session_start i64, expiration i64
+  CLUSTER_MSG_ACCOUNT,            // account
+  CLUSTER_MSG_END,
+  CLUSTER_MSG_OK,
+  CLUSTER_MSG_NOT_FOUND,
+  CLUSTER_MSG_ERROR
+} cluster_msg_t;
+
+typedef bool (*cluster_account_fn)(const account_t *acc, void *arg);
+
+////
+// Encoding
+
+void cluster_encode_account(wire_writer_t *w, const account_t *acc);
+
+// decode an account; returns false on a malformed payload
+bool cluster_decode_account(wire_reader_t *r, account_t *acc);
+
+////
+// Node
+
+/**
+ * Serve requests on a connected socket until the peer disconnects.
+ *
+ * Accounts are kept in `store`, which must also be the default store
+ * (see account_store_set_default()) so that handle_login() finds them.
+ * handle_login() output for the client and the log goes to `log_fd`.
+ */
+void cluster_node_serve(int fd, account_store_t *store, int log_fd);
+
+////
+// Client calls; usable against a node or a router.
+// Each returns false on a connection or protocol error.
+
+/**
+ * Log in over the connection. On success *result holds the login
+ * result, and *session is filled in when it is LOGIN_SUCCESS.
+ */
+bool cluster_login(int fd, const char *userid, const char *password, ip4_addr_t client_ip,
+                   time_t login_time, login_result_t *result, login_session_data_t *session);
+
+bool cluster_put_account(int fd, const account_t *acc);
+
+// *found says whether the account exists
+bool cluster_get_account(int fd, const char *userid, account_t *acc, bool *found);
+
+bool cluster_drop_account(int fd, const char *userid);
+
+// call fn on every account held by a node
+bool cluster_list_accounts(int fd, cluster_account_fn fn, void *arg);
+
+// ask a router to add or remove a node, rebalancing accounts
+bool cluster_node_join(int fd, const char *node_addr);
+bool cluster_node_leave(int fd, const char *node_addr);
+
+////
+// Router
+
+typedef struct cluster_router cluster_router_t;
+
+/**
+ * Create a router over the given nodes, with `vnodes` ring points per
+ * node. The nodes are assumed to already hold their shards.
+ */
+cluster_router_t *cluster_router_create(const char *const *node_addrs, size_t node_count,
+                                        size_t vnodes);
+
+void cluster_router_free(cluster_router_t *router);
+
+// serve requests on a connected client socket until it disconnects
+void cluster_router_serve(cluster_router_t *router, int fd);
+
+/**
+ * Add a node and move to it every account it now owns, each from the
+ * node that owned it before; copies other nodes hold are stale and are
+ * left alone. Every request through the router waits until this returns.
+ * Returns false if the node is already present or a move fails.
+ */
+bool cluster_router_join(cluster_router_t *router, const char *node_addr);
+
+/**
+ * Move every account a node owns onto the remaining nodes, then remove
+ * it and clear it. Copies it holds of accounts owned elsewhere are
+ * stale, and are dropped rather than moved. Every request through the
+ * router waits until this returns.
+ * Returns false if the node isn't present, is the last node, or a move fails.
+ */
+bool cluster_router_leave(cluster_router_t *router, const char *node_addr);
+
+#endif // CLUSTER_H
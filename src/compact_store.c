@@ -0,0 +1,790 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "compact_store.h"
+#include "account_cache.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_BITS 22
+#define CHUNK_BYTES ((size_t)1 << CHUNK_BITS)   // arena chunk; records never straddle two
+#define RECORD_MAX 512                          // longest possible encoded record
+
+// Index entries pack (tag << 48) | ref, where ref is (chunk << CHUNK_BITS)
+// | offset of the record, and tag is the top of the userid hash with the
+// low bit set, so no entry is ever INDEX_EMPTY or INDEX_TOMBSTONE.
+#define INDEX_EMPTY 0
+#define INDEX_TOMBSTONE 1
+#define TAG_SHIFT 48
+#define REF_MASK ((UINT64_C(1) << TAG_SHIFT) - 1)
+
+// record flags
+enum {
+  REC_BIRTHDATE_PACKED = 1,   // birthdate is YYYY-MM-DD, stored as the number YYYYMMDD
+  REC_HASH_PACKED = 2,        // hash is prefix id + packed salt and hash digits
+  REC_EMAIL_DOMAIN = 4,       // email is local part + '@' + domain id
+};
+
+/*
+ * Interned strings (email domains and hash prefixes). Ids start at 1;
+ * strings are never removed.
+ */
+typedef struct {
+  char *bytes;                // the strings, each NUL-terminated
+  size_t bytes_used;
+  size_t bytes_capacity;
+  size_t *offsets;            // offsets[id - 1]: where string `id` starts in bytes
+  size_t count;
+  size_t offsets_capacity;
+  uint32_t *map;              // open addressing, by string hash: id, or 0 if empty
+  size_t map_capacity;        // always a power of two
+} intern_pool_t;
+
+struct compact_store {
+  pthread_rwlock_t lock;
+
+  uint8_t **chunks;
+  size_t chunk_count;
+  size_t chunk_capacity;
+  size_t chunk_used;          // bytes used in the last chunk
+
+  uint64_t *index;
+  size_t index_capacity;      // always a power of two
+  size_t index_used;          // live entries plus tombstones
+  size_t count;
+
+  size_t live_bytes;          // bytes of records the index points to
+  size_t dead_bytes;          // bytes of replaced and removed records
+
+  intern_pool_t strings;
+
+  account_cache_t *cache;     // refreshed after changes; NULL if none
+};
+
+static compact_store_t *_Atomic default_compact = NULL;
+
+static size_t round_up_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+////
+// Encoding helpers
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, uint64_t *v) {
+  uint64_t result = 0;
+  unsigned shift = 0;
+  uint8_t b;
+  do {
+    b = *p++;
+    result |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  *v = result;
+  return p;
+}
+
+// signed values as small varints whether positive or negative
+static uint64_t zigzag(int64_t v) {
+  return v < 0 ? ~((uint64_t)v << 1) : (uint64_t)v << 1;
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (v & 1) ? -(int64_t)(v >> 1) - 1 : (int64_t)(v >> 1);
+}
+
+static const char b64_digits[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+static int b64_value(char c) {
+  if (c == '.') return 0;
+  if (c == '/') return 1;
+  if (c >= '0' && c <= '9') return c - '0' + 2;
+  if (c >= 'A' && c <= 'Z') return c - 'A' + 12;
+  if (c >= 'a' && c <= 'z') return c - 'a' + 38;
+  return -1;
+}
+
+////
+// Interned strings
+
+static uint64_t string_hash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static const char *intern_string(const intern_pool_t *pool, uint32_t id) {
+  return pool->bytes + pool->offsets[id - 1];
+}
+
+static bool intern_grow_map(intern_pool_t *pool) {
+  size_t capacity = pool->map_capacity ? pool->map_capacity * 2 : 64;
+  uint32_t *map = calloc(capacity, sizeof *map);
+  if (!map) return false;
+  for (size_t id = 1; id <= pool->count; id++) {
+    const char *s = intern_string(pool, (uint32_t)id);
+    size_t pos = (size_t)string_hash(s, strlen(s)) & (capacity - 1);
+    while (map[pos]) pos = (pos + 1) & (capacity - 1);
+    map[pos] = (uint32_t)id;
+  }
+  free(pool->map);
+  pool->map = map;
+  pool->map_capacity = capacity;
+  return true;
+}
+
+// id of the string s[0..len), adding it if new; 0 on allocation failure
+static uint32_t intern(intern_pool_t *pool, const char *s, size_t len) {
+  if ((pool->count + 1) * 2 > pool->map_capacity && !intern_grow_map(pool)) return 0;
+
+  size_t mask = pool->map_capacity - 1;
+  size_t pos = (size_t)string_hash(s, len) & mask;
+  for (; pool->map[pos]; pos = (pos + 1) & mask) {
+    const char *t = intern_string(pool, pool->map[pos]);
+    if (strncmp(t, s, len) == 0 && t[len] == '\0') return pool->map[pos];
+  }
+  if (pool->count >= UINT32_MAX - 1) return 0;
+
+  if (pool->bytes_used + len + 1 > pool->bytes_capacity) {
+    size_t capacity = pool->bytes_capacity ? pool->bytes_capacity * 2 : 4096;
+    while (capacity < pool->bytes_used + len + 1) capacity *= 2;
+    char *bytes = realloc(pool->bytes, capacity);
+    if (!bytes) return 0;
+    pool->bytes = bytes;
+    pool->bytes_capacity = capacity;
+  }
+  if (pool->count == pool->offsets_capacity) {
+    size_t capacity = pool->offsets_capacity ? pool->offsets_capacity * 2 : 64;
+    size_t *offsets = realloc(pool->offsets, capacity * sizeof *offsets);
+    if (!offsets) return 0;
+    pool->offsets = offsets;
+    pool->offsets_capacity = capacity;
+  }
+
+  memcpy(pool->bytes + pool->bytes_used, s, len);
+  pool->bytes[pool->bytes_used + len] = '\0';
+  pool->offsets[pool->count] = pool->bytes_used;
+  pool->bytes_used += len + 1;
+  pool->count++;
+  pool->map[pos] = (uint32_t)pool->count;
+  return (uint32_t)pool->count;
+}
+
+static void intern_free(intern_pool_t *pool) {
+  free(pool->bytes);
+  free(pool->offsets);
+  free(pool->map);
+}
+
+////
+// Records
+
+/*
+ * A record is a varint length followed by that many bytes:
+ *
+ *     flags
+ *     userid length, userid
+ *     account_id, unban_time, expiration_time, last_login_time (zigzag varints)
+ *     login_count, login_fail_count, last_ip (varints)
+ *     birthdate: YYYYMMDD varint if REC_BIRTHDATE_PACKED, else 10 raw bytes
+ *     email: [domain id if REC_EMAIL_DOMAIN], local part length, local part
+ *     hash: if REC_HASH_PACKED, prefix id, salt digits, hash digits, then
+ *           the digits at 6 bits each; else length, raw bytes
+ *
+ * The userid comes first so lookups can compare it without decoding
+ * the rest.
+ */
+
+static bool birthdate_packable(const char *b) {
+  for (int i = 0; i < BIRTHDATE_LENGTH; i++) {
+    bool dash = i == 4 || i == 7;
+    if (dash ? b[i] != '-' : (b[i] < '0' || b[i] > '9')) return false;
+  }
+  return true;
+}
+
+/*
+ * Split a crypt hash as <prefix>A$B, where the prefix runs up to its
+ * second-last '$' (e.g. "$y$jBT$") and A and B (salt and hash) are all
+ * base-64 digits. Returns false if the hash doesn't have that shape.
+ */
+static bool hash_split(const char *hash, size_t len, size_t *prefix_len, size_t *a_len) {
+  const char *last = NULL, *prev = NULL;
+  for (const char *p = hash; p < hash + len; p++) {
+    if (*p == '$') {
+      prev = last;
+      last = p;
+    }
+  }
+  if (!prev) return false;
+  for (const char *p = prev + 1; p < hash + len; p++) {
+    if (p != last && b64_value(*p) < 0) return false;
+  }
+  *prefix_len = (size_t)(prev - hash) + 1;
+  *a_len = (size_t)(last - prev) - 1;
+  return true;
+}
+
+// pack base-64 digits at 6 bits each, low bits first
+static uint8_t *pack_digits(uint8_t *p, const char *digits, size_t n) {
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  for (size_t i = 0; i < n; i++) {
+    acc |= (uint32_t)b64_value(digits[i]) << bits;
+    bits += 6;
+    while (bits >= 8) {
+      *p++ = (uint8_t)acc;
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) *p++ = (uint8_t)acc;
+  return p;
+}
+
+static const uint8_t *unpack_digits(const uint8_t *p, char *out, size_t n) {
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (bits < 6) {
+      acc |= (uint32_t)*p++ << bits;
+      bits += 8;
+    }
+    out[i] = b64_digits[acc & 63];
+    acc >>= 6;
+    bits -= 6;
+  }
+  return p;
+}
+
+// Encode `acc` into `out` (RECORD_MAX bytes). Returns its length, or 0
+// if interning failed. Called with the write lock held.
+static size_t record_encode(compact_store_t *store, const account_t *acc, uint8_t *out) {
+  uint8_t body[RECORD_MAX];
+  uint8_t *p = body + 1;
+  uint8_t flags = 0;
+
+  size_t userid_len = strnlen(acc->userid, USER_ID_LENGTH);
+  p = put_varint(p, userid_len);
+  memcpy(p, acc->userid, userid_len);
+  p += userid_len;
+
+  p = put_varint(p, zigzag(acc->account_id));
+  p = put_varint(p, zigzag((int64_t)acc->unban_time));
+  p = put_varint(p, zigzag((int64_t)acc->expiration_time));
+  p = put_varint(p, zigzag((int64_t)acc->last_login_time));
+  p = put_varint(p, acc->login_count);
+  p = put_varint(p, acc->login_fail_count);
+  p = put_varint(p, acc->last_ip);
+
+  if (birthdate_packable(acc->birthdate)) {
+    const char *b = acc->birthdate;
+    uint64_t v = 0;
+    for (int i = 0; i < BIRTHDATE_LENGTH; i++) {
+      if (b[i] != '-') v = v * 10 + (uint64_t)(b[i] - '0');
+    }
+    flags |= REC_BIRTHDATE_PACKED;
+    p = put_varint(p, v);
+  } else {
+    memcpy(p, acc->birthdate, BIRTHDATE_LENGTH);
+    p += BIRTHDATE_LENGTH;
+  }
+
+  size_t email_len = strnlen(acc->email, EMAIL_LENGTH);
+  const char *at = NULL;
+  for (size_t i = 0; i < email_len; i++) {
+    if (acc->email[i] == '@') at = acc->email + i;
+  }
+  size_t local_len = email_len;
+  if (at) {
+    uint32_t domain = intern(&store->strings, at + 1, email_len - (size_t)(at - acc->email) - 1);
+    if (!domain) return 0;
+    flags |= REC_EMAIL_DOMAIN;
+    p = put_varint(p, domain);
+    local_len = (size_t)(at - acc->email);
+  }
+  p = put_varint(p, local_len);
+  memcpy(p, acc->email, local_len);
+  p += local_len;
+
+  size_t hash_len = strnlen(acc->password_hash, HASH_LENGTH - 1);
+  size_t prefix_len, a_len;
+  if (hash_split(acc->password_hash, hash_len, &prefix_len, &a_len)) {
+    uint32_t prefix = intern(&store->strings, acc->password_hash, prefix_len);
+    if (!prefix) return 0;
+    const char *a = acc->password_hash + prefix_len;
+    size_t b_len = hash_len - prefix_len - a_len - 1;
+    flags |= REC_HASH_PACKED;
+    p = put_varint(p, prefix);
+    p = put_varint(p, a_len);
+    p = put_varint(p, b_len);
+    // A and B packed as one run of digits, skipping the '$' between them
+    char digits[HASH_LENGTH];
+    memcpy(digits, a, a_len);
+    memcpy(digits + a_len, a + a_len + 1, b_len);
+    p = pack_digits(p, digits, a_len + b_len);
+  } else {
+    p = put_varint(p, hash_len);
+    memcpy(p, acc->password_hash, hash_len);
+    p += hash_len;
+  }
+
+  body[0] = flags;
+  size_t body_len = (size_t)(p - body);
+  uint8_t *q = put_varint(out, body_len);
+  memcpy(q, body, body_len);
+  return (size_t)(q - out) + body_len;
+}
+
+// total length of the record at `rec`
+static size_t record_size(const uint8_t *rec) {
+  uint64_t body_len;
+  const uint8_t *body = get_varint(rec, &body_len);
+  return (size_t)(body - rec) + (size_t)body_len;
+}
+
+// the userid of the record at `rec`, and its length
+static const char *record_userid(const uint8_t *rec, size_t *len) {
+  uint64_t v;
+  const uint8_t *p = get_varint(rec, &v) + 1;   // body length, flags
+  p = get_varint(p, &v);
+  *len = (size_t)v;
+  return (const char *)p;
+}
+
+// expand the record at `rec` into `acc`. Called with the lock held.
+static void record_decode(const compact_store_t *store, const uint8_t *rec, account_t *acc) {
+  uint64_t v;
+  memset(acc, 0, sizeof *acc);
+  const uint8_t *p = get_varint(rec, &v);
+  uint8_t flags = *p++;
+
+  p = get_varint(p, &v);
+  memcpy(acc->userid, p, (size_t)v);
+  p += v;
+
+  p = get_varint(p, &v);
+  acc->account_id = unzigzag(v);
+  p = get_varint(p, &v);
+  acc->unban_time = (time_t)unzigzag(v);
+  p = get_varint(p, &v);
+  acc->expiration_time = (time_t)unzigzag(v);
+  p = get_varint(p, &v);
+  acc->last_login_time = (time_t)unzigzag(v);
+  p = get_varint(p, &v);
+  acc->login_count = (unsigned int)v;
+  p = get_varint(p, &v);
+  acc->login_fail_count = (unsigned int)v;
+  p = get_varint(p, &v);
+  acc->last_ip = (ip4_addr_t)v;
+
+  if (flags & REC_BIRTHDATE_PACKED) {
+    p = get_varint(p, &v);
+    for (int i = BIRTHDATE_LENGTH - 1; i >= 0; i--) {
+      if (i == 4 || i == 7) {
+        acc->birthdate[i] = '-';
+      } else {
+        acc->birthdate[i] = (char)('0' + v % 10);
+        v /= 10;
+      }
+    }
+  } else {
+    memcpy(acc->birthdate, p, BIRTHDATE_LENGTH);
+    p += BIRTHDATE_LENGTH;
+  }
+
+  const char *domain = NULL;
+  if (flags & REC_EMAIL_DOMAIN) {
+    p = get_varint(p, &v);
+    domain = intern_string(&store->strings, (uint32_t)v);
+  }
+  p = get_varint(p, &v);
+  size_t local_len = (size_t)v;
+  memcpy(acc->email, p, local_len);
+  p += local_len;
+  if (domain) {
+    acc->email[local_len] = '@';
+    memcpy(acc->email + local_len + 1, domain, strlen(domain));
+  }
+
+  if (flags & REC_HASH_PACKED) {
+    uint64_t a_len, b_len;
+    p = get_varint(p, &v);
+    p = get_varint(p, &a_len);
+    p = get_varint(p, &b_len);
+    const char *prefix = intern_string(&store->strings, (uint32_t)v);
+    size_t prefix_len = strlen(prefix);
+    char digits[HASH_LENGTH];
+    unpack_digits(p, digits, (size_t)(a_len + b_len));
+    char *h = acc->password_hash;
+    memcpy(h, prefix, prefix_len);
+    memcpy(h + prefix_len, digits, (size_t)a_len);
+    h[prefix_len + a_len] = '$';
+    memcpy(h + prefix_len + a_len + 1, digits + a_len, (size_t)b_len);
+  } else {
+    p = get_varint(p, &v);
+    memcpy(acc->password_hash, p, (size_t)v);
+  }
+}
+
+////
+// Arena
+
+static uint8_t *arena_at(const compact_store_t *store, uint64_t ref) {
+  return store->chunks[ref >> CHUNK_BITS] + (ref & (CHUNK_BYTES - 1));
+}
+
+// append `len` bytes to the arena, returning their ref; false if out of memory
+static bool arena_append(compact_store_t *store, const uint8_t *rec, size_t len, uint64_t *ref) {
+  if (store->chunk_count == 0 || store->chunk_used + len > CHUNK_BYTES) {
+    if (store->chunk_count == store->chunk_capacity) {
+      size_t capacity = store->chunk_capacity ? store->chunk_capacity * 2 : 16;
+      uint8_t **chunks = realloc(store->chunks, capacity * sizeof *chunks);
+      if (!chunks) return false;
+      store->chunks = chunks;
+      store->chunk_capacity = capacity;
+    }
+    uint8_t *chunk = malloc(CHUNK_BYTES);
+    if (!chunk) return false;
+    store->chunks[store->chunk_count++] = chunk;
+    store->chunk_used = 0;
+  }
+  *ref = (uint64_t)(store->chunk_count - 1) << CHUNK_BITS | store->chunk_used;
+  memcpy(store->chunks[store->chunk_count - 1] + store->chunk_used, rec, len);
+  store->chunk_used += len;
+  return true;
+}
+
+// wipe a record that is no longer referenced, and count it as garbage
+static void record_retire(compact_store_t *store, uint64_t ref) {
+  uint8_t *rec = arena_at(store, ref);
+  size_t size = record_size(rec);
+  memset(rec, 0, size);
+  store->live_bytes -= size;
+  store->dead_bytes += size;
+}
+
+// wipe and free chunks; only `last_used` bytes of the last one were written
+static void chunks_free(uint8_t **chunks, size_t count, size_t last_used) {
+  for (size_t i = 0; i < count; i++) {
+    memset(chunks[i], 0, i + 1 == count ? last_used : CHUNK_BYTES);
+    free(chunks[i]);
+  }
+  free(chunks);
+}
+
+/*
+ * Copy every live record into a fresh arena, dropping garbage. Done
+ * once garbage outweighs live records, so each byte written is copied
+ * O(1) times on average. If memory is short, just skip it for now.
+ */
+static void arena_compact(compact_store_t *store) {
+  uint8_t **old = store->chunks;
+  size_t old_count = store->chunk_count, old_used = store->chunk_used;
+
+  // allocate every chunk up front, so the copy can't fail halfway
+  size_t needed = store->live_bytes / (CHUNK_BYTES - RECORD_MAX) + 1;
+  uint8_t **chunks = malloc(needed * sizeof *chunks);
+  size_t allocated = 0;
+  while (chunks && allocated < needed && (chunks[allocated] = malloc(CHUNK_BYTES)) != NULL) {
+    allocated++;
+  }
+  if (!chunks || allocated < needed) {
+    for (size_t i = 0; chunks && i < allocated; i++) free(chunks[i]);
+    free(chunks);
+    return;
+  }
+
+  size_t chunk = 0, used = 0;
+  for (size_t i = 0; i < store->index_capacity; i++) {
+    uint64_t e = store->index[i];
+    if (e == INDEX_EMPTY || e == INDEX_TOMBSTONE) continue;
+    const uint8_t *rec = arena_at(store, e & REF_MASK);
+    size_t size = record_size(rec);
+    if (used + size > CHUNK_BYTES) {
+      chunk++;
+      used = 0;
+    }
+    memcpy(chunks[chunk] + used, rec, size);
+    store->index[i] = (e & ~REF_MASK) | (uint64_t)chunk << CHUNK_BITS | used;
+    used += size;
+  }
+
+  store->chunks = chunks;
+  store->chunk_count = chunk + 1;
+  store->chunk_capacity = needed;
+  store->chunk_used = used;
+  store->dead_bytes = 0;
+  // the estimate allows for wasted chunk tails, so some may be spare
+  for (size_t i = chunk + 1; i < needed; i++) free(chunks[i]);
+  chunks_free(old, old_count, old_used);
+}
+
+////
+// Index
+
+static uint64_t entry_tag(uint64_t hash) {
+  return ((hash >> TAG_SHIFT) | 1) << TAG_SHIFT;
+}
+
+// find userid's entry, or the slot where it would go. Called with the lock held.
+static size_t index_find(const compact_store_t *store, const char *userid, size_t len,
+                         uint64_t hash, bool *found) {
+  size_t mask = store->index_capacity - 1;
+  size_t pos = (size_t)hash & mask;
+  size_t tombstone = SIZE_MAX;
+  uint64_t tag = entry_tag(hash);
+  for (;; pos = (pos + 1) & mask) {
+    uint64_t e = store->index[pos];
+    if (e == INDEX_EMPTY) {
+      *found = false;
+      return tombstone != SIZE_MAX ? tombstone : pos;
+    }
+    if (e == INDEX_TOMBSTONE) {
+      if (tombstone == SIZE_MAX) tombstone = pos;
+      continue;
+    }
+    if ((e & ~REF_MASK) != tag) continue;
+    size_t rec_len;
+    const char *rec_userid = record_userid(arena_at(store, e & REF_MASK), &rec_len);
+    if (rec_len == len && memcmp(rec_userid, userid, len) == 0) {
+      *found = true;
+      return pos;
+    }
+  }
+}
+
+static bool index_resize(compact_store_t *store, size_t capacity) {
+  uint64_t *index = calloc(capacity, sizeof *index);
+  if (!index) {
+    log_message(LOG_ERROR, "compact_store: failed to grow index.");
+    return false;
+  }
+  for (size_t i = 0; i < store->index_capacity; i++) {
+    uint64_t e = store->index[i];
+    if (e == INDEX_EMPTY || e == INDEX_TOMBSTONE) continue;
+    size_t len;
+    const char *userid = record_userid(arena_at(store, e & REF_MASK), &len);
+    char key[USER_ID_LENGTH + 1] = {0};
+    memcpy(key, userid, len);
+    size_t pos = (size_t)account_store_hash_userid(key) & (capacity - 1);
+    while (index[pos] != INDEX_EMPTY) pos = (pos + 1) & (capacity - 1);
+    index[pos] = e;
+  }
+  free(store->index);
+  store->index = index;
+  store->index_capacity = capacity;
+  store->index_used = store->count;
+  return true;
+}
+
+////
+// Public interface
+
+compact_store_t *compact_store_create(size_t expected_accounts) {
+  compact_store_t *store = calloc(1, sizeof *store);
+  if (!store) {
+    log_message(LOG_ERROR, "compact_store_create: failed to allocate.");
+    return NULL;
+  }
+  // keep the index at most 3/4 full
+  store->index_capacity = round_up_pow2(expected_accounts / 3 * 4 + 16);
+  store->index = calloc(store->index_capacity, sizeof *store->index);
+  if (!store->index || pthread_rwlock_init(&store->lock, NULL) != 0) {
+    log_message(LOG_ERROR, "compact_store_create: failed to allocate.");
+    free(store->index);
+    free(store);
+    return NULL;
+  }
+  return store;
+}
+
+void compact_store_free(compact_store_t *store) {
+  if (!store) return;
+  compact_store_t *expected = store;
+  atomic_compare_exchange_strong(&default_compact, &expected, NULL);
+
+  chunks_free(store->chunks, store->chunk_count, store->chunk_used);
+  free(store->index);
+  intern_free(&store->strings);
+  pthread_rwlock_destroy(&store->lock);
+  free(store);
+}
+
+// store an encoded record for userid, replacing any old one. Called with the write lock held.
+static bool put_locked(compact_store_t *store, const char *userid, const uint8_t *rec, size_t size) {
+  if ((store->index_used + 1) * 4 > store->index_capacity * 3) {
+    size_t capacity = store->index_capacity;
+    if ((store->count + 1) * 2 > capacity) capacity *= 2;
+    if (!index_resize(store, capacity)) return false;
+  }
+
+  size_t len = strnlen(userid, USER_ID_LENGTH);
+  uint64_t hash = account_store_hash_userid(userid);
+  bool found;
+  size_t pos = index_find(store, userid, len, hash, &found);
+  uint64_t ref;
+  if (!arena_append(store, rec, size, &ref)) {
+    log_message(LOG_ERROR, "compact_store: failed to grow arena.");
+    return false;
+  }
+  store->live_bytes += size;
+
+  uint64_t old = store->index[pos];
+  store->index[pos] = entry_tag(hash) | ref;
+  if (found) {
+    record_retire(store, old & REF_MASK);
+  } else {
+    if (old == INDEX_EMPTY) store->index_used++;
+    store->count++;
+  }
+
+  if (store->dead_bytes > store->live_bytes && store->dead_bytes > CHUNK_BYTES) {
+    arena_compact(store);
+  }
+  return true;
+}
+
+bool compact_store_put(compact_store_t *store, const account_t *acc) {
+  if (!store || !acc) {
+    log_message(LOG_ERROR, "compact_store_put: NULL argument.");
+    return false;
+  }
+  uint8_t rec[RECORD_MAX];
+  pthread_rwlock_wrlock(&store->lock);
+  size_t size = record_encode(store, acc, rec);
+  bool ok = size > 0 && put_locked(store, acc->userid, rec, size);
+  if (ok && store->cache) account_cache_refresh(store->cache, acc->userid, acc);
+  pthread_rwlock_unlock(&store->lock);
+  if (size == 0) log_message(LOG_ERROR, "compact_store_put: failed to intern strings.");
+  memset(rec, 0, sizeof rec);
+  return ok;
+}
+
+bool compact_store_get(compact_store_t *store, const char *userid, account_t *result) {
+  if (!store || !userid || !result) {
+    log_message(LOG_ERROR, "compact_store_get: NULL argument.");
+    return false;
+  }
+  size_t len = strnlen(userid, USER_ID_LENGTH);
+  uint64_t hash = account_store_hash_userid(userid);
+  bool found;
+  pthread_rwlock_rdlock(&store->lock);
+  size_t pos = index_find(store, userid, len, hash, &found);
+  if (found) record_decode(store, arena_at(store, store->index[pos] & REF_MASK), result);
+  pthread_rwlock_unlock(&store->lock);
+  return found;
+}
+
+bool compact_store_update(compact_store_t *store, const char *userid,
+                          account_store_update_fn fn, void *arg) {
+  if (!store || !userid || !fn) {
+    log_message(LOG_ERROR, "compact_store_update: NULL argument.");
+    return false;
+  }
+  size_t len = strnlen(userid, USER_ID_LENGTH);
+  uint64_t hash = account_store_hash_userid(userid);
+  bool found, ok = false;
+  account_t acc;
+  uint8_t rec[RECORD_MAX];
+
+  pthread_rwlock_wrlock(&store->lock);
+  size_t pos = index_find(store, userid, len, hash, &found);
+  if (found) {
+    record_decode(store, arena_at(store, store->index[pos] & REF_MASK), &acc);
+    char key[USER_ID_LENGTH];
+    memcpy(key, acc.userid, USER_ID_LENGTH);
+    if (fn(&acc, arg)) {
+      memcpy(acc.userid, key, USER_ID_LENGTH);    // the userid can't change
+      size_t size = record_encode(store, &acc, rec);
+      ok = size > 0 && put_locked(store, key, rec, size);
+      if (ok && store->cache) account_cache_refresh(store->cache, acc.userid, &acc);
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  memset(&acc, 0, sizeof acc);
+  memset(rec, 0, sizeof rec);
+  return ok;
+}
+
+bool compact_store_remove(compact_store_t *store, const char *userid) {
+  if (!store || !userid) return false;
+  size_t len = strnlen(userid, USER_ID_LENGTH);
+  uint64_t hash = account_store_hash_userid(userid);
+  bool found;
+  pthread_rwlock_wrlock(&store->lock);
+  size_t pos = index_find(store, userid, len, hash, &found);
+  if (found) {
+    record_retire(store, store->index[pos] & REF_MASK);
+    store->index[pos] = INDEX_TOMBSTONE;
+    store->count--;
+    if (store->cache) account_cache_invalidate(store->cache, userid);
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return found;
+}
+
+void compact_store_set_cache(compact_store_t *store, account_cache_t *cache) {
+  if (!store) return;
+  pthread_rwlock_wrlock(&store->lock);
+  store->cache = cache;
+  pthread_rwlock_unlock(&store->lock);
+}
+
+size_t compact_store_count(compact_store_t *store) {
+  pthread_rwlock_rdlock(&store->lock);
+  size_t count = store->count;
+  pthread_rwlock_unlock(&store->lock);
+  return count;
+}
+
+void compact_store_foreach(compact_store_t *store, account_store_visit_fn fn, void *arg) {
+  account_t acc;
+  pthread_rwlock_rdlock(&store->lock);
+  for (size_t i = 0; i < store->index_capacity; i++) {
+    uint64_t e = store->index[i];
+    if (e == INDEX_EMPTY || e == INDEX_TOMBSTONE) continue;
+    record_decode(store, arena_at(store, e & REF_MASK), &acc);
+    if (!fn(&acc, arg)) break;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  memset(&acc, 0, sizeof acc);
+}
+
+size_t compact_store_memory(compact_store_t *store) {
+  pthread_rwlock_rdlock(&store->lock);
+  const intern_pool_t *pool = &store->strings;
+  // pages of the last chunk aren't touched until records are written there
+  size_t arena = store->chunk_count ? (store->chunk_count - 1) * CHUNK_BYTES + store->chunk_used : 0;
+  size_t bytes = arena + store->chunk_capacity * sizeof *store->chunks +
+                 store->index_capacity * sizeof *store->index + pool->bytes_capacity +
+                 pool->offsets_capacity * sizeof *pool->offsets +
+                 pool->map_capacity * sizeof *pool->map;
+  pthread_rwlock_unlock(&store->lock);
+  return bytes;
+}
+
+void compact_store_set_default(compact_store_t *store) {
+  atomic_store(&default_compact, store);
+}
+
+compact_store_t *compact_store_get_default(void) {
+  return atomic_load(&default_compact);
+}
@@ -0,0 +1,102 @@
+#ifndef COMPACT_STORE_H
+#define COMPACT_STORE_H
+
+#include "account.h"
+#include "account_store.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file compact_store.h
+ * @brief Memory-compact account store for very large account counts.
+ *
+ * An alternative to account_store.h that trades some lookup speed for
+ * space. An account_t is nearly 400 bytes, almost all of it the padding
+ * in its fixed-size text fields. Here each record is one variable-length
+ * byte string in a shared arena:
+ *
+ * - numbers as varints
+ * - the userid and the local part of the email, length-prefixed
+ * - the email domain, and the algorithm and parameters of the password
+ *   hash (e.g. `$y$jBT$`), as ids of strings interned once per store
+ * - the salt and hash digits packed at 6 bits each, instead of one
+ *   base-64 character per byte
+ *
+ * That is around 100 bytes per account, plus 8 bytes of index. Records
+ * are expanded into an account_t only when looked up. Text after a
+ * field's terminating NUL isn't kept.
+ *
+ * All functions are thread-safe. Lookups share a read lock; writes take
+ * it exclusively. A write appends a new record and leaves the old one
+ * as garbage, and the arena is compacted once garbage outweighs live
+ * records.
+ */
+
+typedef struct compact_store compact_store_t;
+
+/**
+ * Create an empty store sized for roughly `expected_accounts` records
+ * (it still grows past that if needed).
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+compact_store_t *compact_store_create(size_t expected_accounts);
+
+// free the store and wipe its records
+void compact_store_free(compact_store_t *store);
+
+/**
+ * Insert a copy of `acc`, replacing any existing record with the same userid.
+ *
+ * Returns true on success, false on failure (invalid arguments or
+ * out of memory).
+ */
+bool compact_store_put(compact_store_t *store, const account_t *acc);
+
+/**
+ * Look up an account by userid, expanding it into `result`.
+ *
+ * Returns true if the account was found, false otherwise.
+ */
+bool compact_store_get(compact_store_t *store, const char *userid, account_t *result);
+
+/**
+ * Apply `fn` to a copy of the record for `userid` and store the result,
+ * as account_store_update() does. `fn` must not call back into the store.
+ *
+ * Returns true if the account was found and `fn` returned true.
+ */
+bool compact_store_update(compact_store_t *store, const char *userid,
+                          account_store_update_fn fn, void *arg);
+
+// remove an account. returns true if it was present.
+bool compact_store_remove(compact_store_t *store, const char *userid);
+
+// as account_store_set_cache(): refresh `cache` with every change from now on
+void compact_store_set_cache(compact_store_t *store, account_cache_t *cache);
+
+// number of accounts currently held
+size_t compact_store_count(compact_store_t *store);
+
+/**
+ * Call `fn` on every account in the store, in no particular order, until
+ * it returns false. Holds the read lock throughout, so `fn` must not
+ * call back into the store.
+ */
+void compact_store_foreach(compact_store_t *store, account_store_visit_fn fn, void *arg);
+
+// bytes of memory in use for records, index and interned strings
+size_t compact_store_memory(compact_store_t *store);
+
+////
+// Process-wide default store
+
+// Set the store consulted by account_lookup_by_userid() after the
+// default account_store. NULL clears it. The caller keeps ownership.
+void compact_store_set_default(compact_store_t *store);
+
+// the store set by compact_store_set_default(), or NULL
+compact_store_t *compact_store_get_default(void);
+
+#endif // COMPACT_STORE_H
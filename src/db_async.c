@@ -0,0 +1,391 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "db_async.h"
+#include "cluster.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static STATS_DEFINE(stat_round_trips, "db_async.round_trips");
+static STATS_DEFINE(stat_keys, "db_async.keys");
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+////
+// Client
+
+// a multi-get waiting for its results
+typedef struct db_request {
+  uint32_t id;
+  size_t n;
+  size_t remaining;
+  db_lookup_fn fn;
+  void **args;
+  bool *answered;
+  struct db_request *next;
+} db_request_t;
+
+struct db_async {
+  int fd;
+  pthread_t receiver;
+
+  pthread_mutex_t send_lock;      // keeps a multi-get's frames together
+
+  pthread_mutex_t lock;           // protects the fields below
+  db_request_t *pending;
+  uint32_t next_id;
+  bool closed;                    // the receiver has stopped; no more results
+};
+
+static void request_free(db_request_t *req) {
+  free(req->args);
+  free(req->answered);
+  free(req);
+}
+
+// complete every unanswered lookup in `req` with an error, then free it
+static void request_fail(db_request_t *req) {
+  for (size_t i = 0; i < req->n; i++) {
+    if (!req->answered[i]) req->fn(req->args[i], DB_LOOKUP_ERROR, NULL);
+  }
+  request_free(req);
+}
+
+static db_request_t *find_request(db_async_t *db, uint32_t id) {
+  pthread_mutex_lock(&db->lock);
+  db_request_t *req = db->pending;
+  while (req && req->id != id) req = req->next;
+  pthread_mutex_unlock(&db->lock);
+  return req;
+}
+
+static void remove_request(db_async_t *db, db_request_t *req) {
+  pthread_mutex_lock(&db->lock);
+  db_request_t **p = &db->pending;
+  while (*p != req) p = &(*p)->next;
+  *p = req->next;
+  pthread_mutex_unlock(&db->lock);
+}
+
+static void *receive_results(void *p) {
+  db_async_t *db = p;
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+
+  while (wire_recv(db->fd, &type, buf, sizeof buf, &len)) {
+    wire_reader_t r;
+    wire_reader_init(&r, buf, len);
+    uint32_t id = wire_get_u32(&r);
+    uint32_t index = wire_get_u32(&r);
+    bool found = wire_get_u8(&r) != 0;
+    account_t acc;
+    if (found) cluster_decode_account(&r, &acc);
+    if (type != DB_MSG_RESULT || !wire_reader_done(&r)) {
+      log_message(LOG_ERROR, "db_async: malformed reply.");
+      break;
+    }
+
+    // only this thread completes lookups, so the request can't vanish
+    // between finding it and using it
+    db_request_t *req = find_request(db, id);
+    if (!req || index >= req->n || req->answered[index]) {
+      log_message(LOG_ERROR, "db_async: reply to unknown lookup.");
+      break;
+    }
+    req->answered[index] = true;
+    req->fn(req->args[index], found ? DB_LOOKUP_FOUND : DB_LOOKUP_NOT_FOUND, found ? &acc : NULL);
+    if (--req->remaining == 0) {
+      remove_request(db, req);
+      request_free(req);
+    }
+    memset(&acc, 0, sizeof acc);
+  }
+
+  pthread_mutex_lock(&db->lock);
+  db->closed = true;
+  db_request_t *req = db->pending;
+  db->pending = NULL;
+  pthread_mutex_unlock(&db->lock);
+  while (req) {
+    db_request_t *next = req->next;
+    request_fail(req);
+    req = next;
+  }
+  return NULL;
+}
+
+db_async_t *db_async_open(int fd) {
+  db_async_t *db = calloc(1, sizeof *db);
+  if (!db) {
+    log_message(LOG_ERROR, "db_async_open: can't allocate client.");
+    return NULL;
+  }
+  db->fd = fd;
+  pthread_mutex_init(&db->send_lock, NULL);
+  pthread_mutex_init(&db->lock, NULL);
+  if (pthread_create(&db->receiver, NULL, receive_results, db) != 0) {
+    log_message(LOG_ERROR, "db_async_open: can't start receiver thread.");
+    pthread_mutex_destroy(&db->send_lock);
+    pthread_mutex_destroy(&db->lock);
+    free(db);
+    return NULL;
+  }
+  return db;
+}
+
+db_async_t *db_async_connect(const char *addr) {
+  int fd = wire_connect(addr);
+  if (fd < 0) return NULL;
+  db_async_t *db = db_async_open(fd);
+  if (!db) close(fd);
+  return db;
+}
+
+void db_async_close(db_async_t *db) {
+  if (!db) return;
+  shutdown(db->fd, SHUT_RDWR);
+  pthread_join(db->receiver, NULL);
+  close(db->fd);
+  pthread_mutex_destroy(&db->send_lock);
+  pthread_mutex_destroy(&db->lock);
+  free(db);
+}
+
+void db_async_multi_get(db_async_t *db, const char *const *userids, size_t n,
+                        db_lookup_fn fn, void *const *args) {
+  if (n == 0) return;
+  if (n > UINT32_MAX) {
+    log_message(LOG_ERROR, "db_async_multi_get: too many userids.");
+    for (size_t i = 0; i < n; i++) fn(args[i], DB_LOOKUP_ERROR, NULL);
+    return;
+  }
+
+  // No account has a userid this long, and the server won't read one, so
+  // answer such userids here and send the rest.
+  size_t too_long = 0;
+  for (size_t i = 0; i < n; i++) too_long += strnlen(userids[i], USER_ID_LENGTH) == USER_ID_LENGTH;
+  if (too_long > 0) {
+    const char **rest = malloc((n - too_long + 1) * sizeof *rest);
+    void **rest_args = malloc((n - too_long + 1) * sizeof *rest_args);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (strnlen(userids[i], USER_ID_LENGTH) == USER_ID_LENGTH) {
+        fn(args[i], DB_LOOKUP_NOT_FOUND, NULL);
+      } else if (rest && rest_args) {
+        rest[m] = userids[i];
+        rest_args[m++] = args[i];
+      } else {
+        fn(args[i], DB_LOOKUP_ERROR, NULL);
+      }
+    }
+    if (!rest || !rest_args) log_message(LOG_ERROR, "db_async_multi_get: can't allocate request.");
+    db_async_multi_get(db, rest, m, fn, rest_args);
+    free(rest);
+    free(rest_args);
+    return;
+  }
+
+  db_request_t *req = calloc(1, sizeof *req);
+  if (req) {
+    req->args = malloc(n * sizeof *req->args);
+    req->answered = calloc(n, sizeof *req->answered);
+  }
+  if (!req || !req->args || !req->answered) {
+    log_message(LOG_ERROR, "db_async_multi_get: can't allocate request.");
+    if (req) request_free(req);
+    for (size_t i = 0; i < n; i++) fn(args[i], DB_LOOKUP_ERROR, NULL);
+    return;
+  }
+  memcpy(req->args, args, n * sizeof *req->args);
+  req->n = req->remaining = n;
+  req->fn = fn;
+
+  pthread_mutex_lock(&db->lock);
+  if (db->closed) {
+    pthread_mutex_unlock(&db->lock);
+    request_fail(req);
+    return;
+  }
+  uint32_t id = req->id = db->next_id++;
+  req->next = db->pending;
+  db->pending = req;
+  pthread_mutex_unlock(&db->lock);
+
+  // From here on the receiver owns the request (and may free it): results
+  // can arrive before the last frame is sent, and if a send fails,
+  // shutting the socket down makes the receiver fail what's unanswered.
+  wire_writer_t w;
+  bool ok = true;
+  pthread_mutex_lock(&db->send_lock);
+  for (size_t first = 0; ok && first < n; first += DB_LOOKUP_MAX_KEYS) {
+    size_t count = n - first < DB_LOOKUP_MAX_KEYS ? n - first : DB_LOOKUP_MAX_KEYS;
+    wire_writer_init(&w);
+    wire_put_u32(&w, id);
+    wire_put_u32(&w, (uint32_t)first);
+    wire_put_u32(&w, (uint32_t)count);
+    for (size_t i = first; i < first + count; i++) wire_put_str(&w, userids[i], USER_ID_LENGTH);
+    ok = wire_send(db->fd, DB_MSG_LOOKUP, &w);
+  }
+  pthread_mutex_unlock(&db->send_lock);
+  if (!ok) {
+    log_message(LOG_ERROR, "db_async_multi_get: can't send lookup.");
+    shutdown(db->fd, SHUT_RDWR);
+  }
+  stats_add(&stat_round_trips, 1);
+  stats_add(&stat_keys, n);
+}
+
+void db_async_lookup(db_async_t *db, const char *userid, db_lookup_fn fn, void *arg) {
+  db_async_multi_get(db, &userid, 1, fn, &arg);
+}
+
+////
+// Stand-in server
+
+// one request's answers, waiting out the latency
+typedef struct db_reply {
+  uint64_t due_ns;
+  uint32_t id;
+  uint32_t first;
+  uint32_t count;
+  bool found[DB_LOOKUP_MAX_KEYS];
+  account_t accounts[DB_LOOKUP_MAX_KEYS];
+  struct db_reply *next;
+} db_reply_t;
+
+typedef struct {
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  db_reply_t *head;               // oldest first; due times never decrease
+  db_reply_t *tail;
+  bool reading;                   // cleared once the client has hung up
+} db_server_conn_t;
+
+static void *send_replies(void *p) {
+  db_server_conn_t *c = p;
+  bool ok = true;
+
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    // wait for the oldest reply to fall due
+    while (c->reading && (!c->head || now_ns() < c->head->due_ns)) {
+      if (!c->head) {
+        pthread_cond_wait(&c->cond, &c->lock);
+        continue;
+      }
+      struct timespec due = {
+        .tv_sec = (time_t)(c->head->due_ns / 1000000000u),
+        .tv_nsec = (long)(c->head->due_ns % 1000000000u),
+      };
+      pthread_cond_timedwait(&c->cond, &c->lock, &due);
+    }
+    if (!c->reading) break;   // the client hung up; nobody wants the rest
+
+    db_reply_t *reply = c->head;
+    c->head = reply->next;
+    if (!c->head) c->tail = NULL;
+    pthread_mutex_unlock(&c->lock);
+
+    wire_writer_t w;
+    for (uint32_t i = 0; ok && i < reply->count; i++) {
+      wire_writer_init(&w);
+      wire_put_u32(&w, reply->id);
+      wire_put_u32(&w, reply->first + i);
+      wire_put_u8(&w, reply->found[i]);
+      if (reply->found[i]) cluster_encode_account(&w, &reply->accounts[i]);
+      ok = wire_send(c->fd, DB_MSG_RESULT, &w);
+    }
+    memset(reply, 0, sizeof *reply);
+    free(reply);
+    if (!ok) shutdown(c->fd, SHUT_RDWR);    // stops the reader too
+
+    pthread_mutex_lock(&c->lock);
+  }
+
+  while (c->head) {
+    db_reply_t *reply = c->head;
+    c->head = reply->next;
+    memset(reply, 0, sizeof *reply);
+    free(reply);
+  }
+  c->tail = NULL;
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+void db_server_serve(int fd, account_store_t *store, uint64_t latency_ns) {
+  db_server_conn_t c = { .fd = fd, .reading = true };
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&c.lock, NULL);
+  pthread_cond_init(&c.cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t sender;
+  if (pthread_create(&sender, NULL, send_replies, &c) != 0) {
+    log_message(LOG_ERROR, "db_server_serve: can't start sender thread.");
+    pthread_mutex_destroy(&c.lock);
+    pthread_cond_destroy(&c.cond);
+    return;
+  }
+
+  uint8_t buf[WIRE_MAX_FRAME];
+  uint8_t type;
+  size_t len;
+  while (wire_recv(fd, &type, buf, sizeof buf, &len)) {
+    db_reply_t *reply = malloc(sizeof *reply);
+    if (!reply) {
+      log_message(LOG_ERROR, "db_server_serve: can't allocate reply.");
+      break;
+    }
+    wire_reader_t r;
+    wire_reader_init(&r, buf, len);
+    reply->due_ns = now_ns() + latency_ns;
+    reply->id = wire_get_u32(&r);
+    reply->first = wire_get_u32(&r);
+    reply->count = wire_get_u32(&r);
+    reply->next = NULL;
+    bool ok = type == DB_MSG_LOOKUP && !r.error && reply->count <= DB_LOOKUP_MAX_KEYS;
+    for (uint32_t i = 0; ok && i < reply->count; i++) {
+      // room for one character too many, which no account has: that's
+      // an answer, not a broken request
+      char userid[USER_ID_LENGTH + 1];
+      wire_get_str(&r, userid, sizeof userid);
+      reply->found[i] = !r.error && strlen(userid) < USER_ID_LENGTH &&
+                        account_store_get(store, userid, &reply->accounts[i]);
+    }
+    if (!ok || !wire_reader_done(&r)) {
+      log_message(LOG_ERROR, "db_server_serve: malformed request.");
+      free(reply);
+      break;
+    }
+
+    pthread_mutex_lock(&c.lock);
+    if (c.tail) c.tail->next = reply;
+    else c.head = reply;
+    c.tail = reply;
+    pthread_cond_signal(&c.cond);
+    pthread_mutex_unlock(&c.lock);
+  }
+
+  pthread_mutex_lock(&c.lock);
+  c.reading = false;
+  pthread_cond_signal(&c.cond);
+  pthread_mutex_unlock(&c.lock);
+  pthread_join(sender, NULL);
+  pthread_mutex_destroy(&c.lock);
+  pthread_cond_destroy(&c.cond);
+}
@@ -0,0 +1,91 @@
+#ifndef DB_ASYNC_H
+#define DB_ASYNC_H
+
+#include "account.h"
+#include "account_store.h"
+#include "wire.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file db_async.h
+ * @brief Asynchronous, pipelined account lookups against a database server.
+ *
+ * account_lookup_by_userid() blocks its caller for a whole round trip.
+ * A db_async_t instead sends lookups over one connection without waiting
+ * for earlier replies, and reports each result through a completion
+ * callback. db_async_multi_get() resolves many userids in a single
+ * round trip.
+ *
+ * Callbacks run on the connection's receiver thread, so they must be
+ * quick and must not block; hand the result to another thread for
+ * anything expensive (see login_async.h).
+ *
+ * The protocol uses wire.h frames. A lookup request carries up to
+ * DB_LOOKUP_MAX_KEYS userids; longer multi-gets are sent as several
+ * requests back to back. The server answers each userid with its own
+ * RESULT frame.
+ *
+ * db_server_serve() is a stand-in server backed by an account store,
+ * with a configurable delay before each reply to model a remote
+ * database.
+ */
+
+typedef enum {
+  DB_MSG_LOOKUP = 1,      // id u32, first index u32, count u32, then `count` userids
+  DB_MSG_RESULT = 64      // id u32, index u32, found u8, then the account if found
+} db_msg_t;
+
+// userids per LOOKUP frame
+#define DB_LOOKUP_MAX_KEYS ((WIRE_MAX_FRAME - 16) / (2 + USER_ID_LENGTH))
+
+typedef enum {
+  DB_LOOKUP_FOUND,
+  DB_LOOKUP_NOT_FOUND,
+  DB_LOOKUP_ERROR         // the connection failed before the answer arrived
+} db_lookup_status_t;
+
+/**
+ * Completion for one userid. `acc` is only valid during the call, and is
+ * NULL unless `status` is DB_LOOKUP_FOUND.
+ */
+typedef void (*db_lookup_fn)(void *arg, db_lookup_status_t status, const account_t *acc);
+
+typedef struct db_async db_async_t;
+
+// connect to a server at `addr` (see wire_connect()). returns NULL and logs on failure.
+db_async_t *db_async_connect(const char *addr);
+
+// use an already-connected socket, which the db_async_t then owns
+db_async_t *db_async_open(int fd);
+
+/**
+ * Close the connection. Lookups still outstanding complete with
+ * DB_LOOKUP_ERROR before this returns.
+ */
+void db_async_close(db_async_t *db);
+
+/**
+ * Look up `n` userids in one round trip. fn(args[i], ...) is called
+ * exactly once for userids[i], possibly before this returns (e.g. if the
+ * connection has already failed). Results arrive in any order. Userids of
+ * USER_ID_LENGTH characters or more aren't sent; they complete at once
+ * with DB_LOOKUP_NOT_FOUND.
+ */
+void db_async_multi_get(db_async_t *db, const char *const *userids, size_t n,
+                        db_lookup_fn fn, void *const *args);
+
+// look up one userid; shorthand for a multi-get of one
+void db_async_lookup(db_async_t *db, const char *userid, db_lookup_fn fn, void *arg);
+
+/**
+ * Serve lookups from `store` on a connected socket until the peer
+ * disconnects, answering each request `latency_ns` after it arrives.
+ * Requests are read while earlier ones wait, so pipelined lookups each
+ * cost one latency, not one after another. A userid of USER_ID_LENGTH
+ * characters is answered as not found.
+ */
+void db_server_serve(int fd, account_store_t *store, uint64_t latency_ns);
+
+#endif // DB_ASYNC_H
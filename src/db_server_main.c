@@ -0,0 +1,101 @@
+// Entry point for the stand-in database server (`make db-server`).
+//
+// Answers account lookups (see db_async.h) from an in-memory account
+// store, after a configurable delay that models a remote database.
+// Accounts are seeded from a load generator trace, as loadgen does.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_store.h"
+#include "db_async.h"
+#include "loadgen.h"
+#include "logging.h"
+#include "wire.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+  int fd;
+  account_store_t *store;
+  uint64_t latency_ns;
+} conn_arg_t;
+
+static void *serve_connection(void *p) {
+  conn_arg_t *arg = p;
+  db_server_serve(arg->fd, arg->store, arg->latency_ns);
+  close(arg->fd);
+  free(arg);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  const char *listen_addr = NULL;
+  const char *trace_path = NULL;
+  double latency_ms = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:L:r:h")) != -1) {
+    switch (opt) {
+      case 'l': listen_addr = optarg; break;
+      case 'L': latency_ms = atof(optarg); break;
+      case 'r': trace_path = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s -l ADDR [-L MS] [-r TRACE]\n"
+                        "  -l ADDR   listen address (unix:/path or tcp:host:port)\n"
+                        "  -L MS     delay before each reply, in milliseconds (default 0)\n"
+                        "  -r TRACE  seed the accounts used by a loadgen trace\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (!listen_addr || latency_ms < 0) {
+    fprintf(stderr, "%s: -l ADDR is required and -L must not be negative\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  account_store_t *store = account_store_create(0);
+  if (!store) return 1;
+  if (trace_path) {
+    FILE *f = fopen(trace_path, "r");
+    loadgen_trace_t trace;
+    if (!f || !loadgen_trace_read(f, &trace)) {
+      fprintf(stderr, "%s: can't read trace %s\n", argv[0], trace_path);
+      return 1;
+    }
+    fclose(f);
+    bool seeded = loadgen_seed_store(&trace, store);
+    loadgen_trace_free(&trace);
+    if (!seeded) return 1;
+  }
+
+  int lfd = wire_listen(listen_addr);
+  if (lfd < 0) return 1;
+  log_message(LOG_INFO, "db server listening on %s with %zu accounts, %.1f ms latency",
+              listen_addr, account_store_count(store), latency_ms);
+
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) continue;
+
+    conn_arg_t *arg = malloc(sizeof *arg);
+    pthread_t thread;
+    if (!arg) {
+      close(fd);
+      continue;
+    }
+    *arg = (conn_arg_t){ .fd = fd, .store = store, .latency_ns = (uint64_t)(latency_ms * 1e6) };
+    if (pthread_create(&thread, NULL, serve_connection, arg) != 0) {
+      log_message(LOG_ERROR, "db server: can't start connection thread.");
+      close(fd);
+      free(arg);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
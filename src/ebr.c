@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ebr.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// how many retires a thread makes between attempts to reclaim
+#define EBR_RETIRE_BATCH 64
+
+// A thread's announcement: 0 when outside any read-side section, else
+// (epoch << 1) | 1 for the epoch it entered in.
+typedef struct ebr_thread {
+  _Atomic uint64_t announce;
+  atomic_bool in_use;
+  struct ebr_thread *next;        // registry; records are reused, never freed
+
+  // owned by the thread using the record
+  unsigned nesting;
+  ebr_entry_t *limbo_head;        // oldest first, so epochs never decrease
+  ebr_entry_t *limbo_tail;
+  unsigned since_reclaim;
+} ebr_thread_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static ebr_thread_t *_Atomic registry = NULL;
+
+// retired entries left behind by threads that exited
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static ebr_entry_t *orphans = NULL;
+
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static _Thread_local ebr_thread_t *self = NULL;
+
+static STATS_DEFINE(stat_retired, "ebr.retired");
+static STATS_DEFINE(stat_freed, "ebr.freed");
+
+static void free_list(ebr_entry_t *e) {
+  uint64_t n = 0;
+  while (e) {
+    ebr_entry_t *next = e->next;
+    e->free_fn(e);
+    e = next;
+    n++;
+  }
+  if (n) stats_add(&stat_freed, n);
+}
+
+static void thread_exit(void *arg) {
+  ebr_thread_t *t = arg;
+  if (t->limbo_head) {
+    pthread_mutex_lock(&orphan_lock);
+    t->limbo_tail->next = orphans;
+    orphans = t->limbo_head;
+    pthread_mutex_unlock(&orphan_lock);
+  }
+  t->limbo_head = t->limbo_tail = NULL;
+  t->nesting = 0;
+  t->since_reclaim = 0;
+  atomic_store_explicit(&t->announce, 0, memory_order_release);
+  atomic_store_explicit(&t->in_use, false, memory_order_release);
+}
+
+static void make_key(void) {
+  if (pthread_key_create(&thread_key, thread_exit) != 0) {
+    log_message(LOG_ERROR, "ebr: can't create thread key.");
+    abort();
+  }
+}
+
+static ebr_thread_t *thread_record(void) {
+  if (self) return self;
+  pthread_once(&key_once, make_key);
+
+  // reuse a record left by an exited thread if there is one
+  ebr_thread_t *t;
+  for (t = atomic_load(&registry); t; t = t->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&t->in_use, &expected, true)) break;
+  }
+  if (!t) {
+    t = calloc(1, sizeof *t);
+    if (!t) {
+      log_message(LOG_ERROR, "ebr: can't allocate thread record.");
+      abort();
+    }
+    atomic_init(&t->in_use, true);
+    t->next = atomic_load(&registry);
+    while (!atomic_compare_exchange_weak(&registry, &t->next, t)) {}
+  }
+  pthread_setspecific(thread_key, t);
+  self = t;
+  return t;
+}
+
+void ebr_enter(void) {
+  ebr_thread_t *t = thread_record();
+  if (t->nesting++ > 0) return;
+  uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+  atomic_store_explicit(&t->announce, (epoch << 1) | 1, memory_order_relaxed);
+  // order the announcement before the section's loads; pairs with the
+  // fence in try_advance()
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void ebr_exit(void) {
+  ebr_thread_t *t = self;
+  if (!t || t->nesting == 0) {
+    log_message(LOG_ERROR, "ebr_exit: not in a read-side section.");
+    return;
+  }
+  if (--t->nesting > 0) return;
+  atomic_store_explicit(&t->announce, 0, memory_order_release);
+}
+
+/**
+ * Advance the global epoch if every thread in a read-side section has
+ * seen the current one. Returns the (possibly new) global epoch.
+ */
+static uint64_t try_advance(void) {
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (ebr_thread_t *t = atomic_load(&registry); t; t = t->next) {
+    uint64_t a = atomic_load_explicit(&t->announce, memory_order_acquire);
+    if ((a & 1) && (a >> 1) != epoch) return epoch;
+  }
+  if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) return epoch + 1;
+  return epoch;   // someone else advanced it
+}
+
+/**
+ * Free the calling thread's entries, and orphans, retired before epoch
+ * `safe`. Orphans are skipped if another thread holds their lock,
+ * unless `wait` is set.
+ */
+static void reclaim(ebr_thread_t *t, uint64_t safe, bool wait) {
+  ebr_entry_t *done = NULL, **tail = &done;
+  while (t->limbo_head && t->limbo_head->epoch < safe) {
+    *tail = t->limbo_head;
+    tail = &t->limbo_head->next;
+    t->limbo_head = t->limbo_head->next;
+  }
+  *tail = NULL;
+  if (!t->limbo_head) t->limbo_tail = NULL;
+  free_list(done);
+
+  if (wait) pthread_mutex_lock(&orphan_lock);
+  else if (pthread_mutex_trylock(&orphan_lock) != 0) return;
+  ebr_entry_t *keep = NULL;
+  done = NULL;
+  for (ebr_entry_t *e = orphans, *next; e; e = next) {
+    next = e->next;
+    ebr_entry_t **list = e->epoch < safe ? &done : &keep;
+    e->next = *list;
+    *list = e;
+  }
+  orphans = keep;
+  pthread_mutex_unlock(&orphan_lock);
+  free_list(done);
+}
+
+void ebr_retire(ebr_entry_t *entry, void (*free_fn)(ebr_entry_t *entry)) {
+  ebr_thread_t *t = thread_record();
+  entry->free_fn = free_fn;
+  entry->epoch = atomic_load(&global_epoch);
+  entry->next = NULL;
+  if (t->limbo_tail) t->limbo_tail->next = entry;
+  else t->limbo_head = entry;
+  t->limbo_tail = entry;
+  stats_add(&stat_retired, 1);
+
+  if (++t->since_reclaim >= EBR_RETIRE_BATCH) {
+    t->since_reclaim = 0;
+    // entries retired in epoch e are safe once the epoch reaches e + 2
+    reclaim(t, try_advance() - 1, false);
+  }
+}
+
+void ebr_barrier(void) {
+  ebr_thread_t *t = thread_record();
+  if (t->nesting > 0) {
+    log_message(LOG_ERROR, "ebr_barrier: called inside a read-side section.");
+    return;
+  }
+  uint64_t target = atomic_load(&global_epoch) + 2;
+  uint64_t epoch;
+  while ((epoch = try_advance()) < target) sched_yield();
+  reclaim(t, epoch - 1, true);
+}
@@ -0,0 +1,62 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <stdint.h>
+
+/**
+ * @file ebr.h
+ * @brief Epoch-based reclamation for lock-free readers.
+ *
+ * Lets writers unlink shared objects and free them only once no reader
+ * can still be looking at them, without readers taking locks or doing
+ * atomic read-modify-writes.
+ *
+ * Readers bracket their accesses with ebr_enter() and ebr_exit(). A
+ * writer publishes a replacement for an object (an atomic pointer store
+ * is enough), then passes the old one to ebr_retire(). Retired objects
+ * are freed once every thread has been outside a read-side section at
+ * least once since they were retired, i.e. after the global epoch has
+ * advanced twice.
+ *
+ * Read-side sections nest, must be short, and must not block; a reader
+ * that stalls holds up reclamation for every thread. Each thread
+ * registers itself on first use and is unregistered when it exits.
+ *
+ *     typedef struct { ebr_entry_t ebr; ... } thing_t;   // ebr first
+ *
+ *     ebr_enter();
+ *     thing_t *t = atomic_load_explicit(&shared, memory_order_acquire);
+ *     ... use t ...
+ *     ebr_exit();
+ *
+ *     atomic_store_explicit(&shared, replacement, memory_order_release);
+ *     ebr_retire(&old->ebr, free_thing);
+ */
+
+typedef struct ebr_entry {
+  struct ebr_entry *next;
+  uint64_t epoch;                             // global epoch when retired
+  void (*free_fn)(struct ebr_entry *entry);
+} ebr_entry_t;
+
+// start a read-side section
+void ebr_enter(void);
+
+// end a read-side section
+void ebr_exit(void);
+
+/**
+ * Free `entry` with `free_fn` once no reader can hold a reference to it.
+ * The entry must already be unreachable to new readers. May free other
+ * retired entries whose grace period has passed.
+ */
+void ebr_retire(ebr_entry_t *entry, void (*free_fn)(ebr_entry_t *entry));
+
+/**
+ * Wait until every entry retired so far (by any thread) may be freed,
+ * and free those retired by the calling thread or by exited threads.
+ * Must not be called inside a read-side section.
+ */
+void ebr_barrier(void);
+
+#endif // EBR_H
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "entropy.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#define KEY_BYTES 32
+#define BATCH_BLOCKS 16                   // keystream made per refill
+#define RESEED_BYTES (1u << 20)           // output between kernel reseeds
+
+typedef struct {
+  uint32_t key[8];
+  uint64_t counter;
+  unsigned char buf[64 * BATCH_BLOCKS];
+  size_t avail;                           // unread bytes at the end of buf
+  size_t since_reseed;
+  uint64_t generation;                    // fork generation when seeded; 0 = never
+} entropy_state_t;
+
+static _Thread_local entropy_state_t state;
+
+// bumped in the child after fork(), so inherited states reseed
+static _Atomic uint64_t fork_generation = 1;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static STATS_DEFINE(stat_reseeds, "entropy.reseeds");
+static STATS_DEFINE(stat_bytes, "entropy.bytes");
+
+static void after_fork_child(void) {
+  atomic_fetch_add(&fork_generation, 1);
+}
+
+static void register_atfork(void) {
+  if (pthread_atfork(NULL, NULL, after_fork_child) != 0) {
+    log_message(LOG_ERROR, "entropy: can't register fork handler.");
+  }
+}
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTER(a, b, c, d) do { \
+  a += b; d ^= a; d = ROTL(d, 16); \
+  c += d; b ^= c; b = ROTL(b, 12); \
+  a += b; d ^= a; d = ROTL(d, 8); \
+  c += d; b ^= c; b = ROTL(b, 7); \
+} while (0)
+
+void entropy_chacha20_block(const uint32_t key[8], const uint32_t input[4], unsigned char out[64]) {
+  uint32_t init[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+  memcpy(init + 4, key, 8 * sizeof *key);
+  memcpy(init + 12, input, 4 * sizeof *input);
+
+  uint32_t x[16];
+  memcpy(x, init, sizeof x);
+  for (int i = 0; i < 10; i++) {
+    QUARTER(x[0], x[4], x[8], x[12]);
+    QUARTER(x[1], x[5], x[9], x[13]);
+    QUARTER(x[2], x[6], x[10], x[14]);
+    QUARTER(x[3], x[7], x[11], x[15]);
+    QUARTER(x[0], x[5], x[10], x[15]);
+    QUARTER(x[1], x[6], x[11], x[12]);
+    QUARTER(x[2], x[7], x[8], x[13]);
+    QUARTER(x[3], x[4], x[9], x[14]);
+  }
+  for (int i = 0; i < 16; i++) {
+    uint32_t v = x[i] + init[i];
+    out[4 * i] = (unsigned char)v;
+    out[4 * i + 1] = (unsigned char)(v >> 8);
+    out[4 * i + 2] = (unsigned char)(v >> 16);
+    out[4 * i + 3] = (unsigned char)(v >> 24);
+  }
+  memset(x, 0, sizeof x);
+  memset(init, 0, sizeof init);
+}
+
+#undef QUARTER
+#undef ROTL
+
+static bool read_urandom(void *buf, size_t len) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0) return false;
+  unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      close(fd);
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  close(fd);
+  return true;
+}
+
+static bool kernel_random(void *buf, size_t len) {
+  unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t n = getrandom(p, len, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == ENOSYS) return read_urandom(p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool reseed(entropy_state_t *s, uint64_t generation) {
+  unsigned char seed[KEY_BYTES];
+  if (!kernel_random(seed, sizeof seed)) {
+    log_message(LOG_ERROR, "entropy: can't get random bytes from the kernel.");
+    return false;
+  }
+  memcpy(s->key, seed, sizeof s->key);
+  memset(seed, 0, sizeof seed);
+  s->counter = 0;
+  s->avail = 0;
+  s->since_reseed = 0;
+  s->generation = generation;
+  stats_add(&stat_reseeds, 1);
+  return true;
+}
+
+// make a batch of keystream, and take the new key from its start
+static void refill(entropy_state_t *s) {
+  for (size_t i = 0; i < BATCH_BLOCKS; i++) {
+    uint32_t input[4] = { (uint32_t)s->counter, (uint32_t)(s->counter >> 32), 0, 0 };
+    entropy_chacha20_block(s->key, input, s->buf + 64 * i);
+    s->counter++;
+  }
+  memcpy(s->key, s->buf, KEY_BYTES);
+  memset(s->buf, 0, KEY_BYTES);
+  s->avail = sizeof s->buf - KEY_BYTES;
+}
+
+bool entropy_fill(void *buf, size_t len) {
+  pthread_once(&atfork_once, register_atfork);
+  entropy_state_t *s = &state;
+  unsigned char *out = buf;
+
+  uint64_t generation = atomic_load(&fork_generation);
+  if (s->generation != generation || s->since_reseed >= RESEED_BYTES) {
+    if (!reseed(s, generation)) return false;
+  }
+
+  size_t remaining = len;
+  while (remaining > 0) {
+    if (s->avail == 0) refill(s);
+    size_t n = remaining < s->avail ? remaining : s->avail;
+    unsigned char *src = s->buf + sizeof s->buf - s->avail;
+    memcpy(out, src, n);
+    memset(src, 0, n);            // each byte is handed out once
+    s->avail -= n;
+    out += n;
+    remaining -= n;
+  }
+  s->since_reseed += len;
+  stats_add(&stat_bytes, len);
+  return true;
+}
@@ -0,0 +1,35 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file entropy.h
+ * @brief Per-thread random bytes for salts, without a syscall per salt.
+ *
+ * Each thread runs its own ChaCha20 generator, keyed from getrandom()
+ * (or /dev/urandom where that is missing). Keystream is made in 1 KiB
+ * batches. After every batch the generator rekeys from its own output
+ * ("fast key erasure"), so earlier output can't be recovered from the
+ * state. It reseeds from the kernel after every 1 MiB of output, so a
+ * 16-byte salt costs a syscall about once in 65536 calls.
+ *
+ * Fork-safe: a child process reseeds before its first use instead of
+ * repeating its parent's stream.
+ */
+
+/**
+ * Fill `buf` with `len` random bytes. Returns false, leaving `buf`
+ * undefined, if the kernel couldn't supply a seed.
+ */
+bool entropy_fill(void *buf, size_t len);
+
+/**
+ * One ChaCha20 block (RFC 8439): `input` is state words 12-15 (block
+ * counter and nonce). Exposed for testing.
+ */
+void entropy_chacha20_block(const uint32_t key[8], const uint32_t input[4], unsigned char out[64]);
+
+#endif // ENTROPY_H
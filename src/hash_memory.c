@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "hash_memory.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BUDGET_FRACTION 4       // default budget is 1/4 of physical memory
+#define FALLBACK_BUDGET ((size_t)1 << 30)
+
+typedef struct waiter {
+  size_t bytes;
+  bool granted;
+  pthread_cond_t cond;
+  struct waiter *next;
+} waiter_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t budget;                   // 0 until first use; see ensure_budget()
+static size_t in_use;
+static size_t running;
+static waiter_t *head, *tail;           // FIFO of hashes waiting for memory
+
+static STATS_DEFINE(stat_budget, "hash_memory.budget_bytes");
+static STATS_DEFINE(stat_in_use, "hash_memory.in_use_bytes");
+static STATS_DEFINE(stat_peak, "hash_memory.peak_bytes");
+static STATS_DEFINE(stat_running, "hash_memory.running");
+static STATS_DEFINE(stat_queued, "hash_memory.queued");
+static STATS_DEFINE(stat_waits, "hash_memory.waits");
+static STATS_DEFINE(stat_wait_ns, "hash_memory.wait_ns_total");
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// index of c in the crypt base-64 alphabet "./0-9A-Za-z", or -1
+static int atoi64(char c) {
+  if (c == '.') return 0;
+  if (c == '/') return 1;
+  if (c >= '0' && c <= '9') return c - '0' + 2;
+  if (c >= 'A' && c <= 'Z') return c - 'A' + 12;
+  if (c >= 'a' && c <= 'z') return c - 'a' + 38;
+  return -1;
+}
+
+// 128 * r * 2^n_log2, saturating
+static size_t block_mix_bytes(uint64_t r, unsigned n_log2) {
+  if (n_log2 >= 64 || r == 0) return 0;
+  uint64_t n = (uint64_t)1 << n_log2;
+  if (r > UINT64_MAX / 128 / n) return SIZE_MAX;
+  uint64_t bytes = 128 * r * n;
+  return bytes > SIZE_MAX ? SIZE_MAX : (size_t)bytes;
+}
+
+/*
+ * yescrypt's variable-length integer: values below 47 take one
+ * character; larger ones take more, with a wider range per extra
+ * character. Returns the characters used, or 0 if malformed.
+ */
+static size_t yescrypt_uint32(const char *s, uint32_t min, uint64_t *out) {
+  uint32_t start = 0, end = 47, chars = 1, bits = 0;
+  int c = atoi64(s[0]);
+  if (c < 0) return 0;
+  uint64_t v = min;
+  while ((uint32_t)c >= end && chars < 6) {
+    v += (uint64_t)(end - start) << bits;
+    start = end;
+    end = start + (64 - end) / 2;
+    chars++;
+    bits += 6;
+  }
+  v += (uint64_t)((uint32_t)c - start) << bits;
+  for (uint32_t i = 1; i < chars; i++) {
+    c = atoi64(s[i]);
+    if (c < 0) return 0;
+    bits -= 6;
+    v += (uint64_t)c << bits;
+  }
+  *out = v;
+  return chars;
+}
+
+// "$y$" <flavor> <N_log2 - 1> <r> ...
+static size_t yescrypt_cost(const char *s) {
+  int n;
+  uint64_t r;
+  if (atoi64(s[0]) < 0 || (n = atoi64(s[1])) < 0 || !yescrypt_uint32(s + 2, 1, &r)) return 0;
+  return block_mix_bytes(r, (unsigned)n + 1);
+}
+
+// "$7$" <N_log2> <r: 5 chars> <p: 5 chars> ..., little-endian 6-bit groups
+static size_t scrypt_cost(const char *s) {
+  if (strnlen(s, 11) < 11) return 0;
+  int n = atoi64(s[0]);
+  uint64_t r = 0, p = 0;
+  for (int i = 0; i < 5; i++) {
+    int cr = atoi64(s[1 + i]), cp = atoi64(s[6 + i]);
+    if (cr < 0 || cp < 0) return 0;
+    r |= (uint64_t)cr << (6 * i);
+    p |= (uint64_t)cp << (6 * i);
+  }
+  if (n < 0 || p == 0) return 0;
+  // the N-block table, plus one block per parallel lane
+  size_t table = block_mix_bytes(r, (unsigned)n);
+  size_t lanes = block_mix_bytes(r * p, 0);
+  return table > SIZE_MAX - lanes ? SIZE_MAX : table + lanes;
+}
+
+size_t hash_memory_cost(const char *setting) {
+  if (strncmp(setting, "$y$", 3) == 0) return yescrypt_cost(setting + 3);
+  if (strncmp(setting, "$7$", 3) == 0) return scrypt_cost(setting + 3);
+  return 0;
+}
+
+static size_t default_budget(void) {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) return FALLBACK_BUDGET;
+  return (size_t)pages / DEFAULT_BUDGET_FRACTION * (size_t)page_size;
+}
+
+// called with lock held
+static void ensure_budget(void) {
+  if (budget != 0) return;
+  budget = default_budget();
+  stats_set(&stat_budget, budget);
+}
+
+// whether a hash needing `bytes` may start now; called with lock held
+static bool fits(size_t bytes) {
+  return running == 0 || (in_use <= budget && bytes <= budget - in_use);
+}
+
+static void publish_usage(void) {
+  stats_set(&stat_in_use, in_use);
+  stats_max(&stat_peak, in_use);
+  stats_set(&stat_running, running);
+}
+
+// start waiting hashes, oldest first, while they fit; called with lock held
+static void grant_waiters(void) {
+  while (head && fits(head->bytes)) {
+    waiter_t *w = head;
+    head = w->next;
+    if (!head) tail = NULL;
+    in_use += w->bytes;
+    running++;
+    w->granted = true;
+    stats_sub(&stat_queued, 1);
+    pthread_cond_signal(&w->cond);
+  }
+  publish_usage();
+}
+
+void hash_memory_set_budget(size_t bytes) {
+  pthread_mutex_lock(&lock);
+  budget = bytes ? bytes : default_budget();
+  stats_set(&stat_budget, budget);
+  grant_waiters();
+  pthread_mutex_unlock(&lock);
+}
+
+size_t hash_memory_budget(void) {
+  pthread_mutex_lock(&lock);
+  ensure_budget();
+  size_t b = budget;
+  pthread_mutex_unlock(&lock);
+  return b;
+}
+
+void hash_memory_acquire(const char *setting, hash_memory_ticket_t *ticket) {
+  ticket->bytes = hash_memory_cost(setting);
+  if (ticket->bytes == 0) return;
+
+  pthread_mutex_lock(&lock);
+  ensure_budget();
+  if (!head && fits(ticket->bytes)) {
+    in_use += ticket->bytes;
+    running++;
+    publish_usage();
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  waiter_t w = { .bytes = ticket->bytes };
+  pthread_cond_init(&w.cond, NULL);
+  if (tail) tail->next = &w;
+  else head = &w;
+  tail = &w;
+  stats_add(&stat_queued, 1);
+  stats_add(&stat_waits, 1);
+
+  uint64_t start = now_ns();
+  while (!w.granted) pthread_cond_wait(&w.cond, &lock);
+  pthread_mutex_unlock(&lock);
+  pthread_cond_destroy(&w.cond);
+  stats_add(&stat_wait_ns, now_ns() - start);
+}
+
+void hash_memory_release(hash_memory_ticket_t *ticket) {
+  if (ticket->bytes == 0) return;
+  pthread_mutex_lock(&lock);
+  in_use -= ticket->bytes;
+  running--;
+  ticket->bytes = 0;
+  grant_waiters();
+  pthread_mutex_unlock(&lock);
+}
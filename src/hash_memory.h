@@ -0,0 +1,57 @@
+#ifndef HASH_MEMORY_H
+#define HASH_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file hash_memory.h
+ * @brief Memory budget for concurrent memory-hard password hashes.
+ *
+ * yescrypt ($y$) and scrypt ($7$) hashes each allocate a working area
+ * of 128 * r * N bytes, set by the cost parameters in the hash string
+ * (16 MiB for `$y$j9T$`, 64 MiB for `$y$jBT$`). Enough of them at once
+ * can exhaust memory, so every crypt_r() call in account.c first takes
+ * its share of a process-wide budget. Hashes that don't fit wait, in
+ * arrival order, for running ones to finish.
+ *
+ * A hash bigger than the whole budget may still run, but only alone.
+ * Other hash types use little memory and aren't limited.
+ *
+ * Published stats: hash_memory.budget_bytes, hash_memory.in_use_bytes,
+ * hash_memory.peak_bytes, hash_memory.running, hash_memory.queued,
+ * hash_memory.waits and hash_memory.wait_ns_total.
+ */
+
+// Memory reserved by hash_memory_acquire(); pass back to hash_memory_release().
+typedef struct {
+  size_t bytes;
+} hash_memory_ticket_t;
+
+/**
+ * Bytes that hashing with `setting` (a hash string, or the start of
+ * one) needs as working memory, or 0 if it isn't a memory-hard
+ * algorithm or its parameters can't be read.
+ */
+size_t hash_memory_cost(const char *setting);
+
+/**
+ * Set the budget, in bytes. 0 restores the default, a quarter of
+ * physical memory. Waiting hashes that now fit are started.
+ */
+void hash_memory_set_budget(size_t bytes);
+
+// the current budget, in bytes
+size_t hash_memory_budget(void);
+
+/**
+ * Reserve memory for one hash with `setting`, blocking until it fits
+ * in the budget. Always succeeds; call hash_memory_release() with the
+ * same ticket once the hash is done.
+ */
+void hash_memory_acquire(const char *setting, hash_memory_ticket_t *ticket);
+
+// return the memory reserved by hash_memory_acquire()
+void hash_memory_release(hash_memory_ticket_t *ticket);
+
+#endif // HASH_MEMORY_H
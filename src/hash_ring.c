@@ -0,0 +1,169 @@
+#include "hash_ring.h"
+#include "account_store.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint64_t hash;
+  size_t node;
+} ring_point_t;
+
+struct hash_ring {
+  size_t vnodes;
+  char (*nodes)[HASH_RING_NODE_NAME_MAX];
+  size_t node_count;
+  ring_point_t *points;   // sorted by hash
+  size_t point_count;
+};
+
+// Finaliser from MurmurHash3; spreads FNV's output evenly over the ring.
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t point_hash(const char *node, size_t replica) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = node; *p; p++) {
+    h ^= (unsigned char)*p;
+    h *= 0x100000001b3ULL;
+  }
+  return mix64(h ^ ((uint64_t)replica * 0x9e3779b97f4a7c15ULL));
+}
+
+static int compare_points(const void *a, const void *b) {
+  const ring_point_t *x = a;
+  const ring_point_t *y = b;
+  if (x->hash != y->hash) return x->hash > y->hash ? 1 : -1;
+  // break (astronomically unlikely) ties deterministically
+  return (x->node > y->node) - (x->node < y->node);
+}
+
+static long find_node(const hash_ring_t *ring, const char *node) {
+  for (size_t i = 0; i < ring->node_count; i++) {
+    if (strcmp(ring->nodes[i], node) == 0) return (long)i;
+  }
+  return -1;
+}
+
+hash_ring_t *hash_ring_create(size_t vnodes) {
+  if (vnodes == 0) {
+    log_message(LOG_ERROR, "hash_ring_create: vnodes must be positive.");
+    return NULL;
+  }
+  hash_ring_t *ring = calloc(1, sizeof *ring);
+  if (!ring) {
+    log_message(LOG_ERROR, "hash_ring_create: failed to allocate.");
+    return NULL;
+  }
+  ring->vnodes = vnodes;
+  return ring;
+}
+
+void hash_ring_free(hash_ring_t *ring) {
+  if (!ring) return;
+  free(ring->nodes);
+  free(ring->points);
+  free(ring);
+}
+
+bool hash_ring_add(hash_ring_t *ring, const char *node) {
+  if (!ring || !node || strlen(node) >= HASH_RING_NODE_NAME_MAX) {
+    log_message(LOG_ERROR, "hash_ring_add: invalid node name.");
+    return false;
+  }
+  if (find_node(ring, node) >= 0) return false;
+
+  char (*nodes)[HASH_RING_NODE_NAME_MAX] =
+    realloc(ring->nodes, (ring->node_count + 1) * sizeof *nodes);
+  if (!nodes) {
+    log_message(LOG_ERROR, "hash_ring_add: failed to allocate.");
+    return false;
+  }
+  ring->nodes = nodes;
+
+  ring_point_t *points = realloc(ring->points, (ring->point_count + ring->vnodes) * sizeof *points);
+  if (!points) {
+    log_message(LOG_ERROR, "hash_ring_add: failed to allocate.");
+    return false;
+  }
+  ring->points = points;
+
+  size_t idx = ring->node_count++;
+  memcpy(ring->nodes[idx], node, strlen(node) + 1);
+  for (size_t i = 0; i < ring->vnodes; i++) {
+    ring->points[ring->point_count++] = (ring_point_t){ point_hash(node, i), idx };
+  }
+  qsort(ring->points, ring->point_count, sizeof *ring->points, compare_points);
+  return true;
+}
+
+bool hash_ring_remove(hash_ring_t *ring, const char *node) {
+  if (!ring || !node) return false;
+  long found = find_node(ring, node);
+  if (found < 0) return false;
+  size_t idx = (size_t)found;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < ring->point_count; i++) {
+    ring_point_t p = ring->points[i];
+    if (p.node == idx) continue;
+    if (p.node > idx) p.node--;
+    ring->points[kept++] = p;
+  }
+  ring->point_count = kept;
+
+  memmove(ring->nodes[idx], ring->nodes[idx + 1],
+          (ring->node_count - idx - 1) * sizeof *ring->nodes);
+  ring->node_count--;
+  return true;
+}
+
+bool hash_ring_contains(const hash_ring_t *ring, const char *node) {
+  return ring && node && find_node(ring, node) >= 0;
+}
+
+// index of the first point at or after `userid`'s place on the ring
+static size_t first_point(const hash_ring_t *ring, const char *userid) {
+  uint64_t h = mix64(account_store_hash_userid(userid));
+  size_t lo = 0, hi = ring->point_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ring->points[mid].hash < h) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo == ring->point_count ? 0 : lo;   // wrap around
+}
+
+const char *hash_ring_owner(const hash_ring_t *ring, const char *userid) {
+  if (!ring || !userid || ring->point_count == 0) return NULL;
+  return ring->nodes[ring->points[first_point(ring, userid)].node];
+}
+
+const char *hash_ring_owner_without(const hash_ring_t *ring, const char *userid,
+                                    const char *node) {
+  if (!ring || !userid || ring->point_count == 0) return NULL;
+  long skip = node ? find_node(ring, node) : -1;
+  size_t start = first_point(ring, userid);
+  for (size_t n = 0; n < ring->point_count; n++) {
+    const ring_point_t *p = &ring->points[(start + n) % ring->point_count];
+    if ((long)p->node != skip) return ring->nodes[p->node];
+  }
+  return NULL;
+}
+
+size_t hash_ring_node_count(const hash_ring_t *ring) {
+  return ring ? ring->node_count : 0;
+}
+
+const char *hash_ring_node(const hash_ring_t *ring, size_t i) {
+  if (!ring || i >= ring->node_count) return NULL;
+  return ring->nodes[i];
+}
@@ -0,0 +1,61 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file hash_ring.h
+ * @brief Consistent hashing of userids onto a set of named nodes.
+ *
+ * Each node is placed on a 64-bit ring at `vnodes` pseudo-random points
+ * derived from its name; a userid belongs to the node owning the first
+ * point at or after the userid's hash. Adding or removing a node only
+ * moves the userids adjacent to that node's points, about 1/N of the
+ * total. Placement depends only on node names, so every process that
+ * builds a ring from the same names agrees on ownership.
+ *
+ * Not thread-safe; callers serialise access.
+ */
+
+#define HASH_RING_NODE_NAME_MAX 128
+#define HASH_RING_DEFAULT_VNODES 160
+
+typedef struct hash_ring hash_ring_t;
+
+/**
+ * Create an empty ring with `vnodes` points per node.
+ * Returns NULL and logs an error message on failure.
+ */
+hash_ring_t *hash_ring_create(size_t vnodes);
+
+void hash_ring_free(hash_ring_t *ring);
+
+// add a node (name copied). returns false if already present or on error.
+bool hash_ring_add(hash_ring_t *ring, const char *node);
+
+// remove a node. returns false if it wasn't present.
+bool hash_ring_remove(hash_ring_t *ring, const char *node);
+
+// whether a node is on the ring
+bool hash_ring_contains(const hash_ring_t *ring, const char *node);
+
+/**
+ * Name of the node owning `userid`, or NULL if the ring is empty.
+ * The pointer stays valid until that node is removed.
+ */
+const char *hash_ring_owner(const hash_ring_t *ring, const char *userid);
+
+/**
+ * Name of the node that would own `userid` if `node` weren't on the
+ * ring (its owner before `node` was added), or NULL if there is none.
+ */
+const char *hash_ring_owner_without(const hash_ring_t *ring, const char *userid,
+                                    const char *node);
+
+size_t hash_ring_node_count(const hash_ring_t *ring);
+
+// name of the i'th node (in insertion order, with removals compacted)
+const char *hash_ring_node(const hash_ring_t *ring, size_t i);
+
+#endif // HASH_RING_H
@@ -0,0 +1,71 @@
+#include "latency_hist.h"
+
+#include <string.h>
+
+#define EXACT_LIMIT (2 * LATENCY_HIST_SUB_BUCKETS)
+
+static unsigned bucket_index(uint64_t v) {
+  if (v < EXACT_LIMIT) return (unsigned)v;
+
+  unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+  unsigned e = msb - 6u;  // so that (v >> e) is in [64, 127]
+  if (e > LATENCY_HIST_MAX_EXPONENT) return LATENCY_HIST_BUCKETS - 1;
+  return EXACT_LIMIT + (e - 1u) * LATENCY_HIST_SUB_BUCKETS +
+         (unsigned)((v >> e) - LATENCY_HIST_SUB_BUCKETS);
+}
+
+static uint64_t bucket_upper_bound(unsigned idx) {
+  if (idx < EXACT_LIMIT) return idx;
+
+  unsigned e = (idx - EXACT_LIMIT) / LATENCY_HIST_SUB_BUCKETS + 1u;
+  uint64_t m = (idx - EXACT_LIMIT) % LATENCY_HIST_SUB_BUCKETS + LATENCY_HIST_SUB_BUCKETS;
+  return ((m + 1) << e) - 1;
+}
+
+void latency_hist_init(latency_hist_t *h) {
+  memset(h, 0, sizeof *h);
+  h->min = UINT64_MAX;
+}
+
+void latency_hist_record(latency_hist_t *h, uint64_t value_ns) {
+  h->counts[bucket_index(value_ns)]++;
+  h->total++;
+  h->sum += value_ns;
+  if (value_ns < h->min) h->min = value_ns;
+  if (value_ns > h->max) h->max = value_ns;
+}
+
+void latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src) {
+  for (size_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min) dst->min = src->min;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t latency_hist_percentile(const latency_hist_t *h, double percentile) {
+  if (h->total == 0) return 0;
+  if (percentile < 0.0) percentile = 0.0;
+  if (percentile > 100.0) percentile = 100.0;
+
+  // rank of the requested value, 1-based, rounded up
+  uint64_t rank = (uint64_t)((percentile / 100.0) * (double)h->total + 0.999999);
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t v = bucket_upper_bound(i);
+      return v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+double latency_hist_mean(const latency_hist_t *h) {
+  if (h->total == 0) return 0.0;
+  return (double)h->sum / (double)h->total;
+}
@@ -0,0 +1,49 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+
+/**
+ * @file latency_hist.h
+ * @brief Fixed-size log-linear latency histogram.
+ *
+ * Values are nanoseconds. Values below 128 are recorded exactly; above
+ * that, each power of two is split into 64 linear buckets, so any
+ * recorded value is reported to within 1.6% of its true value. The
+ * histogram is a plain struct with no heap allocation and is not
+ * thread-safe: give each thread its own and merge them afterwards.
+ */
+
+#define LATENCY_HIST_SUB_BUCKETS 64
+#define LATENCY_HIST_MAX_EXPONENT 40   // covers values up to ~2^47 ns (~39 hours)
+#define LATENCY_HIST_BUCKETS (2 * LATENCY_HIST_SUB_BUCKETS + \
+                              LATENCY_HIST_MAX_EXPONENT * LATENCY_HIST_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t counts[LATENCY_HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+} latency_hist_t;
+
+// reset a histogram to empty
+void latency_hist_init(latency_hist_t *h);
+
+// record one value (in nanoseconds)
+void latency_hist_record(latency_hist_t *h, uint64_t value_ns);
+
+// add all values recorded in `src` to `dst`
+void latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src);
+
+/**
+ * Value at the given percentile (0.0 to 100.0), or 0 for an empty
+ * histogram. The result is the upper bound of the bucket that holds the
+ * requested rank, clamped to the largest recorded value.
+ */
+uint64_t latency_hist_percentile(const latency_hist_t *h, double percentile);
+
+// mean of recorded values, or 0 for an empty histogram
+double latency_hist_mean(const latency_hist_t *h);
+
+#endif // LATENCY_HIST_H
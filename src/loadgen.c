@@ -0,0 +1,570 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "loadgen.h"
+#include "cluster.h"
+#include "login_admission.h"
+#include "logging.h"
+#include "wire.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_LINE_MAX 512
+#define LATE_START_NS 1000000ULL   // 1ms
+#define RUN_START_DELAY_NS 10000000ULL  // give threads time to start before the first event
+
+static const char *const kind_names[LOADGEN_KIND_COUNT] = {
+  [LOADGEN_VALID] = "valid",
+  [LOADGEN_BAD_PASSWORD] = "bad_password",
+  [LOADGEN_UNKNOWN_USER] = "unknown_user",
+  [LOADGEN_BANNED] = "banned",
+  [LOADGEN_EXPIRED] = "expired",
+};
+
+static const login_result_t expected_results[LOADGEN_KIND_COUNT] = {
+  [LOADGEN_VALID] = LOGIN_SUCCESS,
+  [LOADGEN_BAD_PASSWORD] = LOGIN_FAIL_BAD_PASSWORD,
+  [LOADGEN_UNKNOWN_USER] = LOGIN_FAIL_USER_NOT_FOUND,
+  [LOADGEN_BANNED] = LOGIN_FAIL_ACCOUNT_BANNED,
+  [LOADGEN_EXPIRED] = LOGIN_FAIL_ACCOUNT_EXPIRED,
+};
+
+const char *loadgen_kind_name(loadgen_kind_t kind) {
+  if ((unsigned)kind >= LOADGEN_KIND_COUNT) return NULL;
+  return kind_names[kind];
+}
+
+const char *loadgen_result_name(login_result_t result) {
+  switch (result) {
+    case LOGIN_SUCCESS: return "LOGIN_SUCCESS";
+    case LOGIN_FAIL_USER_NOT_FOUND: return "LOGIN_FAIL_USER_NOT_FOUND";
+    case LOGIN_FAIL_BAD_PASSWORD: return "LOGIN_FAIL_BAD_PASSWORD";
+    case LOGIN_FAIL_ACCOUNT_EXPIRED: return "LOGIN_FAIL_ACCOUNT_EXPIRED";
+    case LOGIN_FAIL_ACCOUNT_BANNED: return "LOGIN_FAIL_ACCOUNT_BANNED";
+    case LOGIN_FAIL_IP_BANNED: return "LOGIN_FAIL_IP_BANNED";
+    case LOGIN_FAIL_INTERNAL_ERROR: return "LOGIN_FAIL_INTERNAL_ERROR";
+  }
+  return "LOGIN_UNKNOWN_RESULT";
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t) {
+  struct timespec ts = {
+    .tv_sec = (time_t)(t / 1000000000ULL),
+    .tv_nsec = (long)(t % 1000000000ULL),
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    // interrupted by a signal; keep waiting
+  }
+}
+
+////
+// Random numbers (splitmix64; statistical quality is all that's needed here)
+
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// uniform double in (0, 1]
+static double rng_unit(uint64_t *state) {
+  return ((double)(rng_next(state) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+static size_t rng_below(uint64_t *state, size_t n) {
+  return (size_t)(rng_next(state) % n);
+}
+
+// Map IP pool index to an address in 10.0.0.0/8. The multiplier is odd,
+// so this is a bijection on 24 bits that scatters neighbouring indexes
+// across different /24s.
+static ip4_addr_t pool_ip(size_t idx) {
+  return (ip4_addr_t)(0x0A000000u | (((uint32_t)idx * 0x9E3779B1u) & 0x00FFFFFFu));
+}
+
+////
+// Traces
+
+void loadgen_synth_defaults(loadgen_synth_params_t *params) {
+  memset(params, 0, sizeof *params);
+  params->accounts = 1000;
+  params->mix[LOADGEN_VALID] = 70.0;
+  params->mix[LOADGEN_BAD_PASSWORD] = 15.0;
+  params->mix[LOADGEN_UNKNOWN_USER] = 10.0;
+  params->mix[LOADGEN_BANNED] = 3.0;
+  params->mix[LOADGEN_EXPIRED] = 2.0;
+  params->qps = 10.0;
+  params->duration_s = 10.0;
+  params->poisson = true;
+  params->ip_pool = 10000;
+  params->ip_skew = 1.0;
+  params->seed = 1;
+}
+
+void loadgen_trace_free(loadgen_trace_t *trace) {
+  if (!trace) return;
+  free(trace->events);
+  memset(trace, 0, sizeof *trace);
+}
+
+static loadgen_event_t *trace_append(loadgen_trace_t *trace) {
+  if (trace->count == trace->capacity) {
+    size_t capacity = trace->capacity ? trace->capacity * 2 : 1024;
+    loadgen_event_t *events = realloc(trace->events, capacity * sizeof *events);
+    if (!events) {
+      log_message(LOG_ERROR, "loadgen: failed to grow trace.");
+      return NULL;
+    }
+    trace->events = events;
+    trace->capacity = capacity;
+  }
+  loadgen_event_t *ev = &trace->events[trace->count++];
+  memset(ev, 0, sizeof *ev);
+  return ev;
+}
+
+static void event_userid(loadgen_event_t *ev, loadgen_kind_t kind, size_t n) {
+  const char *prefix;
+  switch (kind) {
+    case LOADGEN_BANNED: prefix = "banned"; break;
+    case LOADGEN_EXPIRED: prefix = "expired"; break;
+    case LOADGEN_UNKNOWN_USER: prefix = "ghost"; break;
+    default: prefix = "user"; break;
+  }
+  snprintf(ev->userid, sizeof ev->userid, "%s-%zu", prefix, n);
+}
+
+bool loadgen_synthesise(const loadgen_synth_params_t *params, loadgen_trace_t *trace) {
+  if (!params || !trace || params->accounts == 0 || params->ip_pool == 0 ||
+      params->qps <= 0.0 || params->duration_s <= 0.0) {
+    log_message(LOG_ERROR, "loadgen_synthesise: invalid parameters.");
+    return false;
+  }
+
+  double mix_total = 0.0;
+  for (size_t k = 0; k < LOADGEN_KIND_COUNT; k++) {
+    if (params->mix[k] < 0.0) {
+      log_message(LOG_ERROR, "loadgen_synthesise: negative mix weight.");
+      return false;
+    }
+    mix_total += params->mix[k];
+  }
+  if (mix_total <= 0.0) {
+    log_message(LOG_ERROR, "loadgen_synthesise: mix weights sum to zero.");
+    return false;
+  }
+
+  // cumulative distribution of IP popularity (Zipf with exponent ip_skew)
+  double *ip_cdf = malloc(params->ip_pool * sizeof *ip_cdf);
+  if (!ip_cdf) {
+    log_message(LOG_ERROR, "loadgen_synthesise: failed to allocate IP table.");
+    return false;
+  }
+  double acc = 0.0;
+  for (size_t i = 0; i < params->ip_pool; i++) {
+    acc += 1.0 / pow((double)(i + 1), params->ip_skew);
+    ip_cdf[i] = acc;
+  }
+
+  uint64_t rng = params->seed;
+  uint64_t duration_ns = (uint64_t)(params->duration_s * 1e9);
+  double t = 0.0;
+  size_t n = 0;
+
+  for (;;) {
+    if (params->poisson) {
+      t += -log(rng_unit(&rng)) / params->qps * 1e9;
+    } else {
+      t = (double)n / params->qps * 1e9;
+    }
+    if ((uint64_t)t >= duration_ns) break;
+
+    loadgen_event_t *ev = trace_append(trace);
+    if (!ev) {
+      free(ip_cdf);
+      return false;
+    }
+    ev->offset_ns = (uint64_t)t;
+
+    double pick = rng_unit(&rng) * mix_total;
+    size_t kind = 0;
+    while (kind + 1 < LOADGEN_KIND_COUNT && pick > params->mix[kind]) {
+      pick -= params->mix[kind];
+      kind++;
+    }
+    ev->kind = (loadgen_kind_t)kind;
+
+    // unknown users are drawn from a much larger space so they rarely repeat
+    size_t space = params->accounts * (ev->kind == LOADGEN_UNKNOWN_USER ? 100 : 1);
+    event_userid(ev, ev->kind, rng_below(&rng, space));
+
+    double target = rng_unit(&rng) * acc;
+    size_t lo = 0, hi = params->ip_pool - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ip_cdf[mid] < target) lo = mid + 1;
+      else hi = mid;
+    }
+    ev->client_ip = pool_ip(lo);
+    n++;
+  }
+
+  free(ip_cdf);
+  return true;
+}
+
+static int compare_events(const void *a, const void *b) {
+  const loadgen_event_t *x = a;
+  const loadgen_event_t *y = b;
+  return (x->offset_ns > y->offset_ns) - (x->offset_ns < y->offset_ns);
+}
+
+static bool parse_ip(const char *s, ip4_addr_t *ip) {
+  unsigned a, b, c, d;
+  char extra;
+  if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 ||
+      a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  *ip = (ip4_addr_t)((a << 24) | (b << 16) | (c << 8) | d);
+  return true;
+}
+
+static bool parse_kind(const char *s, loadgen_kind_t *kind) {
+  for (size_t k = 0; k < LOADGEN_KIND_COUNT; k++) {
+    if (strcmp(s, kind_names[k]) == 0) {
+      *kind = (loadgen_kind_t)k;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool loadgen_trace_read(FILE *f, loadgen_trace_t *trace) {
+  if (!f || !trace) {
+    log_message(LOG_ERROR, "loadgen_trace_read: NULL argument.");
+    return false;
+  }
+
+  char line[TRACE_LINE_MAX];
+  size_t lineno = 0;
+  while (fgets(line, sizeof line, f)) {
+    lineno++;
+    char *save = NULL;
+    char *offset = strtok_r(line, " \t\r\n", &save);
+    if (!offset || offset[0] == '#') continue;
+    char *kind = strtok_r(NULL, " \t\r\n", &save);
+    char *userid = strtok_r(NULL, " \t\r\n", &save);
+    char *ip = strtok_r(NULL, " \t\r\n", &save);
+
+    char *end;
+    unsigned long long offset_us = strtoull(offset, &end, 10);
+    loadgen_kind_t k;
+    ip4_addr_t addr;
+    if (*end != '\0' || !kind || !userid || !ip || strtok_r(NULL, " \t\r\n", &save) ||
+        !parse_kind(kind, &k) || strlen(userid) >= USER_ID_LENGTH || !parse_ip(ip, &addr) ||
+        offset_us > UINT64_MAX / 1000) {
+      log_message(LOG_ERROR, "loadgen_trace_read: malformed trace at line %zu.", lineno);
+      return false;
+    }
+
+    loadgen_event_t *ev = trace_append(trace);
+    if (!ev) return false;
+    ev->offset_ns = (uint64_t)offset_us * 1000;
+    ev->kind = k;
+    ev->client_ip = addr;
+    memcpy(ev->userid, userid, strlen(userid) + 1);
+  }
+  if (ferror(f)) {
+    log_message(LOG_ERROR, "loadgen_trace_read: read error.");
+    return false;
+  }
+
+  qsort(trace->events, trace->count, sizeof *trace->events, compare_events);
+  return true;
+}
+
+bool loadgen_trace_write(const loadgen_trace_t *trace, FILE *f) {
+  if (!trace || !f) {
+    log_message(LOG_ERROR, "loadgen_trace_write: NULL argument.");
+    return false;
+  }
+  if (fprintf(f, "# offset_us kind userid ip\n") < 0) return false;
+  for (size_t i = 0; i < trace->count; i++) {
+    const loadgen_event_t *ev = &trace->events[i];
+    if (fprintf(f, "%" PRIu64 " %s %s %u.%u.%u.%u\n",
+                ev->offset_ns / 1000, kind_names[ev->kind], ev->userid,
+                (ev->client_ip >> 24) & 0xFF, (ev->client_ip >> 16) & 0xFF,
+                (ev->client_ip >> 8) & 0xFF, ev->client_ip & 0xFF) < 0) {
+      return false;
+    }
+  }
+  return fflush(f) == 0;
+}
+
+bool loadgen_seed_store(const loadgen_trace_t *trace, account_store_t *store) {
+  if (!trace || !store) {
+    log_message(LOG_ERROR, "loadgen_seed_store: NULL argument.");
+    return false;
+  }
+
+  account_t tmpl = {0};
+  memcpy(tmpl.birthdate, "1990-01-01", BIRTHDATE_LENGTH);
+  if (!account_update_password(&tmpl, LOADGEN_SEED_PASSWORD)) {
+    log_message(LOG_ERROR, "loadgen_seed_store: failed to hash seed password.");
+    return false;
+  }
+
+  time_t now = time(NULL);
+  int64_t next_id = (int64_t)account_store_count(store) + 1;
+  for (size_t i = 0; i < trace->count; i++) {
+    const loadgen_event_t *ev = &trace->events[i];
+    if (ev->kind == LOADGEN_UNKNOWN_USER) continue;
+
+    account_t acc;
+    if (account_store_get(store, ev->userid, &acc)) continue;
+
+    acc = tmpl;
+    acc.account_id = next_id++;
+    memcpy(acc.userid, ev->userid, sizeof acc.userid);
+    snprintf(acc.email, sizeof acc.email, "%.60s@example.com", ev->userid);
+    if (ev->kind == LOADGEN_BANNED) acc.unban_time = now + 24 * 3600;
+    if (ev->kind == LOADGEN_EXPIRED) acc.expiration_time = now - 24 * 3600;
+    if (!account_store_put(store, &acc)) return false;
+  }
+  memset(&tmpl, 0, sizeof tmpl);
+  return true;
+}
+
+////
+// Running
+
+login_result_t loadgen_inprocess_login(void *ctx, const char *userid, const char *password,
+                                       ip4_addr_t client_ip, time_t login_time) {
+  int fd = *(const int *)ctx;
+  login_session_data_t session;
+  return handle_login(userid, password, client_ip, login_time, fd, fd, &session);
+}
+
+login_result_t loadgen_admission_login(void *ctx, const char *userid, const char *password,
+                                       ip4_addr_t client_ip, time_t login_time) {
+  const loadgen_admission_ctx_t *actx = ctx;
+  login_session_data_t session;
+  struct timespec deadline;
+  if (actx->timeout_ms > 0) admission_deadline_in(&deadline, actx->timeout_ms);
+  return handle_login_admitted(userid, password, client_ip, login_time, actx->fd, actx->fd,
+                               &session, actx->adm, actx->timeout_ms > 0 ? &deadline : NULL,
+                               NULL);
+}
+
+// each worker thread keeps its own connection
+static _Thread_local int remote_fd = -1;
+
+login_result_t loadgen_remote_login(void *ctx, const char *userid, const char *password,
+                                    ip4_addr_t client_ip, time_t login_time) {
+  const loadgen_remote_ctx_t *rctx = ctx;
+  if (remote_fd < 0) remote_fd = wire_connect(rctx->addr);
+  if (remote_fd < 0) return LOGIN_FAIL_INTERNAL_ERROR;
+
+  login_result_t res;
+  if (!cluster_login(remote_fd, userid, password, client_ip, login_time, &res, NULL)) {
+    close(remote_fd);
+    remote_fd = -1;
+    return LOGIN_FAIL_INTERNAL_ERROR;
+  }
+  return res;
+}
+
+void loadgen_remote_thread_done(void *ctx) {
+  (void)ctx;
+  if (remote_fd >= 0) close(remote_fd);
+  remote_fd = -1;
+}
+
+typedef struct {
+  int fd;
+  bool ok;
+} remote_seed_t;
+
+static bool put_remote(const account_t *acc, void *arg) {
+  remote_seed_t *rs = arg;
+  rs->ok = cluster_put_account(rs->fd, acc);
+  return rs->ok;
+}
+
+bool loadgen_seed_remote(const loadgen_trace_t *trace, const char *addr) {
+  if (!trace || !addr) {
+    log_message(LOG_ERROR, "loadgen_seed_remote: NULL argument.");
+    return false;
+  }
+  account_store_t *local = account_store_create(trace->count);
+  if (!local || !loadgen_seed_store(trace, local)) {
+    account_store_free(local);
+    return false;
+  }
+  remote_seed_t rs = { .fd = wire_connect(addr), .ok = true };
+  if (rs.fd >= 0) {
+    account_store_foreach(local, put_remote, &rs);
+    close(rs.fd);
+  }
+  account_store_free(local);
+  if (rs.fd < 0 || !rs.ok) {
+    log_message(LOG_ERROR, "loadgen_seed_remote: failed to send accounts to '%s'.", addr);
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  const loadgen_trace_t *trace;
+  const loadgen_driver_t *driver;
+  double time_scale;
+  uint64_t start_ns;
+  atomic_size_t next;
+
+  pthread_mutex_t lock;
+  loadgen_report_t *report;
+} run_shared_t;
+
+static void *run_worker(void *arg) {
+  run_shared_t *shared = arg;
+
+  // per-thread results, merged once at the end to keep the hot path free of contention
+  loadgen_report_t *local = malloc(sizeof *local);
+  if (!local) {
+    log_message(LOG_ERROR, "loadgen_run: failed to allocate worker report.");
+    return NULL;
+  }
+  for (size_t r = 0; r < LOADGEN_RESULT_COUNT; r++) latency_hist_init(&local->by_result[r]);
+  local->mismatched = 0;
+  local->late_starts = 0;
+
+  for (;;) {
+    size_t i = atomic_fetch_add(&shared->next, 1);
+    if (i >= shared->trace->count) break;
+    const loadgen_event_t *ev = &shared->trace->events[i];
+
+    uint64_t intended = shared->start_ns + (uint64_t)((double)ev->offset_ns * shared->time_scale);
+    uint64_t now = now_ns();
+    if (now < intended) {
+      sleep_until_ns(intended);
+    } else if (now - intended > LATE_START_NS) {
+      local->late_starts++;
+    }
+
+    const char *password = ev->kind == LOADGEN_BAD_PASSWORD ? LOADGEN_WRONG_PASSWORD
+                                                            : LOADGEN_SEED_PASSWORD;
+    login_result_t res = shared->driver->login(shared->driver->ctx, ev->userid, password,
+                                               ev->client_ip, time(NULL));
+    uint64_t done = now_ns();
+
+    size_t r = (unsigned)res < LOADGEN_RESULT_COUNT ? (size_t)res : LOGIN_FAIL_INTERNAL_ERROR;
+    latency_hist_record(&local->by_result[r], done - intended);
+    if (res != expected_results[ev->kind]) local->mismatched++;
+  }
+
+  if (shared->driver->thread_done) shared->driver->thread_done(shared->driver->ctx);
+
+  pthread_mutex_lock(&shared->lock);
+  for (size_t r = 0; r < LOADGEN_RESULT_COUNT; r++) {
+    latency_hist_merge(&shared->report->by_result[r], &local->by_result[r]);
+  }
+  shared->report->mismatched += local->mismatched;
+  shared->report->late_starts += local->late_starts;
+  pthread_mutex_unlock(&shared->lock);
+
+  free(local);
+  return NULL;
+}
+
+bool loadgen_run(const loadgen_trace_t *trace, const loadgen_run_params_t *params,
+                 const loadgen_driver_t *driver, loadgen_report_t *report) {
+  if (!trace || !params || !driver || !driver->login || !report || params->threads == 0) {
+    log_message(LOG_ERROR, "loadgen_run: invalid arguments.");
+    return false;
+  }
+
+  memset(report, 0, sizeof *report);
+  for (size_t r = 0; r < LOADGEN_RESULT_COUNT; r++) latency_hist_init(&report->by_result[r]);
+  latency_hist_init(&report->all);
+
+  run_shared_t shared = {
+    .trace = trace,
+    .driver = driver,
+    .time_scale = 1.0,
+    .report = report,
+  };
+  atomic_init(&shared.next, 0);
+  pthread_mutex_init(&shared.lock, NULL);
+
+  // retime to the requested rate, keeping the trace's relative spacing
+  if (params->qps > 0.0 && trace->count > 1) {
+    uint64_t span = trace->events[trace->count - 1].offset_ns - trace->events[0].offset_ns;
+    double target_span = (double)(trace->count - 1) / params->qps * 1e9;
+    if (span > 0) shared.time_scale = target_span / (double)span;
+  }
+
+  pthread_t *threads = calloc(params->threads, sizeof *threads);
+  if (!threads) {
+    log_message(LOG_ERROR, "loadgen_run: failed to allocate threads.");
+    pthread_mutex_destroy(&shared.lock);
+    return false;
+  }
+
+  shared.start_ns = now_ns() + RUN_START_DELAY_NS;
+  size_t started = 0;
+  for (; started < params->threads; started++) {
+    if (pthread_create(&threads[started], NULL, run_worker, &shared) != 0) {
+      log_message(LOG_WARN, "loadgen_run: started only %zu of %zu threads.", started, params->threads);
+      break;
+    }
+  }
+  for (size_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  uint64_t end = now_ns();
+
+  free(threads);
+  pthread_mutex_destroy(&shared.lock);
+  if (started == 0) return false;
+
+  report->elapsed_ns = end > shared.start_ns ? end - shared.start_ns : 0;
+  for (size_t r = 0; r < LOADGEN_RESULT_COUNT; r++) {
+    latency_hist_merge(&report->all, &report->by_result[r]);
+  }
+  return true;
+}
+
+static void print_row(int fd, const char *name, const latency_hist_t *h) {
+  dprintf(fd, "%-28s %10" PRIu64 " %10.3f %10.3f %10.3f %10.3f\n", name, h->total,
+          (double)latency_hist_percentile(h, 50.0) / 1e6,
+          (double)latency_hist_percentile(h, 99.0) / 1e6,
+          (double)latency_hist_percentile(h, 99.9) / 1e6,
+          (double)h->max / 1e6);
+}
+
+void loadgen_report_print(const loadgen_report_t *report, int fd) {
+  double secs = (double)report->elapsed_ns / 1e9;
+  dprintf(fd, "requests: %" PRIu64 " in %.3fs (%.1f req/s)\n", report->all.total, secs,
+          secs > 0.0 ? (double)report->all.total / secs : 0.0);
+  dprintf(fd, "unexpected results: %" PRIu64 ", late starts: %" PRIu64 "\n",
+          report->mismatched, report->late_starts);
+  dprintf(fd, "%-28s %10s %10s %10s %10s %10s\n", "result", "count",
+          "p50(ms)", "p99(ms)", "p99.9(ms)", "max(ms)");
+  for (size_t r = 0; r < LOADGEN_RESULT_COUNT; r++) {
+    if (report->by_result[r].total == 0) continue;
+    print_row(fd, loadgen_result_name((login_result_t)r), &report->by_result[r]);
+  }
+  print_row(fd, "all", &report->all);
+}
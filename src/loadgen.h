@@ -0,0 +1,196 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "account.h"
+#include "account_store.h"
+#include "admission.h"
+#include "latency_hist.h"
+#include "login.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @file loadgen.h
+ * @brief Login load generator and trace replayer.
+ *
+ * A trace is a time-ordered list of login attempts. Each attempt has an
+ * intended send time (relative to the start of the run), a kind that
+ * says what outcome the attempt is meant to provoke, a userid and a
+ * client IP. Traces are either synthesised from a workload mix or read
+ * from a recorded trace file.
+ *
+ * Traces never contain passwords: the password sent is derived from the
+ * kind (the shared seed password, or a wrong one for
+ * LOADGEN_BAD_PASSWORD), so recorded traces can be shared safely.
+ *
+ * Runs are open-loop: each attempt is issued at its intended time
+ * whether or not earlier attempts have completed, and latency is
+ * measured from the intended send time rather than the actual one, so
+ * a stalled server shows up in the percentiles instead of silently
+ * slowing the generator down (no coordinated omission).
+ */
+
+#define LOADGEN_SEED_PASSWORD "loadgen-password"
+#define LOADGEN_WRONG_PASSWORD "loadgen-wrong-password"
+
+typedef enum {
+  LOADGEN_VALID = 0,        // correct password for an active account
+  LOADGEN_BAD_PASSWORD,     // wrong password for an active account
+  LOADGEN_UNKNOWN_USER,     // userid that does not exist
+  LOADGEN_BANNED,           // correct password for a banned account
+  LOADGEN_EXPIRED,          // correct password for an expired account
+  LOADGEN_KIND_COUNT
+} loadgen_kind_t;
+
+// number of distinct login_result_t values
+#define LOADGEN_RESULT_COUNT (LOGIN_FAIL_INTERNAL_ERROR + 1)
+
+typedef struct {
+  uint64_t offset_ns;           // intended send time, relative to the start of the run
+  loadgen_kind_t kind;
+  ip4_addr_t client_ip;
+  char userid[USER_ID_LENGTH];
+} loadgen_event_t;
+
+typedef struct {
+  loadgen_event_t *events;
+  size_t count;
+  size_t capacity;
+} loadgen_trace_t;
+
+typedef struct {
+  size_t accounts;                   // accounts per kind in the synthetic population
+  double mix[LOADGEN_KIND_COUNT];    // relative weight of each kind
+  double qps;                        // mean request rate
+  double duration_s;                 // length of the trace
+  bool poisson;                      // exponential inter-arrival times (else evenly spaced)
+  size_t ip_pool;                    // number of distinct client IPs
+  double ip_skew;                    // Zipf exponent for IP popularity (0 = uniform)
+  uint64_t seed;
+} loadgen_synth_params_t;
+
+/**
+ * Called once per attempt. Must be thread-safe.
+ * Returns the result of the attempt.
+ */
+typedef login_result_t (*loadgen_login_fn)(void *ctx, const char *userid, const char *password,
+                                           ip4_addr_t client_ip, time_t login_time);
+
+typedef struct {
+  loadgen_login_fn login;
+  void *ctx;
+  void (*thread_done)(void *ctx);   // optional; called as each worker thread finishes
+} loadgen_driver_t;
+
+typedef struct {
+  size_t threads;       // concurrent attempts in flight, at most
+  double qps;           // if > 0, retime the trace to this rate; else use its own timing
+} loadgen_run_params_t;
+
+typedef struct {
+  latency_hist_t by_result[LOADGEN_RESULT_COUNT];
+  latency_hist_t all;
+  uint64_t mismatched;      // attempts whose result did not match their kind
+  uint64_t late_starts;     // attempts issued more than 1ms after their intended time
+  uint64_t elapsed_ns;
+} loadgen_report_t;
+
+// fill in default synthesis parameters
+void loadgen_synth_defaults(loadgen_synth_params_t *params);
+
+// release memory held by a trace (the struct itself is not freed)
+void loadgen_trace_free(loadgen_trace_t *trace);
+
+/**
+ * Synthesise a trace from the given parameters into `trace`, which must
+ * be zero-initialised. Returns false on invalid parameters or allocation
+ * failure.
+ */
+bool loadgen_synthesise(const loadgen_synth_params_t *params, loadgen_trace_t *trace);
+
+/**
+ * Read a trace file into `trace`, which must be zero-initialised.
+ *
+ * The format is one attempt per line: `offset_us kind userid ip`, where
+ * kind is one of the names returned by loadgen_kind_name() and ip is a
+ * dotted quad. Blank lines and lines starting with `#` are ignored.
+ * Events are sorted by offset after reading.
+ *
+ * Returns false and logs the offending line number on a parse error.
+ */
+bool loadgen_trace_read(FILE *f, loadgen_trace_t *trace);
+
+// write a trace in the format accepted by loadgen_trace_read()
+bool loadgen_trace_write(const loadgen_trace_t *trace, FILE *f);
+
+/**
+ * Insert every account referenced by the trace into `store`, in the
+ * state its kind requires, all with password LOADGEN_SEED_PASSWORD.
+ * Accounts for LOADGEN_UNKNOWN_USER events are not inserted.
+ *
+ * The password is hashed once and the hash shared by all accounts.
+ */
+bool loadgen_seed_store(const loadgen_trace_t *trace, account_store_t *store);
+
+/**
+ * Replay a trace through `driver`. Blocks until every attempt completes.
+ */
+bool loadgen_run(const loadgen_trace_t *trace, const loadgen_run_params_t *params,
+                 const loadgen_driver_t *driver, loadgen_report_t *report);
+
+/**
+ * Driver that calls handle_login() in-process. `ctx` must point to an
+ * int holding a writable fd that receives both client and log output.
+ */
+login_result_t loadgen_inprocess_login(void *ctx, const char *userid, const char *password,
+                                       ip4_addr_t client_ip, time_t login_time);
+
+typedef struct {
+  int fd;                 // receives client and log output
+  admission_t *adm;       // admission controller in front of password verification
+  uint64_t timeout_ms;    // per-attempt deadline, measured from when it is issued (0 = none)
+} loadgen_admission_ctx_t;
+
+/**
+ * Driver that calls handle_login_admitted() in-process. `ctx` must point
+ * to a loadgen_admission_ctx_t. Refused attempts report
+ * LOGIN_FAIL_INTERNAL_ERROR.
+ */
+login_result_t loadgen_admission_login(void *ctx, const char *userid, const char *password,
+                                       ip4_addr_t client_ip, time_t login_time);
+
+typedef struct {
+  const char *addr;       // router or node address (see wire.h)
+} loadgen_remote_ctx_t;
+
+/**
+ * Driver that logs in through a cluster router or node (see cluster.h),
+ * over one connection per worker thread. `ctx` must point to a
+ * loadgen_remote_ctx_t. Connection errors report LOGIN_FAIL_INTERNAL_ERROR.
+ * Use loadgen_remote_thread_done() as the driver's thread_done.
+ */
+login_result_t loadgen_remote_login(void *ctx, const char *userid, const char *password,
+                                    ip4_addr_t client_ip, time_t login_time);
+
+// close the calling thread's connection opened by loadgen_remote_login()
+void loadgen_remote_thread_done(void *ctx);
+
+/**
+ * Like loadgen_seed_store(), but sends the accounts through the router
+ * or node at `addr`.
+ */
+bool loadgen_seed_remote(const loadgen_trace_t *trace, const char *addr);
+
+// write a human-readable report: throughput plus latency percentiles per result
+void loadgen_report_print(const loadgen_report_t *report, int fd);
+
+// name of a kind, as used in trace files; NULL if out of range
+const char *loadgen_kind_name(loadgen_kind_t kind);
+
+// name of a login result, e.g. "LOGIN_SUCCESS"
+const char *loadgen_result_name(login_result_t result);
+
+#endif // LOADGEN_H
@@ -0,0 +1,262 @@
+// Entry point for the login load generator (`make loadgen`).
+//
+// Synthesises a login workload (or reads a recorded trace), seeds an
+// in-memory account store with the accounts it needs, and replays it
+// against handle_login() at the requested rate, either in-process or
+// through a cluster router (-S).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_backup.h"
+#include "account_store.h"
+#include "audit_log.h"
+#include "loadgen.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  account_store_t *store;
+  const char *path;
+  uint64_t delay_ns;
+  pthread_t thread;
+  bool started;
+  bool ok;
+  uint64_t elapsed_ns;
+} backup_job_t;
+
+// back up the store once the run is about half done
+static void *backup_midway(void *arg) {
+  backup_job_t *job = arg;
+  struct timespec delay = {
+    .tv_sec = (time_t)(job->delay_ns / 1000000000u),
+    .tv_nsec = (long)(job->delay_ns % 1000000000u),
+  };
+  nanosleep(&delay, NULL);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  job->ok = account_backup_wait(account_backup_start(job->store, job->path));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  job->elapsed_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u +
+                    (uint64_t)(end.tv_nsec - start.tv_nsec);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -q QPS        target request rate (default 10)\n"
+    "  -d SECONDS    length of a synthesised trace (default 10)\n"
+    "  -t THREADS    maximum attempts in flight (default 16)\n"
+    "  -u ACCOUNTS   accounts per kind in the synthetic population (default 1000)\n"
+    "  -m MIX        weights valid,bad_password,unknown_user,banned,expired\n"
+    "                (default 70,15,10,3,2)\n"
+    "  -i IPS        distinct client IPs (default 10000)\n"
+    "  -z SKEW       Zipf exponent of client IP popularity (default 1.0)\n"
+    "  -c            constant inter-arrival times instead of Poisson\n"
+    "  -s SEED       random seed (default 1)\n"
+    "  -r FILE       replay a recorded trace instead of synthesising one\n"
+    "  -w FILE       write the trace to FILE and exit without running it\n"
+    "  -S ADDR       send logins (and the seed accounts) to the cluster\n"
+    "                router or node at ADDR instead of running in-process\n"
+    "  -a N          put admission control in front of password checks,\n"
+    "                allowing N concurrent hashes\n"
+    "  -D MS         with -a, give each attempt a deadline MS milliseconds\n"
+    "                after it is issued\n"
+    "  -B FILE       halfway through the run, back up the account store to\n"
+    "                FILE in the background (in-process runs only)\n"
+    "  -A DIR        record every attempt in the audit log in DIR\n"
+    "                (in-process runs only)\n"
+    "  -v            keep handle_login() log output (discarded by default)\n",
+    prog);
+}
+
+static bool parse_mix(const char *s, double mix[LOADGEN_KIND_COUNT]) {
+  char *end;
+  for (size_t k = 0; k < LOADGEN_KIND_COUNT; k++) {
+    mix[k] = strtod(s, &end);
+    if (end == s) return false;
+    if (k + 1 < LOADGEN_KIND_COUNT) {
+      if (*end != ',') return false;
+      s = end + 1;
+    }
+  }
+  return *end == '\0';
+}
+
+int main(int argc, char *argv[]) {
+  loadgen_synth_params_t synth;
+  loadgen_synth_defaults(&synth);
+  loadgen_run_params_t run = { .threads = 16, .qps = 0.0 };
+  const char *replay_path = NULL;
+  const char *write_path = NULL;
+  bool verbose = false;
+  bool qps_given = false;
+  size_t admit_concurrent = 0;
+  uint64_t deadline_ms = 0;
+  const char *server_addr = NULL;
+  const char *backup_path = NULL;
+  const char *audit_dir = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "q:d:t:u:m:i:z:cs:r:w:S:a:D:B:A:vh")) != -1) {
+    switch (opt) {
+      case 'q': synth.qps = atof(optarg); qps_given = true; break;
+      case 'd': synth.duration_s = atof(optarg); break;
+      case 't': run.threads = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'u': synth.accounts = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'm':
+        if (!parse_mix(optarg, synth.mix)) {
+          fprintf(stderr, "invalid mix: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'i': synth.ip_pool = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'z': synth.ip_skew = atof(optarg); break;
+      case 'c': synth.poisson = false; break;
+      case 's': synth.seed = strtoull(optarg, NULL, 10); break;
+      case 'r': replay_path = optarg; break;
+      case 'w': write_path = optarg; break;
+      case 'S': server_addr = optarg; break;
+      case 'a': admit_concurrent = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'D': deadline_ms = strtoull(optarg, NULL, 10); break;
+      case 'B': backup_path = optarg; break;
+      case 'A': audit_dir = optarg; break;
+      case 'v': verbose = true; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  loadgen_trace_t trace = {0};
+  if (replay_path) {
+    FILE *f = fopen(replay_path, "r");
+    if (!f) {
+      perror(replay_path);
+      return 1;
+    }
+    bool ok = loadgen_trace_read(f, &trace);
+    fclose(f);
+    if (!ok) return 1;
+    if (qps_given) run.qps = synth.qps;
+  } else if (!loadgen_synthesise(&synth, &trace)) {
+    return 1;
+  }
+
+  if (write_path) {
+    FILE *f = fopen(write_path, "w");
+    if (!f) {
+      perror(write_path);
+      loadgen_trace_free(&trace);
+      return 1;
+    }
+    bool ok = loadgen_trace_write(&trace, f);
+    ok = fclose(f) == 0 && ok;
+    loadgen_trace_free(&trace);
+    return ok ? 0 : 1;
+  }
+
+  if ((backup_path || audit_dir) && server_addr) {
+    fprintf(stderr, "-B and -A can't be combined with -S\n");
+    loadgen_trace_free(&trace);
+    return 1;
+  }
+
+  account_store_t *store = NULL;
+  if (server_addr) {
+    if (!loadgen_seed_remote(&trace, server_addr)) {
+      loadgen_trace_free(&trace);
+      return 1;
+    }
+  } else {
+    store = account_store_create(trace.count);
+    if (!store || !loadgen_seed_store(&trace, store)) {
+      account_store_free(store);
+      loadgen_trace_free(&trace);
+      return 1;
+    }
+    account_store_set_default(store);
+  }
+  audit_log_t *audit = audit_dir ? audit_log_open(audit_dir, NULL) : NULL;
+  if (audit_dir && !audit) {
+    account_store_free(store);
+    loadgen_trace_free(&trace);
+    return 1;
+  }
+  audit_log_set_default(audit);
+
+  // handle_login() writes a line per attempt to the client and log fds,
+  // and log_message() writes to stdout/stderr; send all of that to
+  // /dev/null so it doesn't distort timings, keeping a copy of stdout
+  // for the report.
+  int devnull = open("/dev/null", O_WRONLY);
+  int report_fd = dup(STDOUT_FILENO);
+  if (devnull < 0 || report_fd < 0) {
+    perror("open");
+    audit_log_close(audit);
+    account_store_free(store);
+    loadgen_trace_free(&trace);
+    return 1;
+  }
+  if (!verbose) {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+  }
+
+  loadgen_driver_t driver = { .login = loadgen_inprocess_login, .ctx = &devnull };
+  loadgen_remote_ctx_t remote_ctx = { .addr = server_addr };
+  loadgen_admission_ctx_t admission_ctx = { .fd = devnull, .timeout_ms = deadline_ms };
+  if (server_addr) {
+    driver = (loadgen_driver_t){
+      .login = loadgen_remote_login,
+      .ctx = &remote_ctx,
+      .thread_done = loadgen_remote_thread_done,
+    };
+  } else if (admit_concurrent > 0) {
+    admission_config_t config;
+    admission_config_defaults(&config);
+    config.max_concurrent = admit_concurrent;
+    admission_ctx.adm = admission_create(&config);
+    driver = (loadgen_driver_t){ .login = loadgen_admission_login, .ctx = &admission_ctx };
+  }
+
+  backup_job_t backup = { .store = store, .path = backup_path };
+  if (backup_path && trace.count > 0) {
+    backup.delay_ns = trace.events[trace.count - 1].offset_ns / 2;
+    if (run.qps > 0) backup.delay_ns = (uint64_t)((double)trace.count / run.qps * 0.5e9);
+    backup.started = pthread_create(&backup.thread, NULL, backup_midway, &backup) == 0;
+  }
+
+  loadgen_report_t *report = malloc(sizeof *report);
+  bool ok = report && (admit_concurrent == 0 || admission_ctx.adm) &&
+            loadgen_run(&trace, &run, &driver, report);
+  if (backup.started) pthread_join(backup.thread, NULL);
+  if (ok) {
+    loadgen_report_print(report, report_fd);
+    if (backup.started) {
+      dprintf(report_fd, "backup: %s in %.1fms\n", backup.ok ? "written" : "FAILED",
+              (double)backup.elapsed_ns / 1e6);
+    }
+    if (admission_ctx.adm || backup.started || audit) stats_dump(report_fd);
+  }
+
+  audit_log_close(audit);
+  admission_free(admission_ctx.adm);
+  free(report);
+  close(devnull);
+  close(report_fd);
+  account_store_free(store);
+  loadgen_trace_free(&trace);
+  return ok ? 0 : 1;
+}
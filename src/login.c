@@ -1,75 +1,150 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "login.h"
+#include "login_admission.h"
+#include "login_async.h"
+#include "login_throttle.h"
 #include "account.h"
+#include "account_store.h"
+#include "audit_log.h"
+#include "compact_store.h"
 #include "logging.h"
 #include "db.h"
+#include "single_flight.h"
+#include "stuffing_detector.h"
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <limits.h>
 
-login_result_t handle_login(
-    const char *userid,
-    const char *password,
-    ip4_addr_t client_ip,
-    time_t login_time,
-    int client_output_fd,
-    int log_fd,
-    login_session_data_t *session
-) {
-    if (!userid || !password || !session) {
-        log_message(LOG_ERROR, "handle_login: null input");
-        dprintf(client_output_fd, "Login failed: internal error\n");
-        dprintf(log_fd, "Login failed: internal error (null input)\n");
-        return LOGIN_FAIL_INTERNAL_ERROR;
+admission_priority_t login_admission_priority(const account_t *acc, ip4_addr_t client_ip,
+                                              time_t login_time) {
+    // last_ip is only written on success, and a success resets the
+    // failure count, so together they identify a recent good login.
+    if (acc->last_ip != 0 && acc->last_ip == client_ip && acc->login_fail_count == 0 &&
+        login_time - acc->last_login_time <= LOGIN_RECENT_WINDOW_SECS) {
+        return ADMISSION_PRIORITY_HIGH;
+    }
+    if (acc->login_fail_count >= LOGIN_LOW_PRIORITY_FAILS) {
+        return ADMISSION_PRIORITY_LOW;
     }
+    return ADMISSION_PRIORITY_NORMAL;
+}
 
-    account_t acc;
-    if (!account_lookup_by_userid(userid, &acc)) {
-        log_message(LOG_INFO, "User '%s' not found", userid);
-        dprintf(client_output_fd, "Login failed: user not found\n");
-        dprintf(log_fd, "User '%s' not found\n", userid);
-        return LOGIN_FAIL_USER_NOT_FOUND;
+static bool store_record_success(account_t *acc, void *arg) {
+    account_record_login_success(acc, *(const ip4_addr_t *)arg);
+    return true;
+}
+
+static bool store_record_failure(account_t *acc, void *arg) {
+    (void)arg;
+    account_record_login_failure(acc);
+    return true;
+}
+
+static bool store_extend_ban(account_t *acc, void *arg) {
+    time_t until = *(const time_t *)arg;
+    if (acc->unban_time >= until) return false;
+    account_set_unban_time(acc, until);
+    return true;
+}
+
+// Apply a change to the stored copy of the account as well, when it
+// came from one of the in-memory stores.
+static void store_apply(const char *userid, account_store_update_fn fn, void *arg) {
+    account_store_t *store = account_store_get_default();
+    if (store) account_store_update(store, userid, fn, arg);
+    compact_store_t *compact = compact_store_get_default();
+    if (compact) compact_store_update(compact, userid, fn, arg);
+}
+
+static void store_record_login(const char *userid, bool success, ip4_addr_t client_ip) {
+    if (success) {
+        store_apply(userid, store_record_success, &client_ip);
+    } else {
+        store_apply(userid, store_record_failure, NULL);
     }
+}
 
-    if (account_is_banned(&acc)) {
-        log_message(LOG_INFO, "User '%s' is banned", userid);
-        dprintf(client_output_fd, "Login failed: account is banned\n");
-        dprintf(log_fd, "User '%s' is banned\n", userid);
-        return LOGIN_FAIL_ACCOUNT_BANNED;
+void login_machine_init(login_machine_t *m, const char *userid, const char *password,
+                        ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                        int log_fd, login_session_data_t *session) {
+    memset(m, 0, sizeof *m);
+    m->userid = userid;
+    m->password = password;
+    m->client_ip = client_ip;
+    m->login_time = login_time;
+    m->client_output_fd = client_output_fd;
+    m->log_fd = log_fd;
+    m->session = session;
+    m->state = LOGIN_STATE_START;
+    m->admission = ADMISSION_ADMITTED;
+}
+
+void login_machine_account(login_machine_t *m, db_lookup_status_t status, const account_t *acc) {
+    if (m->state != LOGIN_STATE_LOOKUP) {
+        log_message(LOG_ERROR, "login_machine_account: machine isn't waiting for an account.");
+        return;
     }
+    m->lookup = status;
+    if (status == DB_LOOKUP_FOUND) m->acc = *acc;
+    m->state = LOGIN_STATE_VERIFY;
+}
 
-    if (account_is_expired(&acc)) {
-        log_message(LOG_INFO, "User '%s' is expired", userid);
-        dprintf(client_output_fd, "Login failed: account expired\n");
-        dprintf(log_fd, "User '%s' account expired\n", userid);
-        return LOGIN_FAIL_ACCOUNT_EXPIRED;
+static login_state_t login_finish(login_machine_t *m, login_result_t result) {
+    m->result = result;
+    m->state = LOGIN_STATE_DONE;
+    return LOGIN_STATE_DONE;
+}
+
+void login_machine_password(login_machine_t *m, bool password_ok) {
+    if (m->state != LOGIN_STATE_HASH) {
+        log_message(LOG_ERROR, "login_machine_password: machine isn't waiting for a password check.");
+        return;
     }
+    m->password_ok = password_ok;
+    m->password_checked = true;
+}
+
+// The bookkeeping once the password has been checked.
+static login_result_t login_conclude(login_machine_t *m) {
+    const char *userid = m->userid;
+    int client_output_fd = m->client_output_fd;
+    int log_fd = m->log_fd;
+    account_t *acc = &m->acc;
+    login_throttle_t *throttle = login_throttle_get_default();
 
-    if (!account_validate_password(&acc, password)) {
-        account_record_login_failure(&acc);
+    if (!m->password_ok) {
+        account_record_login_failure(acc);
+        store_record_login(userid, false, m->client_ip);
+        uint32_t lockout = throttle ? login_throttle_failure(throttle, userid, m->login_time) : 0;
+        if (lockout > 0 && login_throttle_config(throttle)->set_unban_time) {
+            time_t until = m->login_time + (time_t)lockout;
+            store_apply(userid, store_extend_ban, &until);
+        }
         log_message(LOG_INFO, "Invalid password for user '%s'", userid);
         dprintf(client_output_fd, "Login failed: incorrect password\n");
         dprintf(log_fd, "Invalid password attempt for user '%s'\n", userid);
         return LOGIN_FAIL_BAD_PASSWORD;
     }
 
-    account_record_login_success(&acc, client_ip);
+    account_record_login_success(acc, m->client_ip);
+    store_record_login(userid, true, m->client_ip);
+    if (throttle) login_throttle_success(throttle, userid);
 
     // Unfortunately, since we can't change the data types in the headers,
     // we just have to accept and deal with the fact that an account_t's
     // account_id might not fit in a login_session_data_t.
-    if (acc.account_id > INT_MAX) {
+    if (acc->account_id > INT_MAX) {
         log_message(LOG_ERROR, "Invalid account ID for user '%s'", userid);
         dprintf(client_output_fd, "Login failed: invalid account ID\n");
         dprintf(log_fd, "Invalid account ID for user '%s'\n", userid);
         return LOGIN_FAIL_INTERNAL_ERROR;
     }
 
-    session->account_id = (int)acc.account_id; // this is now safe after checking
-    session->session_start = login_time;
-    session->expiration_time = login_time + 3600; // 1 hour session
+    m->session->account_id = (int)acc->account_id; // this is now safe after checking
+    m->session->session_start = m->login_time;
+    m->session->expiration_time = m->login_time + 3600; // 1 hour session
 
     log_message(LOG_INFO, "Login success for user '%s'", userid);
     dprintf(client_output_fd, "Login successful! Welcome, %s\n", userid);
@@ -78,3 +153,209 @@ login_result_t handle_login(
     return LOGIN_SUCCESS;
 }
 
+/**
+ * Everything after the lookup up to the password hash. Returns true if
+ * the password needs hashing, with `flight` (and `ticket`) held;
+ * otherwise the login is over and `*result` is set.
+ */
+static bool login_verify(login_machine_t *m, login_result_t *result) {
+    const char *userid = m->userid;
+    int client_output_fd = m->client_output_fd;
+    int log_fd = m->log_fd;
+    account_t *acc = &m->acc;
+
+    if (m->lookup == DB_LOOKUP_ERROR) {
+        log_message(LOG_ERROR, "Lookup for user '%s' failed", userid);
+        dprintf(client_output_fd, "Login failed: internal error\n");
+        dprintf(log_fd, "Login failed: internal error (lookup for user '%s' failed)\n", userid);
+        *result = LOGIN_FAIL_INTERNAL_ERROR;
+        return false;
+    }
+
+    if (m->lookup == DB_LOOKUP_NOT_FOUND) {
+        log_message(LOG_INFO, "User '%s' not found", userid);
+        dprintf(client_output_fd, "Login failed: user not found\n");
+        dprintf(log_fd, "User '%s' not found\n", userid);
+        *result = LOGIN_FAIL_USER_NOT_FOUND;
+        return false;
+    }
+
+    if (account_is_banned(acc)) {
+        log_message(LOG_INFO, "User '%s' is banned", userid);
+        dprintf(client_output_fd, "Login failed: account is banned\n");
+        dprintf(log_fd, "User '%s' is banned\n", userid);
+        *result = LOGIN_FAIL_ACCOUNT_BANNED;
+        return false;
+    }
+
+    if (account_is_expired(acc)) {
+        log_message(LOG_INFO, "User '%s' is expired", userid);
+        dprintf(client_output_fd, "Login failed: account expired\n");
+        dprintf(log_fd, "User '%s' account expired\n", userid);
+        *result = LOGIN_FAIL_ACCOUNT_EXPIRED;
+        return false;
+    }
+
+    // Accounts locked out after repeated failures are turned away before
+    // any hashing.
+    login_throttle_t *throttle = login_throttle_get_default();
+    uint32_t throttled = throttle ? login_throttle_check(throttle, userid, m->login_time) : 0;
+    if (throttled > 0) {
+        log_message(LOG_INFO, "User '%s' is locked out for %u more seconds", userid, throttled);
+        dprintf(client_output_fd, "Login failed: too many failed attempts, try again in %u seconds\n",
+                throttled);
+        dprintf(log_fd, "User '%s' locked out after repeated failures\n", userid);
+        *result = LOGIN_FAIL_ACCOUNT_BANNED;
+        return false;
+    }
+
+    // Identical attempts in flight at the same time share one hash. Only
+    // the leader computes it, so only the leader needs admission; the
+    // others wait for it until their deadline, as they would for admission.
+    single_flight_status_t shared = single_flight_join(acc, m->password, m->deadline, &m->flight,
+                                                       &m->password_ok);
+    if (shared == SINGLE_FLIGHT_EXPIRED) {
+        m->admission = ADMISSION_EXPIRED;
+    } else if (shared == SINGLE_FLIGHT_LEADER && m->adm) {
+        admission_priority_t priority = login_admission_priority(acc, m->client_ip, m->login_time);
+        m->admission = admission_enter(m->adm, priority, m->deadline, &m->ticket);
+        if (m->admission != ADMISSION_ADMITTED) single_flight_abandon(&m->flight);
+    }
+    if (m->admission != ADMISSION_ADMITTED) {
+        log_message(LOG_WARN, "Login for user '%s' not admitted: %s", userid,
+                    admission_status_name(m->admission));
+        dprintf(client_output_fd, "Login failed: server busy, try again later\n");
+        dprintf(log_fd, "Login for user '%s' not admitted (%s)\n", userid,
+                admission_status_name(m->admission));
+        *result = LOGIN_FAIL_INTERNAL_ERROR;
+        return false;
+    }
+    if (shared == SINGLE_FLIGHT_LEADER) return true;
+    *result = login_conclude(m);
+    return false;
+}
+
+// every attempt that gets past the input checks is audited
+static login_state_t login_audited(login_machine_t *m, login_result_t result) {
+    audit_log_t *audit = audit_log_get_default();
+    if (audit) audit_log_append(audit, m->login_time, m->client_ip, m->userid, result);
+    return login_finish(m, result);
+}
+
+static login_state_t login_verified(login_machine_t *m, login_result_t result) {
+    // the stored hash has no further use here
+    memset(&m->acc, 0, sizeof m->acc);
+    return login_audited(m, result);
+}
+
+login_state_t login_machine_run(login_machine_t *m) {
+    switch (m->state) {
+        case LOGIN_STATE_START:
+            if (!m->userid || !m->password || !m->session) {
+                log_message(LOG_ERROR, "handle_login: null input");
+                dprintf(m->client_output_fd, "Login failed: internal error\n");
+                dprintf(m->log_fd, "Login failed: internal error (null input)\n");
+                return login_finish(m, LOGIN_FAIL_INTERNAL_ERROR);
+            }
+            // Sources trying many different userids are turned away before
+            // the lookup, so the answer doesn't depend on whether the
+            // account exists.
+            stuffing_detector_t *stuffing = stuffing_detector_get_default();
+            if (stuffing &&
+                stuffing_detector_observe(stuffing, m->client_ip, m->userid, m->login_time) != STUFFING_CLEAN &&
+                stuffing_detector_config(stuffing)->block) {
+                log_message(LOG_INFO, "Login for user '%s' refused: too many userids tried from client",
+                            m->userid);
+                dprintf(m->client_output_fd, "Login failed: too many attempts from your network\n");
+                dprintf(m->log_fd, "Login for user '%s' refused: client flagged for credential stuffing\n",
+                        m->userid);
+                return login_audited(m, LOGIN_FAIL_IP_BANNED);
+            }
+            m->state = LOGIN_STATE_LOOKUP;
+            return LOGIN_STATE_LOOKUP;
+
+        case LOGIN_STATE_LOOKUP:
+            return LOGIN_STATE_LOOKUP;
+
+        case LOGIN_STATE_VERIFY: {
+            login_result_t result;
+            if (!login_verify(m, &result)) return login_verified(m, result);
+            m->state = LOGIN_STATE_HASH;
+            if (m->batch_hash) return LOGIN_STATE_HASH;
+        }
+        // fall through
+
+        case LOGIN_STATE_HASH:
+            // we lead the flight: hash, unless the caller already has
+            if (!m->password_checked) m->password_ok = account_validate_password(&m->acc, m->password);
+            if (m->adm) admission_leave(m->adm, &m->ticket);
+            single_flight_finish(&m->flight, m->password_ok);
+            return login_verified(m, login_conclude(m));
+
+        case LOGIN_STATE_DONE:
+            break;
+    }
+    return LOGIN_STATE_DONE;
+}
+
+/**
+ * Shared implementation of handle_login() and handle_login_admitted():
+ * the login state machine with a synchronous lookup.
+ * When `adm` is NULL, password verification runs unconditionally.
+ */
+static login_result_t login_common(
+    const char *userid,
+    const char *password,
+    ip4_addr_t client_ip,
+    time_t login_time,
+    int client_output_fd,
+    int log_fd,
+    login_session_data_t *session,
+    admission_t *adm,
+    const struct timespec *deadline,
+    admission_status_t *status
+) {
+    login_machine_t m;
+    login_machine_init(&m, userid, password, client_ip, login_time, client_output_fd, log_fd,
+                       session);
+    m.adm = adm;
+    m.deadline = deadline;
+
+    while (login_machine_run(&m) == LOGIN_STATE_LOOKUP) {
+        account_t acc;
+        bool found = account_lookup_by_userid(userid, &acc);
+        login_machine_account(&m, found ? DB_LOOKUP_FOUND : DB_LOOKUP_NOT_FOUND, &acc);
+        memset(&acc, 0, sizeof acc);
+    }
+    if (status) *status = m.admission;
+    return m.result;
+}
+
+login_result_t handle_login(
+    const char *userid,
+    const char *password,
+    ip4_addr_t client_ip,
+    time_t login_time,
+    int client_output_fd,
+    int log_fd,
+    login_session_data_t *session
+) {
+    return login_common(userid, password, client_ip, login_time, client_output_fd, log_fd,
+                        session, NULL, NULL, NULL);
+}
+
+login_result_t handle_login_admitted(
+    const char *userid,
+    const char *password,
+    ip4_addr_t client_ip,
+    time_t login_time,
+    int client_output_fd,
+    int log_fd,
+    login_session_data_t *session,
+    admission_t *adm,
+    const struct timespec *deadline,
+    admission_status_t *status
+) {
+    return login_common(userid, password, client_ip, login_time, client_output_fd, log_fd,
+                        session, adm, deadline, status);
+}
@@ -0,0 +1,49 @@
+#ifndef LOGIN_ADMISSION_H
+#define LOGIN_ADMISSION_H
+
+#include "admission.h"
+#include "login.h"
+
+#include <time.h>
+
+/**
+ * @file login_admission.h
+ * @brief handle_login() with admission control in front of password verification.
+ */
+
+// A successful login from the same IP within this window earns high priority.
+#define LOGIN_RECENT_WINDOW_SECS (30 * 24 * 3600)
+
+// Accounts with at least this many consecutive failures get low priority.
+#define LOGIN_LOW_PRIORITY_FAILS 3
+
+/**
+ * Like handle_login(), but password verification only runs once `adm`
+ * admits it, at a priority chosen by login_admission_priority().
+ *
+ * Lookups and ban/expiry checks are cheap and always run. If the request
+ * is refused (its deadline passed or the server is overloaded), the
+ * client is told to retry later, LOGIN_FAIL_INTERNAL_ERROR is returned,
+ * and *status says why. Otherwise *status is ADMISSION_ADMITTED. An
+ * attempt waiting on an identical one's hash (single_flight.h) is
+ * refused with ADMISSION_EXPIRED in the same way if its deadline passes.
+ *
+ * `deadline` is an absolute CLOCK_MONOTONIC time, or NULL for none.
+ * `status` may be NULL.
+ */
+login_result_t handle_login_admitted(const char *userid, const char *password,
+                                     ip4_addr_t client_ip, time_t login_time,
+                                     int client_output_fd, int log_fd,
+                                     login_session_data_t *session,
+                                     admission_t *adm, const struct timespec *deadline,
+                                     admission_status_t *status);
+
+/**
+ * Priority class for a login attempt against `acc`: high for an IP that
+ * recently logged in successfully, low for an account on a run of
+ * failures, normal otherwise.
+ */
+admission_priority_t login_admission_priority(const account_t *acc, ip4_addr_t client_ip,
+                                              time_t login_time);
+
+#endif // LOGIN_ADMISSION_H
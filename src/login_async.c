@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_async.h"
+#include "account_cache.h"
+#include "logging.h"
+#include "password_batch.h"
+#include "sha512_crypt.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// most ready logins a worker takes at once
+#define MAX_BATCH 16
+
+typedef struct login_job {
+  login_machine_t *m;
+  login_async_done_fn done;
+  void *arg;
+  login_async_t *la;
+  account_cache_t *cache;         // to fill with the lookup's result, or NULL
+  uint64_t cache_ticket;
+  struct login_job *next;
+} login_job_t;
+
+typedef struct {
+  login_job_t *head;
+  login_job_t *tail;
+} job_list_t;
+
+struct login_async {
+  db_async_t *db;
+
+  pthread_mutex_t lock;           // protects the fields below
+  pthread_cond_t work;            // a list became non-empty, or stopping
+  pthread_cond_t idle;            // in_flight dropped to 0
+  job_list_t fresh;               // submitted; lookup not sent yet
+  job_list_t ready;               // account arrived; password not checked yet
+  size_t in_flight;
+  bool stopping;
+  size_t batch;                   // ready logins a worker takes at once
+
+  size_t worker_count;
+  pthread_t workers[];
+};
+
+static void list_push(job_list_t *list, login_job_t *job) {
+  job->next = NULL;
+  if (list->tail) list->tail->next = job;
+  else list->head = job;
+  list->tail = job;
+}
+
+static void finish(login_job_t *job) {
+  login_async_t *la = job->la;
+  job->done(job->m, job->arg);
+  free(job);
+
+  pthread_mutex_lock(&la->lock);
+  if (--la->in_flight == 0) pthread_cond_broadcast(&la->idle);
+  pthread_mutex_unlock(&la->lock);
+}
+
+// db_async completion; runs on the connection's receiver thread
+static void account_arrived(void *arg, db_lookup_status_t status, const account_t *acc) {
+  login_job_t *job = arg;
+  login_async_t *la = job->la;
+  if (job->cache && job->cache == account_cache_get_default() && status != DB_LOOKUP_ERROR) {
+    account_cache_fill(job->cache, job->m->userid, status == DB_LOOKUP_FOUND ? acc : NULL,
+                       job->cache_ticket);
+  }
+  login_machine_account(job->m, status, acc);
+
+  pthread_mutex_lock(&la->lock);
+  list_push(&la->ready, job);
+  pthread_cond_signal(&la->work);
+  pthread_mutex_unlock(&la->lock);
+}
+
+/**
+ * Run every fresh job up to its lookup, answer what the default account
+ * cache can, and send the rest of the lookups as one multi-get.
+ */
+static void start_jobs(login_async_t *la, login_job_t *jobs) {
+  size_t n = 0;
+  for (login_job_t *job = jobs; job; job = job->next) n++;
+  const char **userids = malloc(n * sizeof *userids);
+  void **args = malloc(n * sizeof *args);
+  account_cache_t *cache = account_cache_get_default();
+  job_list_t cached = { NULL, NULL };
+
+  size_t waiting = 0;
+  for (login_job_t *job = jobs, *next; job; job = next) {
+    next = job->next;
+    account_t acc;
+    bool found;
+    if (login_machine_run(job->m) != LOGIN_STATE_LOOKUP) {
+      finish(job);
+    } else if (cache && account_cache_get(cache, job->m->userid, &acc, &found)) {
+      login_machine_account(job->m, found ? DB_LOOKUP_FOUND : DB_LOOKUP_NOT_FOUND, &acc);
+      memset(&acc, 0, sizeof acc);
+      list_push(&cached, job);
+    } else {
+      job->cache = cache;
+      if (cache) job->cache_ticket = account_cache_ticket(cache, job->m->userid);
+      if (userids && args) {
+        userids[waiting] = job->m->userid;
+        args[waiting++] = job;
+      } else {
+        db_async_lookup(la->db, job->m->userid, account_arrived, job);
+      }
+    }
+  }
+  if (waiting > 0) db_async_multi_get(la->db, userids, waiting, account_arrived, args);
+  free(userids);
+  free(args);
+
+  if (cached.head) {
+    pthread_mutex_lock(&la->lock);
+    if (la->ready.tail) la->ready.tail->next = cached.head;
+    else la->ready.head = cached.head;
+    la->ready.tail = cached.tail;
+    pthread_cond_broadcast(&la->work);
+    pthread_mutex_unlock(&la->lock);
+  }
+}
+
+// whether `m` would wait on the flight of a job already held at LOGIN_STATE_HASH
+static bool same_attempt(const login_machine_t *m, login_job_t *const *held, size_t n,
+                         const job_list_t *alone) {
+  for (size_t i = 0; i < n; i++) {
+    if (strcmp(held[i]->m->userid, m->userid) == 0 && strcmp(held[i]->m->password, m->password) == 0) {
+      return true;
+    }
+  }
+  for (login_job_t *job = alone->head; job; job = job->next) {
+    if (strcmp(job->m->userid, m->userid) == 0 && strcmp(job->m->password, m->password) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Finish ready jobs, checking the passwords of those that can be
+ * batched together (see password_batch.h) and the rest one by one.
+ * A job whose login matches one held for hashing would wait on it (see
+ * single_flight.h), so it runs once the others have finished.
+ */
+static void check_jobs(login_job_t *jobs) {
+  password_check_t checks[MAX_BATCH];
+  login_job_t *hashing[MAX_BATCH];
+  job_list_t alone = { NULL, NULL }, later = { NULL, NULL };
+  size_t n = 0;
+  for (login_job_t *job = jobs, *next; job; job = next) {
+    next = job->next;
+    login_machine_t *m = job->m;
+    if (m->state == LOGIN_STATE_VERIFY && m->lookup == DB_LOOKUP_FOUND &&
+        same_attempt(m, hashing, n, &alone)) {
+      list_push(&later, job);
+    } else if (login_machine_run(m) != LOGIN_STATE_HASH) {
+      finish(job);
+    } else if (n < MAX_BATCH && account_password_batchable(&m->acc, m->password)) {
+      checks[n] = (password_check_t){ .acc = &m->acc, .password = m->password };
+      hashing[n++] = job;
+    } else {
+      list_push(&alone, job);
+    }
+  }
+
+  // a batch of one is no quicker than checking it alone
+  if (n > 1) {
+    account_validate_passwords(checks, n);
+    for (size_t i = 0; i < n; i++) login_machine_password(hashing[i]->m, checks[i].valid);
+  }
+  for (size_t i = 0; i < n; i++) {
+    login_machine_run(hashing[i]->m);
+    finish(hashing[i]);
+  }
+  for (int pass = 0; pass < 2; pass++) {
+    job_list_t *list = pass == 0 ? &alone : &later;
+    for (login_job_t *job = list->head, *next; job; job = next) {
+      next = job->next;
+      if (login_machine_run(job->m) == LOGIN_STATE_HASH) login_machine_run(job->m);
+      finish(job);
+    }
+  }
+}
+
+static void *worker(void *p) {
+  login_async_t *la = p;
+
+  pthread_mutex_lock(&la->lock);
+  for (;;) {
+    while (!la->fresh.head && !la->ready.head && !la->stopping) {
+      pthread_cond_wait(&la->work, &la->lock);
+    }
+    if (la->fresh.head) {
+      // starting is cheap and lets the lookups overlap, so it goes first
+      login_job_t *jobs = la->fresh.head;
+      la->fresh.head = la->fresh.tail = NULL;
+      pthread_mutex_unlock(&la->lock);
+      start_jobs(la, jobs);
+    } else if (la->ready.head) {
+      login_job_t *jobs = la->ready.head, *last = jobs;
+      for (size_t n = 1; n < la->batch && last->next; n++) last = last->next;
+      la->ready.head = last->next;
+      if (!la->ready.head) la->ready.tail = NULL;
+      last->next = NULL;
+      pthread_mutex_unlock(&la->lock);
+      check_jobs(jobs);
+    } else {
+      break;
+    }
+    pthread_mutex_lock(&la->lock);
+  }
+  pthread_mutex_unlock(&la->lock);
+  return NULL;
+}
+
+login_async_t *login_async_create(db_async_t *db, size_t workers) {
+  if (!db) {
+    log_message(LOG_ERROR, "login_async_create: no database connection.");
+    return NULL;
+  }
+  if (workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? (size_t)cpus : 1;
+  }
+
+  login_async_t *la = calloc(1, sizeof *la + workers * sizeof la->workers[0]);
+  if (!la) {
+    log_message(LOG_ERROR, "login_async_create: can't allocate driver.");
+    return NULL;
+  }
+  la->db = db;
+  // without SIMD lanes a batch is slower than checking one by one
+  la->batch = sha512_crypt_lanes() < MAX_BATCH ? sha512_crypt_lanes() : MAX_BATCH;
+  pthread_mutex_init(&la->lock, NULL);
+  pthread_cond_init(&la->work, NULL);
+  pthread_cond_init(&la->idle, NULL);
+  for (; la->worker_count < workers; la->worker_count++) {
+    if (pthread_create(&la->workers[la->worker_count], NULL, worker, la) != 0) {
+      log_message(LOG_ERROR, "login_async_create: can't start worker thread.");
+      login_async_free(la);
+      return NULL;
+    }
+  }
+  return la;
+}
+
+bool login_async_submit(login_async_t *la, login_machine_t *m, login_async_done_fn done, void *arg) {
+  login_job_t *job = malloc(sizeof *job);
+  if (!job) {
+    log_message(LOG_ERROR, "login_async_submit: can't allocate job.");
+    return false;
+  }
+  *job = (login_job_t){ .m = m, .done = done, .arg = arg, .la = la };
+  // A batch holds each of its logins' admission while it hashes, which
+  // could starve the rest of the batch, so admitted logins hash alone.
+  m->batch_hash = la->batch > 1 && !m->adm;
+
+  pthread_mutex_lock(&la->lock);
+  if (la->stopping) {
+    pthread_mutex_unlock(&la->lock);
+    free(job);
+    return false;
+  }
+  list_push(&la->fresh, job);
+  la->in_flight++;
+  pthread_cond_signal(&la->work);
+  pthread_mutex_unlock(&la->lock);
+  return true;
+}
+
+void login_async_free(login_async_t *la) {
+  if (!la) return;
+  pthread_mutex_lock(&la->lock);
+  while (la->in_flight > 0) pthread_cond_wait(&la->idle, &la->lock);
+  la->stopping = true;
+  pthread_cond_broadcast(&la->work);
+  pthread_mutex_unlock(&la->lock);
+
+  for (size_t i = 0; i < la->worker_count; i++) pthread_join(la->workers[i], NULL);
+  pthread_mutex_destroy(&la->lock);
+  pthread_cond_destroy(&la->work);
+  pthread_cond_destroy(&la->idle);
+  free(la);
+}
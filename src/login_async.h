@@ -0,0 +1,131 @@
+#ifndef LOGIN_ASYNC_H
+#define LOGIN_ASYNC_H
+
+#include "admission.h"
+#include "db_async.h"
+#include "login.h"
+#include "single_flight.h"
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * @file login_async.h
+ * @brief handle_login() as a resumable state machine, and a driver that
+ * runs many logins over asynchronous account lookups.
+ *
+ * A login_machine_t performs the same steps as handle_login(), but
+ * stops when it needs the account instead of calling
+ * account_lookup_by_userid():
+ *
+ *     login_machine_init(&m, userid, password, ip, now, out_fd, log_fd, &session);
+ *     while (login_machine_run(&m) == LOGIN_STATE_LOOKUP) {
+ *       ... fetch the account for m.userid, however and whenever ...
+ *       login_machine_account(&m, status, &acc);
+ *     }
+ *     // m.result holds the login_result_t
+ *
+ * While it waits for the account, the machine is just memory: no thread
+ * is tied up. handle_login() and handle_login_admitted() are this loop
+ * with a synchronous lookup.
+ *
+ * With `batch_hash` set, the machine also stops before hashing the
+ * password (LOGIN_STATE_HASH), so that a caller can check several
+ * logins' passwords at once with account_validate_passwords()
+ * (password_batch.h) and hand each verdict back with
+ * login_machine_password().
+ *
+ * A login_async_t drives machines with a db_async_t: lookups for all
+ * logins waiting at the same time are sent as a single multi-get, and
+ * a small pool of worker threads does the password checks once accounts
+ * arrive, checking "$6$" passwords that are ready at the same time in one
+ * batch when the CPU has SIMD lanes for it. Lookups the default account
+ * cache (account_cache.h) can answer don't go to the database at all.
+ */
+
+typedef enum {
+  LOGIN_STATE_START,      // not yet run
+  LOGIN_STATE_LOOKUP,     // waiting for login_machine_account()
+  LOGIN_STATE_VERIFY,     // account supplied; run again to finish
+  LOGIN_STATE_HASH,       // with batch_hash: the password needs checking; run again to
+                          // check it here, or supply the verdict first
+  LOGIN_STATE_DONE        // `result` is set
+} login_state_t;
+
+typedef struct {
+  // the request; the strings must outlive the machine
+  const char *userid;
+  const char *password;
+  ip4_addr_t client_ip;
+  time_t login_time;
+  int client_output_fd;
+  int log_fd;
+  login_session_data_t *session;
+  admission_t *adm;                   // optional; see handle_login_admitted()
+  const struct timespec *deadline;    // for `adm`, and for waiting on an identical attempt
+  bool batch_hash;                    // stop at LOGIN_STATE_HASH rather than hash in run
+
+  login_state_t state;
+  db_lookup_status_t lookup;
+  account_t acc;
+  login_result_t result;
+  admission_status_t admission;       // ADMISSION_ADMITTED unless `adm` refused
+
+  // held from LOGIN_STATE_HASH until the login finishes
+  single_flight_t flight;
+  admission_ticket_t ticket;
+  bool password_checked;              // set by login_machine_password()
+  bool password_ok;
+} login_machine_t;
+
+// set up a machine for one attempt, without admission control
+void login_machine_init(login_machine_t *m, const char *userid, const char *password,
+                        ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                        int log_fd, login_session_data_t *session);
+
+/**
+ * Run the machine until it needs the account (LOGIN_STATE_LOOKUP) or
+ * has finished (LOGIN_STATE_DONE), and return the new state. The password
+ * check happens inside this call, so it may take a while.
+ */
+login_state_t login_machine_run(login_machine_t *m);
+
+/**
+ * Supply the result of looking up m->userid. `acc` is copied, and is
+ * only read when `status` is DB_LOOKUP_FOUND.
+ */
+void login_machine_account(login_machine_t *m, db_lookup_status_t status, const account_t *acc);
+
+/**
+ * Supply the verdict on m->password against m->acc for a machine in
+ * LOGIN_STATE_HASH; run it again to finish. The machine leads any
+ * identical attempts waiting on it (see single_flight.h) until then, so
+ * don't hold it there long.
+ */
+void login_machine_password(login_machine_t *m, bool password_ok);
+
+////
+// Driver
+
+typedef struct login_async login_async_t;
+
+typedef void (*login_async_done_fn)(login_machine_t *m, void *arg);
+
+/**
+ * Create a driver that looks accounts up through `db` and runs password
+ * checks on `workers` threads (0 for one per online CPU).
+ */
+login_async_t *login_async_create(db_async_t *db, size_t workers);
+
+/**
+ * Start an initialised machine. done(m, arg) is called on a worker
+ * thread once m->state is LOGIN_STATE_DONE. The driver sets
+ * m->batch_hash itself; logins with `adm` set are checked one by one. Returns false, without
+ * calling `done`, if the login couldn't be queued.
+ */
+bool login_async_submit(login_async_t *la, login_machine_t *m, login_async_done_fn done, void *arg);
+
+// wait for every submitted login to finish, then free the driver
+void login_async_free(login_async_t *la);
+
+#endif // LOGIN_ASYNC_H
@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_throttle.h"
+#include "account_store.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define BUCKET_SLOTS 8        // one cache line of slots
+#define FIELD_MAX 31          // counts and levels are 5 bits
+
+/*
+ * A slot packs, from the top bit down:
+ *
+ *     tag:16 | last_fail:32 | unused:1 | level:5 | cur:5 | prev:5
+ *
+ * last_fail is the time of the latest failure, cur the failures in the
+ * window holding it, prev those in the window before, and level the
+ * number of lockouts since the account last went a window without
+ * failing. A slot of 0 is empty; tags are never 0.
+ */
+typedef struct {
+  uint16_t tag;
+  uint32_t last_fail;
+  uint32_t level;
+  uint32_t cur;
+  uint32_t prev;
+} slot_t;
+
+struct login_throttle {
+  login_throttle_config_t config;
+  size_t mask;                // slots - 1
+  _Atomic uint64_t *slots;
+};
+
+static login_throttle_t *_Atomic default_throttle = NULL;
+
+static STATS_DEFINE(stat_rejected, "login_throttle.rejected");
+static STATS_DEFINE(stat_lockouts, "login_throttle.lockouts");
+static STATS_DEFINE(stat_evictions, "login_throttle.evictions");
+
+static uint64_t slot_pack(const slot_t *s) {
+  return (uint64_t)s->tag << 48 | (uint64_t)s->last_fail << 16 |
+         (uint64_t)s->level << 10 | (uint64_t)s->cur << 5 | (uint64_t)s->prev;
+}
+
+static slot_t slot_unpack(uint64_t v) {
+  return (slot_t){
+    .tag = (uint16_t)(v >> 48),
+    .last_fail = (uint32_t)(v >> 16),
+    .level = (uint32_t)(v >> 10) & FIELD_MAX,
+    .cur = (uint32_t)(v >> 5) & FIELD_MAX,
+    .prev = (uint32_t)v & FIELD_MAX,
+  };
+}
+
+static uint32_t clamp_time(time_t now) {
+  if (now <= 0) return 0;
+  if ((uint64_t)now > UINT32_MAX) return UINT32_MAX;
+  return (uint32_t)now;
+}
+
+// first slot of the account's bucket, and its tag
+static size_t locate(const login_throttle_t *t, const char *userid, uint16_t *tag) {
+  // FNV-1a's low bits are weak; mix before taking the bucket
+  uint64_t h = account_store_hash_userid(userid);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  *tag = (uint16_t)(h >> 48) ? (uint16_t)(h >> 48) : 1;
+  return (size_t)h & t->mask & ~(size_t)(BUCKET_SLOTS - 1);
+}
+
+static uint32_t lockout_secs(const login_throttle_config_t *c, uint32_t level) {
+  if (level == 0) return 0;
+  if (level - 1 >= 32) return c->max_delay_secs;
+  uint64_t d = (uint64_t)c->base_delay_secs << (level - 1);
+  return d > c->max_delay_secs ? c->max_delay_secs : (uint32_t)d;
+}
+
+// seconds of the lockout left at `now`
+static uint32_t remaining(const login_throttle_config_t *c, const slot_t *s, uint32_t now) {
+  uint64_t end = (uint64_t)s->last_fail + lockout_secs(c, s->level);
+  return end > now ? (uint32_t)(end - now) : 0;
+}
+
+void login_throttle_config_defaults(login_throttle_config_t *config) {
+  config->slots = (size_t)1 << 22;
+  config->window_secs = 300;
+  config->max_failures = 5;
+  config->base_delay_secs = 1;
+  config->max_delay_secs = 900;
+  config->set_unban_time = false;
+}
+
+login_throttle_t *login_throttle_create(const login_throttle_config_t *config) {
+  if (!config || config->slots == 0 || config->window_secs == 0 ||
+      config->max_failures >= FIELD_MAX || config->base_delay_secs == 0 ||
+      config->max_delay_secs < config->base_delay_secs) {
+    log_message(LOG_ERROR, "login_throttle_create: invalid config.");
+    return NULL;
+  }
+  size_t slots = BUCKET_SLOTS;
+  while (slots < config->slots) slots <<= 1;
+
+  login_throttle_t *t = calloc(1, sizeof *t);
+  _Atomic uint64_t *table = aligned_alloc(BUCKET_SLOTS * sizeof *table, slots * sizeof *table);
+  if (!t || !table) {
+    log_message(LOG_ERROR, "login_throttle_create: failed to allocate.");
+    free(t);
+    free(table);
+    return NULL;
+  }
+  for (size_t i = 0; i < slots; i++) atomic_init(&table[i], 0);
+  t->config = *config;
+  t->config.slots = slots;
+  t->mask = slots - 1;
+  t->slots = table;
+  return t;
+}
+
+void login_throttle_free(login_throttle_t *t) {
+  if (!t) return;
+  login_throttle_t *expected = t;
+  atomic_compare_exchange_strong(&default_throttle, &expected, NULL);
+  free(t->slots);
+  free(t);
+}
+
+const login_throttle_config_t *login_throttle_config(const login_throttle_t *t) {
+  return &t->config;
+}
+
+// the account's slot in its bucket, or NULL; *value is its contents
+static _Atomic uint64_t *find(login_throttle_t *t, size_t bucket, uint16_t tag, uint64_t *value) {
+  for (size_t i = 0; i < BUCKET_SLOTS; i++) {
+    uint64_t v = atomic_load_explicit(&t->slots[bucket + i], memory_order_acquire);
+    if (v != 0 && slot_unpack(v).tag == tag) {
+      *value = v;
+      return &t->slots[bucket + i];
+    }
+  }
+  return NULL;
+}
+
+uint32_t login_throttle_check(login_throttle_t *t, const char *userid, time_t now) {
+  uint16_t tag;
+  size_t bucket = locate(t, userid, &tag);
+  uint64_t v;
+  if (!find(t, bucket, tag, &v)) return 0;
+  slot_t s = slot_unpack(v);
+  uint32_t left = remaining(&t->config, &s, clamp_time(now));
+  if (left > 0) stats_add(&stat_rejected, 1);
+  return left;
+}
+
+// s with one more failure at `now`; *lockout is set to the lockout it starts
+static slot_t add_failure(const login_throttle_config_t *c, slot_t s, uint32_t now,
+                          uint32_t *lockout) {
+  uint32_t w = c->window_secs;
+  if (now < s.last_fail) now = s.last_fail;    // racing threads' clocks may disagree
+  uint32_t now_window = now / w, last_window = s.last_fail / w;
+
+  if (now_window == last_window) {
+    s.cur++;
+  } else if (now_window == last_window + 1) {
+    s.prev = s.cur;
+    s.cur = 1;
+  } else {
+    // a whole window without failures: start over
+    s.prev = 0;
+    s.cur = 1;
+    s.level = 0;
+  }
+  if (s.cur > FIELD_MAX) s.cur = FIELD_MAX;
+  s.last_fail = now;
+
+  // sliding window: the previous window counts for the part of it that
+  // still overlaps the last `w` seconds
+  uint32_t failures = s.cur + (uint32_t)((uint64_t)s.prev * (w - now % w) / w);
+  *lockout = 0;
+  if (failures > c->max_failures) {
+    if (s.level < FIELD_MAX) s.level++;
+    *lockout = lockout_secs(c, s.level);
+  }
+  return s;
+}
+
+// an empty slot in the bucket, or else the one whose last failure is oldest
+static _Atomic uint64_t *victim(login_throttle_t *t, size_t bucket, uint64_t *value) {
+  _Atomic uint64_t *slot = &t->slots[bucket];
+  uint64_t old = atomic_load_explicit(slot, memory_order_acquire);
+  for (size_t i = 0; i < BUCKET_SLOTS && old != 0; i++) {
+    uint64_t v = atomic_load_explicit(&t->slots[bucket + i], memory_order_acquire);
+    if (v == 0 || slot_unpack(v).last_fail < slot_unpack(old).last_fail) {
+      slot = &t->slots[bucket + i];
+      old = v;
+    }
+  }
+  *value = old;
+  return slot;
+}
+
+uint32_t login_throttle_failure(login_throttle_t *t, const char *userid, time_t now) {
+  uint16_t tag;
+  size_t bucket = locate(t, userid, &tag);
+  uint32_t now_secs = clamp_time(now);
+
+  for (;;) {
+    uint64_t old;
+    _Atomic uint64_t *slot = find(t, bucket, tag, &old);
+    slot_t s = slot_unpack(old);
+    if (!slot) {
+      slot = victim(t, bucket, &old);
+      s = (slot_t){ .tag = tag };
+    }
+
+    uint32_t lockout;
+    slot_t updated = add_failure(&t->config, s, now_secs, &lockout);
+    if (atomic_compare_exchange_weak_explicit(slot, &old, slot_pack(&updated),
+                                              memory_order_acq_rel, memory_order_relaxed)) {
+      if (old != 0 && slot_unpack(old).tag != tag) stats_add(&stat_evictions, 1);
+      if (lockout > 0) stats_add(&stat_lockouts, 1);
+      return lockout;
+    }
+  }
+}
+
+void login_throttle_success(login_throttle_t *t, const char *userid) {
+  uint16_t tag;
+  size_t bucket = locate(t, userid, &tag);
+  uint64_t v;
+  _Atomic uint64_t *slot;
+  while ((slot = find(t, bucket, tag, &v)) != NULL) {
+    atomic_compare_exchange_weak_explicit(slot, &v, 0, memory_order_acq_rel, memory_order_relaxed);
+  }
+}
+
+// exported state leaves out the tag, which import recomputes from the userid
+#define STATE_MASK (((uint64_t)1 << 48) - 1)
+
+uint64_t login_throttle_export(login_throttle_t *t, const char *userid) {
+  uint16_t tag;
+  size_t bucket = locate(t, userid, &tag);
+  uint64_t v;
+  return find(t, bucket, tag, &v) ? v & STATE_MASK : 0;
+}
+
+void login_throttle_import(login_throttle_t *t, const char *userid, uint64_t state) {
+  state &= STATE_MASK;
+  if (state == 0) return;
+  uint16_t tag;
+  size_t bucket = locate(t, userid, &tag);
+  uint64_t old;
+  while (!find(t, bucket, tag, &old)) {
+    _Atomic uint64_t *slot = victim(t, bucket, &old);
+    if (atomic_compare_exchange_weak_explicit(slot, &old, (uint64_t)tag << 48 | state,
+                                              memory_order_acq_rel, memory_order_relaxed)) {
+      if (old != 0) stats_add(&stat_evictions, 1);
+      return;
+    }
+  }
+}
+
+void login_throttle_set_default(login_throttle_t *t) {
+  atomic_store(&default_throttle, t);
+}
+
+login_throttle_t *login_throttle_get_default(void) {
+  return atomic_load(&default_throttle);
+}
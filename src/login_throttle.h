@@ -0,0 +1,94 @@
+#ifndef LOGIN_THROTTLE_H
+#define LOGIN_THROTTLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file login_throttle.h
+ * @brief Per-account failure tracking with exponential backoff.
+ *
+ * Counts failed logins per account over a sliding window. Once an
+ * account has had more than `max_failures` in a window, it is locked
+ * out: for `base_delay_secs` after that failure, then twice as long
+ * after each further failure, up to `max_delay_secs`. handle_login()
+ * rejects attempts on a locked-out account before hashing the password,
+ * so hammering one account costs the server almost nothing. Attempts
+ * rejected this way don't count as failures. The backoff resets after
+ * a full window with no failures, or on a successful login.
+ *
+ * Each tracked account takes one 64-bit table slot, updated with a
+ * single compare-and-swap, so no locks are taken. Only accounts with
+ * recent failures need a slot. When a bucket of 8 slots is full, the
+ * account that failed longest ago is forgotten. Accounts are told apart
+ * by a 16-bit tag as well as by their bucket, so rarely two accounts
+ * may share a slot and so share a lockout.
+ *
+ * Times are the login_time given to handle_login(), in whole seconds.
+ */
+
+typedef struct {
+  size_t slots;               // table size (8 bytes each); rounded up to a power of two
+  uint32_t window_secs;       // length of the sliding window
+  uint32_t max_failures;      // failures allowed per window (at most 30)
+  uint32_t base_delay_secs;   // first lockout
+  uint32_t max_delay_secs;    // longest lockout
+  bool set_unban_time;        // also ban the stored account for each lockout
+} login_throttle_config_t;
+
+typedef struct login_throttle login_throttle_t;
+
+// fill in a config with defaults: 4M slots (32 MiB), 5 failures per
+// 5 minutes, lockouts from 1 second up to 15 minutes
+void login_throttle_config_defaults(login_throttle_config_t *config);
+
+/**
+ * Create a throttle.
+ * Returns NULL and logs an error message on failure.
+ */
+login_throttle_t *login_throttle_create(const login_throttle_config_t *config);
+
+// free a throttle; no other thread may be using it
+void login_throttle_free(login_throttle_t *t);
+
+// the config a throttle was created with
+const login_throttle_config_t *login_throttle_config(const login_throttle_t *t);
+
+// seconds until `userid` may try again at time `now`, or 0 if it may now
+uint32_t login_throttle_check(login_throttle_t *t, const char *userid, time_t now);
+
+/**
+ * Record a failed login. Returns the length of the lockout it starts,
+ * or 0 if the account is still within its allowance.
+ */
+uint32_t login_throttle_failure(login_throttle_t *t, const char *userid, time_t now);
+
+// record a successful login, forgetting the account's failures
+void login_throttle_success(login_throttle_t *t, const char *userid);
+
+/**
+ * The failure state of `userid` as an opaque value, or 0 if it has none,
+ * to carry across a restart with login_throttle_import().
+ */
+uint64_t login_throttle_export(login_throttle_t *t, const char *userid);
+
+/**
+ * Reinstate a value from login_throttle_export(), possibly by a throttle
+ * with a different config or table size. Does nothing if the account
+ * already has failures recorded or `state` is 0.
+ */
+void login_throttle_import(login_throttle_t *t, const char *userid, uint64_t state);
+
+////
+// Process-wide default throttle
+
+// Set the throttle consulted by handle_login(). NULL clears it.
+// The caller keeps ownership of the throttle.
+void login_throttle_set_default(login_throttle_t *t);
+
+// the throttle set by login_throttle_set_default(), or NULL
+login_throttle_t *login_throttle_get_default(void);
+
+#endif // LOGIN_THROTTLE_H
@@ -0,0 +1,284 @@
+// Entry point for a login cluster node (`make cluster`).
+//
+// Holds one shard of the accounts in memory and serves cluster requests
+// (see cluster.h) on a unix or TCP socket, one thread per connection.
+// Changes to the shard can be published for replicas (see account_cdc.h).
+// With a hot-set file, lookups go through an account cache whose hot set
+// is saved there and warmed from it on the next start (see account_cache.h).
+// SIGINT and SIGTERM save the hot set and seal the audit log before exiting.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_cache.h"
+#include "account_cdc.h"
+#include "account_store.h"
+#include "audit_log.h"
+#include "cluster.h"
+#include "hash_memory.h"
+#include "logging.h"
+#include "login_throttle.h"
+#include "stuffing_detector.h"
+#include "wire.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+  int fd;
+  account_store_t *store;
+  int log_fd;
+} conn_arg_t;
+
+static void *serve_connection(void *p) {
+  conn_arg_t *arg = p;
+  cluster_node_serve(arg->fd, arg->store, arg->log_fd);
+  close(arg->fd);
+  free(arg);
+  return NULL;
+}
+
+typedef struct {
+  int fd;
+  account_cdc_t *cdc;
+} cdc_conn_arg_t;
+
+static void *serve_subscriber(void *p) {
+  cdc_conn_arg_t *arg = p;
+  account_cdc_serve(arg->cdc, arg->fd);
+  close(arg->fd);
+  free(arg);
+  return NULL;
+}
+
+typedef struct {
+  int lfd;
+  account_cdc_t *cdc;
+} cdc_listen_arg_t;
+
+// accept change subscribers, one thread each
+static void *accept_subscribers(void *p) {
+  cdc_listen_arg_t *listen = p;
+  for (;;) {
+    int fd = accept(listen->lfd, NULL, NULL);
+    if (fd < 0) continue;
+
+    cdc_conn_arg_t *arg = malloc(sizeof *arg);
+    pthread_t thread;
+    if (!arg) {
+      close(fd);
+      continue;
+    }
+    *arg = (cdc_conn_arg_t){ .fd = fd, .cdc = listen->cdc };
+    if (pthread_create(&thread, NULL, serve_subscriber, arg) != 0) {
+      log_message(LOG_ERROR, "login node: can't start subscriber thread.");
+      close(fd);
+      free(arg);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static bool lookup_local(void *arg, const char *userid, account_t *acc) {
+  return account_store_get(arg, userid, acc);
+}
+
+typedef struct {
+  account_cache_t *cache;
+  const char *path;
+  account_store_t *store;
+} warm_arg_t;
+
+// warm the cache while serving: accounts the router has already placed here are fetched
+static void *warm_cache(void *p) {
+  warm_arg_t *arg = p;
+  account_cache_warm_stats_t stats;
+  if (account_cache_warm_local(arg->cache, arg->path, lookup_local, arg->store, &stats)) {
+    log_message(LOG_INFO, "login node warmed %zu accounts and %zu \"not found\" entries from %zu "
+                "hot userids%s", stats.fetched, stats.negative, stats.records,
+                stats.complete ? "" : " (stopped at a limit)");
+  }
+  return NULL;
+}
+
+static sigset_t exit_signals;
+
+typedef struct {
+  account_cache_t *cache;
+  const char *hot_set_path;
+  audit_log_t *audit;
+} exit_arg_t;
+
+// on SIGINT or SIGTERM, save the hot set and write out the audit log, then exit
+static void *shut_down(void *p) {
+  exit_arg_t *arg = p;
+  int sig;
+  sigwait(&exit_signals, &sig);
+  if (arg->cache) account_cache_save(arg->cache, arg->hot_set_path);
+  if (arg->audit) {
+    // logins still running may append after this, into a segment indexed
+    // when the log is next opened
+    audit_log_set_default(NULL);
+    audit_log_seal(arg->audit);
+  }
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  const char *listen_addr = NULL;
+  bool verbose = false;
+  size_t hash_memory_mib = 0;
+  const char *audit_dir = NULL;
+  uint32_t stuffing_threshold = 0;
+  const char *cdc_shm_name = NULL;
+  const char *cdc_addr = NULL;
+  account_cache_config_t cache_config;
+  account_cache_config_defaults(&cache_config);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:B:c:C:F:H:l:M:s:S:W:vh")) != -1) {
+    switch (opt) {
+      case 'a': audit_dir = optarg; break;
+      case 'B': cache_config.warm_max_bytes = (size_t)strtoul(optarg, NULL, 10) << 20; break;
+      case 'F': cache_config.warm_max_in_flight = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'H': cache_config.hot_set_path = optarg; break;
+      case 'S': cache_config.save_interval_secs = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'W': cache_config.warm_max_secs = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'c': cdc_shm_name = optarg; break;
+      case 'C': stuffing_threshold = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'l': listen_addr = optarg; break;
+      case 's': cdc_addr = optarg; break;
+      case 'M': hash_memory_mib = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "Usage: %s -l ADDR [-a DIR] [-c NAME] [-C N] [-M MIB] [-s ADDR]\n"
+                        "          [-H PATH [-S SECS] [-W SECS] [-B MIB] [-F N]] [-v]\n"
+                        "  -l ADDR   listen address (unix:/path or tcp:host:port)\n"
+                        "  -a DIR    record login attempts in the audit log in DIR\n"
+                        "  -c NAME   publish account changes in the shared-memory ring /NAME\n"
+                        "  -C N      refuse clients that try more than N distinct userids in\n"
+                        "            10-20 minutes (4N for a /24)\n"
+                        "  -M MIB    memory for concurrent password hashes (default: 1/4 of RAM)\n"
+                        "  -s ADDR   stream account changes to replicas that connect to ADDR\n"
+                        "  -H PATH   cache account lookups, saving the hot set to PATH, and\n"
+                        "            warm the cache from PATH on startup\n"
+                        "  -S SECS   save the hot set every SECS seconds (default 60; 0 for\n"
+                        "            only at exit)\n"
+                        "  -W SECS   stop warming after SECS seconds (default 30)\n"
+                        "  -B MIB    stop warming once warmed entries take MIB MiB (default 32)\n"
+                        "  -F N      warm with up to N lookups in flight (default 4096)\n"
+                        "  -v        write handle_login() log lines to stderr\n", argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (!listen_addr) {
+    fprintf(stderr, "%s: -l ADDR is required\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (cache_config.hot_set_path || audit_dir) {
+    // before any thread starts, so that they all inherit the mask
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &exit_signals, NULL);
+  }
+  hash_memory_set_budget(hash_memory_mib << 20);
+
+  int log_fd = verbose ? STDERR_FILENO : open("/dev/null", O_WRONLY);
+  account_store_t *store = account_store_create(0);
+  login_throttle_config_t throttle_config;
+  login_throttle_config_defaults(&throttle_config);
+  login_throttle_t *throttle = login_throttle_create(&throttle_config);
+  int lfd = wire_listen(listen_addr);
+  audit_log_t *audit = audit_dir ? audit_log_open(audit_dir, NULL) : NULL;
+  stuffing_detector_t *stuffing = NULL;
+  if (stuffing_threshold > 0) {
+    stuffing_config_t stuffing_config;
+    stuffing_config_defaults(&stuffing_config);
+    stuffing_config.ip_threshold = stuffing_threshold;
+    stuffing_config.prefix_threshold = stuffing_threshold * 4;
+    stuffing = stuffing_detector_create(&stuffing_config);
+  }
+  account_cdc_t *cdc = NULL;
+  char shm_name[256];
+  if (cdc_shm_name || cdc_addr) {
+    account_cdc_config_t cdc_config;
+    account_cdc_config_defaults(&cdc_config);
+    if (cdc_shm_name) {
+      snprintf(shm_name, sizeof shm_name, "/%s", cdc_shm_name);
+      cdc_config.shm_name = shm_name;
+    }
+    cdc = account_cdc_create(&cdc_config);
+  }
+  cdc_listen_arg_t cdc_listen = { .lfd = cdc_addr ? wire_listen(cdc_addr) : -1, .cdc = cdc };
+  account_cache_t *cache = cache_config.hot_set_path ? account_cache_create(&cache_config) : NULL;
+  if (log_fd < 0 || !store || !throttle || lfd < 0 || (audit_dir && !audit) ||
+      (stuffing_threshold > 0 && !stuffing) || ((cdc_shm_name || cdc_addr) && !cdc) ||
+      (cdc_addr && cdc_listen.lfd < 0) || (cache_config.hot_set_path && !cache)) {
+    return 1;
+  }
+  account_store_set_cdc(store, cdc);
+  account_store_set_cache(store, cache);
+  if (cdc_addr) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accept_subscribers, &cdc_listen) != 0) {
+      log_message(LOG_ERROR, "login node: can't start subscriber listener.");
+      return 1;
+    }
+    pthread_detach(thread);
+    log_message(LOG_INFO, "login node streaming account changes on %s", cdc_addr);
+  }
+  audit_log_set_default(audit);
+  stuffing_detector_set_default(stuffing);
+  account_store_set_default(store);
+  login_throttle_set_default(throttle);
+  account_cache_set_default(cache);
+  // after the throttle is installed, as warming restores its state
+  warm_arg_t warm_arg = { .cache = cache, .path = cache_config.hot_set_path, .store = store };
+  exit_arg_t exit_arg = { .cache = cache, .hot_set_path = cache_config.hot_set_path, .audit = audit };
+  if (cache || audit) {
+    pthread_t exit_thread;
+    if (pthread_create(&exit_thread, NULL, shut_down, &exit_arg) != 0) {
+      log_message(LOG_ERROR, "login node: can't start shutdown thread.");
+      return 1;
+    }
+    pthread_detach(exit_thread);
+  }
+  if (cache) {
+    pthread_t warm_thread;
+    if (pthread_create(&warm_thread, NULL, warm_cache, &warm_arg) != 0) {
+      log_message(LOG_ERROR, "login node: can't start cache warming thread.");
+      return 1;
+    }
+    pthread_detach(warm_thread);
+  }
+  log_message(LOG_INFO, "login node listening on %s", listen_addr);
+
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) continue;
+
+    conn_arg_t *arg = malloc(sizeof *arg);
+    pthread_t thread;
+    if (!arg) {
+      close(fd);
+      continue;
+    }
+    *arg = (conn_arg_t){ .fd = fd, .store = store, .log_fd = log_fd };
+    if (pthread_create(&thread, NULL, serve_connection, arg) != 0) {
+      log_message(LOG_ERROR, "login node: can't start connection thread.");
+      close(fd);
+      free(arg);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "password_batch.h"
+#include "logging.h"
+#include "sha512_crypt.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static STATS_DEFINE(stat_batched, "password_batch.batched");
+static STATS_DEFINE(stat_single, "password_batch.single");
+
+typedef struct {
+  size_t check;
+  char setting[HASH_LENGTH + 1];    // password_hash needn't be NUL-terminated
+} batched_t;
+
+// the hash as a string, in `setting`, if the engine can check against it
+static bool batchable(const password_check_t *c, char setting[HASH_LENGTH + 1]) {
+  if (strlen(c->password) > SHA512_CRYPT_MAX_KEY) return false;
+  memcpy(setting, c->acc->password_hash, HASH_LENGTH);
+  setting[HASH_LENGTH] = '\0';
+  return sha512_crypt_supported(setting);
+}
+
+bool account_password_batchable(const account_t *acc, const char *password) {
+  if (!acc || !password || sha512_crypt_lanes() < 2) return false;
+  char setting[HASH_LENGTH + 1];
+  password_check_t c = { .acc = acc, .password = password };
+  bool ok = batchable(&c, setting);
+  memset(setting, 0, sizeof setting);
+  return ok;
+}
+
+void account_validate_passwords(password_check_t *checks, size_t n) {
+  if (!checks || n == 0) return;
+
+  // one lane at a time is slower than crypt_r(), so batch only with SIMD
+  sha512_crypt_job_t *jobs = NULL;
+  batched_t *batched = NULL;
+  if (sha512_crypt_lanes() > 1) {
+    jobs = malloc(n * sizeof *jobs);
+    batched = malloc(n * sizeof *batched);
+    if (!jobs || !batched) {
+      log_message(LOG_ERROR, "account_validate_passwords: can't allocate batch; checking one by one.");
+      free(jobs);
+      free(batched);
+      jobs = NULL;
+      batched = NULL;
+    }
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    password_check_t *c = &checks[i];
+    c->valid = false;
+    if (batched && batchable(c, batched[count].setting)) {
+      batched[count].check = i;
+      jobs[count] = (sha512_crypt_job_t){ .key = c->password, .setting = batched[count].setting };
+      count++;
+      continue;
+    }
+    c->valid = account_validate_password(c->acc, c->password);
+  }
+  stats_add(&stat_single, n - count);
+
+  if (count > 0) {
+    sha512_crypt_many(jobs, count);
+    for (size_t j = 0; j < count; j++) {
+      password_check_t *c = &checks[batched[j].check];
+      if (jobs[j].ok) {
+        c->valid = strncmp(jobs[j].output, c->acc->password_hash, sizeof c->acc->password_hash) == 0;
+      } else {
+        c->valid = account_validate_password(c->acc, c->password);
+      }
+    }
+    stats_add(&stat_batched, count);
+    memset(jobs, 0, count * sizeof *jobs);
+  }
+  free(jobs);
+  free(batched);
+}
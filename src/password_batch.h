@@ -0,0 +1,33 @@
+#ifndef PASSWORD_BATCH_H
+#define PASSWORD_BATCH_H
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file password_batch.h
+ * @brief Verifying many passwords at once.
+ *
+ * Each check gives the same answer account_validate_password() would,
+ * but checks against "$6$" (SHA-512-crypt) hashes are run through the
+ * multi-buffer engine in sha512_crypt.h, several per core at a time.
+ * Other hash types, and every check on a CPU where the engine has a
+ * single lane (which is slower than crypt_r()), are checked one by one
+ * with account_validate_password().
+ */
+
+typedef struct {
+  const account_t *acc;
+  const char *password;
+  bool valid;                 // set by account_validate_passwords()
+} password_check_t;
+
+// fill in `valid` for each of `n` checks
+void account_validate_passwords(password_check_t *checks, size_t n);
+
+// whether account_validate_passwords() would batch a check of `password` against `acc`
+bool account_password_batchable(const account_t *acc, const char *password);
+
+#endif // PASSWORD_BATCH_H
@@ -0,0 +1,131 @@
+// Entry point for the login cluster router (`make cluster`).
+//
+// Serves mode: accept cluster requests from clients and forward each
+// one to the node owning its userid.
+// Control mode (-c): ask a running router to add or remove a node.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cluster.h"
+#include "hash_ring.h"
+#include "logging.h"
+#include "wire.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_NODES 64
+
+typedef struct {
+  int fd;
+  cluster_router_t *router;
+} conn_arg_t;
+
+static void *serve_connection(void *p) {
+  conn_arg_t *arg = p;
+  cluster_router_serve(arg->router, arg->fd);
+  close(arg->fd);
+  free(arg);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s -l ADDR -n NODE [-n NODE ...] [-r VNODES]\n"
+    "       %s -c ROUTER (join|leave) NODE\n"
+    "  -l ADDR     listen address (unix:/path or tcp:host:port)\n"
+    "  -n NODE     address of a node that already holds its shard\n"
+    "  -r VNODES   ring points per node (default %d)\n"
+    "  -c ROUTER   send a membership change to a running router\n",
+    prog, prog, HASH_RING_DEFAULT_VNODES);
+}
+
+static int control(const char *router_addr, const char *action, const char *node) {
+  int fd = wire_connect(router_addr);
+  if (fd < 0) return 1;
+
+  bool ok;
+  if (strcmp(action, "join") == 0) {
+    ok = cluster_node_join(fd, node);
+  } else if (strcmp(action, "leave") == 0) {
+    ok = cluster_node_leave(fd, node);
+  } else {
+    fprintf(stderr, "unknown action '%s'\n", action);
+    ok = false;
+  }
+  close(fd);
+  if (!ok) fprintf(stderr, "%s %s failed\n", action, node);
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *listen_addr = NULL;
+  const char *control_addr = NULL;
+  const char *nodes[MAX_NODES];
+  size_t node_count = 0;
+  size_t vnodes = HASH_RING_DEFAULT_VNODES;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:r:c:h")) != -1) {
+    switch (opt) {
+      case 'l': listen_addr = optarg; break;
+      case 'n':
+        if (node_count == MAX_NODES) {
+          fprintf(stderr, "too many nodes (max %d)\n", MAX_NODES);
+          return 1;
+        }
+        nodes[node_count++] = optarg;
+        break;
+      case 'r': vnodes = (size_t)strtoul(optarg, NULL, 10); break;
+      case 'c': control_addr = optarg; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (control_addr) {
+    if (argc - optind != 2) {
+      usage(argv[0]);
+      return 1;
+    }
+    return control(control_addr, argv[optind], argv[optind + 1]);
+  }
+
+  if (!listen_addr || node_count == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  cluster_router_t *router = cluster_router_create(nodes, node_count, vnodes);
+  int lfd = wire_listen(listen_addr);
+  if (!router || lfd < 0) return 1;
+  log_message(LOG_INFO, "login router listening on %s with %zu nodes", listen_addr, node_count);
+
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) continue;
+
+    conn_arg_t *arg = malloc(sizeof *arg);
+    pthread_t thread;
+    if (!arg) {
+      close(fd);
+      continue;
+    }
+    *arg = (conn_arg_t){ .fd = fd, .router = router };
+    if (pthread_create(&thread, NULL, serve_connection, arg) != 0) {
+      log_message(LOG_ERROR, "login router: can't start connection thread.");
+      close(fd);
+      free(arg);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef SHA512_H
+#define SHA512_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file sha512.h
+ * @brief SHA-512 (FIPS 180-4).
+ *
+ * A plain streaming implementation, used by sha512_crypt.c and anywhere
+ * else a keyed or unkeyed SHA-512 is needed without going through
+ * libcrypt.
+ */
+
+#define SHA512_DIGEST_SIZE 64
+#define SHA512_BLOCK_SIZE 128
+
+typedef struct {
+  uint64_t state[8];
+  uint64_t length;                      // bytes hashed so far
+  unsigned char block[SHA512_BLOCK_SIZE];
+  size_t block_len;
+} sha512_ctx_t;
+
+// round constants and initial hash value, shared with the multi-buffer
+// code in sha512_crypt.c
+extern const uint64_t sha512_k[80];
+extern const uint64_t sha512_iv[8];
+
+void sha512_init(sha512_ctx_t *ctx);
+void sha512_update(sha512_ctx_t *ctx, const void *data, size_t len);
+
+// write the digest and wipe the context
+void sha512_final(sha512_ctx_t *ctx, unsigned char digest[SHA512_DIGEST_SIZE]);
+
+// one-shot convenience wrapper
+void sha512(const void *data, size_t len, unsigned char digest[SHA512_DIGEST_SIZE]);
+
+// HMAC-SHA-512 (RFC 2104) of `data` under `key`
+void hmac_sha512(const void *key, size_t key_len, const void *data, size_t len,
+                 unsigned char mac[SHA512_DIGEST_SIZE]);
+
+#endif // SHA512_H
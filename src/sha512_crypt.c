@@ -0,0 +1,346 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sha512_crypt.h"
+#include "sha512.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SALT_MAX 16
+#define ROUNDS_DEFAULT 5000
+#define ROUNDS_MIN 1000
+#define ROUNDS_MAX 999999999
+
+// Longest message in a round: 64-byte digest, salt and two copies of
+// the key, padded to whole blocks.
+#define CRYPT_MSG_MAX \
+  ((64 + SALT_MAX + 2 * SHA512_CRYPT_MAX_KEY + 17 + SHA512_BLOCK_SIZE - 1) / SHA512_BLOCK_SIZE * SHA512_BLOCK_SIZE)
+
+typedef struct {
+  uint32_t rounds;
+  bool rounds_custom;       // "rounds=N$" was given, so it appears in the output
+  char salt[SALT_MAX + 1];
+  size_t salt_len;
+} crypt_setting_t;
+
+// Per-candidate state for the rounds loop: the running digest and the
+// P and S byte sequences derived from the key and salt.
+typedef struct {
+  unsigned char alt[64];
+  unsigned char p[SHA512_CRYPT_MAX_KEY];
+  size_t plen;
+  unsigned char s[SALT_MAX];
+  size_t slen;
+} crypt_lane_t;
+
+static const char b64_chars[] =
+  "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+static uint64_t crypt_load_be64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+  return v;
+}
+
+static void crypt_store_be64(unsigned char *p, uint64_t v) {
+  for (int i = 7; i >= 0; i--) {
+    p[i] = (unsigned char)v;
+    v >>= 8;
+  }
+}
+
+// apply SHA-512 padding to a `len`-byte message; returns its block count
+static size_t crypt_pad(unsigned char *m, size_t len) {
+  size_t blocks = (len + 17 + SHA512_BLOCK_SIZE - 1) / SHA512_BLOCK_SIZE;
+  size_t end = blocks * SHA512_BLOCK_SIZE;
+  m[len] = 0x80;
+  memset(m + len + 1, 0, end - 8 - (len + 1));
+  crypt_store_be64(m + end - 8, (uint64_t)len * 8);
+  return blocks;
+}
+
+////
+// Engines
+
+#define MB_LANES 1
+#define MB_SUFFIX scalar
+#define MB_TARGET
+#include "sha512_crypt_mb.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_ENGINES 1
+
+#define MB_LANES 4
+#define MB_SUFFIX avx2
+#define MB_TARGET __attribute__((target("avx2")))
+#include "sha512_crypt_mb.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+
+#define MB_LANES 8
+#define MB_SUFFIX avx512
+#define MB_TARGET __attribute__((target("avx512f")))
+#include "sha512_crypt_mb.h"
+#undef MB_LANES
+#undef MB_SUFFIX
+#undef MB_TARGET
+#endif
+
+typedef void (*crypt_rounds_fn)(crypt_lane_t *const *lanes, size_t n, uint32_t rounds);
+
+static _Atomic int selected_engine = SHA512_CRYPT_AUTO;
+
+static bool engine_supported(sha512_crypt_engine_t engine) {
+  switch (engine) {
+    case SHA512_CRYPT_AUTO:
+    case SHA512_CRYPT_SCALAR:
+      return true;
+#ifdef HAVE_X86_ENGINES
+    case SHA512_CRYPT_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+    case SHA512_CRYPT_AVX512:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f");
+#else
+    case SHA512_CRYPT_AVX2:
+    case SHA512_CRYPT_AVX512:
+      return false;
+#endif
+  }
+  return false;
+}
+
+sha512_crypt_engine_t sha512_crypt_engine(void) {
+  sha512_crypt_engine_t engine = (sha512_crypt_engine_t)atomic_load(&selected_engine);
+  if (engine != SHA512_CRYPT_AUTO) return engine;
+
+  if (engine_supported(SHA512_CRYPT_AVX512)) engine = SHA512_CRYPT_AVX512;
+  else if (engine_supported(SHA512_CRYPT_AVX2)) engine = SHA512_CRYPT_AVX2;
+  else engine = SHA512_CRYPT_SCALAR;
+  int expected = SHA512_CRYPT_AUTO;
+  atomic_compare_exchange_strong(&selected_engine, &expected, (int)engine);
+  return engine;
+}
+
+bool sha512_crypt_set_engine(sha512_crypt_engine_t engine) {
+  if (!engine_supported(engine)) return false;
+  atomic_store(&selected_engine, (int)engine);
+  return true;
+}
+
+size_t sha512_crypt_lanes(void) {
+  switch (sha512_crypt_engine()) {
+    case SHA512_CRYPT_AVX512: return 8;
+    case SHA512_CRYPT_AVX2: return 4;
+    default: return 1;
+  }
+}
+
+const char *sha512_crypt_engine_name(sha512_crypt_engine_t engine) {
+  switch (engine) {
+    case SHA512_CRYPT_AUTO: return "auto";
+    case SHA512_CRYPT_SCALAR: return "scalar";
+    case SHA512_CRYPT_AVX2: return "avx2";
+    case SHA512_CRYPT_AVX512: return "avx512";
+  }
+  return "unknown";
+}
+
+static crypt_rounds_fn engine_rounds(sha512_crypt_engine_t engine) {
+  switch (engine) {
+#ifdef HAVE_X86_ENGINES
+    case SHA512_CRYPT_AVX512: return crypt_rounds_avx512;
+    case SHA512_CRYPT_AVX2: return crypt_rounds_avx2;
+#endif
+    default: return crypt_rounds_scalar;
+  }
+}
+
+////
+// Settings and output
+
+static bool parse_setting(const char *setting, crypt_setting_t *out) {
+  if (strncmp(setting, "$6$", 3) != 0) return false;
+  const char *p = setting + 3;
+
+  out->rounds = ROUNDS_DEFAULT;
+  out->rounds_custom = false;
+  if (strncmp(p, "rounds=", 7) == 0) {
+    p += 7;
+    if (*p < '1' || *p > '9') return false;
+    uint64_t rounds = 0;
+    while (*p >= '0' && *p <= '9') {
+      rounds = rounds * 10 + (uint64_t)(*p++ - '0');
+      if (rounds > ROUNDS_MAX) return false;
+    }
+    if (*p++ != '$' || rounds < ROUNDS_MIN) return false;
+    out->rounds = (uint32_t)rounds;
+    out->rounds_custom = true;
+  }
+
+  size_t len = 0;
+  while (p[len] != '\0' && p[len] != '$') {
+    if (len == SALT_MAX || !strchr(b64_chars, p[len])) return false;
+    len++;
+  }
+  if (len == 0) return false;
+  memcpy(out->salt, p, len);
+  out->salt[len] = '\0';
+  out->salt_len = len;
+  return true;
+}
+
+bool sha512_crypt_supported(const char *setting) {
+  crypt_setting_t parsed;
+  return setting && parse_setting(setting, &parsed);
+}
+
+// everything before the rounds loop; plain scalar SHA-512
+static void crypt_prepare(crypt_lane_t *lane, const char *key, size_t klen,
+                          const char *salt, size_t slen) {
+  sha512_ctx_t ctx;
+  unsigned char alt[64], temp[64];
+  size_t cnt;
+
+  sha512_init(&ctx);
+  sha512_update(&ctx, key, klen);
+  sha512_update(&ctx, salt, slen);
+  sha512_update(&ctx, key, klen);
+  sha512_final(&ctx, alt);
+
+  sha512_init(&ctx);
+  sha512_update(&ctx, key, klen);
+  sha512_update(&ctx, salt, slen);
+  for (cnt = klen; cnt > 64; cnt -= 64) sha512_update(&ctx, alt, 64);
+  sha512_update(&ctx, alt, cnt);
+  for (cnt = klen; cnt > 0; cnt >>= 1) {
+    if (cnt & 1) sha512_update(&ctx, alt, 64);
+    else sha512_update(&ctx, key, klen);
+  }
+  sha512_final(&ctx, lane->alt);
+
+  sha512_init(&ctx);
+  for (cnt = 0; cnt < klen; cnt++) sha512_update(&ctx, key, klen);
+  sha512_final(&ctx, temp);
+  for (cnt = 0; cnt + 64 <= klen; cnt += 64) memcpy(lane->p + cnt, temp, 64);
+  memcpy(lane->p + cnt, temp, klen - cnt);
+  lane->plen = klen;
+
+  sha512_init(&ctx);
+  for (cnt = 0; cnt < 16u + lane->alt[0]; cnt++) sha512_update(&ctx, salt, slen);
+  sha512_final(&ctx, temp);
+  memcpy(lane->s, temp, slen);
+  lane->slen = slen;
+
+  memset(alt, 0, sizeof alt);
+  memset(temp, 0, sizeof temp);
+}
+
+static char *b64_from_24bit(char *cp, unsigned b2, unsigned b1, unsigned b0, int n) {
+  unsigned w = (b2 << 16) | (b1 << 8) | b0;
+  while (n-- > 0) {
+    *cp++ = b64_chars[w & 0x3f];
+    w >>= 6;
+  }
+  return cp;
+}
+
+static void crypt_encode(const crypt_setting_t *setting, const unsigned char alt[64],
+                         char out[SHA512_CRYPT_OUTPUT_SIZE]) {
+  // byte order used by the reference implementation
+  static const unsigned char order[21][3] = {
+    {0, 21, 42}, {22, 43, 1}, {44, 2, 23}, {3, 24, 45}, {25, 46, 4}, {47, 5, 26},
+    {6, 27, 48}, {28, 49, 7}, {50, 8, 29}, {9, 30, 51}, {31, 52, 10}, {53, 11, 32},
+    {12, 33, 54}, {34, 55, 13}, {56, 14, 35}, {15, 36, 57}, {37, 58, 16}, {59, 17, 38},
+    {18, 39, 60}, {40, 61, 19}, {62, 20, 41},
+  };
+
+  int len;
+  if (setting->rounds_custom) {
+    len = snprintf(out, SHA512_CRYPT_OUTPUT_SIZE, "$6$rounds=%u$%s$", (unsigned)setting->rounds,
+                   setting->salt);
+  } else {
+    len = snprintf(out, SHA512_CRYPT_OUTPUT_SIZE, "$6$%s$", setting->salt);
+  }
+  char *cp = out + len;
+  for (int i = 0; i < 21; i++) {
+    cp = b64_from_24bit(cp, alt[order[i][0]], alt[order[i][1]], alt[order[i][2]], 4);
+  }
+  cp = b64_from_24bit(cp, 0, 0, alt[63], 2);
+  *cp = '\0';
+}
+
+////
+// Batches
+
+typedef struct {
+  uint32_t rounds;
+  size_t job;
+} pending_t;
+
+static int compare_pending(const void *a, const void *b) {
+  const pending_t *x = a;
+  const pending_t *y = b;
+  if (x->rounds != y->rounds) return x->rounds < y->rounds ? -1 : 1;
+  return (x->job > y->job) - (x->job < y->job);
+}
+
+void sha512_crypt_many(sha512_crypt_job_t *jobs, size_t n) {
+  if (!jobs || n == 0) return;
+
+  crypt_setting_t *settings = malloc(n * sizeof *settings);
+  crypt_lane_t *lanes = malloc(n * sizeof *lanes);
+  pending_t *pending = malloc(n * sizeof *pending);
+  if (!settings || !lanes || !pending) {
+    for (size_t i = 0; i < n; i++) jobs[i].ok = false;
+    free(settings);
+    free(lanes);
+    free(pending);
+    return;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    jobs[i].ok = false;
+    if (!jobs[i].key || !jobs[i].setting || !parse_setting(jobs[i].setting, &settings[i])) continue;
+    size_t klen = strlen(jobs[i].key);
+    if (klen > SHA512_CRYPT_MAX_KEY) continue;
+    crypt_prepare(&lanes[i], jobs[i].key, klen, settings[i].salt, settings[i].salt_len);
+    pending[count++] = (pending_t){ settings[i].rounds, i };
+  }
+  qsort(pending, count, sizeof *pending, compare_pending);
+
+  sha512_crypt_engine_t engine = sha512_crypt_engine();
+  crypt_rounds_fn rounds_fn = engine_rounds(engine);
+  size_t width = sha512_crypt_lanes();
+
+  // fill each vector with jobs that share a rounds count
+  for (size_t start = 0; start < count;) {
+    crypt_lane_t *group[8];
+    size_t g = 0;
+    uint32_t rounds = pending[start].rounds;
+    while (start < count && g < width && pending[start].rounds == rounds) {
+      group[g++] = &lanes[pending[start++].job];
+    }
+    rounds_fn(group, g, rounds);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    size_t j = pending[i].job;
+    crypt_encode(&settings[j], lanes[j].alt, jobs[j].output);
+    jobs[j].ok = true;
+  }
+
+  memset(lanes, 0, n * sizeof *lanes);
+  free(lanes);
+  free(settings);
+  free(pending);
+}
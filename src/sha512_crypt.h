@@ -0,0 +1,75 @@
+#ifndef SHA512_CRYPT_H
+#define SHA512_CRYPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file sha512_crypt.h
+ * @brief Multi-buffer SHA-512-crypt ("$6$") hashing.
+ *
+ * Computes the same strings as libcrypt's crypt_r() for "$6$" settings,
+ * but hashes several candidates at once: the rounds loop, which is all
+ * but a few of the SHA-512 compressions, runs the candidates in the
+ * lanes of a SIMD register. The engine is picked at runtime from what
+ * the CPU supports:
+ *
+ * - AVX-512: 8 lanes
+ * - AVX2: 4 lanes
+ * - scalar: 1 lane (any CPU)
+ *
+ * Only well-formed settings are accepted (see sha512_crypt_supported());
+ * callers should hand anything else to crypt_r().
+ */
+
+// "$6$rounds=999999999$" + 16-char salt + "$" + 86-char hash + NUL
+#define SHA512_CRYPT_OUTPUT_SIZE 124
+
+// longest key accepted, matching the libcrypt limit
+#define SHA512_CRYPT_MAX_KEY 511
+
+typedef enum {
+  SHA512_CRYPT_AUTO,        // the widest engine the CPU supports
+  SHA512_CRYPT_SCALAR,
+  SHA512_CRYPT_AVX2,
+  SHA512_CRYPT_AVX512
+} sha512_crypt_engine_t;
+
+typedef struct {
+  const char *key;          // the password
+  const char *setting;      // "$6$[rounds=N$]salt[$hash]"
+  char output[SHA512_CRYPT_OUTPUT_SIZE];
+  bool ok;                  // set if output holds the hash
+} sha512_crypt_job_t;
+
+/**
+ * True if `setting` is a "$6$" setting (or hash) that the engine
+ * handles: an optional "rounds=N$" with 1000 <= N <= 999999999 and no
+ * leading zeros, then 1-16 salt characters from [./0-9A-Za-z] ending at
+ * a '$' or the end of the string.
+ */
+bool sha512_crypt_supported(const char *setting);
+
+/**
+ * Hash every job, filling in `output` and `ok`. Jobs whose setting isn't
+ * supported, or whose key is longer than SHA512_CRYPT_MAX_KEY, get
+ * ok = false. Jobs with the same rounds count are hashed together.
+ */
+void sha512_crypt_many(sha512_crypt_job_t *jobs, size_t n);
+
+/**
+ * Select an engine (SHA512_CRYPT_AUTO restores the default). Returns
+ * false, leaving the engine unchanged, if the CPU doesn't support it.
+ */
+bool sha512_crypt_set_engine(sha512_crypt_engine_t engine);
+
+// the engine in use (never SHA512_CRYPT_AUTO)
+sha512_crypt_engine_t sha512_crypt_engine(void);
+
+// number of candidates the engine in use hashes at once
+size_t sha512_crypt_lanes(void);
+
+// "auto", "scalar", "avx2" or "avx512"
+const char *sha512_crypt_engine_name(sha512_crypt_engine_t engine);
+
+#endif // SHA512_CRYPT_H
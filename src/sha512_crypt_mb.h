@@ -0,0 +1,118 @@
+// Multi-buffer rounds loop for SHA-512-crypt.
+//
+// Not a public header: sha512_crypt.c includes it once per engine, with
+// MB_LANES (lanes per vector), MB_SUFFIX (appended to function names)
+// and MB_TARGET (a target attribute, or nothing) defined. Each inclusion
+// defines MB_FN(crypt_rounds), which runs the rounds loop for up to
+// MB_LANES prepared lanes with the same rounds count.
+//
+// Lanes may need different numbers of blocks in a round (their keys and
+// salts differ in length), so each block is compressed in every lane and
+// the result discarded in lanes that have already finished.
+
+#define MB_CAT2(a, b) a##_##b
+#define MB_CAT(a, b) MB_CAT2(a, b)
+#define MB_FN(name) MB_CAT(name, MB_SUFFIX)
+#define MB_VEC MB_FN(vec_t)
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+typedef uint64_t MB_VEC __attribute__((vector_size(8 * MB_LANES)));
+
+static MB_TARGET void MB_FN(compress)(MB_VEC state[8], MB_VEC w[16]) {
+  MB_VEC a = state[0], b = state[1], c = state[2], d = state[3];
+  MB_VEC e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int t = 0; t < 80; t++) {
+    if (t >= 16) {
+      MB_VEC w15 = w[(t + 1) & 15], w2 = w[(t + 14) & 15];
+      w[t & 15] += (MB_ROTR(w15, 1) ^ MB_ROTR(w15, 8) ^ (w15 >> 7)) + w[(t + 9) & 15] +
+                   (MB_ROTR(w2, 19) ^ MB_ROTR(w2, 61) ^ (w2 >> 6));
+    }
+    MB_VEC t1 = h + (MB_ROTR(e, 14) ^ MB_ROTR(e, 18) ^ MB_ROTR(e, 41)) + ((e & f) ^ (~e & g)) +
+                sha512_k[t] + w[t & 15];
+    MB_VEC t2 = (MB_ROTR(a, 28) ^ MB_ROTR(a, 34) ^ MB_ROTR(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+static MB_TARGET void MB_FN(crypt_rounds)(crypt_lane_t *const *lanes, size_t n, uint32_t rounds) {
+  unsigned char msg[MB_LANES][CRYPT_MSG_MAX];
+  size_t blocks[MB_LANES] = {0};
+
+  for (uint32_t cnt = 0; cnt < rounds; cnt++) {
+    size_t max_blocks = 0;
+    for (size_t l = 0; l < n; l++) {
+      const crypt_lane_t *lane = lanes[l];
+      unsigned char *m = msg[l];
+      size_t len = 0;
+      if (cnt & 1) {
+        memcpy(m, lane->p, lane->plen);
+        len = lane->plen;
+      } else {
+        memcpy(m, lane->alt, 64);
+        len = 64;
+      }
+      if (cnt % 3 != 0) {
+        memcpy(m + len, lane->s, lane->slen);
+        len += lane->slen;
+      }
+      if (cnt % 7 != 0) {
+        memcpy(m + len, lane->p, lane->plen);
+        len += lane->plen;
+      }
+      if (cnt & 1) {
+        memcpy(m + len, lane->alt, 64);
+        len += 64;
+      } else {
+        memcpy(m + len, lane->p, lane->plen);
+        len += lane->plen;
+      }
+      blocks[l] = crypt_pad(m, len);
+      if (blocks[l] > max_blocks) max_blocks = blocks[l];
+    }
+
+    MB_VEC state[8];
+    for (int k = 0; k < 8; k++) {
+      for (size_t l = 0; l < MB_LANES; l++) state[k][l] = sha512_iv[k];
+    }
+    for (size_t b = 0; b < max_blocks; b++) {
+      MB_VEC w[16], saved[8], active;
+      for (size_t l = 0; l < MB_LANES; l++) {
+        bool live = l < n && b < blocks[l];
+        active[l] = live ? UINT64_MAX : 0;
+        for (int j = 0; j < 16; j++) {
+          w[j][l] = live ? crypt_load_be64(msg[l] + b * 128 + 8 * (size_t)j) : 0;
+        }
+      }
+      memcpy(saved, state, sizeof saved);
+      MB_FN(compress)(state, w);
+      for (int k = 0; k < 8; k++) state[k] = (state[k] & active) | (saved[k] & ~active);
+    }
+
+    for (size_t l = 0; l < n; l++) {
+      for (int k = 0; k < 8; k++) crypt_store_be64(lanes[l]->alt + 8 * k, state[k][l]);
+    }
+  }
+  memset(msg, 0, sizeof msg);
+}
+
+#undef MB_ROTR
+#undef MB_VEC
+#undef MB_FN
+#undef MB_CAT
+#undef MB_CAT2
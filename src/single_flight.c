@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "single_flight.h"
+#include "logging.h"
+#include "sha512.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SF_BUCKETS 64
+#define SF_KEY_SIZE 32
+
+typedef enum {
+  FLIGHT_RUNNING,
+  FLIGHT_DONE,
+  FLIGHT_ABANDONED
+} flight_state_t;
+
+typedef struct sf_flight {
+  char userid[USER_ID_LENGTH];
+  char password_hash[HASH_LENGTH];
+  unsigned char digest[SHA512_DIGEST_SIZE];   // HMAC of the candidate password
+  flight_state_t state;
+  bool result;
+  unsigned waiters;                           // followers yet to read the result
+  pthread_cond_t cond;
+  struct sf_flight *next;
+} sf_flight_t;
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static sf_flight_t *table[SF_BUCKETS];        // flights still running
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static unsigned char hmac_key[SF_KEY_SIZE];
+static bool have_key = false;
+
+static STATS_DEFINE(stat_leaders, "single_flight.leaders");
+static STATS_DEFINE(stat_shared, "single_flight.shared");
+static STATS_DEFINE(stat_waiting, "single_flight.waiting");
+static STATS_DEFINE(stat_expired, "single_flight.expired");
+
+static void make_key(void) {
+  FILE *f = fopen("/dev/urandom", "rb");
+  have_key = f && fread(hmac_key, 1, sizeof hmac_key, f) == sizeof hmac_key;
+  if (f) fclose(f);
+  if (!have_key) log_message(LOG_ERROR, "single_flight: no randomness; verifications won't be shared.");
+}
+
+static size_t bucket_of(const unsigned char digest[SHA512_DIGEST_SIZE]) {
+  // the digest is keyed, so its bytes are already well spread
+  return digest[0] % SF_BUCKETS;
+}
+
+static bool flight_matches(const sf_flight_t *f, const account_t *acc,
+                           const unsigned char digest[SHA512_DIGEST_SIZE]) {
+  return memcmp(f->digest, digest, SHA512_DIGEST_SIZE) == 0 &&
+         strncmp(f->userid, acc->userid, USER_ID_LENGTH) == 0 &&
+         memcmp(f->password_hash, acc->password_hash, HASH_LENGTH) == 0;
+}
+
+static void flight_free(sf_flight_t *f) {
+  pthread_cond_destroy(&f->cond);
+  memset(f, 0, sizeof *f);
+  free(f);
+}
+
+// take a flight out of the table; called with table_lock held
+static void unlink_flight(sf_flight_t *f) {
+  sf_flight_t **p = &table[bucket_of(f->digest)];
+  while (*p != f) p = &(*p)->next;
+  *p = f->next;
+  f->next = NULL;
+}
+
+single_flight_status_t single_flight_join(const account_t *acc, const char *password,
+                                          const struct timespec *deadline, single_flight_t *flight,
+                                          bool *result) {
+  flight->flight = NULL;
+  pthread_once(&key_once, make_key);
+  if (!have_key) return SINGLE_FLIGHT_LEADER;
+
+  unsigned char digest[SHA512_DIGEST_SIZE];
+  hmac_sha512(hmac_key, sizeof hmac_key, password, strlen(password), digest);
+  size_t bucket = bucket_of(digest);
+
+  pthread_mutex_lock(&table_lock);
+  for (;;) {
+    sf_flight_t *f = table[bucket];
+    while (f && !flight_matches(f, acc, digest)) f = f->next;
+
+    if (!f) {
+      // lead a new flight; if that can't be set up, just don't share
+      f = calloc(1, sizeof *f);
+      if (f) {
+        memcpy(f->userid, acc->userid, USER_ID_LENGTH);
+        memcpy(f->password_hash, acc->password_hash, HASH_LENGTH);
+        memcpy(f->digest, digest, SHA512_DIGEST_SIZE);
+        f->state = FLIGHT_RUNNING;
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&f->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        f->next = table[bucket];
+        table[bucket] = f;
+      }
+      pthread_mutex_unlock(&table_lock);
+      memset(digest, 0, sizeof digest);
+      flight->flight = f;
+      stats_add(&stat_leaders, 1);
+      return SINGLE_FLIGHT_LEADER;
+    }
+
+    f->waiters++;
+    stats_add(&stat_waiting, 1);
+    if (deadline) {
+      while (f->state == FLIGHT_RUNNING &&
+             pthread_cond_timedwait(&f->cond, &table_lock, deadline) != ETIMEDOUT) {}
+    } else {
+      while (f->state == FLIGHT_RUNNING) pthread_cond_wait(&f->cond, &table_lock);
+    }
+    stats_sub(&stat_waiting, 1);
+    flight_state_t state = f->state;
+    bool answer = f->result;
+    // a running flight is still in the table, so it isn't ours to free
+    if (--f->waiters == 0 && state != FLIGHT_RUNNING) flight_free(f);
+
+    if (state == FLIGHT_RUNNING) {
+      pthread_mutex_unlock(&table_lock);
+      memset(digest, 0, sizeof digest);
+      stats_add(&stat_expired, 1);
+      return SINGLE_FLIGHT_EXPIRED;
+    }
+    if (state == FLIGHT_DONE) {
+      pthread_mutex_unlock(&table_lock);
+      memset(digest, 0, sizeof digest);
+      *result = answer;
+      stats_add(&stat_shared, 1);
+      return SINGLE_FLIGHT_SHARED;
+    }
+    // the leader gave up; look again, and maybe lead
+  }
+}
+
+static void land(single_flight_t *flight, flight_state_t state, bool result) {
+  sf_flight_t *f = flight->flight;
+  flight->flight = NULL;
+  if (!f) return;
+
+  pthread_mutex_lock(&table_lock);
+  unlink_flight(f);
+  f->state = state;
+  f->result = result;
+  if (f->waiters == 0) flight_free(f);
+  else pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&table_lock);
+}
+
+void single_flight_finish(single_flight_t *flight, bool result) {
+  land(flight, FLIGHT_DONE, result);
+}
+
+void single_flight_abandon(single_flight_t *flight) {
+  land(flight, FLIGHT_ABANDONED, false);
+}
+
+bool single_flight_validate_password(const account_t *acc, const char *password) {
+  single_flight_t flight;
+  bool ok;
+  if (single_flight_join(acc, password, NULL, &flight, &ok) == SINGLE_FLIGHT_SHARED) return ok;
+  ok = account_validate_password(acc, password);
+  single_flight_finish(&flight, ok);
+  return ok;
+}
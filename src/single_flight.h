@@ -0,0 +1,70 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * @file single_flight.h
+ * @brief Coalescing of identical password verifications that overlap in time.
+ *
+ * When the same userid, stored hash and candidate password are being
+ * verified by several threads at once (a client retrying in a burst),
+ * one of them (the leader) computes the hash and the rest wait for its
+ * answer instead of repeating the work.
+ *
+ * Nothing outlives the computation: once the leader publishes its
+ * answer, the entry leaves the table, and the next identical request
+ * hashes again. Candidate passwords aren't kept at all; requests are
+ * matched on an HMAC-SHA-512 of the password under a random key made
+ * at startup.
+ *
+ * A follower waits no longer than its deadline, as it would for
+ * admission (admission.h): a leader held up by a slow hash or a long
+ * admission queue doesn't hold its followers past theirs.
+ *
+ *     single_flight_t flight;
+ *     bool ok;
+ *     if (single_flight_join(acc, password, NULL, &flight, &ok) == SINGLE_FLIGHT_LEADER) {
+ *       ok = account_validate_password(acc, password);   // we lead
+ *       single_flight_finish(&flight, ok);
+ *     }
+ */
+
+typedef enum {
+  SINGLE_FLIGHT_LEADER,         // compute the answer, then finish or abandon `flight`
+  SINGLE_FLIGHT_SHARED,         // an identical leader finished; its answer is in *result
+  SINGLE_FLIGHT_EXPIRED         // the deadline passed while waiting for the leader
+} single_flight_status_t;
+
+typedef struct {
+  struct sf_flight *flight;     // NULL if the leader isn't sharing its result
+} single_flight_t;
+
+/**
+ * Join an identical verification already in flight, or become its leader.
+ *
+ * `deadline` is an absolute CLOCK_MONOTONIC time, or NULL to wait for
+ * the leader however long it takes. On SINGLE_FLIGHT_LEADER, the caller
+ * must compute the answer and then call single_flight_finish() or
+ * single_flight_abandon() with `flight` exactly once.
+ */
+single_flight_status_t single_flight_join(const account_t *acc, const char *password,
+                                          const struct timespec *deadline, single_flight_t *flight,
+                                          bool *result);
+
+// publish the leader's answer to everyone waiting on it
+void single_flight_finish(single_flight_t *flight, bool result);
+
+/**
+ * Give up leading without an answer (e.g. admission control refused the
+ * work). A waiting request takes over as leader.
+ */
+void single_flight_abandon(single_flight_t *flight);
+
+// account_validate_password() through the single-flight layer
+bool single_flight_validate_password(const account_t *acc, const char *password);
+
+#endif // SINGLE_FLIGHT_H
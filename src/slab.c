@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "slab.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_BYTES ((size_t)64 * 1024)     // also the slab alignment
+#define SLAB_HEADER 64                     // sizeof(slab_t), rounded up to a cache line
+#define MAGAZINE_SIZE 32
+#define DEPOT_MAX_FULL 16                  // full magazines a depot keeps before flushing one
+#define SPARE_SLABS 1                      // empty slabs a class keeps before releasing them
+
+static const size_t class_sizes[] = {
+  64, 128, 192, 256, 320, 384, 448, 512, 768, 1024, 1536, 2048,
+};
+#define CLASS_COUNT (sizeof class_sizes / sizeof class_sizes[0])
+
+typedef struct magazine {
+  struct magazine *next;        // in the depot
+  size_t count;
+  void *objects[MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct slab {
+  struct slab *next;            // in the class's partial or empty list
+  struct slab *prev;
+  void *free;                   // freed objects, linked through their first word
+  size_t bump;                  // objects never handed out start at this index
+  size_t in_use;
+  bool partial;                 // on the partial list (else on the empty list or full)
+} slab_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t size;
+  size_t per_slab;
+  slab_t *partial;              // slabs with some objects free
+  slab_t *empty;                // slabs with every object free
+  size_t empty_count;
+  magazine_t *full;             // magazines of free objects
+  size_t full_count;
+  magazine_t *spare;            // empty magazines
+} size_class_t;
+
+// a thread's magazines for one class
+typedef struct {
+  magazine_t *loaded;
+  magazine_t *previous;
+} thread_cache_t;
+
+_Static_assert(sizeof(slab_t) <= SLAB_HEADER, "slab header too big");
+
+static size_class_t classes[CLASS_COUNT];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static _Thread_local thread_cache_t caches[CLASS_COUNT];
+static _Thread_local bool registered = false;
+
+static STATS_DEFINE(stat_slabs, "slab.slabs");
+static STATS_DEFINE(stat_slabs_released, "slab.slabs_released");
+static STATS_DEFINE(stat_depot_exchanges, "slab.depot_exchanges");
+
+static void thread_exit(void *arg);
+
+static void init_classes(void) {
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    pthread_mutex_init(&classes[i].lock, NULL);
+    classes[i].size = class_sizes[i];
+    classes[i].per_slab = (SLAB_BYTES - SLAB_HEADER) / class_sizes[i];
+  }
+  if (pthread_key_create(&thread_key, thread_exit) != 0) {
+    log_message(LOG_ERROR, "slab: can't create thread key.");
+    abort();
+  }
+}
+
+static size_t class_index(size_t size) {
+  if (size <= 512) return size == 0 ? 0 : (size - 1) / 64;
+  size_t i = 8;
+  while (class_sizes[i] < size) i++;
+  return i;
+}
+
+static slab_t *slab_of(void *p) {
+  return (slab_t *)((uintptr_t)p & ~(uintptr_t)(SLAB_BYTES - 1));
+}
+
+////
+// Slabs. Called with the class lock held.
+
+static void list_remove(slab_t **head, slab_t *s) {
+  if (s->prev) s->prev->next = s->next;
+  else *head = s->next;
+  if (s->next) s->next->prev = s->prev;
+  s->next = s->prev = NULL;
+}
+
+static void list_push(slab_t **head, slab_t *s) {
+  s->prev = NULL;
+  s->next = *head;
+  if (*head) (*head)->prev = s;
+  *head = s;
+}
+
+// a slab with a free object: partial, else empty, else new
+static slab_t *slab_with_space(size_class_t *c) {
+  if (c->partial) return c->partial;
+  slab_t *s = c->empty;
+  if (s) {
+    list_remove(&c->empty, s);
+    c->empty_count--;
+  } else {
+    s = aligned_alloc(SLAB_BYTES, SLAB_BYTES);
+    if (!s) return NULL;
+    memset(s, 0, SLAB_BYTES);
+    stats_add(&stat_slabs, 1);
+  }
+  s->partial = true;
+  list_push(&c->partial, s);
+  return s;
+}
+
+static void *slab_take(size_class_t *c) {
+  slab_t *s = slab_with_space(c);
+  if (!s) return NULL;
+  void *p;
+  if (s->free) {
+    p = s->free;
+    memcpy(&s->free, p, sizeof(void *));
+    memset(p, 0, sizeof(void *));
+  } else {
+    p = (unsigned char *)s + SLAB_HEADER + s->bump++ * c->size;
+  }
+  if (++s->in_use == c->per_slab) {
+    list_remove(&c->partial, s);
+    s->partial = false;
+  }
+  return p;
+}
+
+// return a wiped object to its slab
+static void slab_put(size_class_t *c, void *p) {
+  slab_t *s = slab_of(p);
+  memcpy(p, &s->free, sizeof(void *));
+  s->free = p;
+  if (!s->partial) {
+    s->partial = true;
+    list_push(&c->partial, s);
+  }
+  if (--s->in_use > 0) return;
+
+  // every object is free again: keep the slab as a spare or release it
+  list_remove(&c->partial, s);
+  s->partial = false;
+  if (c->empty_count < SPARE_SLABS) {
+    list_push(&c->empty, s);
+    c->empty_count++;
+  } else {
+    free(s);
+    stats_sub(&stat_slabs, 1);
+    stats_add(&stat_slabs_released, 1);
+  }
+}
+
+static void magazine_flush(size_class_t *c, magazine_t *m) {
+  while (m->count > 0) slab_put(c, m->objects[--m->count]);
+}
+
+////
+// Magazines
+
+static magazine_t *magazine_new(size_class_t *c) {
+  magazine_t *m = c->spare;
+  if (m) {
+    c->spare = m->next;
+    return m;
+  }
+  m = malloc(sizeof *m);
+  if (m) m->count = 0;
+  return m;
+}
+
+// give all of a thread's magazines back when it exits
+static void thread_exit(void *arg) {
+  (void)arg;
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    size_class_t *c = &classes[i];
+    thread_cache_t *tc = &caches[i];
+    pthread_mutex_lock(&c->lock);
+    magazine_t *mags[2] = { tc->loaded, tc->previous };
+    for (size_t j = 0; j < 2; j++) {
+      if (!mags[j]) continue;
+      magazine_flush(c, mags[j]);
+      mags[j]->next = c->spare;
+      c->spare = mags[j];
+    }
+    pthread_mutex_unlock(&c->lock);
+    tc->loaded = tc->previous = NULL;
+  }
+  registered = false;
+}
+
+static thread_cache_t *thread_cache(size_t i) {
+  if (!registered) {
+    pthread_once(&classes_once, init_classes);
+    pthread_setspecific(thread_key, caches);
+    registered = true;
+  }
+  return &caches[i];
+}
+
+static void swap(thread_cache_t *tc) {
+  magazine_t *m = tc->loaded;
+  tc->loaded = tc->previous;
+  tc->previous = m;
+}
+
+// refill the thread's magazines from the depot or the slabs
+static bool reload(size_class_t *c, thread_cache_t *tc) {
+  pthread_mutex_lock(&c->lock);
+  stats_add(&stat_depot_exchanges, 1);
+  if (c->full) {
+    // trade the empty previous magazine for a full one
+    magazine_t *full = c->full;
+    c->full = full->next;
+    c->full_count--;
+    if (tc->previous) {
+      tc->previous->next = c->spare;
+      c->spare = tc->previous;
+    }
+    tc->previous = tc->loaded;
+    tc->loaded = full;
+  } else {
+    if (!tc->loaded) tc->loaded = magazine_new(c);
+    // half a magazine, leaving room for frees before the next exchange
+    while (tc->loaded && tc->loaded->count < MAGAZINE_SIZE / 2) {
+      void *p = slab_take(c);
+      if (!p) break;
+      tc->loaded->objects[tc->loaded->count++] = p;
+    }
+  }
+  bool ok = tc->loaded && tc->loaded->count > 0;
+  pthread_mutex_unlock(&c->lock);
+  return ok;
+}
+
+// make room in the thread's magazines by passing a full one to the depot
+static bool unload(size_class_t *c, thread_cache_t *tc) {
+  pthread_mutex_lock(&c->lock);
+  stats_add(&stat_depot_exchanges, 1);
+  magazine_t *empty = magazine_new(c);
+  if (!empty) {
+    // no memory for a magazine: free objects straight to their slabs
+    if (tc->loaded) magazine_flush(c, tc->loaded);
+    pthread_mutex_unlock(&c->lock);
+    return tc->loaded != NULL;
+  }
+  if (tc->previous) {
+    tc->previous->next = c->full;
+    c->full = tc->previous;
+    if (++c->full_count > DEPOT_MAX_FULL) {
+      // the depot has plenty; let the oldest full magazine's slabs drain
+      magazine_t *m = c->full, **prevp = &c->full;
+      while (m->next) {
+        prevp = &m->next;
+        m = m->next;
+      }
+      *prevp = NULL;
+      c->full_count--;
+      magazine_flush(c, m);
+      m->next = c->spare;
+      c->spare = m;
+    }
+  }
+  tc->previous = tc->loaded;
+  tc->loaded = empty;
+  pthread_mutex_unlock(&c->lock);
+  return true;
+}
+
+void *slab_alloc(size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    void *p = calloc(1, size);
+    if (!p) log_message(LOG_ERROR, "slab_alloc: failed to allocate %zu bytes.", size);
+    return p;
+  }
+  size_t i = class_index(size);
+  size_class_t *c = &classes[i];
+  thread_cache_t *tc = thread_cache(i);
+
+  if (!tc->loaded || tc->loaded->count == 0) {
+    if (tc->previous && tc->previous->count > 0) swap(tc);
+    else if (!reload(c, tc)) {
+      log_message(LOG_ERROR, "slab_alloc: failed to allocate %zu bytes.", size);
+      return NULL;
+    }
+  }
+  return tc->loaded->objects[--tc->loaded->count];
+}
+
+void slab_free(void *p, size_t size) {
+  if (!p) return;
+  if (size > SLAB_MAX_SIZE) {
+    memset(p, 0, size);
+    free(p);
+    return;
+  }
+  size_t i = class_index(size);
+  size_class_t *c = &classes[i];
+  thread_cache_t *tc = thread_cache(i);
+  memset(p, 0, c->size);
+
+  if (!tc->loaded || tc->loaded->count == MAGAZINE_SIZE) {
+    if (tc->previous && tc->previous->count < MAGAZINE_SIZE) {
+      swap(tc);
+    } else if (!unload(c, tc)) {
+      // not even a magazine to flush: hand the object straight back
+      pthread_mutex_lock(&c->lock);
+      slab_put(c, p);
+      pthread_mutex_unlock(&c->lock);
+      return;
+    }
+  }
+  tc->loaded->objects[tc->loaded->count++] = p;
+}
+
+void slab_trim(void) {
+  pthread_once(&classes_once, init_classes);
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    size_class_t *c = &classes[i];
+    pthread_mutex_lock(&c->lock);
+    while (c->full) {
+      magazine_t *m = c->full;
+      c->full = m->next;
+      magazine_flush(c, m);
+      free(m);
+    }
+    c->full_count = 0;
+    while (c->spare) {
+      magazine_t *m = c->spare;
+      c->spare = m->next;
+      free(m);
+    }
+    while (c->empty) {
+      slab_t *s = c->empty;
+      list_remove(&c->empty, s);
+      free(s);
+      stats_sub(&stat_slabs, 1);
+      stats_add(&stat_slabs_released, 1);
+    }
+    c->empty_count = 0;
+    pthread_mutex_unlock(&c->lock);
+  }
+}
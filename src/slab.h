@@ -0,0 +1,51 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/**
+ * @file slab.h
+ * @brief Slab allocator for small fixed-size records.
+ *
+ * For objects allocated and freed in large numbers, such as account_t
+ * and the account store's record versions. Each request is rounded up
+ * to a size class (multiples of 64 bytes up to 512, then a few larger
+ * classes up to SLAB_MAX_SIZE), and each class carves its objects out
+ * of 64 KiB slabs, so millions of records take a few thousand
+ * allocations from malloc rather than one each.
+ *
+ * Every thread keeps a pair of magazines (small stacks of free objects)
+ * per class, so most allocations and frees touch no shared state. Full
+ * and empty magazines are exchanged with a per-class depot under a
+ * lock, a magazine at a time. A slab whose objects have all been freed
+ * is released as a whole once the class already has a spare one.
+ *
+ * slab_free() wipes the object before it can be reused, and
+ * slab_alloc() always returns zeroed memory.
+ *
+ * Requests larger than SLAB_MAX_SIZE fall back to malloc() and free(),
+ * with the same zeroing and wiping.
+ */
+
+#define SLAB_MAX_SIZE 2048
+
+/**
+ * Allocate `size` bytes of zeroed memory, 64-byte aligned (or as
+ * malloc() aligns it, above SLAB_MAX_SIZE).
+ *
+ * Returns NULL and logs an error message on failure.
+ */
+void *slab_alloc(size_t size);
+
+// wipe and free memory from slab_alloc(); `size` must be the size it was
+// allocated with. NULL is ignored.
+void slab_free(void *p, size_t size);
+
+/**
+ * Return every completely free slab to the system, including those
+ * cached in magazines the depot holds. Objects in threads' own
+ * magazines aren't touched.
+ */
+void slab_trim(void);
+
+#endif // SLAB_H
@@ -0,0 +1,87 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_value_t *registry = NULL;
+
+static void ensure_registered(stats_value_t *stat) {
+  if (atomic_load_explicit(&stat->registered, memory_order_acquire)) return;
+
+  pthread_mutex_lock(&registry_lock);
+  if (!atomic_load_explicit(&stat->registered, memory_order_relaxed)) {
+    stat->next = registry;
+    registry = stat;
+    atomic_store_explicit(&stat->registered, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+void stats_add(stats_value_t *stat, uint64_t n) {
+  ensure_registered(stat);
+  atomic_fetch_add_explicit(&stat->value, n, memory_order_relaxed);
+}
+
+void stats_sub(stats_value_t *stat, uint64_t n) {
+  ensure_registered(stat);
+  atomic_fetch_sub_explicit(&stat->value, n, memory_order_relaxed);
+}
+
+void stats_set(stats_value_t *stat, uint64_t v) {
+  ensure_registered(stat);
+  atomic_store_explicit(&stat->value, v, memory_order_relaxed);
+}
+
+void stats_max(stats_value_t *stat, uint64_t v) {
+  ensure_registered(stat);
+  uint_least64_t cur = atomic_load_explicit(&stat->value, memory_order_relaxed);
+  while (cur < v &&
+         !atomic_compare_exchange_weak_explicit(&stat->value, &cur, v,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+bool stats_get(const char *name, uint64_t *value) {
+  bool found = false;
+  pthread_mutex_lock(&registry_lock);
+  for (stats_value_t *s = registry; s; s = s->next) {
+    if (strcmp(s->name, name) == 0) {
+      *value = atomic_load_explicit(&s->value, memory_order_relaxed);
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return found;
+}
+
+static int compare_stats(const void *a, const void *b) {
+  const stats_value_t *x = *(stats_value_t *const *)a;
+  const stats_value_t *y = *(stats_value_t *const *)b;
+  return strcmp(x->name, y->name);
+}
+
+void stats_dump(int fd) {
+  pthread_mutex_lock(&registry_lock);
+  size_t n = 0;
+  for (stats_value_t *s = registry; s; s = s->next) n++;
+
+  stats_value_t **sorted = malloc(n * sizeof *sorted);
+  if (sorted) {
+    size_t i = 0;
+    for (stats_value_t *s = registry; s; s = s->next) sorted[i++] = s;
+    qsort(sorted, n, sizeof *sorted, compare_stats);
+    for (i = 0; i < n; i++) {
+      dprintf(fd, "%s %" PRIuLEAST64 "\n", sorted[i]->name,
+              atomic_load_explicit(&sorted[i]->value, memory_order_relaxed));
+    }
+    free(sorted);
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file stats.h
+ * @brief Process-wide named counters and gauges.
+ *
+ * A stat is a statically allocated stats_value_t. It registers itself
+ * the first time it is updated, after which it shows up in stats_dump()
+ * and stats_get(). Updates are single relaxed atomic operations, so they
+ * are cheap enough for hot paths.
+ *
+ *     static STATS_DEFINE(logins_total, "login.attempts");
+ *     ...
+ *     stats_add(&logins_total, 1);
+ */
+
+typedef struct stats_value {
+  const char *name;
+  atomic_uint_least64_t value;
+  atomic_bool registered;
+  struct stats_value *next;
+} stats_value_t;
+
+#define STATS_DEFINE(var, stat_name) stats_value_t var = { .name = (stat_name) }
+
+// add n to a counter
+void stats_add(stats_value_t *stat, uint64_t n);
+
+// subtract n from a gauge
+void stats_sub(stats_value_t *stat, uint64_t n);
+
+// set a gauge
+void stats_set(stats_value_t *stat, uint64_t v);
+
+// raise a gauge to v if it is currently lower (for high-water marks)
+void stats_max(stats_value_t *stat, uint64_t v);
+
+/**
+ * Look up the current value of a registered stat by name.
+ * Returns false if no stat with that name has been updated yet.
+ */
+bool stats_get(const char *name, uint64_t *value);
+
+// write "name value" lines for every registered stat, sorted by name
+void stats_dump(int fd);
+
+#endif // STATS_H
@@ -8,6 +8,9 @@
 
 #include "logging.h"
 #include "db.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "compact_store.h"
 
 #include <pthread.h>
 #include <stdbool.h>
@@ -75,6 +78,23 @@ bool account_lookup_by_userid(const char *userid, account_t *acc) {
     panic("Invalid arguments to account_lookup_by_userid");
   }
 
+  // Accounts loaded into the default in-memory store (e.g. by the load
+  // generator) take precedence over the hard-coded example below. The
+  // default cache, if any, answers for those stores.
+  account_cache_t *cache = account_cache_get_default();
+  bool found;
+  if (cache && account_cache_get(cache, userid, acc, &found)) {
+    if (found) return true;
+  } else {
+    uint64_t ticket = cache ? account_cache_ticket(cache, userid) : 0;
+    account_store_t *store = account_store_get_default();
+    compact_store_t *compact = compact_store_get_default();
+    found = (store && account_store_get(store, userid, acc)) ||
+            (compact && compact_store_get(compact, userid, acc));
+    if (cache) account_cache_fill(cache, userid, found ? acc : NULL, ticket);
+    if (found) return true;
+  }
+
   // Example of a simple lookup. Note that no valid hashed password is set.
   // userid must be a valid, null-terminated string.
   // (Note that it is impossible in C for a function to check whether a string has been
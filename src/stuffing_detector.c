@@ -0,0 +1,344 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stuffing_detector.h"
+#include "account_store.h"
+#include "logging.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define REGISTERS 112
+#define REGISTERS_PER_WORD 16     // four bits each
+#define WORDS (REGISTERS / REGISTERS_PER_WORD)
+#define RANK_MAX 15
+#define BUCKET_SLOTS 4
+
+/*
+ * A slot is two cache lines:
+ *
+ *     header:  key:32 | epoch:32     0 if the slot is empty; epochs start at 1
+ *     summary: estimate:32 | flagged:32
+ *     sketch[2][WORDS]               by window parity
+ *
+ * The epoch is the latest window the source was seen in. sketch[epoch & 1]
+ * counts that window, and sketch[(epoch - 1) & 1] the one before (or is
+ * empty if the source wasn't seen then). The summary caches the estimate
+ * over both, and the last window in which the source was flagged.
+ */
+typedef struct {
+  _Atomic uint64_t header;
+  _Atomic uint64_t summary;
+  _Atomic uint64_t sketch[2][WORDS];
+} slot_t;
+
+_Static_assert(sizeof(slot_t) == 128, "slot should be two cache lines");
+
+typedef struct {
+  size_t mask;                  // slots - 1
+  slot_t *slots;
+  uint32_t threshold;
+  bool prefix;
+} table_t;
+
+struct stuffing_detector {
+  stuffing_config_t config;
+  table_t ips;
+  table_t prefixes;
+};
+
+static stuffing_detector_t *_Atomic default_detector = NULL;
+
+static STATS_DEFINE(stat_flagged, "stuffing.flagged");
+static STATS_DEFINE(stat_blocked, "stuffing.blocked");
+static STATS_DEFINE(stat_evictions, "stuffing.evictions");
+
+// 2^-r for each register value
+static const double inverse_powers[RANK_MAX + 1] = {
+  1.0, 1.0 / 2, 1.0 / 4, 1.0 / 8, 1.0 / 16, 1.0 / 32, 1.0 / 64, 1.0 / 128, 1.0 / 256,
+  1.0 / 512, 1.0 / 1024, 1.0 / 2048, 1.0 / 4096, 1.0 / 8192, 1.0 / 16384, 1.0 / 32768,
+};
+// the HyperLogLog bias correction times the number of registers squared
+#define ALPHA_MM (0.7213 / (1.0 + 1.079 / REGISTERS) * REGISTERS * REGISTERS)
+
+static uint32_t header_key(uint64_t h) { return (uint32_t)(h >> 32); }
+static uint32_t header_epoch(uint64_t h) { return (uint32_t)h; }
+static uint64_t make_header(uint32_t key, uint32_t epoch) { return (uint64_t)key << 32 | epoch; }
+
+static uint32_t summary_estimate(uint64_t s) { return (uint32_t)(s >> 32); }
+static uint32_t summary_flagged(uint64_t s) { return (uint32_t)s; }
+
+void stuffing_config_defaults(stuffing_config_t *config) {
+  config->ip_slots = (size_t)1 << 16;
+  config->prefix_slots = (size_t)1 << 14;
+  config->window_secs = 600;
+  config->ip_threshold = 50;
+  config->prefix_threshold = 200;
+  config->block = true;
+}
+
+static bool table_init(table_t *t, size_t slots, uint32_t threshold, bool prefix) {
+  size_t n = BUCKET_SLOTS;
+  while (n < slots) n <<= 1;
+  t->slots = aligned_alloc(sizeof(slot_t), n * sizeof(slot_t));
+  if (!t->slots) return false;
+  for (size_t i = 0; i < n; i++) {
+    atomic_init(&t->slots[i].header, 0);
+    atomic_init(&t->slots[i].summary, 0);
+    for (size_t j = 0; j < WORDS; j++) {
+      atomic_init(&t->slots[i].sketch[0][j], 0);
+      atomic_init(&t->slots[i].sketch[1][j], 0);
+    }
+  }
+  t->mask = n - 1;
+  t->threshold = threshold;
+  t->prefix = prefix;
+  return true;
+}
+
+stuffing_detector_t *stuffing_detector_create(const stuffing_config_t *config) {
+  if (!config || config->ip_slots == 0 || config->prefix_slots == 0 || config->window_secs == 0) {
+    log_message(LOG_ERROR, "stuffing_detector_create: invalid config.");
+    return NULL;
+  }
+  stuffing_detector_t *d = calloc(1, sizeof *d);
+  if (!d || !table_init(&d->ips, config->ip_slots, config->ip_threshold, false) ||
+      !table_init(&d->prefixes, config->prefix_slots, config->prefix_threshold, true)) {
+    log_message(LOG_ERROR, "stuffing_detector_create: failed to allocate.");
+    stuffing_detector_free(d);
+    return NULL;
+  }
+  d->config = *config;
+  d->config.ip_slots = d->ips.mask + 1;
+  d->config.prefix_slots = d->prefixes.mask + 1;
+  return d;
+}
+
+void stuffing_detector_free(stuffing_detector_t *d) {
+  if (!d) return;
+  stuffing_detector_t *expected = d;
+  atomic_compare_exchange_strong(&default_detector, &expected, NULL);
+  free(d->ips.slots);
+  free(d->prefixes.slots);
+  free(d);
+}
+
+const stuffing_config_t *stuffing_detector_config(const stuffing_detector_t *d) {
+  return &d->config;
+}
+
+static uint32_t epoch_of(const stuffing_detector_t *d, time_t now) {
+  uint64_t secs = now > 0 ? (uint64_t)now : 0;
+  uint64_t e = secs / d->config.window_secs + 1;
+  return e > UINT32_MAX ? UINT32_MAX : (uint32_t)e;
+}
+
+static slot_t *bucket_of(const table_t *t, uint32_t key) {
+  uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+  return &t->slots[(size_t)(h >> 32) & t->mask & ~(size_t)(BUCKET_SLOTS - 1)];
+}
+
+static void sketch_clear(slot_t *s, size_t which) {
+  for (size_t j = 0; j < WORDS; j++) atomic_store_explicit(&s->sketch[which][j], 0, memory_order_relaxed);
+}
+
+// the estimate over sketch[first], and sketch[1 - first] as well if `both`
+static uint32_t sketch_estimate(slot_t *s, size_t first, bool both) {
+  double sum = 0;
+  unsigned zeros = 0;
+  for (size_t j = 0; j < WORDS; j++) {
+    uint64_t a = atomic_load_explicit(&s->sketch[first][j], memory_order_relaxed);
+    uint64_t b = both ? atomic_load_explicit(&s->sketch[1 - first][j], memory_order_relaxed) : 0;
+    for (unsigned k = 0; k < REGISTERS_PER_WORD; k++, a >>= 4, b >>= 4) {
+      unsigned r = (unsigned)(a & 0xF) > (unsigned)(b & 0xF) ? (unsigned)(a & 0xF) : (unsigned)(b & 0xF);
+      sum += inverse_powers[r];
+      zeros += r == 0;
+    }
+  }
+  double estimate = ALPHA_MM / sum;
+  // linear counting is far more accurate while registers are still empty
+  if (estimate <= 2.5 * REGISTERS && zeros > 0) estimate = REGISTERS * log((double)REGISTERS / zeros);
+  return estimate >= UINT32_MAX ? UINT32_MAX : (uint32_t)(estimate + 0.5);
+}
+
+// raise register `idx` of sketch `which` to `rank`; false if it was already that high
+static bool sketch_raise(slot_t *s, size_t which, unsigned idx, unsigned rank) {
+  _Atomic uint64_t *word = &s->sketch[which][idx / REGISTERS_PER_WORD];
+  unsigned shift = (idx % REGISTERS_PER_WORD) * 4;
+  uint64_t old = atomic_load_explicit(word, memory_order_relaxed);
+  for (;;) {
+    if (((old >> shift) & 0xF) >= rank) return false;
+    uint64_t updated = (old & ~((uint64_t)0xF << shift)) | (uint64_t)rank << shift;
+    if (atomic_compare_exchange_weak_explicit(word, &old, updated, memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      return true;
+    }
+  }
+}
+
+static void summary_set_estimate(slot_t *s, uint32_t estimate) {
+  uint64_t old = atomic_load_explicit(&s->summary, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&s->summary, &old,
+                                                (uint64_t)estimate << 32 | summary_flagged(old),
+                                                memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+// the source's slot, or NULL
+static slot_t *table_find(const table_t *t, uint32_t key, uint64_t *header) {
+  slot_t *bucket = bucket_of(t, key);
+  for (size_t i = 0; i < BUCKET_SLOTS; i++) {
+    uint64_t h = atomic_load_explicit(&bucket[i].header, memory_order_acquire);
+    if (h != 0 && header_key(h) == key) {
+      *header = h;
+      return &bucket[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The source's slot, brought up to window `epoch` (or later, if another
+ * thread's clock is ahead): taken over if the source is new, with the
+ * sketch for windows that have passed cleared.
+ */
+static slot_t *table_claim(table_t *t, uint32_t key, uint32_t epoch, uint32_t *slot_epoch) {
+  for (;;) {
+    uint64_t h;
+    slot_t *s = table_find(t, key, &h);
+    if (s && header_epoch(h) >= epoch) {
+      *slot_epoch = header_epoch(h);
+      return s;
+    }
+    if (s) {
+      // a new window: the older sketch now holds one that has passed
+      if (!atomic_compare_exchange_strong_explicit(&s->header, &h, make_header(key, epoch),
+                                                   memory_order_acq_rel, memory_order_acquire)) {
+        continue;
+      }
+      bool recent = header_epoch(h) + 1 == epoch;
+      sketch_clear(s, epoch & 1);
+      if (!recent) sketch_clear(s, 1 - (epoch & 1));
+      summary_set_estimate(s, recent ? sketch_estimate(s, 1 - (epoch & 1), false) : 0);
+      *slot_epoch = epoch;
+      return s;
+    }
+
+    // new source: take an empty slot, else one quiet for a whole window,
+    // else the one with the fewest userids
+    slot_t *bucket = bucket_of(t, key), *victim = NULL;
+    uint64_t victim_header = 0;
+    uint32_t victim_estimate = UINT32_MAX;
+    for (size_t i = 0; i < BUCKET_SLOTS; i++) {
+      uint64_t vh = atomic_load_explicit(&bucket[i].header, memory_order_acquire);
+      uint32_t estimate = vh == 0 || header_epoch(vh) + 1 < epoch
+        ? 0 : summary_estimate(atomic_load_explicit(&bucket[i].summary, memory_order_relaxed));
+      if (estimate < victim_estimate) {
+        victim = &bucket[i];
+        victim_header = vh;
+        victim_estimate = estimate;
+      }
+    }
+    if (!atomic_compare_exchange_strong_explicit(&victim->header, &victim_header,
+                                                 make_header(key, epoch),
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+      continue;
+    }
+    if (victim_header != 0) stats_add(&stat_evictions, 1);
+    sketch_clear(victim, 0);
+    sketch_clear(victim, 1);
+    atomic_store_explicit(&victim->summary, 0, memory_order_relaxed);
+    *slot_epoch = epoch;
+    return victim;
+  }
+}
+
+static void log_flagged(const table_t *t, uint32_t key, uint32_t estimate, uint32_t window_secs) {
+  if (t->prefix) {
+    log_message(LOG_WARN, "Possible credential stuffing from %u.%u.%u.0/24: "
+                "about %u userids tried in the last %u-%u minutes",
+                (key >> 16) & 0xFF, (key >> 8) & 0xFF, key & 0xFF, estimate,
+                window_secs / 60, window_secs / 30);
+  } else {
+    log_message(LOG_WARN, "Possible credential stuffing from %u.%u.%u.%u: "
+                "about %u userids tried in the last %u-%u minutes",
+                (key >> 24) & 0xFF, (key >> 16) & 0xFF, (key >> 8) & 0xFF, key & 0xFF, estimate,
+                window_secs / 60, window_secs / 30);
+  }
+}
+
+// add a userid hash to a source; true if it is over the threshold
+static bool table_observe(table_t *t, uint32_t key, uint64_t hash, uint32_t epoch,
+                          uint32_t window_secs) {
+  uint32_t slot_epoch;
+  slot_t *s = table_claim(t, key, epoch, &slot_epoch);
+  unsigned idx = (unsigned)((hash >> 32) % REGISTERS);
+  uint32_t low = (uint32_t)hash;
+  unsigned rank = low ? (unsigned)__builtin_clz(low) + 1 : RANK_MAX;
+  if (rank > RANK_MAX) rank = RANK_MAX;
+
+  uint64_t summary = atomic_load_explicit(&s->summary, memory_order_relaxed);
+  uint32_t estimate = summary_estimate(summary);
+  if (sketch_raise(s, slot_epoch & 1, idx, rank)) {
+    estimate = sketch_estimate(s, slot_epoch & 1, true);
+    summary_set_estimate(s, estimate);
+  }
+  if (estimate <= t->threshold) return false;
+
+  // the first to see the source over its threshold in this window reports it
+  summary = atomic_load_explicit(&s->summary, memory_order_relaxed);
+  while (summary_flagged(summary) != slot_epoch) {
+    uint64_t flagged = (uint64_t)summary_estimate(summary) << 32 | slot_epoch;
+    if (atomic_compare_exchange_weak_explicit(&s->summary, &summary, flagged,
+                                              memory_order_relaxed, memory_order_relaxed)) {
+      stats_add(&stat_flagged, 1);
+      log_flagged(t, key, estimate, window_secs);
+      break;
+    }
+  }
+  return true;
+}
+
+static uint64_t hash_userid(const char *userid) {
+  // FNV-1a alone leaves the high and low bits poorly mixed
+  uint64_t h = account_store_hash_userid(userid);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+stuffing_verdict_t stuffing_detector_observe(stuffing_detector_t *d, ip4_addr_t client_ip,
+                                             const char *userid, time_t now) {
+  uint64_t hash = hash_userid(userid);
+  uint32_t epoch = epoch_of(d, now);
+  uint32_t window = d->config.window_secs;
+  bool ip_flagged = table_observe(&d->ips, client_ip, hash, epoch, window);
+  bool prefix_flagged = table_observe(&d->prefixes, client_ip >> 8, hash, epoch, window);
+
+  stuffing_verdict_t verdict = ip_flagged ? STUFFING_FLAGGED_IP
+                             : prefix_flagged ? STUFFING_FLAGGED_PREFIX : STUFFING_CLEAN;
+  if (verdict != STUFFING_CLEAN && d->config.block) stats_add(&stat_blocked, 1);
+  return verdict;
+}
+
+uint32_t stuffing_detector_estimate(stuffing_detector_t *d, ip4_addr_t client_ip, bool prefix,
+                                    time_t now) {
+  table_t *t = prefix ? &d->prefixes : &d->ips;
+  uint64_t h;
+  slot_t *s = table_find(t, prefix ? client_ip >> 8 : client_ip, &h);
+  uint32_t epoch = epoch_of(d, now), slot_epoch = s ? header_epoch(h) : 0;
+  if (!s || slot_epoch + 1 < epoch) return 0;
+  // a source not yet seen this window only has the last window's sketch
+  return sketch_estimate(s, slot_epoch & 1, slot_epoch >= epoch);
+}
+
+void stuffing_detector_set_default(stuffing_detector_t *d) {
+  atomic_store(&default_detector, d);
+}
+
+stuffing_detector_t *stuffing_detector_get_default(void) {
+  return atomic_load(&default_detector);
+}
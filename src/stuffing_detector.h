@@ -0,0 +1,101 @@
+#ifndef STUFFING_DETECTOR_H
+#define STUFFING_DETECTOR_H
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file stuffing_detector.h
+ * @brief Streaming detection of credential stuffing by client IP and /24.
+ *
+ * Credential stuffing shows up as one source trying many different
+ * userids. The detector estimates, for each client IP and each /24
+ * network, how many distinct userids it has tried recently, and flags
+ * sources over a threshold. While a detector is installed with
+ * stuffing_detector_set_default(), handle_login() feeds it every
+ * attempt before the account is even looked up, and (if `block` is set)
+ * turns away attempts from flagged sources with LOGIN_FAIL_IP_BANNED,
+ * whether or not the userid exists.
+ *
+ * Keeping each source's set of userids would take gigabytes. Instead
+ * each source has a HyperLogLog sketch: 112 four-bit registers holding
+ * the longest run of zero bits seen among the hashes of its userids.
+ * Estimates are within about 10% (and much closer at the small counts
+ * thresholds are set at), and trying the same userid again costs
+ * nothing. Sources are kept in two fixed-size tables, one for IPs and
+ * one for /24s, of 128-byte slots in buckets of 4; a new source takes
+ * the place of one that has gone quiet, or else the one with the fewest
+ * userids.
+ *
+ * Counts decay by time window: a slot holds sketches for the current
+ * window and the one before, and the estimate covers both, so it
+ * reflects between one and two windows of attempts.
+ *
+ * Updates are lock-free. Concurrent updates to one source may very
+ * occasionally lose a userid when its window rolls over, which only
+ * makes the estimate slightly low.
+ */
+
+typedef struct {
+  size_t ip_slots;              // IPs tracked (128 bytes each); rounded up to a power of two
+  size_t prefix_slots;          // /24 networks tracked
+  uint32_t window_secs;
+  uint32_t ip_threshold;        // distinct userids from one IP before it is flagged
+  uint32_t prefix_threshold;    // distinct userids from one /24 before it is flagged
+  bool block;                   // reject attempts from flagged sources, else just log them
+} stuffing_config_t;
+
+typedef enum {
+  STUFFING_CLEAN,
+  STUFFING_FLAGGED_IP,          // the client IP is over its threshold
+  STUFFING_FLAGGED_PREFIX       // the IP's /24 is over its threshold
+} stuffing_verdict_t;
+
+typedef struct stuffing_detector stuffing_detector_t;
+
+// fill in a config with defaults: 64K IPs and 16K /24s (10 MiB), 10
+// minute windows, flagging IPs over 50 userids and /24s over 200, blocking
+void stuffing_config_defaults(stuffing_config_t *config);
+
+/**
+ * Create a detector.
+ * Returns NULL and logs an error message on failure.
+ */
+stuffing_detector_t *stuffing_detector_create(const stuffing_config_t *config);
+
+// free a detector; no other thread may be using it
+void stuffing_detector_free(stuffing_detector_t *d);
+
+// the config a detector was created with
+const stuffing_config_t *stuffing_detector_config(const stuffing_detector_t *d);
+
+/**
+ * Record an attempt on `userid` from `client_ip` at `now`, and say
+ * whether the IP or its /24 is over its threshold. The first attempt to
+ * cross a threshold in each window logs a warning.
+ */
+stuffing_verdict_t stuffing_detector_observe(stuffing_detector_t *d, ip4_addr_t client_ip,
+                                             const char *userid, time_t now);
+
+/**
+ * The estimated number of distinct userids tried recently from
+ * `client_ip` (or, if `prefix` is set, from its /24), or 0 if the
+ * source isn't being tracked.
+ */
+uint32_t stuffing_detector_estimate(stuffing_detector_t *d, ip4_addr_t client_ip, bool prefix,
+                                    time_t now);
+
+////
+// Process-wide default detector
+
+// Set the detector handle_login() feeds. NULL clears it. The caller keeps ownership.
+void stuffing_detector_set_default(stuffing_detector_t *d);
+
+// the detector set by stuffing_detector_set_default(), or NULL
+stuffing_detector_t *stuffing_detector_get_default(void);
+
+#endif // STUFFING_DETECTOR_H
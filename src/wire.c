@@ -0,0 +1,270 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "wire.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LISTEN_BACKLOG 128
+
+void wire_writer_init(wire_writer_t *w) {
+  w->len = 0;
+  w->overflow = false;
+}
+
+void wire_put_bytes(wire_writer_t *w, const void *data, size_t len) {
+  if (w->overflow || len > sizeof w->buf - w->len) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+void wire_put_u8(wire_writer_t *w, uint8_t v) {
+  wire_put_bytes(w, &v, 1);
+}
+
+void wire_put_u32(wire_writer_t *w, uint32_t v) {
+  uint8_t b[4] = { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v };
+  wire_put_bytes(w, b, sizeof b);
+}
+
+void wire_put_u64(wire_writer_t *w, uint64_t v) {
+  wire_put_u32(w, (uint32_t)(v >> 32));
+  wire_put_u32(w, (uint32_t)v);
+}
+
+void wire_put_i64(wire_writer_t *w, int64_t v) {
+  wire_put_u64(w, (uint64_t)v);
+}
+
+void wire_put_str(wire_writer_t *w, const char *s, size_t max_len) {
+  size_t len = strnlen(s, max_len);
+  if (len > UINT16_MAX) {
+    w->overflow = true;
+    return;
+  }
+  uint8_t b[2] = { (uint8_t)(len >> 8), (uint8_t)len };
+  wire_put_bytes(w, b, sizeof b);
+  wire_put_bytes(w, s, len);
+}
+
+void wire_reader_init(wire_reader_t *r, const void *buf, size_t len) {
+  r->buf = buf;
+  r->len = len;
+  r->pos = 0;
+  r->error = false;
+}
+
+void wire_get_bytes(wire_reader_t *r, void *out, size_t len) {
+  if (r->error || len > r->len - r->pos) {
+    r->error = true;
+    memset(out, 0, len);
+    return;
+  }
+  memcpy(out, r->buf + r->pos, len);
+  r->pos += len;
+}
+
+uint8_t wire_get_u8(wire_reader_t *r) {
+  uint8_t v;
+  wire_get_bytes(r, &v, 1);
+  return v;
+}
+
+uint32_t wire_get_u32(wire_reader_t *r) {
+  uint8_t b[4];
+  wire_get_bytes(r, b, sizeof b);
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+uint64_t wire_get_u64(wire_reader_t *r) {
+  uint64_t hi = wire_get_u32(r);
+  return (hi << 32) | wire_get_u32(r);
+}
+
+int64_t wire_get_i64(wire_reader_t *r) {
+  return (int64_t)wire_get_u64(r);
+}
+
+void wire_get_str(wire_reader_t *r, char *out, size_t cap) {
+  uint8_t b[2];
+  wire_get_bytes(r, b, sizeof b);
+  size_t len = ((size_t)b[0] << 8) | b[1];
+  if (r->error || len >= cap) {
+    r->error = true;
+    if (cap > 0) out[0] = '\0';
+    return;
+  }
+  wire_get_bytes(r, out, len);
+  out[r->error ? 0 : len] = '\0';
+}
+
+bool wire_reader_done(const wire_reader_t *r) {
+  return !r->error && r->pos == r->len;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+bool wire_send(int fd, uint8_t type, const wire_writer_t *payload) {
+  size_t len = payload ? payload->len : 0;
+  if (payload && payload->overflow) {
+    log_message(LOG_ERROR, "wire_send: payload too large for frame type %u.", type);
+    return false;
+  }
+  uint8_t frame[4 + 1 + WIRE_MAX_FRAME];
+  size_t total = len + 1;
+  frame[0] = (uint8_t)(total >> 24);
+  frame[1] = (uint8_t)(total >> 16);
+  frame[2] = (uint8_t)(total >> 8);
+  frame[3] = (uint8_t)total;
+  frame[4] = type;
+  if (len > 0) memcpy(frame + 5, payload->buf, len);
+  return write_all(fd, frame, 5 + len);
+}
+
+bool wire_recv(int fd, uint8_t *type, uint8_t *buf, size_t cap, size_t *len) {
+  uint8_t hdr[5];
+  if (!read_all(fd, hdr, sizeof hdr)) return false;
+  size_t total = ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16) | ((size_t)hdr[2] << 8) | hdr[3];
+  if (total == 0 || total - 1 > cap) {
+    log_message(LOG_ERROR, "wire_recv: bad frame length %zu.", total);
+    return false;
+  }
+  *type = hdr[4];
+  *len = total - 1;
+  return read_all(fd, buf, *len);
+}
+
+/**
+ * Resolve `addr` into a socket address. Returns the socket family, or -1
+ * on a malformed or unresolvable address.
+ */
+static int resolve(const char *addr, struct sockaddr_storage *ss, socklen_t *sslen) {
+  memset(ss, 0, sizeof *ss);
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+    const char *path = addr + 5;
+    if (strlen(path) == 0 || strlen(path) >= sizeof sun->sun_path) {
+      log_message(LOG_ERROR, "wire: bad unix socket path '%s'.", path);
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, strlen(path) + 1);
+    *sslen = (socklen_t)sizeof *sun;
+    return AF_UNIX;
+  }
+
+  if (strncmp(addr, "tcp:", 4) == 0) {
+    char host[256];
+    const char *hostport = addr + 4;
+    const char *colon = strrchr(hostport, ':');
+    if (!colon || colon == hostport || (size_t)(colon - hostport) >= sizeof host) {
+      log_message(LOG_ERROR, "wire: bad tcp address '%s'.", addr);
+      return -1;
+    }
+    memcpy(host, hostport, (size_t)(colon - hostport));
+    host[colon - hostport] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    int rc = getaddrinfo(host, colon + 1, &hints, &res);
+    if (rc != 0 || !res) {
+      log_message(LOG_ERROR, "wire: can't resolve '%s': %s", addr, gai_strerror(rc));
+      return -1;
+    }
+    memcpy(ss, res->ai_addr, res->ai_addrlen);
+    *sslen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return AF_INET;
+  }
+
+  log_message(LOG_ERROR, "wire: address '%s' must start with unix: or tcp:", addr);
+  return -1;
+}
+
+int wire_listen(const char *addr) {
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  int family = resolve(addr, &ss, &sslen);
+  if (family < 0) return -1;
+
+  int fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    log_message(LOG_ERROR, "wire_listen: socket: %s", strerror(errno));
+    return -1;
+  }
+  if (family == AF_UNIX) {
+    unlink(((struct sockaddr_un *)&ss)->sun_path);
+  } else {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  }
+  if (bind(fd, (struct sockaddr *)&ss, sslen) != 0 || listen(fd, LISTEN_BACKLOG) != 0) {
+    log_message(LOG_ERROR, "wire_listen: can't listen on '%s': %s", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (family == AF_INET) {
+    // requests are small and latency-sensitive; accepted sockets inherit this
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  }
+  return fd;
+}
+
+int wire_connect(const char *addr) {
+  struct sockaddr_storage ss;
+  socklen_t sslen;
+  int family = resolve(addr, &ss, &sslen);
+  if (family < 0) return -1;
+
+  int fd = socket(family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    log_message(LOG_ERROR, "wire_connect: socket: %s", strerror(errno));
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&ss, sslen) != 0) {
+    log_message(LOG_ERROR, "wire_connect: can't connect to '%s': %s", addr, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (family == AF_INET) {
+    // requests are small and latency-sensitive
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  }
+  return fd;
+}
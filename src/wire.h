@@ -0,0 +1,89 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file wire.h
+ * @brief Framed binary messages over stream sockets.
+ *
+ * A frame is a 4-byte big-endian length, followed by that many bytes:
+ * a 1-byte message type and then the payload. Payloads are built with a
+ * wire_writer_t and parsed with a wire_reader_t; all integers are
+ * big-endian and strings are a 2-byte length followed by the bytes
+ * (without a terminator).
+ *
+ * Socket addresses are strings of the form "unix:/path/to/socket" or
+ * "tcp:host:port".
+ */
+
+#define WIRE_MAX_FRAME 4096
+
+typedef struct {
+  uint8_t buf[WIRE_MAX_FRAME];
+  size_t len;
+  bool overflow;    // set if a put didn't fit; the frame must not be sent
+} wire_writer_t;
+
+typedef struct {
+  const uint8_t *buf;
+  size_t len;
+  size_t pos;
+  bool error;       // set if a get ran past the end or a string didn't fit
+} wire_reader_t;
+
+// reset a writer to empty
+void wire_writer_init(wire_writer_t *w);
+
+void wire_put_u8(wire_writer_t *w, uint8_t v);
+void wire_put_u32(wire_writer_t *w, uint32_t v);
+void wire_put_u64(wire_writer_t *w, uint64_t v);
+void wire_put_i64(wire_writer_t *w, int64_t v);
+void wire_put_bytes(wire_writer_t *w, const void *data, size_t len);
+
+// put a string of at most max_len chars (stopping early at a NUL)
+void wire_put_str(wire_writer_t *w, const char *s, size_t max_len);
+
+// start reading `len` bytes at `buf`
+void wire_reader_init(wire_reader_t *r, const void *buf, size_t len);
+
+uint8_t wire_get_u8(wire_reader_t *r);
+uint32_t wire_get_u32(wire_reader_t *r);
+uint64_t wire_get_u64(wire_reader_t *r);
+int64_t wire_get_i64(wire_reader_t *r);
+void wire_get_bytes(wire_reader_t *r, void *out, size_t len);
+
+/**
+ * Read a string into `out`, always NUL-terminating it. Sets r->error if
+ * the string (plus terminator) doesn't fit in `cap` bytes.
+ */
+void wire_get_str(wire_reader_t *r, char *out, size_t cap);
+
+// true if the whole payload was consumed without error
+bool wire_reader_done(const wire_reader_t *r);
+
+/**
+ * Send one frame. `payload` may be NULL for an empty payload.
+ * Returns false on a write error or if the payload overflowed.
+ */
+bool wire_send(int fd, uint8_t type, const wire_writer_t *payload);
+
+/**
+ * Receive one frame into `buf` (of size `cap`), setting the type and
+ * payload length. Returns false on EOF, a read error, or a frame larger
+ * than `cap`.
+ */
+bool wire_recv(int fd, uint8_t *type, uint8_t *buf, size_t cap, size_t *len);
+
+/**
+ * Open a listening socket on `addr`. For unix sockets, a stale socket
+ * file is removed first. Returns the fd, or -1 and logs an error.
+ */
+int wire_listen(const char *addr);
+
+// connect to `addr`. returns the fd, or -1 and logs an error.
+int wire_connect(const char *addr);
+
+#endif // WIRE_H
@@ -0,0 +1,501 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/account_admin.h"
+#include "../src/account_cache.h"
+#include "../src/account_store.h"
+#include "../src/compact_store.h"
+#include "../src/db.h"
+#include "../src/db_async.h"
+#include "../src/login_async.h"
+#include "../src/login_throttle.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STORED_ACCOUNTS 100
+#define PASSWORD "account-cache-password"
+
+typedef struct {
+    int fd;
+    account_store_t *store;
+    uint64_t latency_ns;
+    pthread_t thread;
+} server_t;
+
+static void *run_server(void *p) {
+    server_t *s = p;
+    db_server_serve(s->fd, s->store, s->latency_ns);
+    close(s->fd);
+    return NULL;
+}
+
+// serve `store` on one end of a socketpair; returns a client on the other
+static db_async_t *start_server(server_t *s, account_store_t *store, uint64_t latency_ns) {
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    *s = (server_t){ .fd = sv[0], .store = store, .latency_ns = latency_ns };
+    ck_assert_int_eq(pthread_create(&s->thread, NULL, run_server, s), 0);
+    db_async_t *db = db_async_open(sv[1]);
+    ck_assert_ptr_nonnull(db);
+    return db;
+}
+
+static void stop_server(server_t *s, db_async_t *db) {
+    db_async_close(db);
+    pthread_join(s->thread, NULL);
+}
+
+// user-0 ... user-(n-1), without passwords unless `password` is set
+static account_store_t *make_store(size_t n, const char *password) {
+    account_store_t *store = account_store_create(n);
+    ck_assert_ptr_nonnull(store);
+    account_t tmpl = {0};
+    if (password) ck_assert(account_update_password(&tmpl, password));
+    for (size_t i = 0; i < n; i++) {
+        account_t acc = tmpl;
+        snprintf(acc.userid, sizeof acc.userid, "user-%zu", i);
+        acc.account_id = (int64_t)i + 1;
+        ck_assert(account_store_put(store, &acc));
+    }
+    return store;
+}
+
+static void hot_set_path(char *path, size_t len) {
+    snprintf(path, len, "/tmp/check-hot-set-%ld", (long)getpid());
+    unlink(path);
+}
+
+START_TEST (test_get_put_evict) {
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    config.max_bytes = 64 * 4096;
+    account_cache_t *cache = account_cache_create(&config);
+    ck_assert_ptr_nonnull(cache);
+
+    account_t acc, alice = make_account("alice", 7);
+    bool found;
+    ck_assert(!account_cache_get(cache, "alice", &acc, &found));
+    account_cache_put(cache, "alice", &alice);
+    ck_assert(account_cache_get(cache, "alice", &acc, &found));
+    ck_assert(found);
+    ck_assert_int_eq(acc.account_id, 7);
+
+    // "not found" is cached too, and a later answer replaces it
+    account_cache_put(cache, "bob", NULL);
+    ck_assert(account_cache_get(cache, "bob", &acc, &found));
+    ck_assert(!found);
+    account_t bob = make_account("bob", 8);
+    account_cache_put(cache, "bob", &bob);
+    ck_assert(account_cache_get(cache, "bob", &acc, &found));
+    ck_assert(found);
+
+    account_cache_invalidate(cache, "alice");
+    ck_assert(!account_cache_get(cache, "alice", &acc, &found));
+
+    // far more than fits: the memory limit holds and the newest survive
+    char userid[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(userid, sizeof userid, "filler-%d", i);
+        account_t filler = make_account(userid, i);
+        account_cache_put(cache, userid, &filler);
+    }
+    ck_assert_uint_le(account_cache_memory(cache), config.max_bytes);
+    ck_assert(account_cache_get(cache, "filler-4999", &acc, &found));
+    ck_assert(!account_cache_get(cache, "filler-0", &acc, &found));
+    account_cache_free(cache);
+
+    // expired entries are misses
+    config.negative_ttl_secs = 0;
+    cache = account_cache_create(&config);
+    account_cache_put(cache, "carol", NULL);
+    ck_assert(!account_cache_get(cache, "carol", &acc, &found));
+    ck_assert_uint_eq(account_cache_memory(cache), 0);
+    account_cache_free(cache);
+}
+END_TEST
+
+START_TEST (test_save_and_warm) {
+    char path[64];
+    hot_set_path(path, sizeof path);
+    time_t now = time(NULL);
+
+    login_throttle_config_t throttle_config;
+    login_throttle_config_defaults(&throttle_config);
+    throttle_config.slots = 1024;
+    login_throttle_t *throttle = login_throttle_create(&throttle_config);
+    login_throttle_set_default(throttle);
+    for (uint32_t i = 0; i <= throttle_config.max_failures; i++) login_throttle_failure(throttle, "user-3", now);
+    ck_assert_uint_gt(login_throttle_check(throttle, "user-3", now), 0);
+
+    // a hot set of 50 accounts and 10 userids that don't exist, saved on free
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    config.hot_set_path = path;
+    config.save_interval_secs = 0;
+    account_cache_t *cache = account_cache_create(&config);
+    char userid[32];
+    for (int i = 0; i < 50; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i + 1);
+        account_cache_put(cache, userid, &acc);
+    }
+    for (int i = 0; i < 10; i++) {
+        snprintf(userid, sizeof userid, "ghost-%d", i);
+        account_cache_put(cache, userid, NULL);
+    }
+    account_cache_free(cache);
+    login_throttle_free(throttle);
+
+    // a restarted process: new throttle, new cache, and a database to warm from
+    throttle = login_throttle_create(&throttle_config);
+    login_throttle_set_default(throttle);
+    cache = account_cache_create(&config);
+    account_store_t *store = make_store(STORED_ACCOUNTS, NULL);
+    server_t server;
+    db_async_t *db = start_server(&server, store, 1000000);
+
+    account_cache_warm_stats_t stats;
+    ck_assert(account_cache_warm(cache, path, db, &stats));
+    ck_assert_uint_eq(stats.records, 60);
+    ck_assert_uint_eq(stats.fetched, 50);
+    ck_assert_uint_eq(stats.negative, 10);
+    ck_assert_uint_eq(stats.throttled, 1);
+    ck_assert(stats.complete);
+
+    account_t acc;
+    bool found;
+    ck_assert(account_cache_get(cache, "user-42", &acc, &found));
+    ck_assert(found);
+    ck_assert_int_eq(acc.account_id, 43);
+    ck_assert(account_cache_get(cache, "ghost-3", &acc, &found));
+    ck_assert(!found);
+    ck_assert(!account_cache_get(cache, "user-60", &acc, &found));
+    ck_assert_uint_gt(login_throttle_check(throttle, "user-3", now), 0);
+    ck_assert_uint_eq(login_throttle_check(throttle, "user-4", now), 0);
+
+    // no file is nothing to warm; a file that isn't a hot set is an error
+    unlink(path);
+    ck_assert(account_cache_warm(cache, path, db, &stats));
+    ck_assert_uint_eq(stats.records, 0);
+    FILE *f = fopen(path, "w");
+    fputs("not a hot set at all", f);
+    fclose(f);
+    ck_assert(!account_cache_warm(cache, path, db, &stats));
+    unlink(path);
+
+    stop_server(&server, db);
+    account_cache_free(cache);
+    login_throttle_free(throttle);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_warm_limits) {
+    char path[64];
+    hot_set_path(path, sizeof path);
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    account_cache_t *cache = account_cache_create(&config);
+    char userid[32];
+    for (int i = 0; i < STORED_ACCOUNTS; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i + 1);
+        account_cache_put(cache, userid, &acc);
+    }
+    size_t per_account = account_cache_memory(cache) / STORED_ACCOUNTS;
+    ck_assert(account_cache_save(cache, path));
+    account_cache_free(cache);
+
+    // memory: only the hottest 10 accounts fit
+    account_store_t *store = make_store(STORED_ACCOUNTS, NULL);
+    server_t server;
+    db_async_t *db = start_server(&server, store, 1000000);
+    config.warm_max_bytes = 10 * per_account;
+    config.warm_max_in_flight = 4;
+    cache = account_cache_create(&config);
+    account_cache_warm_stats_t stats;
+    ck_assert(account_cache_warm(cache, path, db, &stats));
+    ck_assert_uint_eq(stats.fetched, 10);
+    ck_assert(!stats.complete);
+    account_t acc;
+    bool found;
+    ck_assert(account_cache_get(cache, "user-99", &acc, &found));
+    ck_assert(!account_cache_get(cache, "user-0", &acc, &found));
+    account_cache_free(cache);
+    stop_server(&server, db);
+
+    // time: a database slower than the limit; lookups still outstanding
+    // complete harmlessly once the connection closes
+    db = start_server(&server, store, 3000000000u);
+    config = (account_cache_config_t){0};
+    account_cache_config_defaults(&config);
+    config.warm_max_secs = 1;
+    cache = account_cache_create(&config);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(account_cache_warm(cache, path, db, &stats));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ck_assert_int_le(end.tv_sec - start.tv_sec, 2);
+    ck_assert_uint_eq(stats.fetched, 0);
+    ck_assert(!stats.complete);
+    stop_server(&server, db);
+    account_cache_free(cache);
+
+    account_store_free(store);
+    unlink(path);
+}
+END_TEST
+
+static void login_finished(login_machine_t *m, void *arg) {
+    (void)m;
+    (void)arg;
+}
+
+// log in as each userid in turn, each login finishing before the next starts
+static void log_in(db_async_t *db, const char *const *userids, const login_result_t *expected, size_t n) {
+    int fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    for (size_t i = 0; i < n; i++) {
+        login_async_t *la = login_async_create(db, 1);
+        login_machine_t m;
+        login_machine_init(&m, userids[i], PASSWORD, 0x7f000001, time(NULL), fd, fd, &session);
+        ck_assert(login_async_submit(la, &m, login_finished, NULL));
+        login_async_free(la);
+        ck_assert_int_eq(m.result, expected[i]);
+    }
+    close(fd);
+}
+
+START_TEST (test_login_async_uses_cache) {
+    account_store_t *store = make_store(2, PASSWORD);
+    server_t server;
+    db_async_t *db = start_server(&server, store, 1000000);
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    account_cache_t *cache = account_cache_create(&config);
+    account_cache_set_default(cache);
+
+    const char *userids[] = { "user-1", "nobody-here" };
+    const login_result_t expected[] = { LOGIN_SUCCESS, LOGIN_FAIL_USER_NOT_FOUND };
+    uint64_t hits_before = 0, negative_before = 0, hits = 0, negative = 0;
+    log_in(db, userids, expected, 2);
+    stats_get("account_cache.hits", &hits_before);
+    stats_get("account_cache.negative_hits", &negative_before);
+
+    // the second time round, both answers come from the cache
+    log_in(db, userids, expected, 2);
+    ck_assert(stats_get("account_cache.hits", &hits));
+    ck_assert(stats_get("account_cache.negative_hits", &negative));
+    ck_assert_uint_eq(hits, hits_before + 1);
+    ck_assert_uint_eq(negative, negative_before + 1);
+
+    account_cache_free(cache);
+    ck_assert_ptr_eq(account_cache_get_default(), NULL);
+    stop_server(&server, db);
+    account_store_free(store);
+}
+END_TEST
+
+// cache every userid in `userids` as the store has it
+static void cache_from(account_cache_t *cache, account_store_t *store, const char *const *userids,
+                       size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        account_t acc;
+        bool found = account_store_get(store, userids[i], &acc);
+        account_cache_put(cache, userids[i], found ? &acc : NULL);
+    }
+}
+
+static bool cached(account_cache_t *cache, const char *userid) {
+    account_t acc;
+    bool found;
+    return account_cache_get(cache, userid, &acc, &found);
+}
+
+START_TEST (test_store_changes_refresh) {
+    account_store_t *store = make_store(10, NULL);
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    account_cache_t *cache = account_cache_create(&config);
+    ck_assert_ptr_nonnull(cache);
+    account_store_set_cache(store, cache);
+
+    const char *userids[] = { "user-1", "user-2", "user-3", "user-4", "newcomer" };
+    cache_from(cache, store, userids, 5);
+    for (size_t i = 0; i < 5; i++) ck_assert(cached(cache, userids[i]));
+
+    // a changed account is refreshed in place; a removed one is dropped
+    time_t unban = time(NULL) + 3600;
+    account_t acc;
+    bool found;
+    ck_assert(account_admin_set_unban_time(store, "user-1", unban));
+    ck_assert(account_cache_get(cache, "user-1", &acc, &found));
+    ck_assert(found);
+    ck_assert_int_eq(acc.unban_time, unban);
+    ck_assert(account_store_remove(store, "user-2"));
+    ck_assert(!cached(cache, "user-2"));
+    // creating an account drops the cached "not found"
+    account_t newcomer = make_account("newcomer", 99);
+    ck_assert(account_store_put(store, &newcomer));
+    ck_assert(!cached(cache, "newcomer"));
+
+    // a bulk change refreshes every account it changed, and only those
+    const char *banned[] = { "user-3", "user-4" };
+    account_bulk_t bulk = { .op = ACCOUNT_BULK_BAN, .time = unban + 60, .wal_fd = -1 };
+    size_t changed = 0;
+    ck_assert(account_admin_bulk(store, &bulk, banned, 2, &changed));
+    ck_assert_uint_eq(changed, 2);
+    for (size_t i = 0; i < 2; i++) {
+        ck_assert(account_cache_get(cache, banned[i], &acc, &found));
+        ck_assert_int_eq(acc.unban_time, unban + 60);
+    }
+    ck_assert(account_cache_get(cache, "user-1", &acc, &found));
+    ck_assert_int_eq(acc.unban_time, unban);
+
+    // the compact store does the same
+    compact_store_t *compact = compact_store_create(10);
+    ck_assert_ptr_nonnull(compact);
+    compact_store_set_cache(compact, cache);
+    account_t carol = make_account("carol", 5);
+    account_cache_put(cache, "carol", NULL);
+    ck_assert(compact_store_put(compact, &carol));
+    ck_assert(!cached(cache, "carol"));
+    account_cache_put(cache, "carol", &carol);
+    carol.account_id = 6;
+    ck_assert(compact_store_put(compact, &carol));
+    ck_assert(account_cache_get(cache, "carol", &acc, &found));
+    ck_assert_int_eq(acc.account_id, 6);
+    ck_assert(compact_store_remove(compact, "carol"));
+    ck_assert(!cached(cache, "carol"));
+    compact_store_free(compact);
+
+    // once detached, the cache is left alone
+    account_store_set_cache(store, NULL);
+    account_cache_put(cache, "user-5", NULL);
+    ck_assert(account_admin_set_unban_time(store, "user-5", unban));
+    ck_assert(account_cache_get(cache, "user-5", &acc, &found));
+    ck_assert(!found);
+    account_cache_free(cache);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_stale_fill_dropped) {
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    account_cache_t *cache = account_cache_create(&config);
+    ck_assert_ptr_nonnull(cache);
+    account_t alice = make_account("alice", 7);
+    bool found;
+
+    uint64_t ticket = account_cache_ticket(cache, "alice");
+    account_cache_fill(cache, "alice", &alice, ticket);
+    ck_assert(cached(cache, "alice"));
+
+    // the account changed while it was being looked up: the result is stale
+    ticket = account_cache_ticket(cache, "alice");
+    account_cache_invalidate(cache, "alice");
+    account_cache_fill(cache, "alice", &alice, ticket);
+    ck_assert(!cached(cache, "alice"));
+    account_cache_put(cache, "alice", &alice);
+    ticket = account_cache_ticket(cache, "alice");
+    account_cache_refresh(cache, "alice", &alice);
+    account_cache_fill(cache, "alice", NULL, ticket);
+    ck_assert(account_cache_get(cache, "alice", &alice, &found));
+    ck_assert(found);
+
+    // a ticket taken after the change is good
+    ticket = account_cache_ticket(cache, "alice");
+    account_cache_fill(cache, "alice", NULL, ticket);
+    ck_assert(cached(cache, "alice"));
+    account_cache_free(cache);
+}
+END_TEST
+
+static bool lookup_store(void *arg, const char *userid, account_t *acc) {
+    return account_store_get(arg, userid, acc);
+}
+
+START_TEST (test_warm_local_and_lookup) {
+    char path[64];
+    hot_set_path(path, sizeof path);
+    account_cache_config_t config;
+    account_cache_config_defaults(&config);
+    config.hot_set_path = path;
+    config.save_interval_secs = 0;
+    config.warm_max_in_flight = 256;
+    account_cache_t *cache = account_cache_create(&config);
+    char userid[32];
+    for (int i = 0; i < 600; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i + 1);
+        account_cache_put(cache, userid, &acc);
+    }
+    account_cache_free(cache);
+
+    // restarted with only half of those accounts
+    account_store_t *store = make_store(300, NULL);
+    cache = account_cache_create(&config);
+    account_cache_warm_stats_t stats;
+    ck_assert(account_cache_warm_local(cache, path, lookup_store, store, &stats));
+    ck_assert_uint_eq(stats.records, 600);
+    ck_assert_uint_eq(stats.fetched, 300);
+    ck_assert_uint_eq(stats.negative, 300);
+    ck_assert(stats.complete);
+    unlink(path);
+
+    // account_lookup_by_userid() answers from the default cache
+    account_store_t *previous = account_store_get_default();
+    account_store_set_default(store);
+    account_store_set_cache(store, cache);
+    account_cache_set_default(cache);
+    uint64_t hits_before = 0, hits = 0;
+    stats_get("account_cache.hits", &hits_before);
+    account_t acc;
+    ck_assert(account_lookup_by_userid("user-7", &acc));
+    ck_assert_int_eq(acc.account_id, 8);
+    ck_assert(stats_get("account_cache.hits", &hits));
+    ck_assert_uint_eq(hits, hits_before + 1);
+
+    // changes show through, and a cached "not found" still leaves the built-in example
+    ck_assert(account_admin_set_unban_time(store, "user-7", 12345));
+    ck_assert(account_lookup_by_userid("user-7", &acc));
+    ck_assert_int_eq(acc.unban_time, 12345);
+    ck_assert(!account_lookup_by_userid("user-450", &acc));
+    account_t late = make_account("user-450", 451);
+    ck_assert(account_store_put(store, &late));
+    ck_assert(account_lookup_by_userid("user-450", &acc));
+    ck_assert(account_lookup_by_userid("bob", &acc));
+    ck_assert(account_lookup_by_userid("bob", &acc));
+
+    account_store_set_cache(store, NULL);
+    account_cache_free(cache);
+    ck_assert_ptr_eq(account_cache_get_default(), NULL);
+    account_store_set_default(previous);
+    account_store_free(store);
+}
+END_TEST
+
+Suite *account_cache_suite(void) {
+    Suite *s = suite_create("AccountCache");
+    TCase *tc = tcase_create("Core");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_get_put_evict);
+    tcase_add_test(tc, test_save_and_warm);
+    tcase_add_test(tc, test_warm_limits);
+    tcase_add_test(tc, test_login_async_uses_cache);
+    tcase_add_test(tc, test_store_changes_refresh);
+    tcase_add_test(tc, test_stale_fill_dropped);
+    tcase_add_test(tc, test_warm_local_and_lookup);
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account_admin.h"
+#include "../src/account_cdc.h"
+#include "../src/account_store.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static account_cdc_t *make_cdc(const char *shm_name, size_t ring_bytes, bool include_hashes) {
+    account_cdc_config_t config;
+    account_cdc_config_defaults(&config);
+    config.shm_name = shm_name;
+    config.ring_bytes = ring_bytes;
+    config.include_hashes = include_hashes;
+    account_cdc_t *cdc = account_cdc_create(&config);
+    ck_assert_ptr_nonnull(cdc);
+    return cdc;
+}
+
+static bool record_login(account_t *acc, void *arg) {
+    acc->login_fail_count = 0;
+    acc->last_login_time = 1700000000;
+    acc->last_ip = *(const ip4_addr_t *)arg;
+    return true;
+}
+
+static bool set_hash(account_t *acc, void *arg) {
+    strcpy(acc->password_hash, arg);
+    return true;
+}
+
+static bool touch_nothing(account_t *acc, void *arg) {
+    (void)acc;
+    (void)arg;
+    return true;
+}
+
+static account_change_t expect_change(account_cdc_reader_t *r, uint64_t seq,
+                                      account_change_op_t op, uint32_t fields) {
+    account_change_t c;
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_CHANGE);
+    ck_assert_uint_eq(c.seq, seq);
+    ck_assert_int_eq(c.op, op);
+    ck_assert_uint_eq(c.fields, fields);
+    return c;
+}
+
+START_TEST (test_store_changes_recorded) {
+    account_store_t *store = account_store_create(0);
+    account_cdc_t *cdc = make_cdc(NULL, 0, false);
+    account_cdc_reader_t *r = account_cdc_reader_create(cdc);
+    account_store_set_cdc(store, cdc);
+    ck_assert_int_eq(account_cdc_read(r, &(account_change_t){0}), ACCOUNT_CDC_EMPTY);
+
+    account_t alice = make_account("alice", 1), bob = make_account("bob", 2);
+    ck_assert(account_store_put(store, &alice));
+    ck_assert(account_store_put(store, &bob));
+    ck_assert(account_admin_set_email(store, "alice", "alice@example.org"));
+    ip4_addr_t ip = 0x0a000001;
+    ck_assert(account_store_update(store, "bob", record_login, &ip));
+    ck_assert(account_store_update(store, "bob", set_hash, "$6$salt$other"));
+    // an update that changes nothing isn't a change
+    ck_assert(account_store_update(store, "bob", touch_nothing, NULL));
+    account_bulk_t bulk = { .op = ACCOUNT_BULK_BAN, .time = 1800000000, .wal_fd = -1, .threads = 1 };
+    const char *userids[] = { "alice", "bob" };
+    ck_assert(account_admin_bulk(store, &bulk, userids, 2, NULL));
+    ck_assert(account_store_remove(store, "alice"));
+    account_store_set_cdc(store, NULL);
+    ck_assert(account_store_remove(store, "bob"));
+
+    account_change_t c = expect_change(r, 1, ACCOUNT_CHANGE_PUT, ACCOUNT_FIELD_ALL);
+    ck_assert_str_eq(c.acc.userid, "alice");
+    ck_assert_int_eq(c.acc.account_id, 1);
+    // hashes are left out unless asked for
+    ck_assert_str_eq(c.acc.password_hash, "");
+    ck_assert_int_eq(memcmp(c.acc.birthdate, "2000-01-01", BIRTHDATE_LENGTH), 0);
+    expect_change(r, 2, ACCOUNT_CHANGE_PUT, ACCOUNT_FIELD_ALL);
+
+    c = expect_change(r, 3, ACCOUNT_CHANGE_UPDATE, ACCOUNT_FIELD_EMAIL);
+    ck_assert_str_eq(c.acc.userid, "alice");
+    ck_assert_str_eq(c.acc.email, "alice@example.org");
+    c = expect_change(r, 4, ACCOUNT_CHANGE_UPDATE,
+                      ACCOUNT_FIELD_LAST_LOGIN_TIME | ACCOUNT_FIELD_LAST_IP);
+    ck_assert_uint_eq(c.acc.last_ip, ip);
+    c = expect_change(r, 5, ACCOUNT_CHANGE_UPDATE, ACCOUNT_FIELD_PASSWORD_HASH);
+    ck_assert_str_eq(c.acc.password_hash, "");
+
+    // the batch, in one go, in slot order
+    c = expect_change(r, 6, ACCOUNT_CHANGE_UPDATE, ACCOUNT_FIELD_UNBAN_TIME);
+    ck_assert_str_eq(c.acc.userid, "alice");
+    ck_assert_int_eq(c.acc.unban_time, 1800000000);
+    expect_change(r, 7, ACCOUNT_CHANGE_UPDATE, ACCOUNT_FIELD_UNBAN_TIME);
+
+    c = expect_change(r, 8, ACCOUNT_CHANGE_REMOVE, 0);
+    ck_assert_str_eq(c.acc.userid, "alice");
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_EMPTY);
+    ck_assert_uint_eq(account_cdc_next_seq(cdc), 9);
+
+    account_cdc_reader_free(r);
+    account_store_free(store);
+    account_cdc_free(cdc);
+}
+END_TEST
+
+static bool same_account(const account_t *a, const account_t *b) {
+    return a->account_id == b->account_id && strcmp(a->userid, b->userid) == 0 &&
+           strcmp(a->password_hash, b->password_hash) == 0 && strcmp(a->email, b->email) == 0 &&
+           a->unban_time == b->unban_time && a->expiration_time == b->expiration_time &&
+           a->login_count == b->login_count && a->login_fail_count == b->login_fail_count &&
+           a->last_login_time == b->last_login_time && a->last_ip == b->last_ip &&
+           memcmp(a->birthdate, b->birthdate, BIRTHDATE_LENGTH) == 0;
+}
+
+static bool compare_visit(const account_t *acc, void *arg) {
+    account_t copy;
+    ck_assert(account_store_get(arg, acc->userid, &copy));
+    ck_assert(same_account(acc, &copy));
+    return true;
+}
+
+START_TEST (test_replica_follows_shared_ring) {
+    char name[64];
+    snprintf(name, sizeof name, "/check-account-cdc-%ld", (long)getpid());
+    account_store_t *store = account_store_create(0);
+    account_store_t *replica = account_store_create(0);
+    account_cdc_t *cdc = make_cdc(name, 0, true);
+    account_cdc_reader_t *r = account_cdc_reader_open(name);
+    ck_assert_ptr_nonnull(r);
+    account_store_set_cdc(store, cdc);
+
+    char userid[32];
+    for (int i = 0; i < 50; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i);
+        ck_assert(account_store_put(store, &acc));
+    }
+    for (int i = 0; i < 50; i += 3) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ip4_addr_t ip = (ip4_addr_t)i;
+        ck_assert(account_store_update(store, userid, record_login, &ip));
+        ck_assert(account_admin_set_expiration_time(store, userid, 1900000000));
+    }
+    for (int i = 0; i < 50; i += 7) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert(account_store_remove(store, userid));
+    }
+
+    account_change_t c;
+    size_t applied = 0;
+    while (account_cdc_read(r, &c) == ACCOUNT_CDC_CHANGE) {
+        ck_assert(account_cdc_apply(replica, &c));
+        applied++;
+    }
+    ck_assert_uint_eq(applied, 50 + 17 * 2 + 8);
+    ck_assert_uint_eq(account_store_count(replica), account_store_count(store));
+    account_store_foreach(store, compare_visit, replica);
+
+    // an update the replica can't apply means it is out of step
+    c.op = ACCOUNT_CHANGE_UPDATE;
+    strcpy(c.acc.userid, "nobody");
+    ck_assert(!account_cdc_apply(replica, &c));
+
+    account_store_set_cdc(store, NULL);
+    account_cdc_reader_free(r);
+    account_cdc_free(cdc);
+    // the name is gone with the stream
+    ck_assert_ptr_eq(account_cdc_reader_open(name), NULL);
+    account_store_free(replica);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_lapped_reader_loses_changes) {
+    account_store_t *store = account_store_create(0);
+    account_cdc_t *cdc = make_cdc(NULL, 0, false);    // the smallest ring
+    account_cdc_reader_t *r = account_cdc_reader_create(cdc);
+    account_store_set_cdc(store, cdc);
+
+    account_t acc = make_account("alice", 1);
+    ck_assert(account_store_put(store, &acc));
+    // far more than fits in 64 KiB
+    for (ip4_addr_t ip = 1; ip <= 5000; ip++) {
+        ck_assert(account_store_update(store, "alice", record_login, &ip));
+    }
+
+    account_change_t c;
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_LOST);
+    // carried on from the oldest change still held, in order, to the end
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_CHANGE);
+    uint64_t seq = c.seq;
+    ck_assert_uint_gt(seq, 1000);
+    while (account_cdc_read(r, &c) == ACCOUNT_CDC_CHANGE) ck_assert_uint_eq(c.seq, ++seq);
+    ck_assert_uint_eq(seq, 5001);
+    ck_assert_uint_eq(c.acc.last_ip, 5000);
+
+    ck_assert(!account_cdc_reader_seek(r, 1));
+    ck_assert(account_cdc_reader_seek(r, 4990));
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_CHANGE);
+    ck_assert_uint_eq(c.seq, 4990);
+    ck_assert(account_cdc_reader_seek(r, 6000));
+    ck_assert_int_eq(account_cdc_read(r, &c), ACCOUNT_CDC_EMPTY);
+
+    account_store_set_cdc(store, NULL);
+    account_cdc_reader_free(r);
+    account_cdc_free(cdc);
+    account_store_free(store);
+}
+END_TEST
+
+typedef struct {
+    account_cdc_t *cdc;
+    int fd;
+} serve_arg_t;
+
+static void *serve_thread(void *p) {
+    serve_arg_t *arg = p;
+    account_cdc_serve(arg->cdc, arg->fd);
+    return NULL;
+}
+
+START_TEST (test_socket_subscriber) {
+    account_store_t *store = account_store_create(0);
+    account_cdc_t *cdc = make_cdc(NULL, 0, false);
+    account_store_set_cdc(store, cdc);
+    account_t acc = make_account("alice", 1);
+    ck_assert(account_store_put(store, &acc));
+    ck_assert(account_admin_set_email(store, "alice", "alice@example.org"));
+
+    int fds[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    serve_arg_t arg = { .cdc = cdc, .fd = fds[0] };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, serve_thread, &arg), 0);
+
+    // catch up from the start, then follow changes as they happen
+    ck_assert(account_cdc_subscribe(fds[1], 1));
+    account_cdc_status_t status;
+    account_change_t c;
+    ck_assert(account_cdc_recv(fds[1], &status, &c));
+    ck_assert_int_eq(status, ACCOUNT_CDC_CHANGE);
+    ck_assert_uint_eq(c.seq, 1);
+    ck_assert_int_eq(c.op, ACCOUNT_CHANGE_PUT);
+    ck_assert(account_cdc_recv(fds[1], &status, &c));
+    ck_assert_uint_eq(c.seq, 2);
+    ck_assert_str_eq(c.acc.email, "alice@example.org");
+
+    ck_assert(account_admin_set_unban_time(store, "alice", 1800000000));
+    ck_assert(account_cdc_recv(fds[1], &status, &c));
+    ck_assert_int_eq(status, ACCOUNT_CDC_CHANGE);
+    ck_assert_uint_eq(c.seq, 3);
+    ck_assert_uint_eq(c.fields, ACCOUNT_FIELD_UNBAN_TIME);
+    ck_assert_int_eq(c.acc.unban_time, 1800000000);
+
+    // the server notices the subscriber leave
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    account_store_set_cdc(store, NULL);
+    account_cdc_free(cdc);
+    account_store_free(store);
+}
+END_TEST
+
+Suite *account_cdc_suite(void) {
+    Suite *s = suite_create("AccountCdc");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_store_changes_recorded);
+    tcase_add_test(tc, test_replica_follows_shared_ring);
+    tcase_add_test(tc, test_lapped_reader_loses_changes);
+    tcase_add_test(tc, test_socket_subscriber);
+    suite_add_tcase(s, tc);
+    return s;
+}
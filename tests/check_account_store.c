@@ -0,0 +1,429 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account_admin.h"
+#include "../src/account_backup.h"
+#include "../src/account_store.h"
+#include "../src/db.h"
+#include "../src/ebr.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool count_visit(const account_t *acc, void *arg) {
+    (void)acc;
+    (*(size_t *)arg)++;
+    return true;
+}
+
+START_TEST (test_store_put_get) {
+    account_store_t *store = account_store_create(4);
+    ck_assert_ptr_ne(store, NULL);
+
+    account_t acc = make_account("alice", 1);
+    ck_assert(account_store_put(store, &acc));
+
+    account_t out;
+    ck_assert(account_store_get(store, "alice", &out));
+    ck_assert_int_eq(out.account_id, 1);
+    ck_assert_str_eq(out.email, "alice@example.com");
+    ck_assert(!account_store_get(store, "bob", &out));
+
+    // put with an existing userid replaces the record
+    acc.account_id = 2;
+    ck_assert(account_store_put(store, &acc));
+    ck_assert(account_store_get(store, "alice", &out));
+    ck_assert_int_eq(out.account_id, 2);
+    ck_assert_uint_eq(account_store_count(store), 1);
+
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_store_grow_and_remove) {
+    account_store_t *store = account_store_create(0);
+    char userid[32];
+
+    for (int i = 0; i < 5000; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i);
+        ck_assert(account_store_put(store, &acc));
+    }
+    ck_assert_uint_eq(account_store_count(store), 5000);
+
+    for (int i = 0; i < 5000; i += 2) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert(account_store_remove(store, userid));
+    }
+    ck_assert(!account_store_remove(store, "user-0"));
+    ck_assert_uint_eq(account_store_count(store), 2500);
+
+    account_t out;
+    for (int i = 0; i < 5000; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert_int_eq(account_store_get(store, userid, &out), i % 2 == 1);
+        if (i % 2 == 1) ck_assert_int_eq(out.account_id, i);
+    }
+
+    size_t visited = 0;
+    account_store_foreach(store, count_visit, &visited);
+    ck_assert_uint_eq(visited, 2500);
+
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_store_default_lookup) {
+    account_store_t *store = account_store_create(1);
+    account_t acc = make_account("carol", 7);
+    account_store_put(store, &acc);
+
+    account_t out;
+    ck_assert(!account_lookup_by_userid("carol", &out));
+    account_store_set_default(store);
+    ck_assert(account_lookup_by_userid("carol", &out));
+    ck_assert_int_eq(out.account_id, 7);
+
+    // freeing the default store clears it
+    account_store_free(store);
+    ck_assert_ptr_eq(account_store_get_default(), NULL);
+    ck_assert(!account_lookup_by_userid("carol", &out));
+}
+END_TEST
+
+static bool bump_fail_count(account_t *acc, void *arg) {
+    (void)arg;
+    acc->login_fail_count++;
+    return true;
+}
+
+static bool sum_ids(const account_t *acc, void *arg) {
+    *(int64_t *)arg += acc->account_id;
+    return true;
+}
+
+START_TEST (test_store_snapshot_copy_on_write) {
+    account_store_t *store = account_store_create(0);
+    char userid[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i);
+        account_store_put(store, &acc);
+    }
+
+    account_snapshot_t *snap = account_store_snapshot(store);
+    ck_assert_ptr_ne(snap, NULL);
+    uint64_t copied_before = 0;
+    stats_get("account_store.pages_copied", &copied_before);
+
+    // change the store after the snapshot in every way
+    account_t acc = make_account("user-0", 5000);
+    ck_assert(account_store_put(store, &acc));
+    ck_assert(account_store_remove(store, "user-1"));
+    acc = make_account("newcomer", 9000);
+    ck_assert(account_store_put(store, &acc));
+    ck_assert(account_store_update(store, "user-2", bump_fail_count, NULL));
+    ck_assert(account_store_update(store, "user-2", bump_fail_count, NULL));
+    ck_assert(!account_store_update(store, "nobody", bump_fail_count, NULL));
+
+    // the snapshot still sees the store as it was
+    ck_assert_uint_eq(account_snapshot_count(snap), 1000);
+    int64_t sum = 0;
+    account_snapshot_foreach(snap, sum_ids, &sum);
+    ck_assert_int_eq(sum, 999 * 1000 / 2);
+
+    account_t out;
+    ck_assert(account_store_get(store, "user-2", &out));
+    ck_assert_uint_eq(out.login_fail_count, 2);
+
+    // only written pages were copied, each at most once: user-0..2 live
+    // in the first page, and the newcomer reused user-1's slot
+    uint64_t copied_after = 0;
+    ck_assert(stats_get("account_store.pages_copied", &copied_after));
+    ck_assert_uint_eq(copied_after - copied_before, 1);
+
+    // the snapshot outlives the store
+    account_store_free(store);
+    sum = 0;
+    account_snapshot_foreach(snap, sum_ids, &sum);
+    ck_assert_int_eq(sum, 999 * 1000 / 2);
+    account_snapshot_free(snap);
+}
+END_TEST
+
+START_TEST (test_store_backup_restore) {
+    char dir[] = "/tmp/check_backup_XXXXXX";
+    ck_assert_ptr_ne(mkdtemp(dir), NULL);
+    char path[64];
+    snprintf(path, sizeof path, "%s/accounts.bak", dir);
+
+    account_store_t *store = account_store_create(0);
+    char userid[32];
+    for (int i = 0; i < 500; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i);
+        account_store_put(store, &acc);
+    }
+
+    account_backup_t *backup = account_backup_start(store, path);
+    ck_assert_ptr_ne(backup, NULL);
+    // writes during the backup don't show up in it
+    for (int i = 0; i < 500; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_store_update(store, userid, bump_fail_count, NULL);
+    }
+    account_t acc = make_account("late", 1);
+    account_store_put(store, &acc);
+    ck_assert(account_backup_wait(backup));
+
+    account_store_t *restored = account_store_create(0);
+    ck_assert(account_backup_restore(path, restored));
+    ck_assert_uint_eq(account_store_count(restored), 500);
+    account_t out;
+    ck_assert(account_store_get(restored, "user-42", &out));
+    ck_assert_int_eq(out.account_id, 42);
+    ck_assert_uint_eq(out.login_fail_count, 0);
+    ck_assert(!account_store_get(restored, "late", &out));
+
+    // a truncated file is rejected
+    ck_assert_int_eq(truncate(path, 100), 0);
+    ck_assert(!account_backup_restore(path, restored));
+
+    unlink(path);
+    rmdir(dir);
+    account_store_free(restored);
+    account_store_free(store);
+}
+END_TEST
+
+#define RCU_ACCOUNTS 64
+#define RCU_READERS 4
+#define RCU_WRITES 20000
+
+typedef struct {
+    account_store_t *store;
+    atomic_bool stop;
+    atomic_int torn;
+} rcu_state_t;
+
+static bool set_id_and_email(account_t *acc, void *arg) {
+    int64_t id = *(const int64_t *)arg;
+    acc->account_id = id;
+    snprintf(acc->email, sizeof acc->email, "%lld@example.com", (long long)id);
+    return true;
+}
+
+// check that the email always matches the id written alongside it
+static void *rcu_reader(void *arg) {
+    rcu_state_t *st = arg;
+    char userid[32], expected[EMAIL_LENGTH];
+    for (unsigned n = 0; !atomic_load(&st->stop); n++) {
+        snprintf(userid, sizeof userid, "user-%u", n % RCU_ACCOUNTS);
+        account_t acc;
+        if (!account_store_get(st->store, userid, &acc)) continue;
+        snprintf(expected, sizeof expected, "%lld@example.com", (long long)acc.account_id);
+        if (strcmp(acc.email, expected) != 0) atomic_fetch_add(&st->torn, 1);
+    }
+    return NULL;
+}
+
+START_TEST (test_store_lock_free_reads) {
+    rcu_state_t st = { .store = account_store_create(0) };
+    char userid[32];
+    for (int i = 0; i < RCU_ACCOUNTS; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, 0);
+        int64_t id = i;
+        set_id_and_email(&acc, &id);
+        account_store_put(st.store, &acc);
+    }
+
+    pthread_t readers[RCU_READERS];
+    for (int i = 0; i < RCU_READERS; i++) {
+        ck_assert_int_eq(pthread_create(&readers[i], NULL, rcu_reader, &st), 0);
+    }
+
+    uint64_t freed_before = 0;
+    stats_get("ebr.freed", &freed_before);
+    for (int64_t n = 0; n < RCU_WRITES; n++) {
+        snprintf(userid, sizeof userid, "user-%d", (int)(n % RCU_ACCOUNTS));
+        ck_assert(account_store_update(st.store, userid, set_id_and_email, &n));
+        // churn other keys too, so slots are reused and the index grows
+        snprintf(userid, sizeof userid, "churn-%d", (int)(n % 1000));
+        if (n % 2000 < 1000) {
+            account_t acc = make_account(userid, n);
+            account_store_put(st.store, &acc);
+        } else {
+            account_store_remove(st.store, userid);
+        }
+    }
+
+    atomic_store(&st.stop, true);
+    for (int i = 0; i < RCU_READERS; i++) pthread_join(readers[i], NULL);
+    ck_assert_int_eq(atomic_load(&st.torn), 0);
+
+    // replaced versions have been reclaimed, not leaked
+    ebr_barrier();
+    uint64_t freed_after = 0;
+    ck_assert(stats_get("ebr.freed", &freed_after));
+    ck_assert_uint_ge(freed_after - freed_before, RCU_WRITES);
+
+    account_store_free(st.store);
+}
+END_TEST
+
+START_TEST (test_admin_updates) {
+    account_store_t *store = account_store_create(0);
+    account_t acc = make_account("dave", 3);
+    account_store_put(store, &acc);
+
+    ck_assert(account_admin_set_email(store, "dave", "dave@example.org"));
+    ck_assert(!account_admin_set_email(store, "dave", "not an email"));
+    ck_assert(!account_admin_set_email(store, "nobody", "x@example.org"));
+    ck_assert(account_admin_set_unban_time(store, "dave", 1000));
+    ck_assert(account_admin_set_expiration_time(store, "dave", 2000));
+    ck_assert(account_admin_update_password(store, "dave", "correct horse"));
+
+    account_t out;
+    ck_assert(account_store_get(store, "dave", &out));
+    ck_assert_str_eq(out.email, "dave@example.org");
+    ck_assert_int_eq(out.unban_time, 1000);
+    ck_assert_int_eq(out.expiration_time, 2000);
+    ck_assert(account_validate_password(&out, "correct horse"));
+    ck_assert(!account_validate_password(&out, "wrong"));
+
+    account_store_free(store);
+}
+END_TEST
+
+#define BULK_ACCOUNTS 100000
+
+static bool userid_ends_in_7(const account_t *acc, void *arg) {
+    (void)arg;
+    size_t len = strlen(acc->userid);
+    return len > 0 && acc->userid[len - 1] == '7';
+}
+
+typedef struct {
+    account_store_t *store;
+    atomic_bool stop;
+    atomic_int inconsistent;
+} bulk_watch_t;
+
+// user-0 and the last account are banned by the same transaction, so
+// seeing the first banned means the second must be too
+static void *bulk_watcher(void *arg) {
+    bulk_watch_t *w = arg;
+    char last[32];
+    snprintf(last, sizeof last, "user-%d", BULK_ACCOUNTS - 1);
+    while (!atomic_load(&w->stop)) {
+        account_t first, second;
+        if (!account_store_get(w->store, "user-0", &first)) continue;
+        if (!account_store_get(w->store, last, &second)) continue;
+        if (first.unban_time != 0 && second.unban_time == 0) atomic_fetch_add(&w->inconsistent, 1);
+    }
+    return NULL;
+}
+
+START_TEST (test_admin_bulk) {
+    account_store_t *store = account_store_create(BULK_ACCOUNTS);
+    static char names[BULK_ACCOUNTS + 1][32];
+    const char *userids[BULK_ACCOUNTS + 1];
+    for (int i = 0; i < BULK_ACCOUNTS; i++) {
+        snprintf(names[i], sizeof names[i], "user-%d", i);
+        userids[i] = names[i];
+        account_t acc = make_account(names[i], i);
+        account_store_put(store, &acc);
+    }
+    snprintf(names[BULK_ACCOUNTS], sizeof names[0], "no-such-user");
+    userids[BULK_ACCOUNTS] = names[BULK_ACCOUNTS];
+
+    char wal_path[] = "/tmp/check_wal_XXXXXX";
+    int wal = mkstemp(wal_path);
+    ck_assert_int_ge(wal, 0);
+
+    bulk_watch_t watch = { .store = store };
+    pthread_t watcher;
+    ck_assert_int_eq(pthread_create(&watcher, NULL, bulk_watcher, &watch), 0);
+
+    // mass ban by list, timed
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    account_bulk_t ban = { .op = ACCOUNT_BULK_BAN, .time = 4000000000, .wal_fd = wal };
+    size_t changed = 0;
+    ck_assert(account_admin_bulk(store, &ban, userids, BULK_ACCOUNTS + 1, &changed));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ck_assert_uint_eq(changed, BULK_ACCOUNTS);
+    double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    ck_assert_msg(secs < 1.0, "mass ban took %.3fs", secs);
+
+    atomic_store(&watch.stop, true);
+    pthread_join(watcher, NULL);
+    ck_assert_int_eq(atomic_load(&watch.inconsistent), 0);
+
+    account_t out;
+    ck_assert(account_store_get(store, "user-12345", &out));
+    ck_assert(account_is_banned(&out));
+
+    // mass expire by predicate
+    account_bulk_t expire = { .op = ACCOUNT_BULK_EXPIRE, .time = 1, .wal_fd = wal, .threads = 4 };
+    ck_assert(account_admin_bulk_where(store, &expire, userid_ends_in_7, NULL, &changed));
+    ck_assert_uint_eq(changed, BULK_ACCOUNTS / 10);
+    ck_assert(account_store_get(store, "user-17", &out));
+    ck_assert_int_eq(out.expiration_time, 1);
+    ck_assert(account_store_get(store, "user-18", &out));
+    ck_assert_int_eq(out.expiration_time, 0);
+
+    // one log entry per transaction
+    FILE *f = fopen(wal_path, "r");
+    char line[128];
+    int headers = 0, ends = 0, lines = 0;
+    while (fgets(line, sizeof line, f)) {
+        if (strncmp(line, "BULK ", 5) == 0) headers++;
+        else if (strcmp(line, "END\n") == 0) ends++;
+        lines++;
+    }
+    fclose(f);
+    ck_assert_int_eq(headers, 2);
+    ck_assert_int_eq(ends, 2);
+    ck_assert_int_eq(lines, 4 + BULK_ACCOUNTS + BULK_ACCOUNTS / 10);
+
+    // a bad email or an unwritable log changes nothing
+    account_bulk_t email = { .op = ACCOUNT_BULK_SET_EMAIL, .email = "bad address", .wal_fd = -1 };
+    ck_assert(!account_admin_bulk(store, &email, userids, 10, &changed));
+    close(wal);
+    email.email = "good@example.com";
+    email.wal_fd = wal;
+    ck_assert(!account_admin_bulk(store, &email, userids, 10, &changed));
+    ck_assert(account_store_get(store, "user-3", &out));
+    ck_assert_str_eq(out.email, "user-3@example.com");
+
+    unlink(wal_path);
+    account_store_free(store);
+}
+END_TEST
+
+Suite *account_store_suite(void) {
+    Suite *s = suite_create("AccountStore");
+
+    TCase *tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_store_put_get);
+    tcase_add_test(tc_core, test_store_grow_and_remove);
+    tcase_add_test(tc_core, test_store_default_lookup);
+    tcase_add_test(tc_core, test_store_snapshot_copy_on_write);
+    tcase_add_test(tc_core, test_store_backup_restore);
+    tcase_add_test(tc_core, test_store_lock_free_reads);
+    tcase_add_test(tc_core, test_admin_updates);
+    tcase_add_test(tc_core, test_admin_bulk);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
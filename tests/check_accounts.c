@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "../src/account.h"
+#include "check_suites.h"
 #include <check.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -234,8 +235,23 @@ Suite *account_suite(void) {
 
 
 int main(void) {
-    Suite *s = account_suite();
-    SRunner *sr = srunner_create(s);
+    SRunner *sr = srunner_create(account_suite());
+    srunner_add_suite(sr, account_store_suite());
+    srunner_add_suite(sr, loadgen_suite());
+    srunner_add_suite(sr, admission_suite());
+    srunner_add_suite(sr, cluster_suite());
+    srunner_add_suite(sr, sha512_crypt_suite());
+    srunner_add_suite(sr, db_async_suite());
+    srunner_add_suite(sr, single_flight_suite());
+    srunner_add_suite(sr, entropy_suite());
+    srunner_add_suite(sr, hash_memory_suite());
+    srunner_add_suite(sr, login_throttle_suite());
+    srunner_add_suite(sr, compact_store_suite());
+    srunner_add_suite(sr, audit_log_suite());
+    srunner_add_suite(sr, slab_suite());
+    srunner_add_suite(sr, account_cache_suite());
+    srunner_add_suite(sr, stuffing_detector_suite());
+    srunner_add_suite(sr, account_cdc_suite());
 
     srunner_run_all(sr, CK_NORMAL);
     int n_failed = srunner_ntests_failed(sr);
@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/admission.h"
+#include "../src/login_admission.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    admission_t *adm;
+    admission_priority_t priority;
+    admission_status_t status;
+    int order;
+} waiter_arg_t;
+
+static atomic_int grant_order;
+
+static void *wait_for_slot(void *p) {
+    waiter_arg_t *arg = p;
+    admission_ticket_t ticket;
+    arg->status = admission_enter(arg->adm, arg->priority, NULL, &ticket);
+    if (arg->status == ADMISSION_ADMITTED) {
+        arg->order = atomic_fetch_add(&grant_order, 1);
+        admission_leave(arg->adm, &ticket);
+    }
+    return NULL;
+}
+
+// wait (briefly) until the admission queues hold n waiters
+static void wait_queued(uint64_t n) {
+    for (int i = 0; i < 2000; i++) {
+        uint64_t queued = 0;
+        if (stats_get("admission.queued", &queued) && queued == n) return;
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    ck_abort_msg("timed out waiting for %llu queued", (unsigned long long)n);
+}
+
+static admission_t *make_admission(size_t max_queued) {
+    admission_config_t config;
+    admission_config_defaults(&config);
+    config.max_concurrent = 1;
+    config.max_queued = max_queued;
+    return admission_create(&config);
+}
+
+START_TEST (test_admission_immediate_and_expired) {
+    admission_t *adm = make_admission(8);
+    admission_ticket_t ticket;
+
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_NORMAL, NULL, &ticket), ADMISSION_ADMITTED);
+    admission_leave(adm, &ticket);
+
+    struct timespec past;
+    clock_gettime(CLOCK_MONOTONIC, &past);
+    past.tv_sec -= 1;
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_HIGH, &past, &ticket), ADMISSION_EXPIRED);
+
+    // a queued request whose deadline passes is dropped without running
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_NORMAL, NULL, &ticket), ADMISSION_ADMITTED);
+    admission_ticket_t second;
+    struct timespec soon;
+    admission_deadline_in(&soon, 20);
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_HIGH, &soon, &second), ADMISSION_EXPIRED);
+    admission_leave(adm, &ticket);
+
+    admission_free(adm);
+}
+END_TEST
+
+START_TEST (test_admission_priority_order) {
+    admission_t *adm = make_admission(8);
+    admission_ticket_t ticket;
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_NORMAL, NULL, &ticket), ADMISSION_ADMITTED);
+
+    atomic_init(&grant_order, 0);
+    waiter_arg_t low = { .adm = adm, .priority = ADMISSION_PRIORITY_LOW };
+    waiter_arg_t high = { .adm = adm, .priority = ADMISSION_PRIORITY_HIGH };
+    pthread_t t_low, t_high;
+    pthread_create(&t_low, NULL, wait_for_slot, &low);
+    wait_queued(1);
+    pthread_create(&t_high, NULL, wait_for_slot, &high);
+    wait_queued(2);
+
+    admission_leave(adm, &ticket);
+    pthread_join(t_low, NULL);
+    pthread_join(t_high, NULL);
+
+    ck_assert_int_eq(low.status, ADMISSION_ADMITTED);
+    ck_assert_int_eq(high.status, ADMISSION_ADMITTED);
+    ck_assert_int_lt(high.order, low.order);
+
+    admission_free(adm);
+}
+END_TEST
+
+START_TEST (test_admission_overload_sheds_lower) {
+    admission_t *adm = make_admission(1);
+    admission_ticket_t ticket;
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_NORMAL, NULL, &ticket), ADMISSION_ADMITTED);
+
+    waiter_arg_t low = { .adm = adm, .priority = ADMISSION_PRIORITY_LOW };
+    waiter_arg_t normal = { .adm = adm, .priority = ADMISSION_PRIORITY_NORMAL };
+    pthread_t t_low, t_normal;
+    pthread_create(&t_low, NULL, wait_for_slot, &low);
+    wait_queued(1);
+
+    // the queue is full; a better request pushes out the low one
+    pthread_create(&t_normal, NULL, wait_for_slot, &normal);
+    pthread_join(t_low, NULL);
+    ck_assert_int_eq(low.status, ADMISSION_OVERLOADED);
+    wait_queued(1);
+
+    // nothing worse than low to shed, so it is refused at once
+    admission_ticket_t extra;
+    ck_assert_int_eq(admission_enter(adm, ADMISSION_PRIORITY_LOW, NULL, &extra), ADMISSION_OVERLOADED);
+
+    admission_leave(adm, &ticket);
+    pthread_join(t_normal, NULL);
+    ck_assert_int_eq(normal.status, ADMISSION_ADMITTED);
+
+    admission_free(adm);
+}
+END_TEST
+
+START_TEST (test_login_admission_priority) {
+    time_t now = time(NULL);
+    account_t acc = {0};
+    acc.last_ip = 0x0A000001;
+    acc.last_login_time = now - 60;
+
+    ck_assert_int_eq(login_admission_priority(&acc, 0x0A000001, now), ADMISSION_PRIORITY_HIGH);
+    ck_assert_int_eq(login_admission_priority(&acc, 0x0A000002, now), ADMISSION_PRIORITY_NORMAL);
+
+    acc.last_login_time = now - LOGIN_RECENT_WINDOW_SECS - 1;
+    ck_assert_int_eq(login_admission_priority(&acc, 0x0A000001, now), ADMISSION_PRIORITY_NORMAL);
+
+    acc.login_fail_count = LOGIN_LOW_PRIORITY_FAILS;
+    ck_assert_int_eq(login_admission_priority(&acc, 0x0A000002, now), ADMISSION_PRIORITY_LOW);
+}
+END_TEST
+
+Suite *admission_suite(void) {
+    Suite *s = suite_create("Admission");
+
+    TCase *tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_admission_immediate_and_expired);
+    tcase_add_test(tc_core, test_admission_priority_order);
+    tcase_add_test(tc_core, test_admission_overload_sheds_lower);
+    tcase_add_test(tc_core, test_login_admission_priority);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/audit_log.h"
+#include "../src/login.h"
+#include "check_suites.h"
+#include <check.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define T0 ((time_t)1700000040)     // the start of a 60-second partition
+#define IP_A ((ip4_addr_t)0x0a000001)
+#define IP_B ((ip4_addr_t)0x0a000002)
+
+static void make_dir(char *dir) {
+    strcpy(dir, "/tmp/check-audit-XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(dir));
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[512];
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    if (d) closedir(d);
+    rmdir(dir);
+}
+
+static audit_log_t *open_log(const char *dir) {
+    audit_log_config_t config;
+    audit_log_config_defaults(&config);
+    config.segment_secs = 60;
+    config.block_records = 4;
+    return audit_log_open(dir, &config);
+}
+
+typedef struct {
+    size_t count;
+    audit_event_t last;
+} collected_t;
+
+static bool collect(const audit_event_t *ev, void *arg) {
+    collected_t *c = arg;
+    if (c->count > 0) ck_assert_int_le(c->last.time, ev->time);
+    c->last = *ev;
+    c->count++;
+    return true;
+}
+
+static size_t run_query(const char *dir, const audit_query_t *q, audit_query_stats_t *stats) {
+    collected_t c = {0};
+    ck_assert(audit_query(dir, q, collect, &c, stats));
+    ck_assert_uint_eq(stats->matches, c.count);
+    return c.count;
+}
+
+static audit_query_t all_time(void) {
+    return (audit_query_t){ .from = 0, .until = T0 * 2 };
+}
+
+START_TEST (test_segments_and_indexes) {
+    char dir[64];
+    make_dir(dir);
+    audit_log_t *log = open_log(dir);
+    ck_assert_ptr_nonnull(log);
+
+    // three partitions: alice, bob and one zoe in the first, bob alone in
+    // the second, carol from another IP in the third
+    for (int i = 0; i < 20; i++) {
+        const char *userid = i == 13 ? "zoe" : i % 2 ? "alice" : "bob";
+        ck_assert(audit_log_append(log, T0 + i, IP_A, userid, LOGIN_SUCCESS));
+    }
+    for (int i = 0; i < 20; i++) {
+        ck_assert(audit_log_append(log, T0 + 60 + i, IP_A, "bob", LOGIN_FAIL_BAD_PASSWORD));
+    }
+    ck_assert(audit_log_append(log, T0 + 120, IP_B, "carol", LOGIN_FAIL_ACCOUNT_BANNED));
+    audit_log_close(log);
+
+    audit_query_stats_t stats;
+    audit_query_t q = all_time();
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 41);
+    ck_assert_uint_eq(stats.segments, 3);
+
+    // alice is only in the first segment; the others are ruled out by their filters
+    q.userid = "alice";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 9);
+    ck_assert_uint_eq(stats.segments_read, 1);
+
+    // and zoe only in the fourth block of 4 records
+    q.userid = "zoe";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 1);
+    ck_assert_uint_eq(stats.segments_read, 1);
+    ck_assert_uint_eq(stats.blocks_read, 1);
+
+    q.userid = "bob";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 30);
+    ck_assert_uint_eq(stats.segments_read, 2);
+
+    q.userid = "nobody";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 0);
+    ck_assert_uint_eq(stats.segments_read, 0);
+
+    q = all_time();
+    q.match_ip = true;
+    q.client_ip = IP_B;
+    collected_t c = {0};
+    ck_assert(audit_query(dir, &q, collect, &c, &stats));
+    ck_assert_uint_eq(c.count, 1);
+    ck_assert_str_eq(c.last.userid, "carol");
+    ck_assert_int_eq(c.last.result, LOGIN_FAIL_ACCOUNT_BANNED);
+    ck_assert_int_eq(c.last.time, T0 + 120);
+    ck_assert_uint_eq(stats.segments_read, 1);
+
+    // a time range reads one segment, and only the blocks of 4 records it overlaps
+    q = (audit_query_t){ .from = T0 + 65, .until = T0 + 70 };
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 5);
+    ck_assert_uint_eq(stats.segments_read, 1);
+    ck_assert_uint_eq(stats.blocks_read, 2);
+
+    remove_dir(dir);
+}
+END_TEST
+
+static bool stop_after_one(const audit_event_t *ev, void *arg) {
+    (void)ev;
+    (*(size_t *)arg)++;
+    return false;
+}
+
+START_TEST (test_active_segment_and_limits) {
+    char dir[64];
+    make_dir(dir);
+    audit_log_t *log = open_log(dir);
+
+    char long_userid[USER_ID_LENGTH + 20];
+    memset(long_userid, 'x', sizeof long_userid - 1);
+    long_userid[sizeof long_userid - 1] = '\0';
+    ck_assert(audit_log_append(log, T0, IP_A, long_userid, LOGIN_SUCCESS));
+    ck_assert(audit_log_append(log, T0 + 1, IP_A, "dave", LOGIN_SUCCESS));
+
+    // the active segment has no index yet but is still searched once flushed
+    ck_assert(audit_log_flush(log));
+    audit_query_stats_t stats;
+    audit_query_t q = all_time();
+    collected_t c = {0};
+    ck_assert(audit_query(dir, &q, collect, &c, &stats));
+    ck_assert_uint_eq(c.count, 2);
+    ck_assert_str_eq(c.last.userid, "dave");
+
+    long_userid[USER_ID_LENGTH] = '\0';
+    q.userid = long_userid;
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 1);
+
+    // the visitor can stop the query
+    size_t visited = 0;
+    q.userid = NULL;
+    ck_assert(audit_query(dir, &q, stop_after_one, &visited, NULL));
+    ck_assert_uint_eq(visited, 1);
+
+    audit_log_close(log);
+    ck_assert(!audit_query("/nonexistent/audit", &q, collect, &c, NULL));
+    remove_dir(dir);
+}
+END_TEST
+
+START_TEST (test_buffer_flushed_in_time) {
+    char dir[64], path[128];
+    make_dir(dir);
+    audit_log_config_t config;
+    audit_log_config_defaults(&config);
+    config.segment_secs = 60;
+    config.flush_ms = 20;
+    audit_log_t *log = audit_log_open(dir, &config);
+    ck_assert_ptr_nonnull(log);
+
+    // another process sees events once they've been buffered for flush_ms,
+    // without a flush or a full buffer
+    for (int i = 0; i < 3; i++) ck_assert(audit_log_append(log, T0 + i, IP_A, "gina", LOGIN_SUCCESS));
+    audit_query_stats_t stats;
+    audit_query_t q = all_time();
+    struct timespec ms = { 0, 1000000 };
+    collected_t c = {0};
+    for (int i = 0; i < 5000 && c.count < 3; i++) {
+        nanosleep(&ms, NULL);
+        c = (collected_t){0};
+        ck_assert(audit_query(dir, &q, collect, &c, &stats));
+    }
+    ck_assert_uint_eq(c.count, 3);
+
+    // sealing writes the index, and the log carries on in a new segment
+    ck_assert(audit_log_append(log, T0 + 3, IP_A, "gina", LOGIN_SUCCESS));
+    ck_assert(audit_log_seal(log));
+    snprintf(path, sizeof path, "%s/audit-%lld-0.idx", dir, (long long)T0);
+    ck_assert_int_eq(access(path, F_OK), 0);
+    ck_assert(audit_log_append(log, T0 + 4, IP_A, "gina", LOGIN_SUCCESS));
+    audit_log_close(log);
+
+    q.userid = "gina";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 5);
+    ck_assert_uint_eq(stats.segments, 2);
+    remove_dir(dir);
+}
+END_TEST
+
+START_TEST (test_unsealed_segment_recovered) {
+    char dir[64], path[128];
+    make_dir(dir);
+    audit_log_t *log = open_log(dir);
+    for (int i = 0; i < 10; i++) ck_assert(audit_log_append(log, T0 + i, IP_A, "erin", LOGIN_SUCCESS));
+    audit_log_close(log);
+
+    // as if the process died mid-write, before sealing the segment
+    snprintf(path, sizeof path, "%s/audit-%lld-0.idx", dir, (long long)T0);
+    ck_assert_int_eq(unlink(path), 0);
+    snprintf(path, sizeof path, "%s/audit-%lld-0.seg", dir, (long long)T0);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(write(fd, "\x01\x02\x03", 3), 3);
+    close(fd);
+
+    // reopening indexes it, dropping the torn record, and appends go to a new segment
+    log = open_log(dir);
+    ck_assert_ptr_nonnull(log);
+    ck_assert(audit_log_append(log, T0 + 10, IP_A, "erin", LOGIN_SUCCESS));
+    audit_log_close(log);
+
+    audit_query_stats_t stats;
+    audit_query_t q = all_time();
+    q.userid = "erin";
+    ck_assert_uint_eq(run_query(dir, &q, &stats), 11);
+    ck_assert_uint_eq(stats.segments, 2);
+    remove_dir(dir);
+}
+END_TEST
+
+START_TEST (test_handle_login_audited) {
+    char dir[64];
+    make_dir(dir);
+    audit_log_t *log = open_log(dir);
+    audit_log_set_default(log);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    ck_assert_int_eq(handle_login("frank-unknown", "pw", IP_B, T0, null_fd, null_fd, &session),
+                     LOGIN_FAIL_USER_NOT_FOUND);
+    close(null_fd);
+
+    // closing the default log clears it
+    audit_log_close(log);
+    ck_assert_ptr_eq(audit_log_get_default(), NULL);
+
+    audit_query_stats_t stats;
+    audit_query_t q = all_time();
+    q.match_ip = true;
+    q.client_ip = IP_B;
+    collected_t c = {0};
+    ck_assert(audit_query(dir, &q, collect, &c, &stats));
+    ck_assert_uint_eq(c.count, 1);
+    ck_assert_str_eq(c.last.userid, "frank-unknown");
+    ck_assert_int_eq(c.last.result, LOGIN_FAIL_USER_NOT_FOUND);
+    remove_dir(dir);
+}
+END_TEST
+
+Suite *audit_log_suite(void) {
+    Suite *s = suite_create("AuditLog");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_segments_and_indexes);
+    tcase_add_test(tc, test_active_segment_and_limits);
+    tcase_add_test(tc, test_buffer_flushed_in_time);
+    tcase_add_test(tc, test_unsealed_segment_recovered);
+    tcase_add_test(tc, test_handle_login_audited);
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,312 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/cluster.h"
+#include "../src/hash_ring.h"
+#include "../src/wire.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_KEYS 10000
+
+START_TEST (test_ring_balance_and_movement) {
+    hash_ring_t *ring = hash_ring_create(HASH_RING_DEFAULT_VNODES);
+    ck_assert(hash_ring_add(ring, "node-a"));
+    ck_assert(hash_ring_add(ring, "node-b"));
+    ck_assert(hash_ring_add(ring, "node-c"));
+    ck_assert(!hash_ring_add(ring, "node-b"));
+    ck_assert_uint_eq(hash_ring_node_count(ring), 3);
+
+    // owners by letter; the names returned by hash_ring_owner() move when nodes are added
+    static char before[RING_KEYS];
+    size_t per_node[3] = {0};
+    char userid[32];
+    for (int i = 0; i < RING_KEYS; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        before[i] = hash_ring_owner(ring, userid)[5];
+        per_node[before[i] - 'a']++;
+    }
+    // each node should own roughly a third of the keys
+    for (int n = 0; n < 3; n++) {
+        ck_assert_uint_gt(per_node[n], RING_KEYS / 5);
+        ck_assert_uint_lt(per_node[n], RING_KEYS / 2);
+    }
+
+    // adding a node only moves keys onto the new node
+    ck_assert(hash_ring_add(ring, "node-d"));
+    size_t moved = 0;
+    for (int i = 0; i < RING_KEYS; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        const char *owner = hash_ring_owner(ring, userid);
+        if (owner[5] != before[i]) {
+            ck_assert_str_eq(owner, "node-d");
+            moved++;
+        }
+        ck_assert_int_eq(hash_ring_owner_without(ring, userid, "node-d")[5], before[i]);
+    }
+    ck_assert_uint_gt(moved, RING_KEYS / 8);
+    ck_assert_uint_lt(moved, RING_KEYS / 3);
+
+    // removing it again restores the original owners
+    ck_assert(hash_ring_remove(ring, "node-d"));
+    ck_assert(!hash_ring_contains(ring, "node-d"));
+    for (int i = 0; i < RING_KEYS; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert_int_eq(hash_ring_owner(ring, userid)[5], before[i]);
+    }
+
+    hash_ring_free(ring);
+}
+END_TEST
+
+START_TEST (test_wire_round_trip) {
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    wire_writer_t w;
+    wire_writer_init(&w);
+    wire_put_u8(&w, 7);
+    wire_put_u32(&w, 0xdeadbeef);
+    wire_put_i64(&w, -42);
+    wire_put_str(&w, "hello", 100);
+    ck_assert(wire_send(sv[0], 9, &w));
+
+    uint8_t type, buf[WIRE_MAX_FRAME];
+    size_t len;
+    ck_assert(wire_recv(sv[1], &type, buf, sizeof buf, &len));
+    ck_assert_uint_eq(type, 9);
+
+    wire_reader_t r;
+    char str[8];
+    wire_reader_init(&r, buf, len);
+    ck_assert_uint_eq(wire_get_u8(&r), 7);
+    ck_assert_uint_eq(wire_get_u32(&r), 0xdeadbeef);
+    ck_assert_int_eq(wire_get_i64(&r), -42);
+    wire_get_str(&r, str, sizeof str);
+    ck_assert_str_eq(str, "hello");
+    ck_assert(wire_reader_done(&r));
+
+    // reading past the end is an error, not a crash
+    wire_get_u32(&r);
+    ck_assert(r.error);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+END_TEST
+
+typedef struct {
+    int fd;
+    account_store_t *store;
+} node_arg_t;
+
+static void *serve_node(void *p) {
+    node_arg_t *arg = p;
+    cluster_node_serve(arg->fd, arg->store, -1);
+    return NULL;
+}
+
+START_TEST (test_node_account_calls) {
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    node_arg_t arg = { .fd = sv[1], .store = account_store_create(0) };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, serve_node, &arg), 0);
+
+    account_t acc = make_account("alice", 5), out;
+    bool found;
+    ck_assert(cluster_put_account(sv[0], &acc));
+    ck_assert(cluster_get_account(sv[0], "alice", &out, &found));
+    ck_assert(found);
+    ck_assert_int_eq(out.account_id, 5);
+    ck_assert_str_eq(out.email, "alice@example.com");
+
+    ck_assert(cluster_drop_account(sv[0], "alice"));
+    ck_assert(cluster_get_account(sv[0], "alice", &out, &found));
+    ck_assert(!found);
+
+    // nodes don't accept membership changes
+    ck_assert(!cluster_node_join(sv[0], "unix:/nowhere"));
+
+    close(sv[0]);
+    pthread_join(thread, NULL);
+    close(sv[1]);
+    account_store_free(arg.store);
+}
+END_TEST
+
+typedef struct {
+    int listen_fd;
+    account_store_t *store;
+} listener_arg_t;
+
+static atomic_int live_connections;
+
+static void *serve_accepted(void *p) {
+    node_arg_t *arg = p;
+    cluster_node_serve(arg->fd, arg->store, -1);
+    close(arg->fd);
+    free(arg);
+    atomic_fetch_sub(&live_connections, 1);
+    return NULL;
+}
+
+// accept node connections until the listening socket is shut down
+static void *accept_nodes(void *p) {
+    listener_arg_t *arg = p;
+    int fd;
+    while ((fd = accept(arg->listen_fd, NULL, NULL)) >= 0) {
+        node_arg_t *conn = malloc(sizeof *conn);
+        *conn = (node_arg_t){ .fd = fd, .store = arg->store };
+        atomic_fetch_add(&live_connections, 1);
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_accepted, conn);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static bool count_listed(const account_t *acc, void *arg) {
+    (void)acc;
+    (*(size_t *)arg)++;
+    return true;
+}
+
+static size_t node_account_count(const char *addr) {
+    size_t n = 0;
+    int fd = wire_connect(addr);
+    ck_assert_int_ge(fd, 0);
+    ck_assert(cluster_list_accounts(fd, count_listed, &n));
+    close(fd);
+    return n;
+}
+
+START_TEST (test_router_join_leave) {
+    char dir[] = "/tmp/check_cluster_XXXXXX";
+    ck_assert_ptr_ne(mkdtemp(dir), NULL);
+
+    char addrs[3][64];
+    listener_arg_t nodes[3];
+    pthread_t acceptors[3];
+    for (int i = 0; i < 3; i++) {
+        snprintf(addrs[i], sizeof addrs[i], "unix:%s/node%d.sock", dir, i);
+        nodes[i].store = account_store_create(0);
+        nodes[i].listen_fd = wire_listen(addrs[i]);
+        ck_assert_int_ge(nodes[i].listen_fd, 0);
+        ck_assert_int_eq(pthread_create(&acceptors[i], NULL, accept_nodes, &nodes[i]), 0);
+    }
+
+    const char *first[] = { addrs[0] };
+    cluster_router_t *router = cluster_router_create(first, 1, HASH_RING_DEFAULT_VNODES);
+    ck_assert_ptr_ne(router, NULL);
+
+    for (int i = 0; i < 200; i++) {
+        char userid[32];
+        snprintf(userid, sizeof userid, "user-%d", i);
+        account_t acc = make_account(userid, i);
+        ck_assert(account_store_put(nodes[0].store, &acc));
+    }
+
+    // joining moves part of the accounts to the new node
+    ck_assert(cluster_router_join(router, addrs[1]));
+    ck_assert(!cluster_router_join(router, addrs[1]));
+    size_t on_new = node_account_count(addrs[1]);
+    ck_assert_uint_gt(on_new, 0);
+    ck_assert_uint_eq(node_account_count(addrs[0]) + on_new, 200);
+
+    // every account is reachable through the router
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    for (int i = 0; i < 200; i++) {
+        char userid[32];
+        snprintf(userid, sizeof userid, "user-%d", i);
+        wire_writer_t w;
+        wire_writer_init(&w);
+        wire_put_str(&w, userid, sizeof userid);
+        ck_assert(wire_send(sv[0], CLUSTER_MSG_GET_ACCOUNT, &w));
+    }
+    shutdown(sv[0], SHUT_WR);
+    cluster_router_serve(router, sv[1]);
+    for (int i = 0; i < 200; i++) {
+        uint8_t type, buf[WIRE_MAX_FRAME];
+        size_t len;
+        ck_assert(wire_recv(sv[0], &type, buf, sizeof buf, &len));
+        ck_assert_uint_eq(type, CLUSTER_MSG_ACCOUNT);
+    }
+    close(sv[0]);
+    close(sv[1]);
+
+    // A stale copy on node 1 (e.g. from a drop that failed during an
+    // earlier move) of an account node 0 owns and has since changed, and
+    // which node 2 will own once it joins.
+    hash_ring_t *ring = hash_ring_create(HASH_RING_DEFAULT_VNODES);
+    ck_assert(hash_ring_add(ring, addrs[0]));
+    ck_assert(hash_ring_add(ring, addrs[1]));
+    ck_assert(hash_ring_add(ring, addrs[2]));
+    char stale_userid[32] = "";
+    for (int i = 0; i < 200 && !stale_userid[0]; i++) {
+        char userid[32];
+        account_t acc;
+        snprintf(userid, sizeof userid, "user-%d", i);
+        if (strcmp(hash_ring_owner(ring, userid), addrs[2]) == 0 &&
+            account_store_get(nodes[0].store, userid, &acc)) {
+            ck_assert(account_store_put(nodes[1].store, &acc));
+            acc.login_count = 42;
+            ck_assert(account_store_put(nodes[0].store, &acc));
+            memcpy(stale_userid, userid, sizeof userid);
+        }
+    }
+    hash_ring_free(ring);
+    ck_assert(stale_userid[0]);
+
+    // joining moves the live record, not the stale copy
+    ck_assert(cluster_router_join(router, addrs[2]));
+    account_t live;
+    ck_assert(account_store_get(nodes[2].store, stale_userid, &live));
+    ck_assert_uint_eq(live.login_count, 42);
+    ck_assert(!account_store_get(nodes[0].store, stale_userid, &live));
+
+    // node 1 still holds the stale copy, and leaving moves back what it
+    // owned, not that; the last node can't leave
+    ck_assert(cluster_router_leave(router, addrs[1]));
+    ck_assert(cluster_router_leave(router, addrs[0]));
+    ck_assert(!cluster_router_leave(router, addrs[2]));
+    ck_assert_uint_eq(node_account_count(addrs[0]), 0);
+    ck_assert_uint_eq(node_account_count(addrs[1]), 0);
+    ck_assert_uint_eq(node_account_count(addrs[2]), 200);
+    ck_assert(account_store_get(nodes[2].store, stale_userid, &live));
+    ck_assert_uint_eq(live.login_count, 42);
+
+    cluster_router_free(router);
+    for (int i = 0; i < 3; i++) {
+        shutdown(nodes[i].listen_fd, SHUT_RDWR);
+        pthread_join(acceptors[i], NULL);
+        close(nodes[i].listen_fd);
+        unlink(addrs[i] + strlen("unix:"));
+    }
+    rmdir(dir);
+
+    // the router closed its pooled connections; wait for the nodes to notice
+    struct timespec ms = { 0, 1000000 };
+    while (atomic_load(&live_connections) > 0) nanosleep(&ms, NULL);
+    for (int i = 0; i < 3; i++) account_store_free(nodes[i].store);
+}
+END_TEST
+
+Suite *cluster_suite(void) {
+    Suite *s = suite_create("Cluster");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_ring_balance_and_movement);
+    tcase_add_test(tc, test_wire_round_trip);
+    tcase_add_test(tc, test_node_account_calls);
+    tcase_add_test(tc, test_router_join_leave);
+    suite_add_tcase(s, tc);
+    return s;
+}
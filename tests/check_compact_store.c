@@ -0,0 +1,196 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/compact_store.h"
+#include "../src/db.h"
+#include "check_suites.h"
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MANY 20000
+#define BCRYPT_HASH "$2b$05$abcdefghijklmnopqrstuuVTC0m4V7nvx0OhMk4ucqpp6c9UFv86e"
+
+static account_t shaped_account(const char *userid, const char *email, const char *hash,
+                                const char *birthdate) {
+    account_t acc = make_account(userid, 0);
+    memset(acc.email, 0, sizeof acc.email);
+    strncpy(acc.email, email, EMAIL_LENGTH);
+    memset(acc.password_hash, 0, sizeof acc.password_hash);
+    strncpy(acc.password_hash, hash, HASH_LENGTH - 1);
+    memset(acc.birthdate, 0, sizeof acc.birthdate);
+    memcpy(acc.birthdate, birthdate, strnlen(birthdate, BIRTHDATE_LENGTH));
+    return acc;
+}
+
+static void assert_same(const account_t *a, const account_t *b) {
+    ck_assert_int_eq(a->account_id, b->account_id);
+    ck_assert_mem_eq(a->userid, b->userid, USER_ID_LENGTH);
+    ck_assert_mem_eq(a->password_hash, b->password_hash, HASH_LENGTH);
+    ck_assert_mem_eq(a->email, b->email, EMAIL_LENGTH);
+    ck_assert_int_eq(a->unban_time, b->unban_time);
+    ck_assert_int_eq(a->expiration_time, b->expiration_time);
+    ck_assert_uint_eq(a->login_count, b->login_count);
+    ck_assert_uint_eq(a->login_fail_count, b->login_fail_count);
+    ck_assert_int_eq(a->last_login_time, b->last_login_time);
+    ck_assert_uint_eq(a->last_ip, b->last_ip);
+    ck_assert_mem_eq(a->birthdate, b->birthdate, BIRTHDATE_LENGTH);
+}
+
+static void assert_round_trip(compact_store_t *store, const account_t *acc) {
+    account_t out;
+    ck_assert(compact_store_put(store, acc));
+    char userid[USER_ID_LENGTH + 1] = {0};
+    memcpy(userid, acc->userid, USER_ID_LENGTH);
+    ck_assert(compact_store_get(store, userid, &out));
+    assert_same(acc, &out);
+}
+
+START_TEST (test_compact_round_trip) {
+    compact_store_t *store = compact_store_create(0);
+    ck_assert_ptr_nonnull(store);
+
+    // a real hash from account_create()
+    account_t *created = account_create("created", "pw", "created@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(created);
+    created->account_id = 42;
+    created->unban_time = -5;
+    created->expiration_time = (time_t)1 << 40;
+    created->login_count = 7;
+    created->login_fail_count = 3;
+    created->last_login_time = 1700000000;
+    created->last_ip = 0xc0a80001;
+    assert_round_trip(store, created);
+    account_free(created);
+
+    account_t acc = shaped_account("sha", "x@y.org", "$6$rounds=1000$saltsalt$abc./XYZ019", "2001-12-31");
+    assert_round_trip(store, &acc);
+    acc = shaped_account("bcrypt", "a@b@c", BCRYPT_HASH, "0000-00-00");
+    assert_round_trip(store, &acc);
+
+    // shapes that don't pack are kept as they are
+    acc = shaped_account("odd", "no-at-sign", "*", "not a date");
+    assert_round_trip(store, &acc);
+    acc = shaped_account("odder", "trailing@", "$1$sa-lt$hash", "1990/01/01");
+    assert_round_trip(store, &acc);
+    acc = shaped_account("empty", "", "", "");
+    assert_round_trip(store, &acc);
+
+    // fields that fill their whole buffer, with no terminator
+    memset(acc.userid, 'u', USER_ID_LENGTH);
+    memset(acc.email, 'e', EMAIL_LENGTH);
+    acc.email[40] = '@';
+    assert_round_trip(store, &acc);
+
+    ck_assert_uint_eq(compact_store_count(store), 7);
+    account_t out;
+    ck_assert(!compact_store_get(store, "nobody", &out));
+    compact_store_free(store);
+}
+END_TEST
+
+static bool bump_logins(account_t *acc, void *arg) {
+    (void)arg;
+    acc->login_count++;
+    strcpy(acc->userid, "renamed");     // ignored
+    return true;
+}
+
+static bool count_visit(const account_t *acc, void *arg) {
+    (void)acc;
+    (*(size_t *)arg)++;
+    return true;
+}
+
+START_TEST (test_compact_update_remove_compact) {
+    compact_store_t *store = compact_store_create(16);
+    char userid[32], email[64];
+    for (int i = 0; i < MANY; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        snprintf(email, sizeof email, "user.%d@domain%d.example.com", i, i % 10);
+        account_t acc = shaped_account(userid, email, BCRYPT_HASH, "1985-06-15");
+        acc.account_id = i;
+        ck_assert(compact_store_put(store, &acc));
+    }
+    ck_assert_uint_eq(compact_store_count(store), MANY);
+    size_t memory = compact_store_memory(store);
+
+    // rewriting every record several times leaves garbage behind, which
+    // compaction reclaims
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < MANY; i++) {
+            snprintf(userid, sizeof userid, "user-%d", i);
+            ck_assert(compact_store_update(store, userid, bump_logins, NULL));
+        }
+    }
+    ck_assert_uint_le(compact_store_memory(store), memory + ((size_t)8 << 20));
+
+    for (int i = 0; i < MANY; i += 2) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert(compact_store_remove(store, userid));
+    }
+    ck_assert(!compact_store_remove(store, "user-0"));
+    ck_assert_uint_eq(compact_store_count(store), MANY / 2);
+
+    account_t out;
+    ck_assert(!compact_store_get(store, "renamed", &out));
+    ck_assert(!compact_store_get(store, "user-10", &out));
+    ck_assert(compact_store_get(store, "user-11", &out));
+    ck_assert_int_eq(out.account_id, 11);
+    ck_assert_uint_eq(out.login_count, 4);
+    ck_assert_str_eq(out.email, "user.11@domain1.example.com");
+    ck_assert_str_eq(out.password_hash, BCRYPT_HASH);
+
+    size_t visited = 0;
+    compact_store_foreach(store, count_visit, &visited);
+    ck_assert_uint_eq(visited, MANY / 2);
+    compact_store_free(store);
+}
+END_TEST
+
+START_TEST (test_compact_is_compact) {
+    compact_store_t *store = compact_store_create(MANY);
+    char userid[32], email[64];
+    for (int i = 0; i < MANY; i++) {
+        snprintf(userid, sizeof userid, "user%d", i);
+        snprintf(email, sizeof email, "user%d@example.com", i);
+        account_t acc = shaped_account(userid, email,
+            "$y$jBT$.Jtl0CXmqMb5dO5ujCs1H/$Ja3J9XfSAFKMBkSA4wM0mz.e7ZzL8fMdqOn3gTxLp5B", "1990-01-01");
+        acc.account_id = i;
+        ck_assert(compact_store_put(store, &acc));
+    }
+    // under a third of an account_t each, counting the index
+    ck_assert_uint_lt(compact_store_memory(store) / MANY, sizeof(account_t) / 3);
+    compact_store_free(store);
+}
+END_TEST
+
+START_TEST (test_compact_default_lookup) {
+    compact_store_t *store = compact_store_create(1);
+    account_t acc = shaped_account("dave", "dave@example.com", "*", "1990-01-01");
+    acc.account_id = 9;
+    compact_store_put(store, &acc);
+
+    account_t out;
+    ck_assert(!account_lookup_by_userid("dave", &out));
+    compact_store_set_default(store);
+    ck_assert(account_lookup_by_userid("dave", &out));
+    ck_assert_int_eq(out.account_id, 9);
+
+    // freeing the default store clears it
+    compact_store_free(store);
+    ck_assert_ptr_eq(compact_store_get_default(), NULL);
+    ck_assert(!account_lookup_by_userid("dave", &out));
+}
+END_TEST
+
+Suite *compact_store_suite(void) {
+    Suite *s = suite_create("CompactStore");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_compact_round_trip);
+    tcase_add_test(tc, test_compact_update_remove_compact);
+    tcase_add_test(tc, test_compact_is_compact);
+    tcase_add_test(tc, test_compact_default_lookup);
+    suite_add_tcase(s, tc);
+    return s;
+}
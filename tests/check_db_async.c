@@ -0,0 +1,407 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/account_store.h"
+#include "../src/db_async.h"
+#include "../src/login_async.h"
+#include "../src/sha512_crypt.h"
+#include "../src/stats.h"
+#include "../src/wire.h"
+#include "check_suites.h"
+#include <check.h>
+#include <crypt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LATENCY_NS 50000000u      // 50ms
+#define STORED_ACCOUNTS 100
+#define PASSWORD "db-async-password"
+
+typedef struct {
+    int fd;
+    account_store_t *store;
+    uint64_t latency_ns;
+    pthread_t thread;
+} server_t;
+
+static void *run_server(void *p) {
+    server_t *s = p;
+    db_server_serve(s->fd, s->store, s->latency_ns);
+    close(s->fd);
+    return NULL;
+}
+
+// serve `store` on one end of a socketpair; returns a client on the other
+static db_async_t *start_server(server_t *s, account_store_t *store, uint64_t latency_ns) {
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    *s = (server_t){ .fd = sv[0], .store = store, .latency_ns = latency_ns };
+    ck_assert_int_eq(pthread_create(&s->thread, NULL, run_server, s), 0);
+    db_async_t *db = db_async_open(sv[1]);
+    ck_assert_ptr_nonnull(db);
+    return db;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000u + (uint64_t)now.tv_nsec -
+           (uint64_t)start->tv_nsec;
+}
+
+// accounts user-0 ... user-(n-1), sharing one password hash
+static account_store_t *make_store(size_t n) {
+    account_store_t *store = account_store_create(n);
+    ck_assert_ptr_nonnull(store);
+    account_t tmpl = {0};
+    ck_assert(account_update_password(&tmpl, PASSWORD));
+    for (size_t i = 0; i < n; i++) {
+        account_t acc = tmpl;
+        snprintf(acc.userid, sizeof acc.userid, "user-%zu", i);
+        acc.account_id = (int64_t)i + 1;
+        ck_assert(account_store_put(store, &acc));
+    }
+    return store;
+}
+
+typedef struct {
+    db_lookup_status_t status;
+    int64_t account_id;
+} lookup_result_t;
+
+static atomic_size_t completed;
+
+static void record_lookup(void *arg, db_lookup_status_t status, const account_t *acc) {
+    lookup_result_t *res = arg;
+    res->status = status;
+    res->account_id = acc ? acc->account_id : 0;
+    atomic_fetch_add(&completed, 1);
+}
+
+static void wait_completed(size_t n) {
+    struct timespec ms = { 0, 1000000 };
+    for (int i = 0; i < 5000 && atomic_load(&completed) < n; i++) nanosleep(&ms, NULL);
+    ck_assert_uint_eq(atomic_load(&completed), n);
+}
+
+START_TEST (test_multi_get_one_round_trip) {
+    account_store_t *store = make_store(STORED_ACCOUNTS);
+    server_t server;
+    db_async_t *db = start_server(&server, store, LATENCY_NS);
+
+    // more keys than fit in one request frame, some of them unknown
+    enum { KEYS = STORED_ACCOUNTS + 50 };
+    static char names[KEYS][32];
+    static const char *userids[KEYS];
+    static lookup_result_t results[KEYS];
+    static void *args[KEYS];
+    for (size_t i = 0; i < KEYS; i++) {
+        snprintf(names[i], sizeof names[i], "user-%zu", i);
+        userids[i] = names[i];
+        args[i] = &results[i];
+    }
+
+    uint64_t trips_before = 0, trips_after = 0;
+    stats_get("db_async.round_trips", &trips_before);
+    atomic_store(&completed, 0);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    db_async_multi_get(db, userids, KEYS, record_lookup, args);
+    wait_completed(KEYS);
+    uint64_t took = elapsed_ns(&start);
+
+    // one latency for the lot, not one per key
+    ck_assert_uint_ge(took, LATENCY_NS);
+    ck_assert_uint_lt(took, 3 * LATENCY_NS);
+    stats_get("db_async.round_trips", &trips_after);
+    ck_assert_uint_eq(trips_after - trips_before, 1);
+
+    for (size_t i = 0; i < KEYS; i++) {
+        if (i < STORED_ACCOUNTS) {
+            ck_assert_int_eq(results[i].status, DB_LOOKUP_FOUND);
+            ck_assert_int_eq(results[i].account_id, (int64_t)i + 1);
+        } else {
+            ck_assert_int_eq(results[i].status, DB_LOOKUP_NOT_FOUND);
+        }
+    }
+
+    db_async_close(db);
+    pthread_join(server.thread, NULL);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_close_fails_pending) {
+    account_store_t *store = make_store(1);
+    server_t server;
+    db_async_t *db = start_server(&server, store, 10 * LATENCY_NS);
+
+    lookup_result_t result = { .status = DB_LOOKUP_FOUND };
+    atomic_store(&completed, 0);
+    db_async_lookup(db, "user-0", record_lookup, &result);
+    db_async_close(db);
+    ck_assert_uint_eq(atomic_load(&completed), 1);
+    ck_assert_int_eq(result.status, DB_LOOKUP_ERROR);
+
+    pthread_join(server.thread, NULL);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_long_userid_not_found) {
+    account_store_t *store = make_store(3);
+    server_t server;
+    db_async_t *db = start_server(&server, store, 0);
+
+    // too long for any account, mixed in with real ones
+    char exact[USER_ID_LENGTH + 1], longer[2 * USER_ID_LENGTH];
+    memset(exact, 'x', USER_ID_LENGTH);
+    exact[USER_ID_LENGTH] = '\0';
+    memset(longer, 'y', sizeof longer - 1);
+    longer[sizeof longer - 1] = '\0';
+    const char *userids[] = { "user-0", exact, "user-1", longer };
+    lookup_result_t results[4];
+    void *args[] = { &results[0], &results[1], &results[2], &results[3] };
+    atomic_store(&completed, 0);
+    db_async_multi_get(db, userids, 4, record_lookup, args);
+    wait_completed(4);
+    ck_assert_int_eq(results[0].status, DB_LOOKUP_FOUND);
+    ck_assert_int_eq(results[1].status, DB_LOOKUP_NOT_FOUND);
+    ck_assert_int_eq(results[2].status, DB_LOOKUP_FOUND);
+    ck_assert_int_eq(results[3].status, DB_LOOKUP_NOT_FOUND);
+
+    // the connection still works
+    atomic_store(&completed, 0);
+    db_async_lookup(db, "user-2", record_lookup, &results[0]);
+    wait_completed(1);
+    ck_assert_int_eq(results[0].status, DB_LOOKUP_FOUND);
+    ck_assert_int_eq(results[0].account_id, 3);
+    db_async_close(db);
+    pthread_join(server.thread, NULL);
+
+    // the server answers a long userid sent by another client, and
+    // carries on with the rest of the request
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    server = (server_t){ .fd = sv[0], .store = store };
+    ck_assert_int_eq(pthread_create(&server.thread, NULL, run_server, &server), 0);
+    wire_writer_t w;
+    wire_writer_init(&w);
+    wire_put_u32(&w, 7);
+    wire_put_u32(&w, 0);
+    wire_put_u32(&w, 2);
+    wire_put_str(&w, exact, USER_ID_LENGTH);
+    wire_put_str(&w, "user-0", USER_ID_LENGTH);
+    ck_assert(wire_send(sv[1], DB_MSG_LOOKUP, &w));
+    for (uint32_t i = 0; i < 2; i++) {
+        uint8_t buf[WIRE_MAX_FRAME], type;
+        size_t len;
+        ck_assert(wire_recv(sv[1], &type, buf, sizeof buf, &len));
+        wire_reader_t r;
+        wire_reader_init(&r, buf, len);
+        ck_assert_int_eq(type, DB_MSG_RESULT);
+        ck_assert_uint_eq(wire_get_u32(&r), 7);
+        ck_assert_uint_eq(wire_get_u32(&r), i);
+        ck_assert_uint_eq(wire_get_u8(&r), i == 1);
+    }
+    close(sv[1]);
+    pthread_join(server.thread, NULL);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_login_machine_steps) {
+    int fd = open("/dev/null", O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    login_session_data_t session;
+    login_machine_t m;
+
+    login_machine_init(&m, "nobody", "pw", 0, time(NULL), fd, fd, &session);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_LOOKUP);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_LOOKUP);    // still waiting
+    login_machine_account(&m, DB_LOOKUP_NOT_FOUND, NULL);
+    ck_assert_int_eq(m.state, LOGIN_STATE_VERIFY);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_DONE);
+    ck_assert_int_eq(m.result, LOGIN_FAIL_USER_NOT_FOUND);
+
+    login_machine_init(&m, "nobody", "pw", 0, time(NULL), fd, fd, &session);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_LOOKUP);
+    login_machine_account(&m, DB_LOOKUP_ERROR, NULL);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_DONE);
+    ck_assert_int_eq(m.result, LOGIN_FAIL_INTERNAL_ERROR);
+
+    account_t acc = {0};
+    strcpy(acc.userid, "someone");
+    acc.account_id = 7;
+    ck_assert(account_update_password(&acc, PASSWORD));
+    login_machine_init(&m, "someone", PASSWORD, 0, time(NULL), fd, fd, &session);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_LOOKUP);
+    login_machine_account(&m, DB_LOOKUP_FOUND, &acc);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_DONE);
+    ck_assert_int_eq(m.result, LOGIN_SUCCESS);
+    ck_assert_int_eq(session.account_id, 7);
+
+    // with batch_hash, the caller checks the password
+    login_machine_init(&m, "someone", PASSWORD, 0, time(NULL), fd, fd, &session);
+    m.batch_hash = true;
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_LOOKUP);
+    login_machine_account(&m, DB_LOOKUP_FOUND, &acc);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_HASH);
+    login_machine_password(&m, false);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_DONE);
+    ck_assert_int_eq(m.result, LOGIN_FAIL_BAD_PASSWORD);
+
+    // missing input ends the login before any lookup
+    login_machine_init(&m, "someone", NULL, 0, time(NULL), fd, fd, &session);
+    ck_assert_int_eq(login_machine_run(&m), LOGIN_STATE_DONE);
+    ck_assert_int_eq(m.result, LOGIN_FAIL_INTERNAL_ERROR);
+    close(fd);
+}
+END_TEST
+
+typedef struct {
+    login_machine_t m;
+    login_session_data_t session;
+    char userid[32];
+    const char *password;
+    login_result_t expected;
+} async_login_t;
+
+static atomic_size_t logins_done;
+
+static void login_finished(login_machine_t *m, void *arg) {
+    (void)m;
+    (void)arg;
+    atomic_fetch_add(&logins_done, 1);
+}
+
+START_TEST (test_login_async) {
+    account_store_t *store = make_store(4);
+    account_t acc;
+    ck_assert(account_store_get(store, "user-2", &acc));
+    acc.unban_time = time(NULL) + 3600;
+    ck_assert(account_store_put(store, &acc));
+    ck_assert(account_store_get(store, "user-3", &acc));
+    acc.expiration_time = time(NULL) - 3600;
+    ck_assert(account_store_put(store, &acc));
+
+    server_t server;
+    db_async_t *db = start_server(&server, store, LATENCY_NS);
+    login_async_t *la = login_async_create(db, 2);
+    ck_assert_ptr_nonnull(la);
+    int fd = open("/dev/null", O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+
+    enum { LOGINS = 24 };
+    static async_login_t logins[LOGINS];
+    static const login_result_t by_kind[] = {
+        LOGIN_SUCCESS, LOGIN_FAIL_BAD_PASSWORD, LOGIN_FAIL_ACCOUNT_BANNED,
+        LOGIN_FAIL_ACCOUNT_EXPIRED, LOGIN_FAIL_USER_NOT_FOUND,
+    };
+    atomic_store(&logins_done, 0);
+    for (int i = 0; i < LOGINS; i++) {
+        async_login_t *l = &logins[i];
+        int kind = i % 5;
+        snprintf(l->userid, sizeof l->userid, "user-%d", kind == 0 || kind == 1 ? 0 : kind);
+        l->password = kind == 1 ? "wrong" : PASSWORD;
+        l->expected = by_kind[kind];
+        login_machine_init(&l->m, l->userid, l->password, 0x7f000001, time(NULL), fd, fd,
+                           &l->session);
+        ck_assert(login_async_submit(la, &l->m, login_finished, l));
+    }
+    login_async_free(la);
+    ck_assert_uint_eq(atomic_load(&logins_done), LOGINS);
+    for (int i = 0; i < LOGINS; i++) {
+        ck_assert_int_eq(logins[i].m.state, LOGIN_STATE_DONE);
+        ck_assert_int_eq(logins[i].m.result, logins[i].expected);
+    }
+
+    close(fd);
+    db_async_close(db);
+    pthread_join(server.thread, NULL);
+    account_store_free(store);
+}
+END_TEST
+
+START_TEST (test_login_async_batches) {
+    // "$6$" accounts, which the driver checks in batches when it can
+    enum { ACCOUNTS = 12, LOGINS = 2 * ACCOUNTS + 2 };
+    account_store_t *store = account_store_create(ACCOUNTS);
+    for (int i = 0; i < ACCOUNTS; i++) {
+        account_t acc = {0};
+        snprintf(acc.userid, sizeof acc.userid, "user-%d", i);
+        acc.account_id = i + 1;
+        char setting[32];
+        snprintf(setting, sizeof setting, "$6$rounds=1000$salt%d", i);
+        struct crypt_data data = {0};
+        char *out = crypt_r(PASSWORD, setting, &data);
+        ck_assert_ptr_nonnull(out);
+        memcpy(acc.password_hash, out, strlen(out));
+        ck_assert(account_store_put(store, &acc));
+    }
+
+    server_t server;
+    db_async_t *db = start_server(&server, store, LATENCY_NS);
+    login_async_t *la = login_async_create(db, 1);
+    ck_assert_ptr_nonnull(la);
+    int fd = open("/dev/null", O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    uint64_t batched_before = 0, batched_after = 0;
+    stats_get("password_batch.batched", &batched_before);
+
+    // every account with the right and a wrong password, after two more of
+    // the first attempt, which share a hash rather than wait on each other
+    static async_login_t logins[LOGINS];
+    atomic_store(&logins_done, 0);
+    for (int i = 0; i < LOGINS; i++) {
+        async_login_t *l = &logins[i];
+        int account = i < 2 ? 0 : (i - 2) / 2;
+        bool right = i < 2 || i % 2 == 0;
+        snprintf(l->userid, sizeof l->userid, "user-%d", account);
+        l->password = right ? PASSWORD : "wrong";
+        l->expected = right ? LOGIN_SUCCESS : LOGIN_FAIL_BAD_PASSWORD;
+        login_machine_init(&l->m, l->userid, l->password, 0x7f000001, time(NULL), fd, fd,
+                           &l->session);
+        ck_assert(login_async_submit(la, &l->m, login_finished, l));
+    }
+    login_async_free(la);
+    ck_assert_uint_eq(atomic_load(&logins_done), LOGINS);
+    for (int i = 0; i < LOGINS; i++) {
+        ck_assert_int_eq(logins[i].m.result, logins[i].expected);
+        if (logins[i].expected == LOGIN_SUCCESS) {
+            ck_assert_int_eq(logins[i].session.account_id, i < 2 ? 1 : (i - 2) / 2 + 1);
+        }
+    }
+
+    // the lookups arrive together, so the checks are batched when the
+    // engine has the lanes for it
+    stats_get("password_batch.batched", &batched_after);
+    if (sha512_crypt_lanes() > 1) ck_assert_uint_gt(batched_after, batched_before);
+    else ck_assert_uint_eq(batched_after, batched_before);
+
+    close(fd);
+    db_async_close(db);
+    pthread_join(server.thread, NULL);
+    account_store_free(store);
+}
+END_TEST
+
+Suite *db_async_suite(void) {
+    Suite *s = suite_create("DB async");
+    TCase *tc = tcase_create("Core");
+    tcase_set_timeout(tc, 30);
+    tcase_add_test(tc, test_multi_get_one_round_trip);
+    tcase_add_test(tc, test_close_fails_pending);
+    tcase_add_test(tc, test_long_userid_not_found);
+    tcase_add_test(tc, test_login_machine_steps);
+    tcase_add_test(tc, test_login_async);
+    tcase_add_test(tc, test_login_async_batches);
+    suite_add_tcase(s, tc);
+    return s;
+}
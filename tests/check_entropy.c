@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/entropy.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SALTS 20000
+
+static uint64_t stat_value(const char *name) {
+    uint64_t v = 0;
+    stats_get(name, &v);
+    return v;
+}
+
+START_TEST (test_chacha20_block) {
+    // RFC 8439 section 2.3.2
+    uint32_t key[8];
+    for (int i = 0; i < 8; i++) {
+        key[i] = (uint32_t)(4 * i) | (uint32_t)(4 * i + 1) << 8 |
+                 (uint32_t)(4 * i + 2) << 16 | (uint32_t)(4 * i + 3) << 24;
+    }
+    const uint32_t input[4] = { 1, 0x09000000, 0x4a000000, 0 };
+    unsigned char out[64];
+    char hex[2 * sizeof out + 1];
+    entropy_chacha20_block(key, input, out);
+    for (size_t i = 0; i < sizeof out; i++) sprintf(hex + 2 * i, "%02x", out[i]);
+    ck_assert_str_eq(hex,
+        "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+        "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e");
+}
+END_TEST
+
+START_TEST (test_salts_without_syscalls) {
+    unsigned char prev[16] = {0}, cur[16];
+    ck_assert(entropy_fill(cur, sizeof cur));
+
+    // 20000 salts is well under the reseed interval: at most one more seed
+    uint64_t reseeds = stat_value("entropy.reseeds");
+    for (int i = 0; i < SALTS; i++) {
+        memcpy(prev, cur, sizeof cur);
+        ck_assert(entropy_fill(cur, sizeof cur));
+        ck_assert_mem_ne(prev, cur, sizeof cur);
+    }
+    ck_assert_uint_le(stat_value("entropy.reseeds") - reseeds, 1);
+}
+END_TEST
+
+START_TEST (test_large_fill) {
+    // spans several refills; no 64-byte block should repeat
+    static unsigned char buf[64 * 64];
+    ck_assert(entropy_fill(buf, sizeof buf));
+    for (size_t i = 0; i < sizeof buf; i += 64) {
+        for (size_t j = i + 64; j < sizeof buf; j += 64) {
+            ck_assert_mem_ne(buf + i, buf + j, 64);
+        }
+    }
+}
+END_TEST
+
+static void *fill_in_thread(void *p) {
+    ck_assert(entropy_fill(p, 32));
+    return NULL;
+}
+
+START_TEST (test_threads_get_own_streams) {
+    unsigned char a[32], b[32];
+    pthread_t t;
+    ck_assert_int_eq(pthread_create(&t, NULL, fill_in_thread, a), 0);
+    pthread_join(t, NULL);
+    ck_assert_int_eq(pthread_create(&t, NULL, fill_in_thread, b), 0);
+    pthread_join(t, NULL);
+    ck_assert_mem_ne(a, b, sizeof a);
+}
+END_TEST
+
+START_TEST (test_fork_reseeds) {
+    // warm the pool so the child inherits a seeded state
+    unsigned char parent[32], child[32];
+    ck_assert(entropy_fill(parent, sizeof parent));
+
+    int fds[2];
+    ck_assert_int_eq(pipe(fds), 0);
+    pid_t pid = fork();
+    ck_assert_int_ge(pid, 0);
+    if (pid == 0) {
+        close(fds[0]);
+        bool ok = entropy_fill(child, sizeof child) &&
+                  write(fds[1], child, sizeof child) == (ssize_t)sizeof child;
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    ck_assert_int_eq(read(fds[0], child, sizeof child), (ssize_t)sizeof child);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // without a reseed the child would return what the parent returns next
+    ck_assert(entropy_fill(parent, sizeof parent));
+    ck_assert_mem_ne(parent, child, sizeof child);
+}
+END_TEST
+
+START_TEST (test_password_salts_differ) {
+    account_t *a = account_create("salt-a", "same password", "a@example.com", "1990-01-01");
+    account_t *b = account_create("salt-b", "same password", "b@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(a);
+    ck_assert_ptr_nonnull(b);
+    ck_assert_str_ne(a->password_hash, b->password_hash);
+    ck_assert(account_validate_password(a, "same password"));
+    ck_assert(account_validate_password(b, "same password"));
+    account_free(a);
+    account_free(b);
+}
+END_TEST
+
+Suite *entropy_suite(void) {
+    Suite *s = suite_create("Entropy");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_chacha20_block);
+    tcase_add_test(tc, test_salts_without_syscalls);
+    tcase_add_test(tc, test_large_fill);
+    tcase_add_test(tc, test_threads_get_own_streams);
+    tcase_add_test(tc, test_fork_reseeds);
+    tcase_add_test(tc, test_password_salts_differ);
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,13 @@
+#include "check_suites.h"
+#include <stdio.h>
+#include <string.h>
+
+account_t make_account(const char *userid, int64_t id) {
+    account_t acc = {0};
+    acc.account_id = id;
+    strncpy(acc.userid, userid, sizeof acc.userid - 1);
+    snprintf(acc.email, sizeof acc.email, "%s@example.com", userid);
+    strcpy(acc.password_hash, "$6$salt$hash");
+    memcpy(acc.birthdate, "2000-01-01", BIRTHDATE_LENGTH);
+    return acc;
+}
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/hash_memory.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define MIB ((size_t)1 << 20)
+#define YESCRYPT_16MIB "$y$j9T$salt$"   // N = 2^12, r = 32
+
+static uint64_t stat_value(const char *name) {
+    uint64_t v = 0;
+    stats_get(name, &v);
+    return v;
+}
+
+// wait (briefly) until a stat reaches n
+static void wait_stat(const char *name, uint64_t n) {
+    struct timespec ms = { 0, 1000000 };
+    for (int i = 0; i < 5000 && stat_value(name) != n; i++) nanosleep(&ms, NULL);
+    ck_assert_uint_eq(stat_value(name), n);
+}
+
+START_TEST (test_cost_from_setting) {
+    ck_assert_uint_eq(hash_memory_cost("$y$j75$salt$hash"), 1 * MIB);
+    ck_assert_uint_eq(hash_memory_cost(YESCRYPT_16MIB), 16 * MIB);
+    ck_assert_uint_eq(hash_memory_cost("$y$jBT$salt$hash"), 64 * MIB);
+    // scrypt: N = 2^15, r = 32, p = 1
+    ck_assert_uint_eq(hash_memory_cost("$7$DU..../....salt$hash"), 128 * MIB + 128 * 32);
+
+    // not memory-hard, or unreadable
+    ck_assert_uint_eq(hash_memory_cost("$6$rounds=1000$salt$hash"), 0);
+    ck_assert_uint_eq(hash_memory_cost("$2b$11$salthash"), 0);
+    ck_assert_uint_eq(hash_memory_cost("$y$j"), 0);
+    ck_assert_uint_eq(hash_memory_cost("$7$DU..."), 0);
+    ck_assert_uint_eq(hash_memory_cost(""), 0);
+}
+END_TEST
+
+START_TEST (test_cost_matches_generated_hash) {
+    account_t *acc = account_create("mem-user", "pw", "mem@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(acc);
+    if (acc->password_hash[1] == 'y' || acc->password_hash[1] == '7') {
+        ck_assert_uint_gt(hash_memory_cost(acc->password_hash), MIB);
+    }
+    ck_assert_uint_eq(stat_value("hash_memory.in_use_bytes"), 0);
+    account_free(acc);
+}
+END_TEST
+
+typedef struct {
+    hash_memory_ticket_t ticket;
+    atomic_bool started;
+} hasher_t;
+
+static void *acquire_in_thread(void *p) {
+    hasher_t *h = p;
+    hash_memory_acquire(YESCRYPT_16MIB, &h->ticket);
+    atomic_store(&h->started, true);
+    return NULL;
+}
+
+START_TEST (test_waits_for_budget) {
+    size_t saved = hash_memory_budget();
+    hash_memory_set_budget(40 * MIB);
+
+    hash_memory_ticket_t a, b;
+    hash_memory_acquire(YESCRYPT_16MIB, &a);
+    hash_memory_acquire(YESCRYPT_16MIB, &b);
+    ck_assert_uint_eq(stat_value("hash_memory.in_use_bytes"), 32 * MIB);
+
+    // a third 16 MiB hash doesn't fit in 40 MiB, so it queues
+    uint64_t waits = stat_value("hash_memory.waits");
+    hasher_t third = {0};
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, acquire_in_thread, &third), 0);
+    wait_stat("hash_memory.queued", 1);
+    ck_assert(!atomic_load(&third.started));
+    ck_assert_uint_eq(stat_value("hash_memory.waits") - waits, 1);
+
+    hash_memory_release(&a);
+    pthread_join(thread, NULL);
+    ck_assert(atomic_load(&third.started));
+    ck_assert_uint_eq(stat_value("hash_memory.queued"), 0);
+    ck_assert_uint_eq(stat_value("hash_memory.in_use_bytes"), 32 * MIB);
+    ck_assert_uint_ge(stat_value("hash_memory.peak_bytes"), 32 * MIB);
+
+    hash_memory_release(&b);
+    hash_memory_release(&third.ticket);
+    ck_assert_uint_eq(stat_value("hash_memory.in_use_bytes"), 0);
+    hash_memory_set_budget(saved);
+}
+END_TEST
+
+START_TEST (test_oversized_runs_alone) {
+    size_t saved = hash_memory_budget();
+    hash_memory_set_budget(1 * MIB);
+
+    // bigger than the budget, but nothing else is running
+    hash_memory_ticket_t big;
+    hash_memory_acquire(YESCRYPT_16MIB, &big);
+    ck_assert_uint_eq(stat_value("hash_memory.running"), 1);
+
+    hasher_t next = {0};
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, acquire_in_thread, &next), 0);
+    wait_stat("hash_memory.queued", 1);
+
+    // cheap hashes aren't governed
+    hash_memory_ticket_t cheap;
+    hash_memory_acquire("$6$rounds=1000$salt$", &cheap);
+    ck_assert_uint_eq(cheap.bytes, 0);
+    hash_memory_release(&cheap);
+
+    // raising the budget lets the waiter in
+    hash_memory_set_budget(64 * MIB);
+    pthread_join(thread, NULL);
+    ck_assert_uint_eq(stat_value("hash_memory.running"), 2);
+
+    hash_memory_release(&big);
+    hash_memory_release(&next.ticket);
+    hash_memory_set_budget(saved);
+}
+END_TEST
+
+Suite *hash_memory_suite(void) {
+    Suite *s = suite_create("HashMemory");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_cost_from_setting);
+    tcase_add_test(tc, test_cost_matches_generated_hash);
+    tcase_add_test(tc, test_waits_for_budget);
+    tcase_add_test(tc, test_oversized_runs_alone);
+    suite_add_tcase(s, tc);
+    return s;
+}
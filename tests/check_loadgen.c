@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/latency_hist.h"
+#include "../src/loadgen.h"
+#include "check_suites.h"
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+START_TEST (test_hist_percentiles) {
+    latency_hist_t *h = malloc(sizeof *h);
+    latency_hist_init(h);
+    ck_assert_uint_eq(latency_hist_percentile(h, 50.0), 0);
+
+    for (uint64_t v = 1; v <= 100000; v++) {
+        latency_hist_record(h, v * 1000);
+    }
+    uint64_t p50 = latency_hist_percentile(h, 50.0);
+    uint64_t p99 = latency_hist_percentile(h, 99.0);
+    uint64_t p999 = latency_hist_percentile(h, 99.9);
+
+    // within bucket precision (1/64) of the exact value
+    ck_assert_uint_ge(p50, 50000000);
+    ck_assert_uint_le(p50, 50000000 + 50000000 / 64);
+    ck_assert_uint_ge(p99, 99000000);
+    ck_assert_uint_le(p99, 99000000 + 99000000 / 64);
+    ck_assert_uint_ge(p999, 99900000);
+    ck_assert_uint_le(latency_hist_percentile(h, 100.0), 100000000);
+    free(h);
+}
+END_TEST
+
+START_TEST (test_synthesise_mix) {
+    loadgen_synth_params_t params;
+    loadgen_synth_defaults(&params);
+    params.qps = 1000.0;
+    params.duration_s = 10.0;
+    memset(params.mix, 0, sizeof params.mix);
+    params.mix[LOADGEN_VALID] = 3.0;
+    params.mix[LOADGEN_BANNED] = 1.0;
+
+    loadgen_trace_t trace = {0};
+    ck_assert(loadgen_synthesise(&params, &trace));
+    ck_assert_uint_gt(trace.count, 9000);
+    ck_assert_uint_lt(trace.count, 11000);
+
+    size_t kinds[LOADGEN_KIND_COUNT] = {0};
+    for (size_t i = 0; i < trace.count; i++) {
+        kinds[trace.events[i].kind]++;
+        if (i > 0) ck_assert_uint_ge(trace.events[i].offset_ns, trace.events[i - 1].offset_ns);
+    }
+    ck_assert_uint_eq(kinds[LOADGEN_VALID] + kinds[LOADGEN_BANNED], trace.count);
+    ck_assert_uint_gt(kinds[LOADGEN_VALID], 2 * kinds[LOADGEN_BANNED]);
+
+    loadgen_trace_free(&trace);
+}
+END_TEST
+
+START_TEST (test_trace_roundtrip) {
+    const char *text =
+        "# comment\n"
+        "2000 banned banned-3 192.168.0.1\n"
+        "1000 valid user-1 10.0.0.1\n";
+    FILE *f = fmemopen((void *)text, strlen(text), "r");
+    loadgen_trace_t trace = {0};
+    ck_assert(loadgen_trace_read(f, &trace));
+    fclose(f);
+
+    ck_assert_uint_eq(trace.count, 2);
+    ck_assert_uint_eq(trace.events[0].offset_ns, 1000000);
+    ck_assert_str_eq(trace.events[0].userid, "user-1");
+    ck_assert_int_eq(trace.events[1].kind, LOADGEN_BANNED);
+    ck_assert_uint_eq(trace.events[1].client_ip, 0xC0A80001);
+
+    char buf[256] = {0};
+    f = fmemopen(buf, sizeof buf, "w");
+    ck_assert(loadgen_trace_write(&trace, f));
+    fclose(f);
+    ck_assert_ptr_ne(strstr(buf, "2000 banned banned-3 192.168.0.1\n"), NULL);
+
+    loadgen_trace_free(&trace);
+}
+END_TEST
+
+START_TEST (test_trace_malformed) {
+    const char *text = "1000 valid user-1 10.0.0.300\n";
+    FILE *f = fmemopen((void *)text, strlen(text), "r");
+    loadgen_trace_t trace = {0};
+    ck_assert(!loadgen_trace_read(f, &trace));
+    fclose(f);
+    loadgen_trace_free(&trace);
+}
+END_TEST
+
+static login_result_t fake_login(void *ctx, const char *userid, const char *password,
+                                 ip4_addr_t client_ip, time_t login_time) {
+    (void)ctx;
+    (void)client_ip;
+    (void)login_time;
+    if (strncmp(userid, "ghost", 5) == 0) return LOGIN_FAIL_USER_NOT_FOUND;
+    return strcmp(password, LOADGEN_SEED_PASSWORD) == 0 ? LOGIN_SUCCESS : LOGIN_FAIL_BAD_PASSWORD;
+}
+
+START_TEST (test_run_counts_results) {
+    loadgen_synth_params_t params;
+    loadgen_synth_defaults(&params);
+    params.qps = 2000.0;
+    params.duration_s = 0.25;
+    memset(params.mix, 0, sizeof params.mix);
+    params.mix[LOADGEN_VALID] = 1.0;
+    params.mix[LOADGEN_BAD_PASSWORD] = 1.0;
+    params.mix[LOADGEN_UNKNOWN_USER] = 1.0;
+
+    loadgen_trace_t trace = {0};
+    ck_assert(loadgen_synthesise(&params, &trace));
+
+    loadgen_run_params_t run = { .threads = 4, .qps = 0.0 };
+    loadgen_driver_t driver = { .login = fake_login, .ctx = NULL };
+    loadgen_report_t *report = malloc(sizeof *report);
+    ck_assert(loadgen_run(&trace, &run, &driver, report));
+
+    ck_assert_uint_eq(report->all.total, trace.count);
+    ck_assert_uint_eq(report->mismatched, 0);
+    ck_assert_uint_eq(report->by_result[LOGIN_SUCCESS].total +
+                      report->by_result[LOGIN_FAIL_BAD_PASSWORD].total +
+                      report->by_result[LOGIN_FAIL_USER_NOT_FOUND].total, trace.count);
+    // open loop: the run takes as long as the trace, not as long as the work
+    ck_assert_uint_ge(report->elapsed_ns, trace.events[trace.count - 1].offset_ns);
+
+    free(report);
+    loadgen_trace_free(&trace);
+}
+END_TEST
+
+Suite *loadgen_suite(void) {
+    Suite *s = suite_create("Loadgen");
+
+    TCase *tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, test_hist_percentiles);
+    tcase_add_test(tc_core, test_synthesise_mix);
+    tcase_add_test(tc_core, test_trace_roundtrip);
+    tcase_add_test(tc_core, test_trace_malformed);
+    tcase_add_test(tc_core, test_run_counts_results);
+
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
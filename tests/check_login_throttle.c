@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/account_store.h"
+#include "../src/login.h"
+#include "../src/login_throttle.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define T0 ((time_t)1700000040)    // the start of a 60-second window
+#define THREADS 4
+
+static login_throttle_t *make_throttle(size_t slots, uint32_t max_failures) {
+    login_throttle_config_t config;
+    login_throttle_config_defaults(&config);
+    config.slots = slots;
+    config.window_secs = 60;
+    config.max_failures = max_failures;
+    config.base_delay_secs = 2;
+    config.max_delay_secs = 16;
+    return login_throttle_create(&config);
+}
+
+START_TEST (test_backoff_doubles) {
+    login_throttle_t *t = make_throttle(1024, 3);
+    ck_assert_ptr_nonnull(t);
+
+    for (int i = 0; i < 3; i++) ck_assert_uint_eq(login_throttle_failure(t, "alice", T0), 0);
+    ck_assert_uint_eq(login_throttle_check(t, "alice", T0), 0);
+
+    // over the allowance: 2, 4, 8, 16, then capped
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0), 2);
+    ck_assert_uint_eq(login_throttle_check(t, "alice", T0), 2);
+    ck_assert_uint_eq(login_throttle_check(t, "alice", T0 + 1), 1);
+    ck_assert_uint_eq(login_throttle_check(t, "alice", T0 + 2), 0);
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0 + 2), 4);
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0 + 6), 8);
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0 + 14), 16);
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0 + 30), 16);
+
+    // other accounts aren't affected
+    ck_assert_uint_eq(login_throttle_check(t, "bob", T0 + 30), 0);
+
+    // a success forgets the failures
+    login_throttle_success(t, "alice");
+    ck_assert_uint_eq(login_throttle_check(t, "alice", T0 + 30), 0);
+    ck_assert_uint_eq(login_throttle_failure(t, "alice", T0 + 30), 0);
+    login_throttle_free(t);
+}
+END_TEST
+
+START_TEST (test_sliding_window) {
+    login_throttle_t *t = make_throttle(1024, 3);
+
+    // three failures at the end of one window...
+    for (int i = 0; i < 3; i++) ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 59), 0);
+    // ...still mostly count early in the next one: 1 + 3 * 59/60 rounds down to 3
+    ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 61), 0);
+    ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 62), 2);
+
+    // a whole quiet window resets the count and the backoff
+    ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 240), 0);
+    for (int i = 0; i < 2; i++) ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 240), 0);
+    ck_assert_uint_eq(login_throttle_failure(t, "carol", T0 + 240), 2);
+    login_throttle_free(t);
+}
+END_TEST
+
+START_TEST (test_full_bucket_forgets_oldest) {
+    // a single bucket of 8 slots
+    login_throttle_t *t = make_throttle(1, 0);
+    uint64_t evictions = 0;
+    stats_get("login_throttle.evictions", &evictions);
+
+    char userid[16];
+    for (int i = 0; i < 9; i++) {
+        snprintf(userid, sizeof userid, "user-%d", i);
+        ck_assert_uint_eq(login_throttle_failure(t, userid, T0 + i), 2);
+    }
+    uint64_t after = 0;
+    ck_assert(stats_get("login_throttle.evictions", &after));
+    ck_assert_uint_eq(after - evictions, 1);
+
+    ck_assert_uint_eq(login_throttle_check(t, "user-0", T0 + 1), 0);
+    ck_assert_uint_eq(login_throttle_check(t, "user-8", T0 + 9), 1);
+    login_throttle_free(t);
+}
+END_TEST
+
+static void *fail_five(void *p) {
+    for (int i = 0; i < 5; i++) login_throttle_failure(p, "shared", T0);
+    return NULL;
+}
+
+START_TEST (test_concurrent_failures_all_count) {
+    login_throttle_t *t = make_throttle(1024, 30);
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, fail_five, t), 0);
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+
+    // 20 so far; the 31st failure is the first over the allowance
+    for (int i = 0; i < 10; i++) ck_assert_uint_eq(login_throttle_failure(t, "shared", T0), 0);
+    ck_assert_uint_eq(login_throttle_failure(t, "shared", T0), 2);
+    login_throttle_free(t);
+}
+END_TEST
+
+START_TEST (test_handle_login_skips_hash) {
+    account_store_t *store = account_store_create(1);
+    account_t *acc = account_create("throttled", "right", "t@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(acc);
+    ck_assert(account_store_put(store, acc));
+    account_free(acc);
+    account_store_set_default(store);
+
+    login_throttle_config_t config;
+    login_throttle_config_defaults(&config);
+    config.slots = 1024;
+    config.max_failures = 2;
+    config.base_delay_secs = 60;
+    login_throttle_t *t = login_throttle_create(&config);
+    login_throttle_set_default(t);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    time_t now = time(NULL);
+    for (int i = 0; i < 3; i++) {
+        ck_assert_int_eq(handle_login("throttled", "wrong", 0, now, null_fd, null_fd, &session),
+                         LOGIN_FAIL_BAD_PASSWORD);
+    }
+
+    // locked out: even the right password is turned away
+    uint64_t rejected = 0, after = 0;
+    stats_get("login_throttle.rejected", &rejected);
+    ck_assert_int_eq(handle_login("throttled", "right", 0, now, null_fd, null_fd, &session),
+                     LOGIN_FAIL_ACCOUNT_BANNED);
+    ck_assert(stats_get("login_throttle.rejected", &after));
+    ck_assert_uint_eq(after - rejected, 1);
+
+    // with set_unban_time, a lockout also bans the stored account
+    login_throttle_free(t);
+    ck_assert_ptr_eq(login_throttle_get_default(), NULL);
+    config.set_unban_time = true;
+    t = login_throttle_create(&config);
+    login_throttle_set_default(t);
+    for (int i = 0; i < 3; i++) handle_login("throttled", "wrong", 0, now, null_fd, null_fd, &session);
+    account_t out;
+    ck_assert(account_store_get(store, "throttled", &out));
+    ck_assert_int_eq(out.unban_time, now + 60);
+
+    close(null_fd);
+    login_throttle_free(t);
+    account_store_set_default(NULL);
+    account_store_free(store);
+}
+END_TEST
+
+Suite *login_throttle_suite(void) {
+    Suite *s = suite_create("LoginThrottle");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_backoff_doubles);
+    tcase_add_test(tc, test_sliding_window);
+    tcase_add_test(tc, test_full_bucket_forgets_oldest);
+    tcase_add_test(tc, test_concurrent_failures_all_count);
+    tcase_add_test(tc, test_handle_login_skips_hash);
+    suite_add_tcase(s, tc);
+    return s;
+}
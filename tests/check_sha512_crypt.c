@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/password_batch.h"
+#include "../src/sha512.h"
+#include "../src/sha512_crypt.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <crypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// low rounds keep the reference crypt_r() calls quick
+#define JOB_COUNT 37
+
+static void hex(const unsigned char *digest, char *out) {
+    for (int i = 0; i < SHA512_DIGEST_SIZE; i++) sprintf(out + 2 * i, "%02x", digest[i]);
+}
+
+START_TEST (test_sha512_vectors) {
+    unsigned char digest[SHA512_DIGEST_SIZE];
+    char out[2 * SHA512_DIGEST_SIZE + 1];
+
+    sha512("abc", 3, digest);
+    hex(digest, out);
+    ck_assert_str_eq(out,
+        "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+        "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f");
+
+    // same message fed in awkward pieces
+    const char *msg = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+                      "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+    sha512_ctx_t ctx;
+    sha512_init(&ctx);
+    for (size_t i = 0, step = 1; i < strlen(msg); i += step, step = step * 2 + 1) {
+        size_t len = strlen(msg) - i < step ? strlen(msg) - i : step;
+        sha512_update(&ctx, msg + i, len);
+    }
+    sha512_final(&ctx, digest);
+    hex(digest, out);
+    ck_assert_str_eq(out,
+        "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+        "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909");
+}
+END_TEST
+
+START_TEST (test_settings_supported) {
+    ck_assert(sha512_crypt_supported("$6$salt"));
+    ck_assert(sha512_crypt_supported("$6$salt$hash"));
+    ck_assert(sha512_crypt_supported("$6$rounds=1000$0123456789abcdef$"));
+    ck_assert(!sha512_crypt_supported("$6$"));
+    ck_assert(!sha512_crypt_supported("$6$rounds=999$salt"));
+    ck_assert(!sha512_crypt_supported("$6$rounds=01000$salt"));
+    ck_assert(!sha512_crypt_supported("$6$0123456789abcdefg$"));
+    ck_assert(!sha512_crypt_supported("$6$sa*t$"));
+    ck_assert(!sha512_crypt_supported("$5$salt$"));
+    ck_assert(!sha512_crypt_supported("$y$j9T$salt$"));
+}
+END_TEST
+
+// every engine the CPU has must match crypt_r() exactly
+START_TEST (test_engines_match_crypt) {
+    static const char *settings[] = {
+        "$6$rounds=1000$a", "$6$rounds=1000$saltstring", "$6$rounds=1001$0123456789abcdef",
+        "$6$rounds=1000$./AZaz09$ignored",
+    };
+    static char keys[JOB_COUNT][256];
+    static char expected[JOB_COUNT][SHA512_CRYPT_OUTPUT_SIZE];
+    sha512_crypt_job_t jobs[JOB_COUNT];
+
+    for (int i = 0; i < JOB_COUNT; i++) {
+        // lengths cross the 64- and 128-byte boundaries of P and the round messages
+        size_t len = (size_t)(i * 7) % 200;
+        for (size_t j = 0; j < len; j++) keys[i][j] = (char)(' ' + (i * 31 + (int)j) % 95);
+        keys[i][len] = '\0';
+        struct crypt_data data = {0};
+        char *out = crypt_r(keys[i], settings[i % 4], &data);
+        ck_assert_ptr_nonnull(out);
+        strcpy(expected[i], out);
+    }
+
+    sha512_crypt_engine_t engines[] = { SHA512_CRYPT_SCALAR, SHA512_CRYPT_AVX2, SHA512_CRYPT_AVX512 };
+    for (size_t e = 0; e < sizeof engines / sizeof engines[0]; e++) {
+        if (!sha512_crypt_set_engine(engines[e])) continue;
+        ck_assert_int_eq(sha512_crypt_engine(), engines[e]);
+        for (int i = 0; i < JOB_COUNT; i++) {
+            jobs[i] = (sha512_crypt_job_t){ .key = keys[i], .setting = settings[i % 4] };
+        }
+        sha512_crypt_many(jobs, JOB_COUNT);
+        for (int i = 0; i < JOB_COUNT; i++) {
+            ck_assert(jobs[i].ok);
+            ck_assert_str_eq(jobs[i].output, expected[i]);
+        }
+    }
+    ck_assert(sha512_crypt_set_engine(SHA512_CRYPT_AUTO));
+    ck_assert_int_ne(sha512_crypt_engine(), SHA512_CRYPT_AUTO);
+}
+END_TEST
+
+// the default 5000 rounds are left out of the output unless given
+START_TEST (test_default_rounds) {
+    sha512_crypt_job_t jobs[2] = {
+        { .key = "Hello world!", .setting = "$6$saltstring" },
+        { .key = "Hello world!", .setting = "$6$rounds=5000$saltstring" },
+    };
+    sha512_crypt_many(jobs, 2);
+    ck_assert(jobs[0].ok && jobs[1].ok);
+    ck_assert_str_eq(jobs[0].output, "$6$saltstring$svn8UoSVapNtMuq1ukKS4tPQd8iKwSMHWjl/O817G3uBnIFNjnQJu"
+                                     "esI68u4OTLiBFdcbYEdFCoEOfaS35inz1");
+    ck_assert_str_eq(jobs[1].output, "$6$rounds=5000$saltstring$svn8UoSVapNtMuq1ukKS4tPQd8iKwSMHWjl/O817G3uBnIFNjnQJu"
+                                     "esI68u4OTLiBFdcbYEdFCoEOfaS35inz1");
+}
+END_TEST
+
+START_TEST (test_validate_passwords) {
+    static const char *passwords[] = { "hunter2", "", "correct horse battery staple", "x" };
+    account_t *accs[5];
+    password_check_t checks[10];
+    size_t n = 0;
+
+    for (int i = 0; i < 4; i++) {
+        accs[i] = account_create("user", "placeholder", "user@example.com", "1990-01-01");
+        ck_assert_ptr_nonnull(accs[i]);
+        char setting[32];
+        snprintf(setting, sizeof setting, "$6$rounds=1000$salt%d", i);
+        struct crypt_data data = {0};
+        char *out = crypt_r(passwords[i], setting, &data);
+        ck_assert_ptr_nonnull(out);
+        memset(accs[i]->password_hash, 0, sizeof accs[i]->password_hash);
+        memcpy(accs[i]->password_hash, out, strlen(out));
+
+        checks[n++] = (password_check_t){ .acc = accs[i], .password = passwords[i] };
+        checks[n++] = (password_check_t){ .acc = accs[i], .password = passwords[(i + 1) % 4] };
+    }
+    // a non-$6$ hash takes the one-by-one path
+    accs[4] = account_create("user", "native", "user@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(accs[4]);
+    checks[n++] = (password_check_t){ .acc = accs[4], .password = "native" };
+    checks[n++] = (password_check_t){ .acc = accs[4], .password = "nope" };
+
+    account_validate_passwords(checks, n);
+    for (size_t i = 0; i < n; i++) {
+        ck_assert_int_eq(checks[i].valid, i % 2 == 0);
+        ck_assert_int_eq(checks[i].valid, account_validate_password(checks[i].acc, checks[i].password));
+    }
+
+    // with a single lane, everything is checked one by one
+    ck_assert(sha512_crypt_set_engine(SHA512_CRYPT_SCALAR));
+    ck_assert(!account_password_batchable(accs[0], passwords[0]));
+    uint64_t batched_before = 0, batched_after = 0;
+    stats_get("password_batch.batched", &batched_before);
+    account_validate_passwords(checks, n);
+    stats_get("password_batch.batched", &batched_after);
+    ck_assert_uint_eq(batched_after, batched_before);
+    for (size_t i = 0; i < n; i++) ck_assert_int_eq(checks[i].valid, i % 2 == 0);
+    ck_assert(sha512_crypt_set_engine(SHA512_CRYPT_AUTO));
+    ck_assert_int_eq(account_password_batchable(accs[0], passwords[0]), sha512_crypt_lanes() > 1);
+    ck_assert(!account_password_batchable(accs[4], "native"));
+    for (int i = 0; i < 5; i++) account_free(accs[i]);
+}
+END_TEST
+
+Suite *sha512_crypt_suite(void) {
+    Suite *s = suite_create("SHA-512-crypt");
+    TCase *tc = tcase_create("Core");
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_sha512_vectors);
+    tcase_add_test(tc, test_settings_supported);
+    tcase_add_test(tc, test_engines_match_crypt);
+    tcase_add_test(tc, test_default_rounds);
+    tcase_add_test(tc, test_validate_passwords);
+    suite_add_tcase(s, tc);
+    return s;
+}
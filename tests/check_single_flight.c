@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/account_store.h"
+#include "../src/admission.h"
+#include "../src/login_admission.h"
+#include "../src/sha512.h"
+#include "../src/single_flight.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FOLLOWERS 6
+
+START_TEST (test_hmac_sha512) {
+    // RFC 4231 test case 2
+    unsigned char mac[SHA512_DIGEST_SIZE];
+    char hex[2 * SHA512_DIGEST_SIZE + 1];
+    const char *data = "what do ya want for nothing?";
+    hmac_sha512("Jefe", 4, data, strlen(data), mac);
+    for (int i = 0; i < SHA512_DIGEST_SIZE; i++) sprintf(hex + 2 * i, "%02x", mac[i]);
+    ck_assert_str_eq(hex,
+        "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+        "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737");
+}
+END_TEST
+
+typedef struct {
+    const account_t *acc;
+    const char *password;
+    const struct timespec *deadline;
+    bool joined;        // true if it shared someone else's answer
+    bool result;
+    single_flight_t flight;
+    atomic_bool returned;
+} follower_t;
+
+static void *follow(void *p) {
+    follower_t *f = p;
+    f->joined = single_flight_join(f->acc, f->password, f->deadline, &f->flight, &f->result) ==
+                SINGLE_FLIGHT_SHARED;
+    atomic_store(&f->returned, true);
+    return NULL;
+}
+
+static uint64_t stat_value(const char *name) {
+    uint64_t v = 0;
+    stats_get(name, &v);
+    return v;
+}
+
+// wait (briefly) until n requests are waiting on a leader
+static void wait_waiting(uint64_t n) {
+    struct timespec ms = { 0, 1000000 };
+    for (int i = 0; i < 5000 && stat_value("single_flight.waiting") != n; i++) nanosleep(&ms, NULL);
+    ck_assert_uint_eq(stat_value("single_flight.waiting"), n);
+}
+
+START_TEST (test_followers_share_result) {
+    account_t acc = {0};
+    strcpy(acc.userid, "burst");
+    strcpy(acc.password_hash, "$6$rounds=1000$salt$notarealhash");
+
+    single_flight_t lead;
+    bool result;
+    ck_assert_int_eq(single_flight_join(&acc, "pw", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+
+    follower_t followers[FOLLOWERS];
+    pthread_t threads[FOLLOWERS];
+    for (int i = 0; i < FOLLOWERS; i++) {
+        followers[i] = (follower_t){ .acc = &acc, .password = "pw" };
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, follow, &followers[i]), 0);
+    }
+    wait_waiting(FOLLOWERS);
+
+    // a different password isn't coalesced with the flight in progress
+    single_flight_t other;
+    ck_assert_int_eq(single_flight_join(&acc, "pw2", NULL, &other, &result), SINGLE_FLIGHT_LEADER);
+    single_flight_finish(&other, false);
+
+    uint64_t shared = stat_value("single_flight.shared");
+    single_flight_finish(&lead, true);
+    for (int i = 0; i < FOLLOWERS; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert(followers[i].joined);
+        ck_assert(followers[i].result);
+    }
+    ck_assert_uint_eq(stat_value("single_flight.shared") - shared, FOLLOWERS);
+
+    // nothing is remembered once the flight lands
+    ck_assert_int_eq(single_flight_join(&acc, "pw", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+    single_flight_finish(&lead, false);
+}
+END_TEST
+
+START_TEST (test_abandon_hands_over) {
+    account_t acc = {0};
+    strcpy(acc.userid, "refused");
+    strcpy(acc.password_hash, "$6$rounds=1000$salt$notarealhash");
+
+    single_flight_t lead;
+    bool result;
+    ck_assert_int_eq(single_flight_join(&acc, "pw", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+
+    follower_t followers[2];
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        followers[i] = (follower_t){ .acc = &acc, .password = "pw" };
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, follow, &followers[i]), 0);
+    }
+    wait_waiting(2);
+    single_flight_abandon(&lead);
+
+    // one follower takes over as leader; the other waits for it
+    wait_waiting(1);
+    int leader = -1;
+    struct timespec ms = { 0, 1000000 };
+    while (leader < 0) {
+        for (int i = 0; i < 2; i++) {
+            if (atomic_load(&followers[i].returned)) leader = i;
+        }
+        if (leader < 0) nanosleep(&ms, NULL);
+    }
+    pthread_join(threads[leader], NULL);
+    ck_assert(!followers[leader].joined);
+    single_flight_finish(&followers[leader].flight, true);
+
+    // the other shares that answer, unless it was woken too late to join
+    // the new flight before it landed; then it leads one of its own
+    follower_t *other = &followers[1 - leader];
+    pthread_join(threads[1 - leader], NULL);
+    if (other->joined) ck_assert(other->result);
+    else single_flight_finish(&other->flight, true);
+    ck_assert_uint_eq(stat_value("single_flight.waiting"), 0);
+}
+END_TEST
+
+START_TEST (test_follower_deadline) {
+    account_t acc = {0};
+    strcpy(acc.userid, "slow");
+    strcpy(acc.password_hash, "$6$rounds=1000$salt$notarealhash");
+
+    single_flight_t lead;
+    bool result;
+    ck_assert_int_eq(single_flight_join(&acc, "pw", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+
+    // one follower gives up at its deadline; one without a deadline waits on
+    struct timespec soon;
+    admission_deadline_in(&soon, 20);
+    follower_t patient = { .acc = &acc, .password = "pw" };
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, follow, &patient), 0);
+    wait_waiting(1);
+    uint64_t expired = stat_value("single_flight.expired");
+    single_flight_t flight;
+    ck_assert_int_eq(single_flight_join(&acc, "pw", &soon, &flight, &result), SINGLE_FLIGHT_EXPIRED);
+    ck_assert_uint_eq(stat_value("single_flight.expired"), expired + 1);
+    ck_assert(!atomic_load(&patient.returned));
+
+    single_flight_finish(&lead, true);
+    pthread_join(thread, NULL);
+    ck_assert(patient.joined);
+    ck_assert(patient.result);
+
+    // a follower that expires alone leaves the flight to its leader
+    ck_assert_int_eq(single_flight_join(&acc, "pw", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+    admission_deadline_in(&soon, 5);
+    ck_assert_int_eq(single_flight_join(&acc, "pw", &soon, &flight, &result), SINGLE_FLIGHT_EXPIRED);
+    single_flight_finish(&lead, false);
+    ck_assert_uint_eq(stat_value("single_flight.waiting"), 0);
+}
+END_TEST
+
+START_TEST (test_login_waiting_on_leader_expires) {
+    account_t *acc = account_create("sf-login", "right", "sf@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(acc);
+    account_store_t *store = account_store_create(4);
+    ck_assert(account_store_put(store, acc));
+    account_store_t *previous = account_store_get_default();
+    account_store_set_default(store);
+    admission_config_t config;
+    admission_config_defaults(&config);
+    admission_t *adm = admission_create(&config);
+    ck_assert_ptr_nonnull(adm);
+
+    // an identical attempt is hashing; this one can't wait past its deadline
+    single_flight_t lead;
+    bool result;
+    ck_assert_int_eq(single_flight_join(acc, "right", NULL, &lead, &result), SINGLE_FLIGHT_LEADER);
+    struct timespec soon;
+    admission_deadline_in(&soon, 20);
+    int null_fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    admission_status_t status = ADMISSION_ADMITTED;
+    ck_assert_int_eq(handle_login_admitted("sf-login", "right", 0, time(NULL), null_fd, null_fd,
+                                           &session, adm, &soon, &status),
+                     LOGIN_FAIL_INTERNAL_ERROR);
+    ck_assert_int_eq(status, ADMISSION_EXPIRED);
+    single_flight_abandon(&lead);
+
+    // with the leader gone it hashes for itself
+    admission_deadline_in(&soon, 10000);
+    ck_assert_int_eq(handle_login_admitted("sf-login", "right", 0, time(NULL), null_fd, null_fd,
+                                           &session, adm, &soon, &status),
+                     LOGIN_SUCCESS);
+    ck_assert_int_eq(status, ADMISSION_ADMITTED);
+    close(null_fd);
+
+    admission_free(adm);
+    account_store_set_default(previous);
+    account_store_free(store);
+    account_free(acc);
+}
+END_TEST
+
+START_TEST (test_validate_password_single_flight) {
+    account_t *acc = account_create("sf-user", "right", "sf@example.com", "1990-01-01");
+    ck_assert_ptr_nonnull(acc);
+    ck_assert(single_flight_validate_password(acc, "right"));
+    ck_assert(!single_flight_validate_password(acc, "wrong"));
+    account_free(acc);
+}
+END_TEST
+
+Suite *single_flight_suite(void) {
+    Suite *s = suite_create("SingleFlight");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_hmac_sha512);
+    tcase_add_test(tc, test_followers_share_result);
+    tcase_add_test(tc, test_abandon_hands_over);
+    tcase_add_test(tc, test_follower_deadline);
+    tcase_add_test(tc, test_login_waiting_on_leader_expires);
+    tcase_add_test(tc, test_validate_password_single_flight);
+    suite_add_tcase(s, tc);
+    return s;
+}
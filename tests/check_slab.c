@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/account.h"
+#include "../src/slab.h"
+#include "../src/stats.h"
+#include "check_suites.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 4
+#define ROUNDS 2000
+#define HELD 100
+
+static bool is_zero(const void *p, size_t size) {
+    const unsigned char *b = p;
+    for (size_t i = 0; i < size; i++) {
+        if (b[i]) return false;
+    }
+    return true;
+}
+
+START_TEST (test_zeroed_and_wiped) {
+    account_t *acc = slab_alloc(sizeof *acc);
+    ck_assert_ptr_nonnull(acc);
+    ck_assert(is_zero(acc, sizeof *acc));
+    ck_assert_uint_eq((uintptr_t)acc % 64, 0);
+
+    // a freed record is wiped, and comes back zeroed
+    memset(acc, 0xA5, sizeof *acc);
+    slab_free(acc, sizeof *acc);
+    ck_assert(is_zero(acc, sizeof *acc));
+    account_t *again = slab_alloc(sizeof *again);
+    ck_assert_ptr_eq(again, acc);
+    ck_assert(is_zero(again, sizeof *again));
+    slab_free(again, sizeof *again);
+
+    // every size gets its own zeroed block; large ones fall back to calloc
+    size_t sizes[] = { 0, 1, 63, 64, 65, 500, 513, 1500, SLAB_MAX_SIZE, SLAB_MAX_SIZE + 1, 100000 };
+    void *blocks[sizeof sizes / sizeof sizes[0]];
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        blocks[i] = slab_alloc(sizes[i]);
+        ck_assert_ptr_nonnull(blocks[i]);
+        ck_assert(is_zero(blocks[i], sizes[i]));
+        memset(blocks[i], 0xFF, sizes[i]);
+    }
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        slab_free(blocks[i], sizes[i]);
+    }
+    slab_free(NULL, 64);
+}
+END_TEST
+
+START_TEST (test_account_lifecycle) {
+    account_t *accs[20];
+    for (size_t i = 0; i < 20; i++) {
+        accs[i] = account_create("slabuser", "pw", "slab@example.com", "1990-01-01");
+        ck_assert_ptr_nonnull(accs[i]);
+    }
+    for (size_t i = 0; i < 20; i++) account_free(accs[i]);
+    account_free(NULL);
+}
+END_TEST
+
+// each thread keeps HELD records live, freeing and replacing them at random,
+// and checks no other thread ever writes to them
+static void *churn(void *arg) {
+    unsigned char tag = (unsigned char)(uintptr_t)arg;
+    unsigned int seed = tag;
+    account_t *held[HELD] = {0};
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t i = (size_t)rand_r(&seed) % HELD;
+        if (held[i]) {
+            const unsigned char *b = (const unsigned char *)held[i];
+            for (size_t j = 0; j < sizeof *held[i]; j++) ck_assert_uint_eq(b[j], tag);
+            slab_free(held[i], sizeof *held[i]);
+        }
+        held[i] = slab_alloc(sizeof *held[i]);
+        ck_assert_ptr_nonnull(held[i]);
+        ck_assert(is_zero(held[i], sizeof *held[i]));
+        memset(held[i], tag, sizeof *held[i]);
+    }
+    // hand half of them to the next thread to free
+    account_t **leftover = malloc(HELD / 2 * sizeof *leftover);
+    for (size_t i = 0; i < HELD; i++) {
+        if (i < HELD / 2) leftover[i] = held[i];
+        else slab_free(held[i], sizeof *held[i]);
+    }
+    return leftover;
+}
+
+static void *free_all(void *arg) {
+    account_t **accs = arg;
+    for (size_t i = 0; i < HELD / 2; i++) slab_free(accs[i], sizeof *accs[i]);
+    free(accs);
+    return NULL;
+}
+
+START_TEST (test_threads) {
+    pthread_t threads[THREADS];
+    void *leftovers[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, churn, (void *)(i + 1)), 0);
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], &leftovers[i]);
+        ck_assert_ptr_nonnull(leftovers[i]);
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, free_all, leftovers[(i + 1) % THREADS]), 0);
+    }
+    for (size_t i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+}
+END_TEST
+
+static void *fill_and_empty(void *arg) {
+    (void)arg;
+    void *blocks[1000];
+    for (size_t i = 0; i < 1000; i++) {
+        blocks[i] = slab_alloc(SLAB_MAX_SIZE);
+        ck_assert_ptr_nonnull(blocks[i]);
+    }
+    for (size_t i = 0; i < 1000; i++) slab_free(blocks[i], SLAB_MAX_SIZE);
+    return NULL;
+}
+
+START_TEST (test_slabs_released) {
+    uint64_t slabs_before = 0, slabs_peak = 0, slabs_after = 0;
+    slab_trim();
+    stats_get("slab.slabs", &slabs_before);
+
+    // 1000 of the largest class span dozens of slabs; once the thread has
+    // exited and its magazines are flushed, trimming gives them all back
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, fill_and_empty, NULL), 0);
+    pthread_join(thread, NULL);
+    ck_assert(stats_get("slab.slabs", &slabs_peak));
+    slab_trim();
+    ck_assert(stats_get("slab.slabs", &slabs_after));
+    ck_assert_uint_le(slabs_after, slabs_before);
+    ck_assert_uint_gt(slabs_peak, slabs_after);
+}
+END_TEST
+
+Suite *slab_suite(void) {
+    Suite *s = suite_create("Slab");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_zeroed_and_wiped);
+    tcase_add_test(tc, test_account_lifecycle);
+    tcase_add_test(tc, test_threads);
+    tcase_add_test(tc, test_slabs_released);
+    tcase_set_timeout(tc, 30);
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/login.h"
+#include "../src/stuffing_detector.h"
+#include "check_suites.h"
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define T0 ((time_t)1700000400)     // the start of a 600-second window
+#define IP_A ((ip4_addr_t)0x0a000001)
+
+static stuffing_detector_t *make_detector(bool block) {
+    stuffing_config_t config;
+    stuffing_config_defaults(&config);
+    config.ip_slots = 64;
+    config.prefix_slots = 64;
+    config.block = block;
+    stuffing_detector_t *d = stuffing_detector_create(&config);
+    ck_assert_ptr_nonnull(d);
+    return d;
+}
+
+static stuffing_verdict_t try_userid(stuffing_detector_t *d, ip4_addr_t ip, size_t i, time_t now) {
+    char userid[32];
+    snprintf(userid, sizeof userid, "victim-%zu", i);
+    return stuffing_detector_observe(d, ip, userid, now);
+}
+
+START_TEST (test_repeated_userids_stay_clean) {
+    stuffing_detector_t *d = make_detector(true);
+    // a shared office NAT: a few users, many attempts each
+    for (size_t round = 0; round < 100; round++) {
+        for (size_t i = 0; i < 10; i++) {
+            ck_assert_int_eq(try_userid(d, IP_A, i, T0), STUFFING_CLEAN);
+        }
+    }
+    ck_assert_uint_eq(stuffing_detector_estimate(d, IP_A, false, T0), 10);
+    ck_assert_uint_eq(stuffing_detector_estimate(d, IP_A + 1, false, T0), 0);
+    stuffing_detector_free(d);
+}
+END_TEST
+
+START_TEST (test_many_userids_flag_ip) {
+    stuffing_detector_t *d = make_detector(true);
+    stuffing_verdict_t last = STUFFING_CLEAN;
+    size_t first_flagged = 0;
+    for (size_t i = 0; i < 100; i++) {
+        last = try_userid(d, IP_A, i, T0);
+        if (last != STUFFING_CLEAN && first_flagged == 0) first_flagged = i + 1;
+    }
+    ck_assert_int_eq(last, STUFFING_FLAGGED_IP);
+    ck_assert_uint_ge(first_flagged, 40);
+    ck_assert_uint_le(first_flagged, 60);
+
+    uint32_t estimate = stuffing_detector_estimate(d, IP_A, false, T0);
+    ck_assert_uint_ge(estimate, 85);
+    ck_assert_uint_le(estimate, 115);
+
+    // the network as a whole isn't over its threshold, so a neighbour is clean
+    ck_assert_int_eq(try_userid(d, IP_A + 1, 0, T0), STUFFING_CLEAN);
+    stuffing_detector_free(d);
+}
+END_TEST
+
+START_TEST (test_spread_over_network_flags_prefix) {
+    stuffing_detector_t *d = make_detector(true);
+    // 10 userids from each of 30 addresses: no one address stands out
+    stuffing_verdict_t last = STUFFING_CLEAN;
+    for (size_t i = 0; i < 300; i++) {
+        last = try_userid(d, IP_A + (ip4_addr_t)(i / 10), i, T0);
+    }
+    ck_assert_int_eq(last, STUFFING_FLAGGED_PREFIX);
+    ck_assert_uint_le(stuffing_detector_estimate(d, IP_A, false, T0), 15);
+    ck_assert_uint_ge(stuffing_detector_estimate(d, IP_A, true, T0), 250);
+    // another /24 is unaffected
+    ck_assert_int_eq(try_userid(d, IP_A + 0x100, 0, T0), STUFFING_CLEAN);
+    stuffing_detector_free(d);
+}
+END_TEST
+
+START_TEST (test_counts_decay) {
+    stuffing_detector_t *d = make_detector(true);
+    for (size_t i = 0; i < 100; i++) try_userid(d, IP_A, i, T0);
+    ck_assert_int_eq(try_userid(d, IP_A, 0, T0), STUFFING_FLAGGED_IP);
+
+    // the next window still counts this one
+    ck_assert_uint_ge(stuffing_detector_estimate(d, IP_A, false, T0 + 600), 85);
+    ck_assert_int_eq(try_userid(d, IP_A, 0, T0 + 600), STUFFING_FLAGGED_IP);
+
+    // two windows on, only the attempt just made counts
+    ck_assert_uint_eq(stuffing_detector_estimate(d, IP_A, false, T0 + 1800), 0);
+    ck_assert_int_eq(try_userid(d, IP_A, 1, T0 + 1800), STUFFING_CLEAN);
+    ck_assert_uint_eq(stuffing_detector_estimate(d, IP_A, false, T0 + 1800), 1);
+    stuffing_detector_free(d);
+}
+END_TEST
+
+START_TEST (test_handle_login_refused) {
+    stuffing_detector_t *d = make_detector(true);
+    for (size_t i = 0; i < 100; i++) try_userid(d, IP_A, i, T0);
+    stuffing_detector_set_default(d);
+
+    // refused before the lookup, so an unknown userid gives the same answer
+    int null_fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    ck_assert_int_eq(handle_login("stuffing-unknown", "pw", IP_A, T0, null_fd, null_fd, &session),
+                     LOGIN_FAIL_IP_BANNED);
+    // other clients are looked up as usual
+    ck_assert_int_eq(handle_login("stuffing-unknown", "pw", IP_A + 0x100, T0, null_fd, null_fd,
+                                  &session),
+                     LOGIN_FAIL_USER_NOT_FOUND);
+    close(null_fd);
+
+    // freeing the default detector clears it
+    stuffing_detector_free(d);
+    ck_assert_ptr_eq(stuffing_detector_get_default(), NULL);
+}
+END_TEST
+
+START_TEST (test_flag_only) {
+    stuffing_detector_t *d = make_detector(false);
+    for (size_t i = 0; i < 100; i++) try_userid(d, IP_A, i, T0);
+    stuffing_detector_set_default(d);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    login_session_data_t session;
+    ck_assert_int_eq(handle_login("stuffing-unknown", "pw", IP_A, T0, null_fd, null_fd, &session),
+                     LOGIN_FAIL_USER_NOT_FOUND);
+    close(null_fd);
+
+    stuffing_detector_set_default(NULL);
+    stuffing_detector_free(d);
+}
+END_TEST
+
+Suite *stuffing_detector_suite(void) {
+    Suite *s = suite_create("StuffingDetector");
+    TCase *tc = tcase_create("Core");
+    tcase_add_test(tc, test_repeated_userids_stay_clean);
+    tcase_add_test(tc, test_many_userids_flag_ip);
+    tcase_add_test(tc, test_spread_over_network_flags_prefix);
+    tcase_add_test(tc, test_counts_decay);
+    tcase_add_test(tc, test_handle_login_refused);
+    tcase_add_test(tc, test_flag_only);
+    suite_add_tcase(s, tc);
+    return s;
+}
@@ -0,0 +1,34 @@
+#ifndef CHECK_SUITES_H
+#define CHECK_SUITES_H
+
+#include "../src/account.h"
+#include <check.h>
+#include <stdint.h>
+
+// Each test file defines one suite; main() in check_accounts.c runs them all.
+
+Suite *account_suite(void);
+Suite *account_store_suite(void);
+Suite *loadgen_suite(void);
+Suite *admission_suite(void);
+Suite *cluster_suite(void);
+Suite *sha512_crypt_suite(void);
+Suite *db_async_suite(void);
+Suite *single_flight_suite(void);
+Suite *entropy_suite(void);
+Suite *hash_memory_suite(void);
+Suite *login_throttle_suite(void);
+Suite *compact_store_suite(void);
+Suite *audit_log_suite(void);
+Suite *slab_suite(void);
+Suite *account_cache_suite(void);
+Suite *stuffing_detector_suite(void);
+Suite *account_cdc_suite(void);
+
+// Fixtures shared by the suites, in check_fixtures.c.
+
+// An account with the given userid and id, an email derived from the
+// userid, a placeholder hash and a fixed birthdate.
+account_t make_account(const char *userid, int64_t id);
+
+#endif // CHECK_SUITES_H